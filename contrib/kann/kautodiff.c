@@ -833,7 +833,40 @@ kad_node_t **kad_unroll(int n_v, kad_node_t **v, int *new_n, int *len)
  * Vector and matrix operations *
  ********************************/
 
-#ifdef __SSE__
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+
+static inline float kad_sdot(int n, const float *x, const float *y) /* BLAS sdot using AVX2 + FMA */
+{
+	int i, n16 = n>>4<<4;
+	__m256 vs1, vs2;
+	__m128 vl;
+	float s;
+	vs1 = _mm256_setzero_ps();
+	vs2 = _mm256_setzero_ps();
+	for (i = 0; i < n16; i += 16) {
+		vs1 = _mm256_fmadd_ps(_mm256_loadu_ps(&x[i]), _mm256_loadu_ps(&y[i]), vs1);
+		vs2 = _mm256_fmadd_ps(_mm256_loadu_ps(&x[i+8]), _mm256_loadu_ps(&y[i+8]), vs2);
+	}
+	vs1 = _mm256_add_ps(vs1, vs2);
+	vl = _mm_add_ps(_mm256_castps256_ps128(vs1), _mm256_extractf128_ps(vs1, 1));
+	vl = _mm_add_ps(vl, _mm_movehl_ps(vl, vl));
+	vl = _mm_add_ss(vl, _mm_shuffle_ps(vl, vl, 1));
+	for (s = _mm_cvtss_f32(vl); i < n; ++i) s += x[i] * y[i];
+	return s;
+}
+static inline void kad_saxpy_inlined(int n, float a, const float *x, float *y) /* BLAS saxpy using AVX2 + FMA */
+{
+	int i, n16 = n>>4<<4;
+	__m256 va;
+	va = _mm256_set1_ps(a);
+	for (i = 0; i < n16; i += 16) {
+		_mm256_storeu_ps(&y[i], _mm256_fmadd_ps(va, _mm256_loadu_ps(&x[i]), _mm256_loadu_ps(&y[i])));
+		_mm256_storeu_ps(&y[i+8], _mm256_fmadd_ps(va, _mm256_loadu_ps(&x[i+8]), _mm256_loadu_ps(&y[i+8])));
+	}
+	for (; i < n; ++i) y[i] += a * x[i];
+}
+#elif defined(__SSE__)
 #include <xmmintrin.h>
 
 static inline float kad_sdot(int n, const float *x, const float *y) /* BLAS sdot using SSE */
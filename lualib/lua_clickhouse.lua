@@ -24,6 +24,7 @@ local rspamd_logger = require "rspamd_logger"
 local rspamd_http = require "rspamd_http"
 local lua_util = require "lua_util"
 local rspamd_text = require "rspamd_text"
+local rspamd_util = require "rspamd_util"
 
 local exports = {}
 local N = 'clickhouse'
@@ -34,65 +35,128 @@ local function escape_spaces(query)
   return query:gsub('%s', '%%20')
 end
 
-local function ch_number(a)
-  if (a + 2 ^ 52) - 2 ^ 52 == a then
-    -- Integer
-    return tostring(math.floor(a))
+-- Converts a row into TSV, taking extra care about arrays
+exports.row_to_tsv = rspamd_util.clickhouse_row_to_tsv
+
+-- Converts a row into RowBinary using types compiled by `compile_types`
+exports.row_to_binary = rspamd_util.clickhouse_row_to_binary
+exports.compile_types = rspamd_util.clickhouse_compile_types
+
+-- Calls cb(pos, char, depth) for characters outside of quotes, stops when
+-- cb returns true and returns the current position
+local function scan_sql(sql, cb)
+  local depth, quote, escaped = 0, nil, false
+
+  for i = 1, #sql do
+    local c = sql:sub(i, i)
+
+    if quote then
+      if escaped then
+        escaped = false
+      elseif c == '\\' then
+        escaped = true
+      elseif c == quote then
+        quote = nil
+      end
+    elseif c == "'" or c == '`' then
+      quote = c
+    else
+      if c == ')' then
+        depth = depth - 1
+      end
+      if cb(i, c, depth) then
+        return i
+      end
+      if c == '(' then
+        depth = depth + 1
+      end
+    end
   end
 
-  return tostring(a)
+  return nil
 end
 
-local function clickhouse_quote(str)
-  if str then
-    return str:gsub('[\'\\\n\t\r]', {
-      ['\''] = [[\']],
-      ['\\'] = [[\\]],
-      ['\n'] = [[\n]],
-      ['\t'] = [[\t]],
-      ['\r'] = [[\r]],
-    })
-  end
+local non_column_keywords = {
+  INDEX = true,
+  PROJECTION = true,
+  CONSTRAINT = true,
+}
 
-  return ''
-end
+local computed_column_keywords = {
+  ALIAS = true,
+  MATERIALIZED = true,
+  DEFAULT = true,
+}
 
--- Converts an array to a string suitable for clickhouse
-local function array_to_string(ar)
-  for i, elt in ipairs(ar) do
-    local t = type(elt)
-    if t == 'string' then
-      ar[i] = string.format('\'%s\'', clickhouse_quote(elt))
-    elseif t == 'userdata' then
-      ar[i] = string.format('\'%s\'', clickhouse_quote(tostring(elt)))
-    elseif t == 'number' then
-      ar[i] = ch_number(elt)
+--[[[
+-- @function lua_clickhouse.schema_types(sql)
+-- Extracts types of columns from `CREATE TABLE` statement, columns that cannot be
+-- inserted (`ALIAS` and `MATERIALIZED`) are skipped
+-- @param {string} sql CREATE TABLE statement
+-- @return {table} column types indexed by column names
+--]]
+exports.schema_types = function(sql)
+  local columns, start = {}, nil
+
+  scan_sql(sql, function(i, c, depth)
+    if not start then
+      if c == '(' then
+        start = i + 1
+      end
+    elseif (depth == 1 and c == ',') or (depth == 0 and c == ')') then
+      table.insert(columns, sql:sub(start, i - 1))
+      start = i + 1
+
+      return depth == 0
     end
-  end
+  end)
 
-  return table.concat(ar, ',')
-end
+  local types = {}
 
--- Converts a row into TSV, taking extra care about arrays
-local function row_to_tsv(row)
-
-  for i, elt in ipairs(row) do
-    local t = type(elt)
-    if t == 'table' then
-      row[i] = '[' .. array_to_string(elt) .. ']'
-    elseif t == 'number' then
-      row[i] = ch_number(elt)
-    elseif t == 'userdata' then
-      row[i] = clickhouse_quote(tostring(elt))
-    else
-      row[i] = clickhouse_quote(elt)
+  for _, def in ipairs(columns) do
+    local name, rest = def:match('^%s*`([^`]+)`%s+(.*)$')
+
+    if not name then
+      name, rest = def:match('^%s*([%w_%.]+)%s+(.*)$')
+    end
+
+    if name and not non_column_keywords[name:upper()] then
+      local type_end = scan_sql(rest, function(_, c, depth)
+        return depth == 0 and c:match('%s') ~= nil
+      end)
+      local col_type = rest:sub(1, (type_end or #rest + 1) - 1)
+      local modifier = rest:sub(#col_type + 1):match('^%s*(%u+)')
+
+      if not computed_column_keywords[col_type:upper()] and
+          modifier ~= 'ALIAS' and modifier ~= 'MATERIALIZED' then
+        types[name] = col_type
+      end
     end
   end
 
-  return rspamd_text.fromtable(row, '\t')
+  return types
 end
 
-exports.row_to_tsv = row_to_tsv
+--[[[
+-- @function lua_clickhouse.row_binary_header(names, types)
+-- Returns header of the RowBinaryWithNamesAndTypes format, so ClickHouse
+-- checks names and types of the columns instead of reading garbage
+-- @param {table} names column names
+-- @param {table} types column types
+-- @return {rspamd_text} header to be prepended to RowBinary rows
+--]]
+exports.row_binary_header = function(names, types)
+  local string_types = {}
+
+  for i = 1, #types do
+    string_types[i] = 'String'
+  end
+
+  return rspamd_text.fromtable({
+    exports.row_to_binary({ names }, exports.compile_types({ 'Array(String)' })),
+    exports.row_to_binary(types, exports.compile_types(string_types)),
+  })
+end
 
 -- Parses JSONEachRow reply from CH
 local function parse_clickhouse_response_json_eachrow(params, data, row_cb)
@@ -378,11 +442,12 @@ end
 
 --[[[
 -- @function lua_clickhouse.insert(upstream, settings, params, query, rows,
-      ok_cb, fail_cb)
+      ok_cb, fail_cb[, binary_header])
 -- Insert data rows to clickhouse
 -- @param {upstream} upstream clickhouse server upstream
 -- @param {table} settings global settings table:
 --   * use_gsip: use gzip compression
+--   * use_zstd: use zstd compression (faster than gzip, overrides it)
 --   * timeout: request timeout
 --   * no_ssl_verify: skip SSL verification
 --   * user: HTTP user
@@ -392,12 +457,14 @@ end
 -- @param {table|mixed} rows mix of strings, numbers or tables (for arrays)
 -- @param {function} ok_cb callback to be called in case of success
 -- @param {function} fail_cb callback to be called in case of some error
+-- @param {rspamd_text} binary_header if specified, rows are in RowBinary format and
+-- are sent as RowBinaryWithNamesAndTypes with this header
 -- @return {boolean} whether a connection was successful
 -- @example
 --
 --]]
 exports.insert = function(upstream, settings, params, query, rows,
-                          ok_cb, fail_cb)
+                          ok_cb, fail_cb, binary_header)
   local http_params = {}
 
   for k, v in pairs(params) do
@@ -412,7 +479,22 @@ exports.insert = function(upstream, settings, params, query, rows,
   http_params.user = settings.user
   http_params.password = settings.password
   http_params.method = 'POST'
-  http_params.body = { rspamd_text.fromtable(rows, '\n'), '\n' }
+  local format = 'TabSeparated'
+
+  if binary_header then
+    format = 'RowBinaryWithNamesAndTypes'
+    http_params.mime_type = 'application/octet-stream'
+    http_params.body = { binary_header, rspamd_text.fromtable(rows) }
+  else
+    http_params.body = { rspamd_text.fromtable(rows, '\n'), '\n' }
+  end
+
+  if settings.use_zstd then
+    http_params.body = rspamd_util.zstd_compress(rspamd_text.fromtable(http_params.body))
+    http_params.gzip = false
+    http_params.headers = lua_util.shallowcopy(http_params.headers or {})
+    http_params.headers['Content-Encoding'] = 'zstd'
+  end
   http_params.log_obj = params.task or params.config
 
   if not http_params.url then
@@ -422,11 +504,12 @@ exports.insert = function(upstream, settings, params, query, rows,
     end
     local ip_addr = upstream:get_addr():to_string(true)
     local database = settings.database or 'default'
-    http_params.url = string.format('%s%s/?database=%s&query=%s%%20FORMAT%%20TabSeparated',
+    http_params.url = string.format('%s%s/?database=%s&query=%s%%20FORMAT%%20%s',
         connect_prefix,
         ip_addr,
         escape_spaces(database),
-        escape_spaces(query))
+        escape_spaces(query),
+        format)
   end
 
   return rspamd_http.request(http_params)
@@ -0,0 +1,460 @@
+--[[
+Copyright (c) 2024, Vsevolod Stakhov <vsevolod@rspamd.com>
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+]]--
+
+--[[[
+-- @module lua_export
+-- This module implements export pipelines: plugins enqueue records, and records
+-- are sent to a sink in batches independently of message processing. Failed
+-- batches are retried with an exponential backoff and spooled to disk if a sink
+-- is unavailable for a long time; spooled batches are sent by any worker of the
+-- same host once the sink is back.
+--]]
+
+local rspamd_logger = require "rspamd_logger"
+local rspamd_util = require "rspamd_util"
+local rspamd_text = require "rspamd_text"
+local lua_util = require "lua_util"
+
+local exports = {}
+
+local N = 'lua_export'
+
+local default_opts = {
+  batch_size = 500, -- records in a batch
+  batch_interval = 1.0, -- incomplete batches are sent after this interval
+  max_queue = 10000, -- records waiting for a batch, the oldest are dropped when it is full
+  max_batches = 16, -- batches waiting to be sent in memory
+  max_retries = 5, -- attempts to send a batch before it is spooled or dropped
+  retry_interval = 1.0, -- delay after a failure, doubled on each subsequent failure
+  max_retry_interval = 60.0,
+  spool_dir = nil, -- directory to store batches that cannot be sent
+  max_spool_files = 1000,
+  compress = true, -- compress spooled batches using zstd
+}
+
+local pipeline_mt = {}
+pipeline_mt.__index = pipeline_mt
+
+local function default_encode(records)
+  return table.concat(records, '\n')
+end
+
+local function spool_files(self)
+  local files = rspamd_util.glob(string.format('%s/%s-*.spool*',
+      self.spool_dir, self.name)) or {}
+  table.sort(files)
+
+  return files
+end
+
+-- Stores batch in the spool directory, batch is dropped if it is impossible
+local function spool_batch(self, batch, log_obj)
+  log_obj = log_obj or rspamd_config
+
+  if not self.spool_dir then
+    self.stats.dropped = self.stats.dropped + batch.nrecords
+    rspamd_logger.errx(log_obj, '%s: drop batch of %s records: sink is unavailable',
+        self.name, batch.nrecords)
+    return false
+  end
+
+  if #spool_files(self) >= self.max_spool_files then
+    self.stats.dropped = self.stats.dropped + batch.nrecords
+    rspamd_logger.errx(log_obj, '%s: drop batch of %s records: spool is full',
+        self.name, batch.nrecords)
+    return false
+  end
+
+  local fname = string.format('%s-%d-%s-%d.spool', self.name, os.time(),
+      rspamd_util.random_hex(8), batch.nrecords)
+  local data
+
+  if self.compress then
+    data = rspamd_util.zstd_compress(batch.payload)
+    fname = fname .. '.zst'
+  elseif type(batch.payload) == 'string' then
+    data = rspamd_text.fromstring(batch.payload)
+  else
+    data = batch.payload
+  end
+
+  -- Hidden temporary file is not matched by other workers until renamed
+  local tmp_path = string.format('%s/.%s.tmp', self.spool_dir, fname)
+  local path = string.format('%s/%s', self.spool_dir, fname)
+  local ret, err = data:save_in_file(tmp_path)
+
+  if ret then
+    ret, err = os.rename(tmp_path, path)
+  end
+
+  if not ret then
+    rspamd_util.unlink(tmp_path)
+    self.stats.dropped = self.stats.dropped + batch.nrecords
+    rspamd_logger.errx(log_obj, '%s: drop batch of %s records: cannot write %s: %s',
+        self.name, batch.nrecords, path, err)
+    return false
+  end
+
+  self.stats.spooled = self.stats.spooled + batch.nrecords
+  lua_util.debugm(N, log_obj, '%s: spooled batch of %s records to %s',
+      self.name, batch.nrecords, path)
+
+  return true
+end
+
+-- Loads the oldest spooled batch, file is claimed by renaming, so each batch
+-- is loaded by a single worker
+local function unspool_batch(self)
+  for _, path in ipairs(spool_files(self)) do
+    local dir, fname = path:match('^(.*)/([^/]+)$')
+    local claimed = string.format('%s/.%s.%s', dir, fname, rspamd_util.random_hex(8))
+
+    if os.rename(path, claimed) then
+      local f = io.open(claimed, 'rb')
+      local data = f and f:read('*a')
+
+      if f then
+        f:close()
+      end
+      rspamd_util.unlink(claimed)
+
+      if data and fname:sub(-4) == '.zst' then
+        local err
+        err, data = rspamd_util.zstd_decompress(data)
+
+        if err then
+          rspamd_logger.errx(rspamd_config, '%s: cannot decompress spooled batch %s: %s',
+              self.name, path, err)
+          data = nil
+        end
+      end
+
+      if data then
+        return {
+          payload = data,
+          nrecords = tonumber(fname:match('%-(%d+)%.spool')) or 0,
+          attempts = 0,
+        }
+      end
+    end
+  end
+
+  return nil
+end
+
+local function make_batch(self)
+  local records = {}
+  local last = math.min(self.head + self.batch_size, self.tail) - 1
+
+  for i = self.head, last do
+    table.insert(records, self.records[i])
+    self.records[i] = nil
+  end
+  self.head = last + 1
+
+  if #records == 0 then
+    return
+  end
+
+  table.insert(self.batches, {
+    payload = self.encode(records),
+    nrecords = #records,
+    attempts = 0,
+  })
+
+  if #self.batches > self.max_batches then
+    -- Sink cannot keep up, move the oldest batch out of memory
+    spool_batch(self, table.remove(self.batches, 1))
+  end
+end
+
+local function sink_params(self, task)
+  if task then
+    return { task = task, config = rspamd_config }
+  end
+
+  return { ev_base = self.ev_base, config = rspamd_config }
+end
+
+local function process(self)
+  if self.inflight or #self.batches == 0 or
+      rspamd_util.get_time() < self.next_attempt then
+    return
+  end
+
+  local batch = table.remove(self.batches, 1)
+  local finished = false
+  self.inflight = batch
+
+  local function done(ok, err)
+    if finished then
+      return
+    end
+    finished = true
+
+    if self.inflight ~= batch then
+      -- Batch has been spooled on termination
+      return
+    end
+    self.inflight = nil
+
+    if ok then
+      self.failures = 0
+      self.next_attempt = 0
+      self.stats.sent = self.stats.sent + batch.nrecords
+      lua_util.debugm(N, rspamd_config, '%s: sent batch of %s records',
+          self.name, batch.nrecords)
+    else
+      self.failures = self.failures + 1
+      batch.attempts = batch.attempts + 1
+      self.next_attempt = rspamd_util.get_time() + math.min(
+          self.retry_interval * 2 ^ (self.failures - 1), self.max_retry_interval)
+      rspamd_logger.infox(rspamd_config, '%s: cannot send batch of %s records: %s; failed attempts: %s/%s',
+          self.name, batch.nrecords, err, batch.attempts, self.max_retries)
+
+      if batch.attempts >= self.max_retries then
+        spool_batch(self, batch)
+      else
+        table.insert(self.batches, 1, batch)
+      end
+    end
+
+    process(self)
+  end
+
+  self.send(batch.payload, done, sink_params(self))
+end
+
+--[[[
+-- @method pipeline:tick()
+-- Makes a batch of queued records and sends pending batches if the sink is
+-- available, it is called periodically by workers that have started the pipeline
+--]]
+function pipeline_mt:tick()
+  make_batch(self)
+  process(self)
+
+  -- Spooled batches are sent only when the sink works and nothing else is pending
+  if self.spool_dir and self.failures == 0 and not self.inflight and
+      #self.batches == 0 then
+    local batch = unspool_batch(self)
+
+    if batch then
+      table.insert(self.batches, batch)
+      process(self)
+    end
+  end
+end
+
+--[[[
+-- @method pipeline:start(ev_base)
+-- Starts sending batches in the current worker, it is called automatically on
+-- the first `push` and when scanner workers are started
+--]]
+function pipeline_mt:start(ev_base)
+  if self.ev_base then
+    return
+  end
+
+  self.ev_base = ev_base
+
+  if self.spool_dir then
+    local ret, err = rspamd_util.mkdir(self.spool_dir, true)
+    if not ret then
+      rspamd_logger.errx(rspamd_config, '%s: cannot create spool directory %s: %s; spooling is disabled',
+          self.name, self.spool_dir, err)
+      self.spool_dir = nil
+    end
+  end
+
+  rspamd_config:add_periodic(ev_base, self.batch_interval, function()
+    self:tick()
+    return true
+  end, true)
+end
+
+--[[[
+-- @method pipeline:push(task, record)
+-- Enqueues record, this function never blocks and never fails: if the queue
+-- is full, then the oldest record is dropped
+-- @param {rspamd_task} task task object
+-- @param {string} record record to export
+--]]
+function pipeline_mt:push(task, record)
+  if not self.ev_base then
+    self:start(task:get_ev_base())
+  end
+
+  self.records[self.tail] = record
+  self.tail = self.tail + 1
+
+  if self.tail - self.head > self.max_queue then
+    self.records[self.head] = nil
+    self.head = self.head + 1
+    self.stats.dropped = self.stats.dropped + 1
+  end
+
+  if self.tail - self.head >= self.batch_size then
+    make_batch(self)
+    process(self)
+  end
+end
+
+--[[[
+-- @method pipeline:stat()
+-- Returns statistics of the pipeline in the current worker: `queued` records,
+-- records in `batches`, records `sent`, `dropped` and `spooled` by this worker
+-- @return {table} statistics
+--]]
+function pipeline_mt:stat()
+  local in_batches = 0
+  for _, b in ipairs(self.batches) do
+    in_batches = in_batches + b.nrecords
+  end
+
+  return {
+    queued = self.tail - self.head,
+    batches = in_batches,
+    sent = self.stats.sent,
+    dropped = self.stats.dropped,
+    spooled = self.stats.spooled,
+  }
+end
+
+--[[[
+-- @method pipeline:terminate(task)
+-- Spools pending records and the batch being sent, or sends them in the task
+-- session if there is no spool, it is called when a worker terminates
+-- @param {rspamd_task} task task object
+--]]
+function pipeline_mt:terminate(task)
+  while self.tail > self.head do
+    make_batch(self)
+  end
+
+  if self.inflight then
+    -- Request is likely to be aborted, so the batch might be sent twice
+    table.insert(self.batches, 1, self.inflight)
+    self.inflight = nil
+  end
+
+  for _, batch in ipairs(self.batches) do
+    if self.spool_dir then
+      spool_batch(self, batch, task)
+    else
+      self.send(batch.payload, function(ok, err)
+        if not ok then
+          rspamd_logger.errx(task, '%s: cannot send batch of %s records on termination: %s',
+              self.name, batch.nrecords, err)
+        end
+      end, sink_params(self, task))
+    end
+  end
+
+  self.batches = {}
+end
+
+--[[[
+-- @function lua_export.http_sink(opts)
+-- Creates sink that sends batches in HTTP POST requests
+-- @param {table} opts `url` (string or function that returns url), `headers`, `mime_type`,
+-- `gzip`, `user`, `password`, `timeout`, `no_ssl_verify`, `valid_codes` (list of codes, 2xx by default)
+-- @return {function} sink function
+--]]
+exports.http_sink = function(opts)
+  local rspamd_http = require "rspamd_http"
+  local valid_codes = {}
+
+  for _, c in ipairs(opts.valid_codes or { 200, 201, 202, 204 }) do
+    valid_codes[c] = true
+  end
+
+  return function(payload, done, params)
+    local url = opts.url
+
+    if type(url) == 'function' then
+      url = url()
+    end
+
+    local req = lua_util.shallowcopy(params)
+    req.url = url
+    req.method = 'post'
+    req.body = payload
+    req.headers = opts.headers
+    req.mime_type = opts.mime_type
+    req.gzip = opts.gzip
+    req.user = opts.user
+    req.password = opts.password
+    req.timeout = opts.timeout
+    req.no_ssl_verify = opts.no_ssl_verify
+    req.callback = function(err, code)
+      if err then
+        done(false, err)
+      elseif not valid_codes[code] then
+        done(false, string.format('%s: unexpected http code %s', url, code))
+      else
+        done(true)
+      end
+    end
+
+    if not rspamd_http.request(req) then
+      done(false, string.format('%s: cannot make http request', url))
+    end
+  end
+end
+
+--[[[
+-- @function lua_export.create(opts)
+-- Creates export pipeline, must be called on configuration stage. Options:
+--
+-- - `name`: name used in logs and spool file names
+-- - `send`: sink function `send(payload, done, params)`, it must call `done(ok, [err])` once;
+-- `params` contain `task` or `ev_base` and `config` to be used for requests
+-- - `encode`: function that converts list of records to a batch payload (records
+-- joined by newlines by default)
+-- - `batch_size`, `batch_interval`, `max_queue`, `max_batches`, `max_retries`,
+-- `retry_interval`, `max_retry_interval`, `spool_dir`, `max_spool_files`, `compress`
+-- @param {table} opts pipeline options
+-- @return {pipeline} pipeline object
+--]]
+exports.create = function(opts)
+  local self = lua_util.override_defaults(default_opts, opts)
+  assert(self.send, 'sink is required')
+
+  self.name = self.name or N
+  self.encode = self.encode or default_encode
+  self.records = {}
+  self.head, self.tail = 1, 1
+  self.batches = {}
+  self.failures = 0
+  self.next_attempt = 0
+  self.stats = { sent = 0, dropped = 0, spooled = 0 }
+  setmetatable(self, pipeline_mt)
+
+  rspamd_config:add_on_load(function(_, ev_base, worker)
+    -- Batches spooled by previous runs are sent by scanners even without new records
+    if worker:is_scanner() then
+      self:start(ev_base)
+    end
+  end)
+  rspamd_config:register_finish_script(function(task)
+    self:terminate(task)
+  end)
+
+  return self
+end
+
+return exports
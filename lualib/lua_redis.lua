@@ -17,6 +17,7 @@ limitations under the License.
 local logger = require "rspamd_logger"
 local lutil = require "lua_util"
 local rspamd_util = require "rspamd_util"
+local lua_redis_cluster = require "lua_redis_cluster"
 local ts = require("tableshape").types
 
 local exports = {}
@@ -33,6 +34,9 @@ local common_schema = {
   username = ts.string:is_optional():describe("Username"),
   password = ts.string:is_optional():describe("Password"),
   expand_keys = ts.boolean:is_optional():describe("Expand keys"),
+  auto_pipeline = ts.boolean:is_optional():describe("Share connections between requests to pipeline commands"),
+  cluster = ts.boolean:is_optional():describe("Servers are seed nodes of Redis Cluster"),
+  cluster_refresh_time = (ts.number + ts.string / lutil.parse_time_interval):is_optional():describe("Cluster slots refresh time"),
   sentinels = (ts.string + ts.array_of(ts.string)):is_optional():describe("Sentinel servers"),
   sentinel_watch_time = (ts.number + ts.string / lutil.parse_time_interval):is_optional():describe("Sentinel watch time"),
   sentinel_masters_pattern = ts.string:is_optional():describe("Sentinel masters pattern"),
@@ -313,6 +317,22 @@ local function add_redis_sentinels(params)
   end)
 end
 
+local function add_redis_cluster(params)
+  local seeds = params.write_servers or params.read_servers
+  local state = lua_redis_cluster.create(seeds, params.cluster_refresh_time)
+
+  -- All requests are routed to masters using the slots map
+  params.cluster_state = state
+
+  rspamd_config:add_on_load(function(cfg, ev_base, _)
+    rspamd_config:add_periodic(ev_base, 0.0, function()
+      lua_redis_cluster.refresh(state, params, cfg, ev_base)
+
+      return state.refresh_time
+    end, false)
+  end)
+end
+
 local cached_results = {}
 
 local function calculate_redis_hash(params)
@@ -376,6 +396,16 @@ local function process_redis_opts(options, redis_params)
   if options['password'] and not redis_params['password'] then
     redis_params['password'] = options['password']
   end
+  if type(options['auto_pipeline']) == 'boolean' and redis_params['auto_pipeline'] == nil then
+    redis_params['auto_pipeline'] = options['auto_pipeline']
+  end
+
+  if type(options['cluster']) == 'boolean' and redis_params['cluster'] == nil then
+    redis_params['cluster'] = options['cluster']
+  end
+  if options['cluster_refresh_time'] and not redis_params['cluster_refresh_time'] then
+    redis_params['cluster_refresh_time'] = lutil.parse_time_interval(options['cluster_refresh_time'])
+  end
 
   if not redis_params.sentinels and options.sentinels then
     redis_params.sentinels = options.sentinels
@@ -414,7 +444,9 @@ local function maybe_return_cached(redis_params)
   redis_params.hash = h
   cached_results[h] = redis_params
 
-  if not redis_params.read_only and redis_params.sentinels then
+  if redis_params.cluster then
+    add_redis_cluster(redis_params)
+  elseif not redis_params.read_only and redis_params.sentinels then
     add_redis_sentinels(redis_params)
   end
 
@@ -852,6 +884,67 @@ local function get_key_indexes(cmd, args)
   return idx_l
 end
 
+-- Returns the key that defines cluster slot for a command
+local function get_cluster_key(cmd, args, key)
+  local f = process_cmd[string.lower(cmd)]
+
+  if f and type(args) == 'table' then
+    local idx_l = f(args)
+
+    if idx_l[1] and args[idx_l[1]] then
+      return tostring(args[idx_l[1]])
+    end
+  end
+
+  return key
+end
+
+-- Repeats request on a cluster node from MOVED/ASK error, returns a new upstream
+-- on success
+local function redirect_cluster_request(redis_params, options, err, ev_base)
+  local state = redis_params.cluster_state
+  local addr, is_ask = lua_redis_cluster.process_redirect(state, err)
+
+  if not addr then
+    return nil
+  end
+
+  local rspamd_redis = require "rspamd_redis"
+  local opts = lutil.shallowcopy(options)
+  opts.host = addr:get_addr()
+  opts.auto_pipeline = nil
+
+  local ret
+
+  if is_ask then
+    -- ASKING must precede the command on the same connection
+    local cmd, args = opts.cmd, opts.args
+    opts.cmd = 'ASKING'
+    opts.args = {}
+    opts.callback = function(_, _)
+    end
+
+    local conn
+    ret, conn = rspamd_redis.make_request(opts)
+
+    if ret then
+      ret = conn:add_cmd(options.callback, cmd, args)
+    end
+  else
+    ret = rspamd_redis.make_request(opts)
+
+    if state.stale and ev_base then
+      lua_redis_cluster.refresh(state, redis_params, rspamd_config, ev_base)
+    end
+  end
+
+  if not ret then
+    return nil
+  end
+
+  return addr
+end
+
 local gen_meta = {
   principal_recipient = function(task)
     return task:get_principal_recipient()
@@ -944,8 +1037,19 @@ end
 -- extra_opts - table of optional request arguments
 local function rspamd_redis_make_request(task, redis_params, key, is_write,
                                          callback, command, args, extra_opts)
-  local addr
+  local addr, options
+  local redirected = false
   local function rspamd_redis_make_request_cb(err, data)
+    if err and redis_params.cluster_state and not redirected then
+      redirected = true
+      local new_addr = redirect_cluster_request(redis_params, options, err,
+          task:get_ev_base())
+
+      if new_addr then
+        addr = new_addr
+        return
+      end
+    end
     if err then
       addr:fail()
     else
@@ -961,7 +1065,10 @@ local function rspamd_redis_make_request(task, redis_params, key, is_write,
 
   local rspamd_redis = require "rspamd_redis"
 
-  if key then
+  if redis_params.cluster_state then
+    addr = lua_redis_cluster.get_upstream(redis_params.cluster_state,
+        get_cluster_key(command, args, key))
+  elseif key then
     if is_write then
       addr = redis_params['write_servers']:get_upstream_by_hash(key)
     else
@@ -988,7 +1095,7 @@ local function rspamd_redis_make_request(task, redis_params, key, is_write,
   end
 
   local ip_addr = addr:get_addr()
-  local options = {
+  options = {
     task = task,
     callback = rspamd_redis_make_request_cb,
     host = ip_addr,
@@ -1015,6 +1122,10 @@ local function rspamd_redis_make_request(task, redis_params, key, is_write,
     options['dbname'] = redis_params['db']
   end
 
+  if redis_params['auto_pipeline'] then
+    options['auto_pipeline'] = true
+  end
+
   lutil.debugm(N, task, 'perform request to redis server' ..
       ' (host=%s, timeout=%s): cmd: %s', ip_addr,
       options.timeout, options.cmd)
@@ -1050,8 +1161,18 @@ local function redis_make_request_taskless(ev_base, cfg, redis_params, key,
     return false, nil, nil
   end
 
-  local addr
+  local addr, options
+  local redirected = false
   local function rspamd_redis_make_request_cb(err, data)
+    if err and redis_params.cluster_state and not redirected then
+      redirected = true
+      local new_addr = redirect_cluster_request(redis_params, options, err, ev_base)
+
+      if new_addr then
+        addr = new_addr
+        return
+      end
+    end
     if err then
       addr:fail()
     else
@@ -1064,7 +1185,10 @@ local function redis_make_request_taskless(ev_base, cfg, redis_params, key,
 
   local rspamd_redis = require "rspamd_redis"
 
-  if key then
+  if redis_params.cluster_state then
+    addr = lua_redis_cluster.get_upstream(redis_params.cluster_state,
+        get_cluster_key(command, args, key))
+  elseif key then
     if is_write then
       addr = redis_params['write_servers']:get_upstream_by_hash(key)
     else
@@ -1082,7 +1206,7 @@ local function redis_make_request_taskless(ev_base, cfg, redis_params, key,
     logger.errx(cfg, 'cannot select server to make redis request')
   end
 
-  local options = {
+  options = {
     ev_base = ev_base,
     config = cfg,
     callback = rspamd_redis_make_request_cb,
@@ -1109,6 +1233,10 @@ local function redis_make_request_taskless(ev_base, cfg, redis_params, key,
     options['dbname'] = redis_params['db']
   end
 
+  if redis_params['auto_pipeline'] then
+    options['auto_pipeline'] = true
+  end
+
   lutil.debugm(N, cfg, 'perform taskless request to redis server' ..
       ' (host=%s, timeout=%s): cmd: %s', options.host:tostring(true),
       options.timeout, options.cmd)
@@ -1154,11 +1282,16 @@ local function prepare_redis_call(script)
   local servers = {}
   local options = {}
 
-  if script.redis_params.read_servers then
-    servers = lutil.table_merge(servers, script.redis_params.read_servers:all_upstreams())
-  end
-  if script.redis_params.write_servers then
-    servers = lutil.table_merge(servers, script.redis_params.write_servers:all_upstreams())
+  if script.redis_params.cluster_state then
+    -- Scripts must be loaded to all masters
+    servers = lua_redis_cluster.all_upstreams(script.redis_params.cluster_state)
+  else
+    if script.redis_params.read_servers then
+      servers = lutil.table_merge(servers, script.redis_params.read_servers:all_upstreams())
+    end
+    if script.redis_params.write_servers then
+      servers = lutil.table_merge(servers, script.redis_params.write_servers:all_upstreams())
+    end
   end
 
   -- Call load script on each server, set loaded flag
@@ -1465,7 +1598,9 @@ local function redis_connect_sync(redis_params, is_write, key, cfg, ev_base)
   local rspamd_redis = require "rspamd_redis"
   local addr
 
-  if key then
+  if redis_params.cluster_state then
+    addr = lua_redis_cluster.get_upstream(redis_params.cluster_state, key)
+  elseif key then
     if is_write then
       addr = redis_params['write_servers']:get_upstream_by_hash(key)
     else
@@ -1590,7 +1725,18 @@ exports.request = function(redis_params, attrs, req)
   if opts.callback then
     -- Wrap callback
     local callback = opts.callback
+    local redirected = false
     local function rspamd_redis_make_request_cb(err, data)
+      if err and redis_params.cluster_state and not redirected then
+        redirected = true
+        local new_addr = redirect_cluster_request(redis_params, opts, err,
+            opts.ev_base or opts.task:get_ev_base())
+
+        if new_addr then
+          addr = new_addr
+          return
+        end
+      end
       if err then
         addr:fail()
       else
@@ -1604,7 +1750,18 @@ exports.request = function(redis_params, attrs, req)
   local rspamd_redis = require "rspamd_redis"
   local is_write = opts.is_write
 
-  if opts.key then
+  if redis_params.cluster_state then
+    local cmd, args = req, nil
+    if type(req) == 'table' then
+      cmd = req[1]
+      args = {}
+      for i = 2, #req do
+        args[#args + 1] = req[i]
+      end
+    end
+    addr = lua_redis_cluster.get_upstream(redis_params.cluster_state,
+        get_cluster_key(cmd, args, attrs.key))
+  elseif opts.key then
     if is_write then
       addr = redis_params['write_servers']:get_upstream_by_hash(attrs.key)
     else
@@ -1645,6 +1802,10 @@ exports.request = function(redis_params, attrs, req)
     opts.dbname = redis_params.db
   end
 
+  if redis_params.auto_pipeline then
+    opts.auto_pipeline = true
+  end
+
   lutil.debugm(N, 'perform generic request to redis server' ..
       ' (host=%s, timeout=%s): cmd: %s, arguments: %s', addr,
       opts.timeout, opts.cmd, opts.args)
@@ -1715,7 +1876,9 @@ exports.connect = function(redis_params, attrs)
   local rspamd_redis = require "rspamd_redis"
   local is_write = opts.is_write
 
-  if opts.key then
+  if redis_params.cluster_state then
+    addr = lua_redis_cluster.get_upstream(redis_params.cluster_state, attrs.key)
+  elseif opts.key then
     if is_write then
       addr = redis_params['write_servers']:get_upstream_by_hash(attrs.key)
     else
@@ -1770,6 +1933,299 @@ exports.connect = function(redis_params, attrs)
   end
 end
 
+--[[[
+-- Write-behind buffer: commutative updates are coalesced per key in memory and
+-- flushed in batches, so many messages result in a single command per key
+--]]
+local write_behind_mt = {}
+write_behind_mt.__index = write_behind_mt
+
+local function write_behind_key(self, key)
+  local elt = self.pending[key]
+
+  if not elt then
+    elt = {}
+    self.pending[key] = elt
+    table.insert(self.keys, key)
+  end
+
+  self.nops = self.nops + 1
+
+  return elt
+end
+
+-- Large integral sums must not be sent in exponent notation (e.g. 1e+15)
+local function write_behind_number(v)
+  if math.floor(v) == v then
+    return string.format('%d', v)
+  end
+
+  return tostring(v)
+end
+
+local function write_behind_commands(elt)
+  local cmds = {}
+
+  if elt.incr then
+    local cmd = (math.floor(elt.incr) == elt.incr) and 'INCRBY' or 'INCRBYFLOAT'
+    table.insert(cmds, { cmd, { write_behind_number(elt.incr) } })
+  end
+
+  if elt.hincr then
+    for field, v in pairs(elt.hincr) do
+      local cmd = (math.floor(v) == v) and 'HINCRBY' or 'HINCRBYFLOAT'
+      table.insert(cmds, { cmd, { field, write_behind_number(v) } })
+    end
+  end
+
+  if elt.list then
+    table.insert(cmds, { 'LPUSH', elt.list })
+    if elt.list_max then
+      table.insert(cmds, { 'LTRIM', { '0', string.format('%d', elt.list_max - 1) } })
+    end
+  end
+
+  if elt.set then
+    local args = {}
+    for member in pairs(elt.set) do
+      table.insert(args, member)
+    end
+    table.insert(cmds, { 'SADD', args })
+  end
+
+  if elt.zset then
+    local args = {}
+    for member, score in pairs(elt.zset) do
+      table.insert(args, write_behind_number(score))
+      table.insert(args, member)
+    end
+    table.insert(cmds, { 'ZADD', args })
+  end
+
+  if elt.zincr then
+    for member, v in pairs(elt.zincr) do
+      table.insert(cmds, { 'ZINCRBY', { write_behind_number(v), member } })
+    end
+  end
+
+  if elt.zset or elt.zincr then
+    if elt.zset_max then
+      table.insert(cmds, { 'ZREMRANGEBYRANK', { '0', string.format('%d', -(elt.zset_max + 1)) } })
+    end
+  end
+
+  if elt.expire then
+    table.insert(cmds, { 'EXPIRE', { string.format('%d', elt.expire) } })
+  end
+
+  return cmds
+end
+
+--[[[
+-- @method write_behind:flush([task])
+-- Sends all pending updates to Redis, uses task session if `task` is specified
+-- (e.g. from a finish script), otherwise requests are not bound to any task
+--]]
+function write_behind_mt:flush(task)
+  if self.nops == 0 then
+    return
+  end
+
+  local pending, keys = self.pending, self.keys
+  local log_obj = task or rspamd_config
+  self.pending, self.keys, self.nops = {}, {}, 0
+
+  local function flush_cb(err)
+    if err then
+      logger.errx(log_obj, '%s: cannot flush pending updates: %s', self.name, err)
+    end
+  end
+
+  for _, key in ipairs(keys) do
+    local cmds = write_behind_commands(pending[key])
+
+    if #cmds > 0 then
+      local first_args = { key }
+      for _, a in ipairs(cmds[1][2]) do
+        table.insert(first_args, a)
+      end
+
+      local ret, conn
+      local route_key = self.route_by_key and key or nil
+      if task then
+        ret, conn = exports.rspamd_redis_make_request(task, self.redis_params, route_key,
+            true, flush_cb, cmds[1][1], first_args)
+      else
+        ret, conn = redis_make_request_taskless(self.ev_base, rspamd_config, self.redis_params,
+            route_key, true, flush_cb, cmds[1][1], first_args)
+      end
+
+      if ret then
+        for i = 2, #cmds do
+          local args = { key }
+          for _, a in ipairs(cmds[i][2]) do
+            table.insert(args, a)
+          end
+          conn:add_cmd(cmds[i][1], args)
+        end
+      else
+        logger.errx(log_obj, '%s: cannot flush pending updates for %s', self.name, key)
+      end
+    end
+  end
+
+  lutil.debugm(N, log_obj, '%s: flushed updates for %s keys', self.name, #keys)
+end
+
+local function write_behind_added(self, task)
+  if not self.ev_base then
+    -- Flush timer is started lazily in workers that actually write something
+    self.ev_base = task:get_ev_base()
+    rspamd_config:add_periodic(self.ev_base, self.interval, function()
+      self:flush()
+      return true
+    end, true)
+  end
+
+  if self.nops >= self.max_pending then
+    self:flush()
+  end
+end
+
+--[[[
+-- @method write_behind:incrby(task, key, value)
+-- Adds `value` to the counter stored in `key`
+--]]
+function write_behind_mt:incrby(task, key, value)
+  local elt = write_behind_key(self, key)
+  elt.incr = (elt.incr or 0) + value
+  write_behind_added(self, task)
+end
+
+--[[[
+-- @method write_behind:hincrby(task, key, field, value)
+-- Adds `value` to the `field` of hash stored in `key`
+--]]
+function write_behind_mt:hincrby(task, key, field, value)
+  local elt = write_behind_key(self, key)
+  if not elt.hincr then
+    elt.hincr = {}
+  end
+  elt.hincr[field] = (elt.hincr[field] or 0) + value
+  write_behind_added(self, task)
+end
+
+--[[[
+-- @method write_behind:lpush(task, key, value[, max_len])
+-- Prepends `value` to the list stored in `key`, list is trimmed to `max_len` elements
+--]]
+function write_behind_mt:lpush(task, key, value, max_len)
+  local elt = write_behind_key(self, key)
+  if not elt.list then
+    elt.list = {}
+  end
+  table.insert(elt.list, value)
+  if max_len then
+    elt.list_max = max_len
+    -- Elements that will be trimmed anyway are not sent
+    if #elt.list > max_len then
+      table.remove(elt.list, 1)
+    end
+  end
+  write_behind_added(self, task)
+end
+
+--[[[
+-- @method write_behind:zadd(task, key, score, member[, max_card])
+-- Adds `member` to the sorted set stored in `key` (the highest score wins),
+-- elements with the lowest scores are removed to keep `max_card` elements
+--]]
+function write_behind_mt:zadd(task, key, score, member, max_card)
+  local elt = write_behind_key(self, key)
+  if not elt.zset then
+    elt.zset = {}
+  end
+  if not elt.zset[member] or elt.zset[member] < score then
+    elt.zset[member] = score
+  end
+  if max_card then
+    elt.zset_max = max_card
+  end
+  write_behind_added(self, task)
+end
+
+--[[[
+-- @method write_behind:zincrby(task, key, member, value[, max_card])
+-- Adds `value` to the score of `member` in the sorted set stored in `key`,
+-- elements with the lowest scores are removed to keep `max_card` elements
+--]]
+function write_behind_mt:zincrby(task, key, member, value, max_card)
+  local elt = write_behind_key(self, key)
+  if not elt.zincr then
+    elt.zincr = {}
+  end
+  elt.zincr[member] = (elt.zincr[member] or 0) + value
+  if max_card then
+    elt.zset_max = max_card
+  end
+  write_behind_added(self, task)
+end
+
+--[[[
+-- @method write_behind:sadd(task, key, member)
+-- Adds `member` to the set stored in `key`
+--]]
+function write_behind_mt:sadd(task, key, member)
+  local elt = write_behind_key(self, key)
+  if not elt.set then
+    elt.set = {}
+  end
+  elt.set[member] = true
+  write_behind_added(self, task)
+end
+
+--[[[
+-- @method write_behind:expire(task, key, ttl)
+-- Sets expiration for `key` after all other pending updates are applied
+--]]
+function write_behind_mt:expire(task, key, ttl)
+  local elt = write_behind_key(self, key)
+  elt.expire = ttl
+  write_behind_added(self, task)
+end
+
+--[[[
+-- @function lua_redis.write_behind(redis_params, [opts])
+-- Creates a buffer for commutative updates (counters, lists appends, sets and sorted sets)
+-- that are coalesced per key and flushed to Redis each `interval` seconds or
+-- when `max_pending` updates are queued. Updates that are not flushed are lost
+-- if a worker crashes, pending updates are flushed on normal termination.
+-- Must be called on configuration stage.
+-- @param {table} redis_params redis server parameters
+-- @param {table} opts optional parameters: `name`, `interval` (1s by default), `max_pending` (1000 by default),
+-- `route_by_key` (true by default, select server by the key as `redis_make_request` does)
+-- @return {write_behind} buffer object
+--]]
+exports.write_behind = function(redis_params, opts)
+  opts = opts or E
+  local self = setmetatable({
+    redis_params = redis_params,
+    name = opts.name or N,
+    interval = opts.interval or 1.0,
+    max_pending = opts.max_pending or 1000,
+    route_by_key = opts.route_by_key ~= false,
+    pending = {},
+    keys = {},
+    nops = 0,
+  }, write_behind_mt)
+
+  rspamd_config:register_finish_script(function(task)
+    self:flush(task)
+  end)
+
+  return self
+end
+
 local redis_prefixes = {}
 
 --[[[
@@ -0,0 +1,315 @@
+--[[
+Copyright (c) 2024, Vsevolod Stakhov <vsevolod@rspamd.com>
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+]]--
+
+--[[[
+-- @module lua_redis_cluster
+-- This module maintains Redis Cluster slots map used by lua_redis to route
+-- requests to the nodes that own the corresponding keys
+--]]
+
+local logger = require "rspamd_logger"
+local lutil = require "lua_util"
+
+local N = "lua_redis"
+
+local exports = {}
+
+-- Normalise `host:port` string returned by Redis, wrapping IPv6 addresses
+local function node_name(host, port)
+  if not port then
+    -- host:port form, port is the last component
+    local h, p = string.match(host, '^(.+):(%d+)$')
+    if not h then
+      return nil
+    end
+    host, port = h, p
+  end
+
+  if host:sub(1, 1) ~= '[' and host:match(':') then
+    host = '[' .. host .. ']'
+  end
+
+  return string.format('%s:%s', host, port)
+end
+
+exports.node_name = node_name
+
+--[[[
+-- @function lua_redis_cluster.create(seeds, refresh_time)
+-- Creates cluster state for a redis servers definition
+-- @param {upstream_list} seeds upstreams used to discover cluster topology
+-- @param {number} refresh_time interval between topology updates
+-- @return {table} cluster state
+--]]
+exports.create = function(seeds, refresh_time)
+  return {
+    seeds = seeds,
+    refresh_time = refresh_time or 60.0,
+    ranges = {}, -- sorted array of {first, last, master}
+    masters = {}, -- array of known masters
+    moved = {}, -- slot -> node overrides learned from MOVED replies
+    nodes = {}, -- node name -> upstream list
+    refreshing = false,
+  }
+end
+
+local function get_node_upstreams(state, name)
+  local ups = state.nodes[name]
+
+  if not ups then
+    local upstream_list = require "rspamd_upstream_list"
+    ups = upstream_list.create(rspamd_config, name, 6379)
+
+    if not ups then
+      logger.errx(rspamd_config, 'cannot create upstream for redis cluster node %s', name)
+      return nil
+    end
+
+    state.nodes[name] = ups
+  end
+
+  return ups
+end
+
+-- Binary search of the slot in the ranges array
+local function find_slot_master(ranges, slot)
+  local lo, hi = 1, #ranges
+
+  while lo <= hi do
+    local mid = math.floor((lo + hi) / 2)
+    local r = ranges[mid]
+
+    if slot < r[1] then
+      hi = mid - 1
+    elseif slot > r[2] then
+      lo = mid + 1
+    else
+      return r[3]
+    end
+  end
+
+  return nil
+end
+
+exports.find_slot_master = find_slot_master
+
+--[[[
+-- @function lua_redis_cluster.get_upstream(state, key)
+-- Returns upstream of the master node that owns a key; seed upstreams are used
+-- if the slots map is not known yet (the request is then redirected by Redis)
+-- @param {table} state cluster state
+-- @param {string} key redis key (or nil)
+-- @return {upstream} upstream object
+--]]
+exports.get_upstream = function(state, key)
+  if key then
+    local rspamd_redis = require "rspamd_redis"
+    local slot = rspamd_redis.key_slot(key)
+    local master = state.moved[slot] or find_slot_master(state.ranges, slot)
+
+    if master then
+      local ups = get_node_upstreams(state, master)
+
+      if ups then
+        return ups:get_upstream_round_robin()
+      end
+    end
+
+    return state.seeds:get_upstream_by_hash(key)
+  end
+
+  return state.seeds:get_upstream_round_robin()
+end
+
+--[[[
+-- @function lua_redis_cluster.all_upstreams(state)
+-- Returns upstreams of all known masters (or seeds if topology is unknown)
+-- @param {table} state cluster state
+-- @return {table} array of upstreams
+--]]
+exports.all_upstreams = function(state)
+  local res = {}
+
+  for _, master in ipairs(state.masters) do
+    local ups = get_node_upstreams(state, master)
+
+    if ups then
+      res[#res + 1] = ups:get_upstream_round_robin()
+    end
+  end
+
+  if #res == 0 then
+    return state.seeds:all_upstreams()
+  end
+
+  return res
+end
+
+--[[[
+-- @function lua_redis_cluster.process_redirect(state, err)
+-- Processes MOVED/ASK error replies
+-- @param {table} state cluster state
+-- @param {string} err error returned by Redis
+-- @return {upstream,boolean} upstream of the target node and `true` if it is an ASK redirection
+--]]
+exports.process_redirect = function(state, err)
+  local kind, slot, target = string.match(err, '^(%u+) (%d+) (%S+)')
+
+  if not kind or (kind ~= 'MOVED' and kind ~= 'ASK') then
+    return nil
+  end
+
+  local name = node_name(target)
+
+  if not name then
+    return nil
+  end
+
+  local ups = get_node_upstreams(state, name)
+
+  if not ups then
+    return nil
+  end
+
+  if kind == 'MOVED' then
+    -- Slot has been permanently moved, topology should be refreshed
+    state.moved[tonumber(slot)] = name
+    state.stale = true
+    lutil.debugm(N, rspamd_config, 'cluster slot %s has been moved to %s', slot, name)
+
+    return ups:get_upstream_round_robin(), false
+  end
+
+  lutil.debugm(N, rspamd_config, 'cluster slot %s is migrating to %s', slot, name)
+
+  return ups:get_upstream_round_robin(), true
+end
+
+local function process_slots_reply(state, data, queried_host)
+  local ranges, masters, seen = {}, {}, {}
+
+  for _, elt in ipairs(data) do
+    local first, last, master = tonumber(elt[1]), tonumber(elt[2]), elt[3]
+
+    if first and last and type(master) == 'table' then
+      local host = master[1]
+
+      if not host or host == '' or host == '?' then
+        -- Node does not know its own address
+        host = queried_host
+      end
+
+      local name = node_name(tostring(host), tostring(master[2]))
+      ranges[#ranges + 1] = { first, last, name }
+
+      if not seen[name] then
+        seen[name] = true
+        masters[#masters + 1] = name
+      end
+    end
+  end
+
+  if #ranges == 0 then
+    return false
+  end
+
+  table.sort(ranges, function(a, b)
+    return a[1] < b[1]
+  end)
+  table.sort(masters)
+
+  state.ranges = ranges
+  state.masters = masters
+  state.moved = {}
+  state.stale = false
+
+  return true
+end
+
+--[[[
+-- @function lua_redis_cluster.refresh(state, redis_params, cfg, ev_base)
+-- Queries `CLUSTER SLOTS` and replaces the slots map
+-- @param {table} state cluster state
+-- @param {table} redis_params redis parameters (timeout, username, password)
+-- @param {rspamd_config} cfg config object
+-- @param {ev_base} ev_base event loop
+--]]
+exports.refresh = function(state, redis_params, cfg, ev_base)
+  if state.refreshing then
+    return
+  end
+
+  local rspamd_redis = require "rspamd_redis"
+  local addr
+
+  -- Prefer the already known nodes as seeds may be gone
+  if #state.masters > 0 then
+    local ups = get_node_upstreams(state, state.masters[math.random(#state.masters)])
+    if ups then
+      addr = ups:get_upstream_round_robin()
+    end
+  end
+
+  if not addr then
+    addr = state.seeds:get_upstream_round_robin()
+  end
+
+  local host = addr:get_addr()
+
+  local function slots_cb(err, data)
+    state.refreshing = false
+
+    if err or type(data) ~= 'table' then
+      logger.errx(cfg, 'cannot get slots from redis cluster node %s: %s',
+          host:to_string(true), err or 'bad reply')
+      addr:fail()
+
+      return
+    end
+
+    addr:ok()
+
+    if process_slots_reply(state, data, host:to_string()) then
+      lutil.debugm(N, cfg, 'updated redis cluster slots map from %s: %s ranges, %s masters',
+          host:to_string(true), #state.ranges, #state.masters)
+    else
+      logger.errx(cfg, 'empty slots map received from redis cluster node %s',
+          host:to_string(true))
+    end
+  end
+
+  local ret = rspamd_redis.make_request {
+    host = host,
+    timeout = redis_params.timeout,
+    username = redis_params.username,
+    password = redis_params.password,
+    config = cfg,
+    ev_base = ev_base,
+    cmd = 'CLUSTER',
+    args = { 'SLOTS' },
+    no_pool = true,
+    callback = slots_cb,
+  }
+
+  if ret then
+    state.refreshing = true
+  else
+    logger.errx(cfg, 'cannot query redis cluster node %s', host:to_string(true))
+    addr:fail()
+  end
+end
+
+return exports
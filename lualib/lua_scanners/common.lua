@@ -22,6 +22,8 @@ limitations under the License.
 
 local rspamd_logger = require "rspamd_logger"
 local rspamd_regexp = require "rspamd_regexp"
+local rspamd_util = require "rspamd_util"
+local rspamd_shared_cache = require "rspamd_shared_cache"
 local lua_util = require "lua_util"
 local lua_redis = require "lua_redis"
 local lua_magic_types = require "lua_magic/types"
@@ -64,7 +66,7 @@ local function match_patterns(default_sym, found, patterns, dyn_weight)
   end
 end
 
-local function yield_result(task, rule, vname, dyn_weight, is_fail, maybe_part)
+local function insert_scan_result(task, rule, vname, dyn_weight, is_fail, maybe_part)
   local all_whitelisted = true
   local patterns
   local symbol
@@ -137,6 +139,185 @@ local function yield_result(task, rule, vname, dyn_weight, is_fail, maybe_part)
   end
 end
 
+--[[[
+-- Concurrency limiter for external scanners: the number of concurrent requests
+-- to the scanner's upstreams is adjusted using AIMD (additive increase on fast
+-- replies, multiplicative decrease on slow replies and failures); requests above
+-- the limit wait in a bounded queue and are shed when it is full.
+-- Requests for the same digest are coalesced: only one scan is performed, and
+-- tasks that have asked for the same content later get its results.
+-- The limiter is per-process and is enabled by `concurrency` rule option.
+--]]
+local function get_limiter(rule)
+  if not rule.concurrency then
+    return nil
+  end
+
+  if not rule.limiter then
+    local opts = lua_util.override_defaults({
+      max = 32, -- upper limit of concurrent requests
+      min = 1, -- lower limit of concurrent requests
+      queue = 64, -- max number of requests waiting for a slot
+      queue_timeout = 1.0, -- how long a request can wait for a slot
+      latency = (rule.timeout or 5.0) / 2.0, -- slower replies decrease limit
+    }, type(rule.concurrency) == 'table' and rule.concurrency or {})
+
+    rule.limiter = {
+      opts = opts,
+      limit = opts.max,
+      in_flight = 0,
+      queue = {}, -- waiting scans
+      scans = {}, -- digest -> waiting or running scan
+    }
+  end
+
+  return rule.limiter
+end
+
+local function limiter_grant(limiter)
+  while limiter.in_flight < math.floor(limiter.limit) and #limiter.queue > 0 do
+    local scan = table.remove(limiter.queue, 1)
+    -- Wake up the waiting task, timer is not pending if a task is already finished
+    if scan.timer:reschedule(0) then
+      limiter.in_flight = limiter.in_flight + 1
+      scan.granted = true
+    end
+  end
+end
+
+-- Finishes scan and shares its results with all coalesced tasks
+local function limiter_finish(rule, limiter, scan, results)
+  if limiter.scans[scan.digest] ~= scan then
+    return
+  end
+
+  limiter.scans[scan.digest] = nil
+
+  if scan.start or scan.granted then
+    -- Slot is held since it has been granted, even if scan has not been started
+    limiter.in_flight = limiter.in_flight - 1
+
+    if scan.start then
+      local opts = limiter.opts
+      local failed = results and results[1] and results[1][3] == 'fail'
+
+      if failed or not results or rspamd_util.get_time() - scan.start > opts.latency then
+        limiter.limit = math.max(opts.min, limiter.limit * 0.75)
+      else
+        limiter.limit = math.min(opts.max, limiter.limit + 1.0 / limiter.limit)
+      end
+    end
+  else
+    for i, queued in ipairs(limiter.queue) do
+      if queued == scan then
+        table.remove(limiter.queue, i)
+        break
+      end
+    end
+  end
+
+  for _, follower in ipairs(scan.followers) do
+    follower.results = results or { { 'failed: concurrent scan has been aborted', 0.0, 'fail' } }
+    follower.timer:reschedule(0)
+  end
+
+  limiter_grant(limiter)
+end
+
+local function limiter_shed(task, rule, maybe_part, reason)
+  rspamd_logger.infox(task, '%s: skip scan: %s', rule.log_prefix, reason)
+  insert_scan_result(task, rule, 'overloaded: ' .. reason, 0.0, 'fail', maybe_part)
+end
+
+local function limiter_run(task, rule, digest, fn, maybe_part)
+  local limiter = get_limiter(rule)
+
+  if not limiter then
+    fn()
+    return
+  end
+
+  local existing = limiter.scans[digest]
+
+  if existing then
+    local follower = {}
+    local wait_time = (rule.timeout or 5.0) * ((rule.retransmits or 0) + 1) +
+        limiter.opts.queue_timeout
+    follower.timer = task:add_timer(wait_time, function(t)
+      if follower.results then
+        lua_util.debugm(rule.name, t, '%s: got results of a concurrent scan for %s',
+            rule.log_prefix, digest)
+        for _, res in ipairs(follower.results) do
+          insert_scan_result(t, rule, res[1], res[2], res[3], maybe_part)
+        end
+      else
+        limiter_shed(t, rule, maybe_part, 'timeout waiting for concurrent scan')
+      end
+    end)
+    table.insert(existing.followers, follower)
+
+    return
+  end
+
+  local scan = {
+    digest = digest,
+    uid = task:get_uid(),
+    followers = {},
+  }
+
+  local function start_scan()
+    scan.start = rspamd_util.get_time()
+    fn()
+  end
+
+  -- Release slot if task is finished without results, e.g. on timeout
+  task:get_mempool():add_destructor(function()
+    limiter_finish(rule, limiter, scan, nil)
+  end)
+
+  if limiter.in_flight < math.floor(limiter.limit) then
+    limiter.scans[digest] = scan
+    limiter.in_flight = limiter.in_flight + 1
+    start_scan()
+  elseif #limiter.queue < limiter.opts.queue then
+    limiter.scans[digest] = scan
+    scan.timer = task:add_timer(limiter.opts.queue_timeout, function(t)
+      if scan.granted then
+        start_scan()
+      else
+        local results = { { 'overloaded: queue timeout', 0.0, 'fail' } }
+        limiter_shed(t, rule, maybe_part, 'queue timeout')
+        limiter_finish(rule, limiter, scan, results)
+      end
+    end)
+    table.insert(limiter.queue, scan)
+  else
+    limiter_shed(task, rule, maybe_part, string.format('%d requests in flight and %d queued',
+        limiter.in_flight, #limiter.queue))
+  end
+end
+
+-- Called when a scanner has got results for a digest
+local function limiter_complete(task, rule, digest, result)
+  local limiter = rule.limiter
+
+  if not limiter or not digest then
+    return
+  end
+
+  local scan = limiter.scans[digest]
+
+  if scan and scan.start and scan.uid == task:get_uid() then
+    limiter_finish(rule, limiter, scan, { result })
+  end
+end
+
+local function yield_result(task, rule, vname, dyn_weight, is_fail, maybe_part)
+  local digest = maybe_part and maybe_part:get_digest() or task:get_digest()
+  insert_scan_result(task, rule, vname, dyn_weight, is_fail, maybe_part)
+  limiter_complete(task, rule, digest, { vname, dyn_weight, is_fail })
+end
+
 local function message_not_too_large(task, content, rule)
   local max_size = tonumber(rule.max_size)
   if not max_size then
@@ -216,34 +397,95 @@ local function dynamic_scan(task, rule)
   end
 end
 
+--[[[
+-- Local cache is a shared memory cache of scan results that is checked before
+-- Redis cache, so the most frequent attachments do not need any requests at all.
+-- It is enabled by `local_cache` rule option and must be initialized when
+-- the rule is configured, so the memory is shared between workers.
+--]]
+local function init_local_cache(rule)
+  if not rule.local_cache or rule.local_cache.storage then
+    return
+  end
+
+  local opts = lua_util.override_defaults({
+    size = 16 * 1024 * 1024, -- memory size in bytes
+    max_value = 256, -- longer results are not cached locally
+    expire = rule.cache_expire or 3600,
+  }, type(rule.local_cache) == 'table' and rule.local_cache or {})
+
+  rule.local_cache = {
+    storage = rspamd_shared_cache.create(rspamd_config, opts.size, opts.max_value),
+    expire = opts.expire,
+    -- Clean results
+    negative_expire = opts.negative_expire or opts.expire,
+  }
+end
+
+local function local_cache_key(rule, digest)
+  return (rule.prefix or rule.name) .. digest
+end
+
+local function local_cache_set(rule, digest, value)
+  local expire = rule.local_cache.expire
+
+  if value:sub(1, 3) == 'OK\t' then
+    expire = rule.local_cache.negative_expire
+  end
+
+  if expire > 0 then
+    rule.local_cache.storage:set(local_cache_key(rule, digest), value, expire)
+  end
+end
+
+local function yield_cached_result(task, rule, key, data, maybe_part)
+  data = lua_util.str_split(data, '\t')
+  local threat_string = lua_util.str_split(data[1], '\v')
+  local score = data[2] or rule.default_score
+
+  if threat_string[1] ~= 'OK' then
+    if threat_string[1] == 'MACRO' then
+      yield_result(task, rule, 'File contains macros',
+          0.0, 'macro', maybe_part)
+    elseif threat_string[1] == 'ENCRYPTED' then
+      yield_result(task, rule, 'File is encrypted',
+          0.0, 'encrypted', maybe_part)
+    else
+      lua_util.debugm(rule.name, task, '%s: got cached threat result for %s: %s - score: %s',
+          rule.log_prefix, key, threat_string[1], score)
+      yield_result(task, rule, threat_string, score, false, maybe_part)
+    end
+
+  else
+    lua_util.debugm(rule.name, task, '%s: got cached negative result for %s: %s',
+        rule.log_prefix, key, threat_string[1])
+  end
+end
+
 local function need_check(task, content, rule, digest, fn, maybe_part)
 
   local uncached = true
   local key = digest
 
+  if rule.local_cache and rule.local_cache.storage then
+    local data = rule.local_cache.storage:get(local_cache_key(rule, digest))
+
+    if data then
+      lua_util.debugm(rule.name, task, '%s: found %s in local cache',
+          rule.log_prefix, digest)
+      yield_cached_result(task, rule, digest, data, maybe_part)
+
+      return true
+    end
+  end
+
   local function redis_av_cb(err, data)
     if data and type(data) == 'string' then
       -- Cached
-      data = lua_util.str_split(data, '\t')
-      local threat_string = lua_util.str_split(data[1], '\v')
-      local score = data[2] or rule.default_score
-
-      if threat_string[1] ~= 'OK' then
-        if threat_string[1] == 'MACRO' then
-          yield_result(task, rule, 'File contains macros',
-              0.0, 'macro', maybe_part)
-        elseif threat_string[1] == 'ENCRYPTED' then
-          yield_result(task, rule, 'File is encrypted',
-              0.0, 'encrypted', maybe_part)
-        else
-          lua_util.debugm(rule.name, task, '%s: got cached threat result for %s: %s - score: %s',
-              rule.log_prefix, key, threat_string[1], score)
-          yield_result(task, rule, threat_string, score, false, maybe_part)
-        end
+      yield_cached_result(task, rule, key, data, maybe_part)
 
-      else
-        lua_util.debugm(rule.name, task, '%s: got cached negative result for %s: %s',
-            rule.log_prefix, key, threat_string[1])
+      if rule.local_cache and rule.local_cache.storage then
+        local_cache_set(rule, digest, data)
       end
       uncached = false
     else
@@ -263,7 +505,7 @@ local function need_check(task, content, rule, digest, fn, maybe_part)
         f_message_min_words and
         f_dynamic_scan then
 
-      fn()
+      limiter_run(task, rule, digest, fn, maybe_part)
 
     end
 
@@ -285,6 +527,11 @@ local function need_check(task, content, rule, digest, fn, maybe_part)
     end
   end
 
+  if rule.concurrency then
+    limiter_run(task, rule, digest, fn, maybe_part)
+    return true
+  end
+
   return false
 
 end
@@ -295,6 +542,13 @@ local function save_cache(task, digest, rule, to_save, dyn_weight, maybe_part)
     dyn_weight = 1.0
   end
 
+  if to_save == 'OK' then
+    -- Clean results are not reported to tasks
+    limiter_complete(task, rule, digest, nil)
+  else
+    limiter_complete(task, rule, digest, { to_save, dyn_weight })
+  end
+
   local function redis_set_cb(err)
     -- Do nothing
     if err then
@@ -317,6 +571,10 @@ local function save_cache(task, digest, rule, to_save, dyn_weight, maybe_part)
   end
   local value = table.concat(value_tbl, '\t')
 
+  if rule.local_cache and rule.local_cache.storage then
+    local_cache_set(rule, digest, value)
+  end
+
   if rule.redis_params and rule.prefix then
     key = rule.prefix .. key
 
@@ -514,6 +772,7 @@ exports.yield_result = yield_result
 exports.match_patterns = match_patterns
 exports.condition_check_and_continue = need_check
 exports.save_cache = save_cache
+exports.init_local_cache = init_local_cache
 exports.create_regex_table = create_regex_table
 exports.check_parts_match = check_parts_match
 exports.check_metric_results = check_metric_results
@@ -684,7 +684,7 @@ local function get_headers_stat_tokens(task, cf, res, i)
   -- As discussed with Alexander Moisseev, this feature can skew statistics
   -- especially when learning is separated from scanning, so learning
   -- has a different set of tokens where this token can have too high weight
-  local hdrs_cksum = task:get_mempool():get_variable("headers_hash")
+  local hdrs_cksum = task:get_headers_hash()
 
   if hdrs_cksum then
     rawset(res, i, string.format("#hh:%s", hdrs_cksum:sub(1, 7)))
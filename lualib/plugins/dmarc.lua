@@ -66,6 +66,8 @@ exports.default_settings = {
     enabled = false,
     max_entries = 1000,
     keys_expire = 172800,
+    flush_interval = 5.0, -- Aggregate reports in memory and flush them each interval (0 to disable)
+    max_pending = 10000, -- Flush earlier if there are more pending updates
     only_domains = nil,
   },
   actions = {},
@@ -40,7 +40,7 @@ local default_options = {
     mse = 0.001,
     autotrain = true,
     train_prob = 1.0,
-    learn_threads = 1,
+    learn_threads = 1, -- number of threads used by KANN optimizer
     learn_mode = 'balanced', -- Possible values: balanced, proportional
     learning_rate = 0.01,
     classes_bias = 0.0, -- balanced mode: what difference is allowed between classes (1:1 proportion means 0 bias)
@@ -193,9 +193,9 @@ local function get_roc_thresholds(ann, inputs, outputs, alpha, beta)
 
   local function get_scores(nn, input_vectors)
     local scores = {}
-    for i = 1, #inputs do
-      local score = nn:apply1(input_vectors[i], nn.pca)[1]
-      scores[#scores + 1] = score
+    local outputs_batch = nn:apply_batch(input_vectors, nn.pca)
+    for i = 1, #outputs_batch do
+      scores[i] = outputs_batch[i][1]
     end
 
     return scores
@@ -524,7 +524,8 @@ local function spawn_train(params)
             lr = params.rule.train.learning_rate,
             max_epoch = params.rule.train.max_iterations,
             cb = train_cb,
-            pca = pca
+            pca = pca,
+            threads = params.rule.train.learn_threads,
           })
 
       if not ret then
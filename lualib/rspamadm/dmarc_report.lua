@@ -53,6 +53,11 @@ parser:option "-b --batch-size"
       :argname "<number>"
       :convert(tonumber)
       :default "10"
+parser:option "--read-batch"
+      :description "Read report entries from Redis in chunks of <number> elements"
+      :argname "<number>"
+      :convert(tonumber)
+      :default "1000"
 
 local report_template = [[From: "{= from_name =}" <{= from_addr =}>
 To: {= rcpt =}
@@ -120,6 +125,60 @@ local function redis_prefix(...)
   return table.concat({ ... }, dmarc_settings.reporting.redis_keys.join_char)
 end
 
+-- Sends all commands in a single pipeline, returns a list of {ok, result} pairs
+local function redis_pipeline(cmds)
+  local ret, conn = lua_redis.connect(redis_params, {
+    config = redis_attrs.config,
+    ev_base = redis_attrs.ev_base,
+    session = redis_attrs.session,
+    log_obj = redis_attrs.log_obj,
+    resolver = redis_attrs.resolver,
+    is_write = true,
+  })
+
+  if not ret then
+    return nil
+  end
+
+  for _, cmd in ipairs(cmds) do
+    conn:add_cmd(cmd[1], { select(2, lua_util.unpack(cmd)) })
+  end
+
+  local replies = { conn:exec() }
+  local results = {}
+  for i = 1, #replies, 2 do
+    table.insert(results, { replies[i], replies[i + 1] })
+  end
+
+  return results
+end
+
+-- Reads a sorted set in chunks calling `cb(member, score)` for each element,
+-- so large reports are not transferred in a single reply
+local function stream_report_entries(opts, rep_key, cb)
+  local batch = opts.read_batch
+  local start = 0
+
+  while true do
+    local ret, results = lua_redis.request(redis_params, redis_attrs,
+        { 'ZRANGE', rep_key, tostring(start), tostring(start + batch - 1), 'WITHSCORES' })
+
+    if not ret or type(results) ~= 'table' then
+      return false
+    end
+
+    for i = 1, #results, 2 do
+      cb(results[i], results[i + 1])
+    end
+
+    if #results < batch * 2 then
+      return true
+    end
+
+    start = start + batch
+  end
+end
+
 local function get_rua(rep_key)
   local parts = lua_util.str_split(rep_key, dmarc_settings.reporting.redis_keys.join_char)
 
@@ -460,7 +519,9 @@ local function send_reports_by_smtp(opts, reports, finish_cb)
   send_data_in_batches(1)
 end
 
-local function prepare_report(opts, start_time, end_time, rep_key)
+-- `rep_key` is the original report key, `data_key` is the key where report data is stored
+-- (they differ when the report key has been renamed for processing)
+local function prepare_report(opts, start_time, end_time, rep_key, data_key)
   local rua = get_rua(rep_key)
   local reporting_domain = get_domain(rep_key)
 
@@ -473,42 +534,27 @@ local function prepare_report(opts, start_time, end_time, rep_key)
     return nil
   end
 
-  local ret, results = lua_redis.request(redis_params, redis_attrs,
-      { 'EXISTS', rep_key })
-
-  if not ret or not results or results == 0 then
-    return nil
-  end
-
-  -- Rename report key to avoid races
-  if not opts.no_opt then
-    lua_redis.request(redis_params, redis_attrs,
-        { 'RENAME', rep_key, rep_key .. '_processing' })
-    rep_key = rep_key .. '_processing'
-  end
-
   local dmarc_record = validate_reporting_domain(reporting_domain)
   lua_util.debugm(N, 'process reporting domain %s: %s', reporting_domain, dmarc_record)
 
   if not dmarc_record then
-    if not opts.no_opt then
-      lua_redis.request(redis_params, redis_attrs,
-          { 'DEL', rep_key })
-    end
     logger.messagex('Cannot process reports for domain %s; invalid dmarc record', reporting_domain)
     return nil
   end
 
   -- Get all reports for a domain
-  ret, results = lua_redis.request(redis_params, redis_attrs,
-      { 'ZRANGE', rep_key, '0', '-1', 'WITHSCORES' })
   local report_entries = {}
   table.insert(report_entries,
       report_header(reporting_domain, start_time, end_time, dmarc_record))
-  for i = 1, #results, 2 do
-    local xml_record = entry_to_xml(process_report_entry(results[i], results[i + 1]))
-    table.insert(report_entries, xml_record)
+  local ok = stream_report_entries(opts, data_key, function(member, score)
+    table.insert(report_entries, entry_to_xml(process_report_entry(member, score)))
+  end)
+
+  if not ok then
+    logger.errx('cannot read report data for %s', rep_key)
+    return nil
   end
+
   table.insert(report_entries, '</feedback>')
   local xml_to_compress = rspamd_text.fromtable(report_entries)
   lua_util.debugm(N, 'got xml: %s', xml_to_compress)
@@ -554,11 +600,6 @@ local function prepare_report(opts, start_time, end_time, rep_key)
 
   lua_util.debugm(N, 'got final message: %s', message)
 
-  if not opts.no_opt then
-    lua_redis.request(redis_params, redis_attrs,
-        { 'DEL', rep_key })
-  end
-
   local report_rcpts = lua_util.str_split(rcpt_string, ',')
 
   if report_settings.bcc_addrs then
@@ -603,21 +644,55 @@ local function process_report_date(opts, start_time, end_time, date)
     return {}
   end
 
+  -- Rename all report keys to avoid races (or check that they exist) in a single pipeline
+  local rep_keys = results
+  local cmds = {}
+  for _, rep in ipairs(rep_keys) do
+    if opts.no_opt then
+      table.insert(cmds, { 'EXISTS', rep })
+    else
+      table.insert(cmds, { 'RENAME', rep, rep .. '_processing' })
+    end
+  end
+
+  local replies = {}
+  if #cmds > 0 then
+    replies = redis_pipeline(cmds)
+
+    if not replies then
+      logger.messagex('Cannot get reports for %s', date)
+      return {}
+    end
+  end
+
   local reports = {}
-  for _, rep in ipairs(results) do
-    local report = prepare_report(opts, start_time, end_time, rep)
+  local processed_keys = { idx_key }
+  for i, rep in ipairs(rep_keys) do
+    local reply = replies[i]
 
-    if report then
-      table.insert(reports, report)
+    -- Missing keys are skipped: `RENAME` fails and `EXISTS` returns 0
+    if reply and reply[1] and reply[2] ~= 0 then
+      local data_key = rep
+
+      if not opts.no_opt then
+        data_key = rep .. '_processing'
+        table.insert(processed_keys, data_key)
+      end
+
+      local report = prepare_report(opts, start_time, end_time, rep, data_key)
+
+      if report then
+        table.insert(reports, report)
+      end
     end
   end
 
   -- Shuffle reports to make sending more fair
   lua_util.shuffle(reports)
-  -- Remove processed key
+  -- Remove processed keys
   if not opts.no_opt then
     lua_redis.request(redis_params, redis_attrs,
-        { 'DEL', idx_key })
+        { 'DEL', lua_util.unpack(processed_keys) })
   end
 
   return reports
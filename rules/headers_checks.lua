@@ -38,12 +38,7 @@ local rcvd_cb_id = rspamd_config:register_symbol {
       [12] = 'TWELVE'
     }
     local def = 'ZERO'
-    local received = task:get_received_headers()
-    local nreceived = fun.reduce(function(acc, rcvd)
-      return acc + 1
-    end, 0, fun.filter(function(h)
-      return not h['flags']['artificial']
-    end, received))
+    local nreceived = task:get_received_count(true)
 
     for k, v in pairs(cnts) do
       if nreceived >= tonumber(k) then
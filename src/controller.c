@@ -25,6 +25,7 @@
 #include "libstat/stat_api.h"
 #include "rspamd.h"
 #include "libserver/worker_util.h"
+#include "libserver/counters.h"
 #include "worker_private.h"
 #include "lua/lua_common.h"
 #include "cryptobox.h"
@@ -2737,6 +2738,7 @@ rspamd_controller_handle_stat_common(
 	ucl_object_insert_key(top,
 						  ucl_object_fromint(stat->control_connections_count),
 						  "control_connections", 0, false);
+	ucl_object_insert_key(top, rspamd_counters_to_ucl(), "counters", 0, false);
 
 
 	ucl_object_insert_key(top,
@@ -3080,6 +3082,7 @@ rspamd_controller_metrics_fin_task(void *ud)
 		}
 	}
 
+	rspamd_counters_write_openmetrics(&output);
 	rspamd_printf_fstring(&output, "# EOF\n");
 
 	rspamd_controller_send_openmetrics(conn_ent, output);
@@ -3606,7 +3609,12 @@ rspamd_controller_finish_handler(struct rspamd_http_connection_entry *conn_ent)
 {
 	struct rspamd_controller_session *session = conn_ent->ud;
 
+#ifndef HAVE_ATOMIC_BUILTINS
 	session->ctx->worker->srv->stat->control_connections_count++;
+#else
+	__atomic_add_fetch(&session->ctx->worker->srv->stat->control_connections_count,
+					   1, __ATOMIC_RELEASE);
+#endif
 
 	if (session->task != NULL) {
 		rspamd_session_destroy(session->task->s);
@@ -1170,7 +1170,7 @@ rspamd_mime_expr_process(void *ud, rspamd_expression_atom_t *atom)
 				ret = lua_toboolean(L, -1);
 			}
 			else if (lua_type(L, -1) == LUA_TNUMBER) {
-				ret = lua_tonumber(L, 1);
+				ret = lua_tonumber(L, -1);
 			}
 			else {
 				msg_err_task("%s returned wrong return type: %s",
@@ -1200,7 +1200,7 @@ rspamd_mime_expr_process(void *ud, rspamd_expression_atom_t *atom)
 				ret = lua_toboolean(L, -1);
 			}
 			else if (lua_type(L, -1) == LUA_TNUMBER) {
-				ret = lua_tonumber(L, 1);
+				ret = lua_tonumber(L, -1);
 			}
 			else {
 				msg_err_task("%s returned wrong return type: %s",
@@ -1208,7 +1208,8 @@ rspamd_mime_expr_process(void *ud, rspamd_expression_atom_t *atom)
 			}
 		}
 
-		lua_settop(L, 0);
+		/* Expression can be processed from Lua, so we cannot just clear the stack */
+		lua_settop(L, err_idx - 1);
 	}
 	else {
 		ret = rspamd_mime_expr_process_function(mime_atom->d.func, task,
@@ -0,0 +1,263 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "mime_headers.h"
+#include "frozen/string.h"
+#include "frozen/unordered_map.h"
+
+#include <array>
+#include <string_view>
+
+namespace rspamd::mime {
+
+/* Must be in sync with `enum rspamd_mime_header_id` */
+static constexpr const std::array<const char *, RSPAMD_HEADER_ID_MAX> header_names{
+	"",
+	"Received",
+	"To",
+	"Cc",
+	"Bcc",
+	"From",
+	"Message-ID",
+	"Subject",
+	"Return-Path",
+	"Delivered-To",
+	"Date",
+	"Sender",
+	"In-Reply-To",
+	"Content-Type",
+	"Content-Transfer-Encoding",
+	"References",
+	"Reply-To",
+	"MIME-Version",
+	"Content-Disposition",
+	"Content-ID",
+	"Content-Description",
+	"Content-Language",
+	"Content-Location",
+	"List-ID",
+	"List-Unsubscribe",
+	"List-Unsubscribe-Post",
+	"List-Post",
+	"List-Help",
+	"List-Subscribe",
+	"List-Owner",
+	"List-Archive",
+	"Precedence",
+	"Auto-Submitted",
+	"X-Mailer",
+	"User-Agent",
+	"X-Priority",
+	"Importance",
+	"Priority",
+	"Organization",
+	"DKIM-Signature",
+	"DomainKey-Signature",
+	"ARC-Seal",
+	"ARC-Message-Signature",
+	"ARC-Authentication-Results",
+	"Authentication-Results",
+	"Received-SPF",
+	"X-Originating-IP",
+	"X-Spam-Status",
+	"X-Spam-Flag",
+	"X-Spam",
+	"X-Spam-Level",
+	"X-Spam-Score",
+	"Disposition-Notification-To",
+	"Return-Receipt-To",
+	"Errors-To",
+	"Resent-From",
+	"Resent-To",
+	"Resent-Cc",
+	"Resent-Date",
+	"Resent-Message-ID",
+	"Resent-Sender",
+	"Thread-Index",
+	"Thread-Topic",
+	"X-MimeOLE",
+	"X-MS-Has-Attach",
+	"X-MS-TNEF-Correlator",
+	"X-Forwarded-To",
+	"X-Original-To",
+	"X-Envelope-From",
+	"X-Envelope-To",
+	"Feedback-ID",
+	"X-PHP-Originating-Script",
+	"X-Virus-Scanned",
+	"Keywords",
+	"Comments",
+	"Autocrypt",
+};
+
+static constexpr const auto header_ids = frozen::make_unordered_map<frozen::string, rspamd_mime_header_id>({
+	{"received", RSPAMD_HEADER_ID_RECEIVED},
+	{"to", RSPAMD_HEADER_ID_TO},
+	{"cc", RSPAMD_HEADER_ID_CC},
+	{"bcc", RSPAMD_HEADER_ID_BCC},
+	{"from", RSPAMD_HEADER_ID_FROM},
+	{"message-id", RSPAMD_HEADER_ID_MESSAGE_ID},
+	{"subject", RSPAMD_HEADER_ID_SUBJECT},
+	{"return-path", RSPAMD_HEADER_ID_RETURN_PATH},
+	{"delivered-to", RSPAMD_HEADER_ID_DELIVERED_TO},
+	{"date", RSPAMD_HEADER_ID_DATE},
+	{"sender", RSPAMD_HEADER_ID_SENDER},
+	{"in-reply-to", RSPAMD_HEADER_ID_IN_REPLY_TO},
+	{"content-type", RSPAMD_HEADER_ID_CONTENT_TYPE},
+	{"content-transfer-encoding", RSPAMD_HEADER_ID_CONTENT_TRANSFER_ENCODING},
+	{"references", RSPAMD_HEADER_ID_REFERENCES},
+	{"reply-to", RSPAMD_HEADER_ID_REPLY_TO},
+	{"mime-version", RSPAMD_HEADER_ID_MIME_VERSION},
+	{"content-disposition", RSPAMD_HEADER_ID_CONTENT_DISPOSITION},
+	{"content-id", RSPAMD_HEADER_ID_CONTENT_ID},
+	{"content-description", RSPAMD_HEADER_ID_CONTENT_DESCRIPTION},
+	{"content-language", RSPAMD_HEADER_ID_CONTENT_LANGUAGE},
+	{"content-location", RSPAMD_HEADER_ID_CONTENT_LOCATION},
+	{"list-id", RSPAMD_HEADER_ID_LIST_ID},
+	{"list-unsubscribe", RSPAMD_HEADER_ID_LIST_UNSUBSCRIBE},
+	{"list-unsubscribe-post", RSPAMD_HEADER_ID_LIST_UNSUBSCRIBE_POST},
+	{"list-post", RSPAMD_HEADER_ID_LIST_POST},
+	{"list-help", RSPAMD_HEADER_ID_LIST_HELP},
+	{"list-subscribe", RSPAMD_HEADER_ID_LIST_SUBSCRIBE},
+	{"list-owner", RSPAMD_HEADER_ID_LIST_OWNER},
+	{"list-archive", RSPAMD_HEADER_ID_LIST_ARCHIVE},
+	{"precedence", RSPAMD_HEADER_ID_PRECEDENCE},
+	{"auto-submitted", RSPAMD_HEADER_ID_AUTO_SUBMITTED},
+	{"x-mailer", RSPAMD_HEADER_ID_X_MAILER},
+	{"user-agent", RSPAMD_HEADER_ID_USER_AGENT},
+	{"x-priority", RSPAMD_HEADER_ID_X_PRIORITY},
+	{"importance", RSPAMD_HEADER_ID_IMPORTANCE},
+	{"priority", RSPAMD_HEADER_ID_PRIORITY},
+	{"organization", RSPAMD_HEADER_ID_ORGANIZATION},
+	{"dkim-signature", RSPAMD_HEADER_ID_DKIM_SIGNATURE},
+	{"domainkey-signature", RSPAMD_HEADER_ID_DOMAINKEY_SIGNATURE},
+	{"arc-seal", RSPAMD_HEADER_ID_ARC_SEAL},
+	{"arc-message-signature", RSPAMD_HEADER_ID_ARC_MESSAGE_SIGNATURE},
+	{"arc-authentication-results", RSPAMD_HEADER_ID_ARC_AUTHENTICATION_RESULTS},
+	{"authentication-results", RSPAMD_HEADER_ID_AUTHENTICATION_RESULTS},
+	{"received-spf", RSPAMD_HEADER_ID_RECEIVED_SPF},
+	{"x-originating-ip", RSPAMD_HEADER_ID_X_ORIGINATING_IP},
+	{"x-spam-status", RSPAMD_HEADER_ID_X_SPAM_STATUS},
+	{"x-spam-flag", RSPAMD_HEADER_ID_X_SPAM_FLAG},
+	{"x-spam", RSPAMD_HEADER_ID_X_SPAM},
+	{"x-spam-level", RSPAMD_HEADER_ID_X_SPAM_LEVEL},
+	{"x-spam-score", RSPAMD_HEADER_ID_X_SPAM_SCORE},
+	{"disposition-notification-to", RSPAMD_HEADER_ID_DISPOSITION_NOTIFICATION_TO},
+	{"return-receipt-to", RSPAMD_HEADER_ID_RETURN_RECEIPT_TO},
+	{"errors-to", RSPAMD_HEADER_ID_ERRORS_TO},
+	{"resent-from", RSPAMD_HEADER_ID_RESENT_FROM},
+	{"resent-to", RSPAMD_HEADER_ID_RESENT_TO},
+	{"resent-cc", RSPAMD_HEADER_ID_RESENT_CC},
+	{"resent-date", RSPAMD_HEADER_ID_RESENT_DATE},
+	{"resent-message-id", RSPAMD_HEADER_ID_RESENT_MESSAGE_ID},
+	{"resent-sender", RSPAMD_HEADER_ID_RESENT_SENDER},
+	{"thread-index", RSPAMD_HEADER_ID_THREAD_INDEX},
+	{"thread-topic", RSPAMD_HEADER_ID_THREAD_TOPIC},
+	{"x-mimeole", RSPAMD_HEADER_ID_X_MIMEOLE},
+	{"x-ms-has-attach", RSPAMD_HEADER_ID_X_MS_HAS_ATTACH},
+	{"x-ms-tnef-correlator", RSPAMD_HEADER_ID_X_MS_TNEF_CORRELATOR},
+	{"x-forwarded-to", RSPAMD_HEADER_ID_X_FORWARDED_TO},
+	{"x-original-to", RSPAMD_HEADER_ID_X_ORIGINAL_TO},
+	{"x-envelope-from", RSPAMD_HEADER_ID_X_ENVELOPE_FROM},
+	{"x-envelope-to", RSPAMD_HEADER_ID_X_ENVELOPE_TO},
+	{"feedback-id", RSPAMD_HEADER_ID_FEEDBACK_ID},
+	{"x-php-originating-script", RSPAMD_HEADER_ID_X_PHP_ORIGINATING_SCRIPT},
+	{"x-virus-scanned", RSPAMD_HEADER_ID_X_VIRUS_SCANNED},
+	{"keywords", RSPAMD_HEADER_ID_KEYWORDS},
+	{"comments", RSPAMD_HEADER_ID_COMMENTS},
+	{"autocrypt", RSPAMD_HEADER_ID_AUTOCRYPT},
+});
+
+/* Longest name in the map, anything longer is definitely unknown */
+static constexpr const std::size_t max_header_name_len = 27;
+
+static auto
+header_id_from_name(std::string_view name) -> rspamd_mime_header_id
+{
+	if (name.empty() || name.size() > max_header_name_len) {
+		return RSPAMD_HEADER_ID_UNKNOWN;
+	}
+
+	char lc_buf[max_header_name_len];
+
+	for (auto i = 0u; i < name.size(); i++) {
+		lc_buf[i] = g_ascii_tolower(name[i]);
+	}
+
+	auto found = header_ids.find(frozen::string(lc_buf, name.size()));
+
+	if (found != header_ids.end()) {
+		return found->second;
+	}
+
+	return RSPAMD_HEADER_ID_UNKNOWN;
+}
+
+}// namespace rspamd::mime
+
+enum rspamd_mime_header_id
+rspamd_mime_header_id_from_name(const char *name, gsize len)
+{
+	if (name == nullptr) {
+		return RSPAMD_HEADER_ID_UNKNOWN;
+	}
+
+	return rspamd::mime::header_id_from_name(std::string_view{name, len});
+}
+
+const char *
+rspamd_mime_header_id_to_name(enum rspamd_mime_header_id id)
+{
+	if (id <= RSPAMD_HEADER_ID_UNKNOWN || id >= RSPAMD_HEADER_ID_MAX) {
+		return nullptr;
+	}
+
+	return rspamd::mime::header_names[id];
+}
+
+/* Tests part */
+#define DOCTEST_CONFIG_IMPLEMENTATION_IN_DLL
+#include "doctest/doctest.h"
+
+TEST_SUITE("mime_header_ids")
+{
+	TEST_CASE("header id lookup")
+	{
+		CHECK(rspamd_mime_header_id_from_name("Subject", 7) == RSPAMD_HEADER_ID_SUBJECT);
+		CHECK(rspamd_mime_header_id_from_name("SUBJECT", 7) == RSPAMD_HEADER_ID_SUBJECT);
+		CHECK(rspamd_mime_header_id_from_name("content-transfer-encoding", 25) ==
+			  RSPAMD_HEADER_ID_CONTENT_TRANSFER_ENCODING);
+		CHECK(rspamd_mime_header_id_from_name("Subjectx", 8) == RSPAMD_HEADER_ID_UNKNOWN);
+		CHECK(rspamd_mime_header_id_from_name("Subj", 4) == RSPAMD_HEADER_ID_UNKNOWN);
+		CHECK(rspamd_mime_header_id_from_name("", 0) == RSPAMD_HEADER_ID_UNKNOWN);
+		CHECK(rspamd_mime_header_id_from_name("X-Some-Very-Long-Header-Name-That-Is-Unknown", 44) ==
+			  RSPAMD_HEADER_ID_UNKNOWN);
+	}
+
+	TEST_CASE("header id names round trip")
+	{
+		for (auto i = RSPAMD_HEADER_ID_UNKNOWN + 1; i < RSPAMD_HEADER_ID_MAX; i++) {
+			auto id = static_cast<rspamd_mime_header_id>(i);
+			const auto *name = rspamd_mime_header_id_to_name(id);
+			REQUIRE(name != nullptr);
+			CHECK(rspamd_mime_header_id_from_name(name, strlen(name)) == id);
+		}
+
+		CHECK(rspamd_mime_header_id_to_name(RSPAMD_HEADER_ID_UNKNOWN) == nullptr);
+		CHECK(rspamd_mime_header_id_to_name(RSPAMD_HEADER_ID_MAX) == nullptr);
+	}
+}
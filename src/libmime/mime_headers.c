@@ -30,6 +30,8 @@ KHASH_INIT(rspamd_mime_headers_htb, char *,
 
 struct rspamd_mime_headers_table {
 	khash_t(rspamd_mime_headers_htb) htb;
+	/* Heads of the well-known headers chains, indexed by header id */
+	struct rspamd_mime_header *by_id[RSPAMD_HEADER_ID_MAX];
 	ref_entry_t ref;
 };
 
@@ -37,7 +39,6 @@ static void
 rspamd_mime_header_check_special(struct rspamd_task *task,
 								 struct rspamd_mime_header *rh)
 {
-	uint64_t h;
 	const char *p, *end;
 	char *id;
 	int max_recipients = -1, len;
@@ -46,39 +47,36 @@ rspamd_mime_header_check_special(struct rspamd_task *task,
 		max_recipients = task->cfg->max_recipients;
 	}
 
-	h = rspamd_icase_hash(rh->name, strlen(rh->name), 0xdeadbabe);
-
-	switch (h) {
-	case 0x88705DC4D9D61ABULL: /* received */
-		if (rspamd_received_header_parse(task, rh->decoded, strlen(rh->decoded), rh)) {
-			rh->flags |= RSPAMD_HEADER_RECEIVED;
-		}
+	switch (rh->id) {
+	case RSPAMD_HEADER_ID_RECEIVED:
+		/* Parsed on demand, valid headers are flagged when they are parsed */
+		rspamd_received_header_add(task, rh);
 		break;
-	case 0x76F31A09F4352521ULL: /* to */
+	case RSPAMD_HEADER_ID_TO:
 		MESSAGE_FIELD(task, rcpt_mime) = rspamd_email_address_from_mime(task->task_pool,
 																		rh->value, strlen(rh->value),
 																		MESSAGE_FIELD(task, rcpt_mime), max_recipients);
 		rh->flags |= RSPAMD_HEADER_TO | RSPAMD_HEADER_RCPT | RSPAMD_HEADER_UNIQUE;
 		break;
-	case 0x7EB117C1480B76ULL: /* cc */
+	case RSPAMD_HEADER_ID_CC:
 		MESSAGE_FIELD(task, rcpt_mime) = rspamd_email_address_from_mime(task->task_pool,
 																		rh->value, strlen(rh->value),
 																		MESSAGE_FIELD(task, rcpt_mime), max_recipients);
 		rh->flags |= RSPAMD_HEADER_CC | RSPAMD_HEADER_RCPT | RSPAMD_HEADER_UNIQUE;
 		break;
-	case 0xE4923E11C4989C8DULL: /* bcc */
+	case RSPAMD_HEADER_ID_BCC:
 		MESSAGE_FIELD(task, rcpt_mime) = rspamd_email_address_from_mime(task->task_pool,
 																		rh->value, strlen(rh->value),
 																		MESSAGE_FIELD(task, rcpt_mime), max_recipients);
 		rh->flags |= RSPAMD_HEADER_BCC | RSPAMD_HEADER_RCPT | RSPAMD_HEADER_UNIQUE;
 		break;
-	case 0x41E1985EDC1CBDE4ULL: /* from */
+	case RSPAMD_HEADER_ID_FROM:
 		MESSAGE_FIELD(task, from_mime) = rspamd_email_address_from_mime(task->task_pool,
 																		rh->value, strlen(rh->value),
 																		MESSAGE_FIELD(task, from_mime), max_recipients);
 		rh->flags |= RSPAMD_HEADER_FROM | RSPAMD_HEADER_SENDER | RSPAMD_HEADER_UNIQUE;
 		break;
-	case 0x43A558FC7C240226ULL: /* message-id */ {
+	case RSPAMD_HEADER_ID_MESSAGE_ID: {
 
 		rh->flags = RSPAMD_HEADER_MESSAGE_ID | RSPAMD_HEADER_UNIQUE;
 		p = rh->decoded;
@@ -119,39 +117,41 @@ rspamd_mime_header_check_special(struct rspamd_task *task,
 
 		break;
 	}
-	case 0xB91D3910358E8212ULL: /* subject */
+	case RSPAMD_HEADER_ID_SUBJECT:
 		if (MESSAGE_FIELD(task, subject) == NULL) {
 			MESSAGE_FIELD(task, subject) = rh->decoded;
 		}
 		rh->flags = RSPAMD_HEADER_SUBJECT | RSPAMD_HEADER_UNIQUE;
 		break;
-	case 0xEE4AA2EAAC61D6F4ULL: /* return-path */
+	case RSPAMD_HEADER_ID_RETURN_PATH:
 		if (task->from_envelope == NULL) {
 			task->from_envelope = rspamd_email_address_from_smtp(rh->decoded,
 																 strlen(rh->decoded));
 		}
 		rh->flags = RSPAMD_HEADER_RETURN_PATH | RSPAMD_HEADER_UNIQUE;
 		break;
-	case 0xB9EEFAD2E93C2161ULL: /* delivered-to */
+	case RSPAMD_HEADER_ID_DELIVERED_TO:
 		if (task->deliver_to == NULL) {
 			task->deliver_to = rh->decoded;
 		}
 		rh->flags = RSPAMD_HEADER_DELIVERED_TO;
 		break;
-	case 0x2EC3BFF3C393FC10ULL: /* date */
-	case 0xAC0DDB1A1D214CAULL:  /* sender */
-	case 0x54094572367AB695ULL: /* in-reply-to */
-	case 0x81CD9E9131AB6A9AULL: /* content-type */
-	case 0xC39BD9A75AA25B60ULL: /* content-transfer-encoding */
-	case 0xB3F6704CB3AD6589ULL: /* references */
+	case RSPAMD_HEADER_ID_DATE:
+	case RSPAMD_HEADER_ID_SENDER:
+	case RSPAMD_HEADER_ID_IN_REPLY_TO:
+	case RSPAMD_HEADER_ID_CONTENT_TYPE:
+	case RSPAMD_HEADER_ID_CONTENT_TRANSFER_ENCODING:
+	case RSPAMD_HEADER_ID_REFERENCES:
 		rh->flags = RSPAMD_HEADER_UNIQUE;
 		break;
+	default:
+		break;
 	}
 }
 
 static void
 rspamd_mime_header_add(struct rspamd_task *task,
-					   khash_t(rspamd_mime_headers_htb) * target,
+					   struct rspamd_mime_headers_table *target,
 					   struct rspamd_mime_header **order_ptr,
 					   struct rspamd_mime_header *rh,
 					   gboolean check_special)
@@ -160,17 +160,23 @@ rspamd_mime_header_add(struct rspamd_task *task,
 	struct rspamd_mime_header *ex;
 	int res;
 
-	k = kh_put(rspamd_mime_headers_htb, target, rh->name, &res);
+	rh->id = rspamd_mime_header_id_from_name(rh->name, strlen(rh->name));
+	k = kh_put(rspamd_mime_headers_htb, &target->htb, rh->name, &res);
 
 	if (res == 0) {
-		ex = kh_value(target, k);
+		ex = kh_value(&target->htb, k);
 		DL_APPEND(ex, rh);
 		msg_debug_task("append raw header %s: %s", rh->name, rh->value);
 	}
 	else {
-		kh_value(target, k) = rh;
+		kh_value(&target->htb, k) = rh;
 		rh->prev = rh;
 		rh->next = NULL;
+
+		if (rh->id != RSPAMD_HEADER_ID_UNKNOWN) {
+			target->by_id[rh->id] = rh;
+		}
+
 		msg_debug_task("add new raw header %s: %s", rh->name, rh->value);
 	}
 
@@ -403,7 +409,7 @@ void rspamd_mime_headers_process(struct rspamd_task *task,
 			/* We also validate utf8 and replace all non-valid utf8 chars */
 			rspamd_mime_charset_utf_enforce(nh->decoded, strlen(nh->decoded));
 			nh->order = norder++;
-			rspamd_mime_header_add(task, &target->htb, order_ptr, nh, check_newlines);
+			rspamd_mime_header_add(task, target, order_ptr, nh, check_newlines);
 			nh = NULL;
 			state = 0;
 			break;
@@ -416,7 +422,7 @@ void rspamd_mime_headers_process(struct rspamd_task *task,
 				nh->raw_len++;
 			}
 			nh->order = norder++;
-			rspamd_mime_header_add(task, &target->htb, order_ptr, nh, check_newlines);
+			rspamd_mime_header_add(task, target, order_ptr, nh, check_newlines);
 			nh = NULL;
 			state = 0;
 			break;
@@ -487,8 +493,6 @@ void rspamd_mime_headers_process(struct rspamd_task *task,
 	if (check_newlines) {
 		unsigned int max_cnt = 0;
 		int sel = 0;
-		rspamd_cryptobox_hash_state_t hs;
-		unsigned char hout[rspamd_cryptobox_HASHBYTES], *hexout;
 
 		for (int i = RSPAMD_TASK_NEWLINES_CR; i < RSPAMD_TASK_NEWLINES_MAX; i++) {
 			if (nlines_count[i] > max_cnt) {
@@ -498,25 +502,47 @@ void rspamd_mime_headers_process(struct rspamd_task *task,
 		}
 
 		MESSAGE_FIELD(task, nlines_type) = sel;
+	}
+}
 
-		rspamd_cryptobox_hash_init(&hs, NULL, 0);
+const char *
+rspamd_mime_headers_hash(struct rspamd_task *task)
+{
+	struct rspamd_mime_header *nh;
+	rspamd_cryptobox_hash_state_t hs;
+	unsigned char hout[rspamd_cryptobox_HASHBYTES];
+	char *hexout;
 
-		LL_FOREACH(*order_ptr, nh)
-		{
-			if (nh->name && nh->flags != RSPAMD_HEADER_RECEIVED) {
-				rspamd_cryptobox_hash_update(&hs, nh->name, strlen(nh->name));
-			}
-		}
+	hexout = rspamd_mempool_get_variable(task->task_pool,
+										 RSPAMD_MEMPOOL_HEADERS_HASH);
 
-		rspamd_cryptobox_hash_final(&hs, hout);
-		hexout = rspamd_mempool_alloc(task->task_pool, sizeof(hout) * 2 + 1);
-		hexout[sizeof(hout) * 2] = '\0';
-		rspamd_encode_hex_buf(hout, sizeof(hout), hexout,
-							  sizeof(hout) * 2 + 1);
-		rspamd_mempool_set_variable(task->task_pool,
-									RSPAMD_MEMPOOL_HEADERS_HASH,
-									hexout, NULL);
+	if (hexout || task->message == NULL ||
+		MESSAGE_FIELD(task, headers_order) == NULL) {
+		return hexout;
 	}
+
+	/* Valid Received headers are flagged only when the chain is parsed */
+	(void) rspamd_received_count(task, true);
+
+	rspamd_cryptobox_hash_init(&hs, NULL, 0);
+
+	LL_FOREACH(MESSAGE_FIELD(task, headers_order), nh)
+	{
+		if (nh->name && nh->flags != RSPAMD_HEADER_RECEIVED) {
+			rspamd_cryptobox_hash_update(&hs, nh->name, strlen(nh->name));
+		}
+	}
+
+	rspamd_cryptobox_hash_final(&hs, hout);
+	hexout = rspamd_mempool_alloc(task->task_pool, sizeof(hout) * 2 + 1);
+	hexout[sizeof(hout) * 2] = '\0';
+	rspamd_encode_hex_buf(hout, sizeof(hout), hexout,
+						  sizeof(hout) * 2 + 1);
+	rspamd_mempool_set_variable(task->task_pool,
+								RSPAMD_MEMPOOL_HEADERS_HASH,
+								hexout, NULL);
+
+	return hexout;
 }
 
 static void
@@ -916,15 +942,42 @@ rspamd_mime_message_id_generate(const char *fqdn)
 	return g_string_free(out, FALSE);
 }
 
+static inline struct rspamd_mime_header *
+rspamd_message_header_select(struct rspamd_mime_header *hdr,
+							 gboolean need_modified)
+{
+	if (!need_modified) {
+		if (hdr->flags & RSPAMD_HEADER_NON_EXISTING) {
+			return NULL;
+		}
+
+		return hdr;
+	}
+	else {
+		if (hdr->flags & RSPAMD_HEADER_MODIFIED) {
+			return hdr->modified_chain;
+		}
+
+		return hdr;
+	}
+}
+
 struct rspamd_mime_header *
 rspamd_message_get_header_from_hash(struct rspamd_mime_headers_table *hdrs,
 									const char *field,
 									gboolean need_modified)
 {
-	if (hdrs == NULL) {
+	if (hdrs == NULL || field == NULL) {
 		return NULL;
 	}
 
+	enum rspamd_mime_header_id id = rspamd_mime_header_id_from_name(field, strlen(field));
+
+	if (id != RSPAMD_HEADER_ID_UNKNOWN) {
+		/* Well-known header, no need to hash its name */
+		return rspamd_message_get_header_by_id(hdrs, id, need_modified);
+	}
+
 	khiter_t k;
 	khash_t(rspamd_mime_headers_htb) *htb = &hdrs->htb;
 	struct rspamd_mime_header *hdr;
@@ -938,23 +991,38 @@ rspamd_message_get_header_from_hash(struct rspamd_mime_headers_table *hdrs,
 
 		hdr = kh_value(htb, k);
 
-		if (!need_modified) {
-			if (hdr->flags & RSPAMD_HEADER_NON_EXISTING) {
-				return NULL;
-			}
+		return rspamd_message_header_select(hdr, need_modified);
+	}
 
-			return hdr;
-		}
-		else {
-			if (hdr->flags & RSPAMD_HEADER_MODIFIED) {
-				return hdr->modified_chain;
-			}
+	return NULL;
+}
 
-			return hdr;
-		}
+struct rspamd_mime_header *
+rspamd_message_get_header_by_id(struct rspamd_mime_headers_table *hdrs,
+								enum rspamd_mime_header_id id,
+								gboolean need_modified)
+{
+	if (hdrs == NULL || id <= RSPAMD_HEADER_ID_UNKNOWN || id >= RSPAMD_HEADER_ID_MAX) {
+		return NULL;
 	}
 
-	return NULL;
+	struct rspamd_mime_header *hdr = hdrs->by_id[id];
+
+	if (hdr == NULL) {
+		return NULL;
+	}
+
+	return rspamd_message_header_select(hdr, need_modified);
+}
+
+struct rspamd_mime_header *
+rspamd_message_get_header_array_by_id(struct rspamd_task *task,
+									  enum rspamd_mime_header_id id,
+									  gboolean need_modified)
+{
+	return rspamd_message_get_header_by_id(
+		MESSAGE_FIELD_CHECK(task, raw_headers),
+		id, need_modified);
 }
 
 struct rspamd_mime_header *
@@ -1114,12 +1182,17 @@ void rspamd_message_set_modified_header(struct rspamd_task *task,
 
 			hdr_elt->flags |= RSPAMD_HEADER_MODIFIED | RSPAMD_HEADER_NON_EXISTING;
 			hdr_elt->name = rspamd_mempool_strdup(task->task_pool, hdr_name);
+			hdr_elt->id = rspamd_mime_header_id_from_name(hdr_name, strlen(hdr_name));
 
 			int r;
 			k = kh_put(rspamd_mime_headers_htb, htb, hdr_elt->name, &r);
 
 			kh_value(htb, k) = hdr_elt;
 
+			if (hdr_elt->id != RSPAMD_HEADER_ID_UNKNOWN) {
+				hdrs->by_id[hdr_elt->id] = hdr_elt;
+			}
+
 			if (order_ptr) {
 				/*
 				 * This iterates over all headers in O(N), but we have no other options here, as the
@@ -1273,6 +1346,7 @@ void rspamd_message_set_modified_header(struct rspamd_task *task,
 
 					nhdr->flags |= RSPAMD_HEADER_ADDED;
 					nhdr->name = hdr_elt->name;
+					nhdr->id = hdr_elt->id;
 					nhdr->value = rspamd_mempool_alloc(task->task_pool,
 													   raw_len + 1);
 					/* Strlcpy will ensure that value will have no embedded \0 */
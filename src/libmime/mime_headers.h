@@ -55,11 +55,96 @@ enum rspamd_mime_header_flags {
 	RSPAMD_HEADER_NON_EXISTING = 1u << 18u, /* Header was not in the original message */
 };
 
+/*
+ * Identifiers of the well-known headers, names are interned at parse time, so
+ * lookups of these headers do not need hashing of the header's name
+ */
+enum rspamd_mime_header_id {
+	RSPAMD_HEADER_ID_UNKNOWN = 0,
+	RSPAMD_HEADER_ID_RECEIVED,
+	RSPAMD_HEADER_ID_TO,
+	RSPAMD_HEADER_ID_CC,
+	RSPAMD_HEADER_ID_BCC,
+	RSPAMD_HEADER_ID_FROM,
+	RSPAMD_HEADER_ID_MESSAGE_ID,
+	RSPAMD_HEADER_ID_SUBJECT,
+	RSPAMD_HEADER_ID_RETURN_PATH,
+	RSPAMD_HEADER_ID_DELIVERED_TO,
+	RSPAMD_HEADER_ID_DATE,
+	RSPAMD_HEADER_ID_SENDER,
+	RSPAMD_HEADER_ID_IN_REPLY_TO,
+	RSPAMD_HEADER_ID_CONTENT_TYPE,
+	RSPAMD_HEADER_ID_CONTENT_TRANSFER_ENCODING,
+	RSPAMD_HEADER_ID_REFERENCES,
+	RSPAMD_HEADER_ID_REPLY_TO,
+	RSPAMD_HEADER_ID_MIME_VERSION,
+	RSPAMD_HEADER_ID_CONTENT_DISPOSITION,
+	RSPAMD_HEADER_ID_CONTENT_ID,
+	RSPAMD_HEADER_ID_CONTENT_DESCRIPTION,
+	RSPAMD_HEADER_ID_CONTENT_LANGUAGE,
+	RSPAMD_HEADER_ID_CONTENT_LOCATION,
+	RSPAMD_HEADER_ID_LIST_ID,
+	RSPAMD_HEADER_ID_LIST_UNSUBSCRIBE,
+	RSPAMD_HEADER_ID_LIST_UNSUBSCRIBE_POST,
+	RSPAMD_HEADER_ID_LIST_POST,
+	RSPAMD_HEADER_ID_LIST_HELP,
+	RSPAMD_HEADER_ID_LIST_SUBSCRIBE,
+	RSPAMD_HEADER_ID_LIST_OWNER,
+	RSPAMD_HEADER_ID_LIST_ARCHIVE,
+	RSPAMD_HEADER_ID_PRECEDENCE,
+	RSPAMD_HEADER_ID_AUTO_SUBMITTED,
+	RSPAMD_HEADER_ID_X_MAILER,
+	RSPAMD_HEADER_ID_USER_AGENT,
+	RSPAMD_HEADER_ID_X_PRIORITY,
+	RSPAMD_HEADER_ID_IMPORTANCE,
+	RSPAMD_HEADER_ID_PRIORITY,
+	RSPAMD_HEADER_ID_ORGANIZATION,
+	RSPAMD_HEADER_ID_DKIM_SIGNATURE,
+	RSPAMD_HEADER_ID_DOMAINKEY_SIGNATURE,
+	RSPAMD_HEADER_ID_ARC_SEAL,
+	RSPAMD_HEADER_ID_ARC_MESSAGE_SIGNATURE,
+	RSPAMD_HEADER_ID_ARC_AUTHENTICATION_RESULTS,
+	RSPAMD_HEADER_ID_AUTHENTICATION_RESULTS,
+	RSPAMD_HEADER_ID_RECEIVED_SPF,
+	RSPAMD_HEADER_ID_X_ORIGINATING_IP,
+	RSPAMD_HEADER_ID_X_SPAM_STATUS,
+	RSPAMD_HEADER_ID_X_SPAM_FLAG,
+	RSPAMD_HEADER_ID_X_SPAM,
+	RSPAMD_HEADER_ID_X_SPAM_LEVEL,
+	RSPAMD_HEADER_ID_X_SPAM_SCORE,
+	RSPAMD_HEADER_ID_DISPOSITION_NOTIFICATION_TO,
+	RSPAMD_HEADER_ID_RETURN_RECEIPT_TO,
+	RSPAMD_HEADER_ID_ERRORS_TO,
+	RSPAMD_HEADER_ID_RESENT_FROM,
+	RSPAMD_HEADER_ID_RESENT_TO,
+	RSPAMD_HEADER_ID_RESENT_CC,
+	RSPAMD_HEADER_ID_RESENT_DATE,
+	RSPAMD_HEADER_ID_RESENT_MESSAGE_ID,
+	RSPAMD_HEADER_ID_RESENT_SENDER,
+	RSPAMD_HEADER_ID_THREAD_INDEX,
+	RSPAMD_HEADER_ID_THREAD_TOPIC,
+	RSPAMD_HEADER_ID_X_MIMEOLE,
+	RSPAMD_HEADER_ID_X_MS_HAS_ATTACH,
+	RSPAMD_HEADER_ID_X_MS_TNEF_CORRELATOR,
+	RSPAMD_HEADER_ID_X_FORWARDED_TO,
+	RSPAMD_HEADER_ID_X_ORIGINAL_TO,
+	RSPAMD_HEADER_ID_X_ENVELOPE_FROM,
+	RSPAMD_HEADER_ID_X_ENVELOPE_TO,
+	RSPAMD_HEADER_ID_FEEDBACK_ID,
+	RSPAMD_HEADER_ID_X_PHP_ORIGINATING_SCRIPT,
+	RSPAMD_HEADER_ID_X_VIRUS_SCANNED,
+	RSPAMD_HEADER_ID_KEYWORDS,
+	RSPAMD_HEADER_ID_COMMENTS,
+	RSPAMD_HEADER_ID_AUTOCRYPT,
+	RSPAMD_HEADER_ID_MAX, /* Must be the last */
+};
+
 struct rspamd_mime_header {
 	const char *raw_value; /* As it is in the message (unfolded and unparsed) */
 	gsize raw_len;
 	unsigned int order;
 	int flags; /* see enum rspamd_mime_header_flags */
+	enum rspamd_mime_header_id id;
 	/* These are zero terminated (historically) */
 	char *name; /* Also used for key */
 	char *value;
@@ -86,6 +171,15 @@ void rspamd_mime_headers_process(struct rspamd_task *task,
 								 const char *in, gsize len,
 								 gboolean check_newlines);
 
+/**
+ * Returns hex encoded hash of the message header names excluding valid
+ * Received headers; it is computed on the first call, as it requires the
+ * whole Received chain to be parsed
+ * @param task
+ * @return hash or NULL if the message has no headers
+ */
+const char *rspamd_mime_headers_hash(struct rspamd_task *task);
+
 /**
  * Perform rfc2047 decoding of a header
  * @param pool
@@ -133,6 +227,44 @@ rspamd_message_get_header_from_hash(struct rspamd_mime_headers_table *hdrs,
 									const char *field,
 									gboolean need_modified);
 
+/**
+ * Get a header by its well-known identifier, this lookup does not hash
+ * the header's name
+ * @param hdrs headers table
+ * @param id header's identifier
+ * @return An array of header's values or NULL. It is NOT permitted to free array or values.
+ */
+struct rspamd_mime_header *
+rspamd_message_get_header_by_id(struct rspamd_mime_headers_table *hdrs,
+								enum rspamd_mime_header_id id,
+								gboolean need_modified);
+
+/**
+ * Get a header of the task's message by its well-known identifier
+ * @param task worker task structure
+ * @param id header's identifier
+ * @return An array of header's values or NULL. It is NOT permitted to free array or values.
+ */
+struct rspamd_mime_header *
+rspamd_message_get_header_array_by_id(struct rspamd_task *task,
+									  enum rspamd_mime_header_id id,
+									  gboolean need_modified);
+
+/**
+ * Returns identifier of a well-known header (caseless)
+ * @param name header's name
+ * @param len length of the name
+ * @return identifier or RSPAMD_HEADER_ID_UNKNOWN
+ */
+enum rspamd_mime_header_id rspamd_mime_header_id_from_name(const char *name, gsize len);
+
+/**
+ * Returns canonical name of a well-known header
+ * @param id header's identifier
+ * @return static string or NULL for unknown identifiers
+ */
+const char *rspamd_mime_header_id_to_name(enum rspamd_mime_header_id id);
+
 /**
  * Modifies a header (or insert one if not found)
  * @param hdrs
@@ -398,7 +398,7 @@ rspamd_mime_part_get_cte(struct rspamd_task *task,
 	enum rspamd_cte cte = RSPAMD_CTE_UNKNOWN;
 	gboolean parent_propagated = FALSE;
 
-	hdr = rspamd_message_get_header_from_hash(hdrs, "Content-Transfer-Encoding", FALSE);
+	hdr = rspamd_message_get_header_by_id(hdrs, RSPAMD_HEADER_ID_CONTENT_TRANSFER_ENCODING, FALSE);
 
 	if (hdr == NULL) {
 		if (part->parent_part && part->parent_part->cte != RSPAMD_CTE_UNKNOWN &&
@@ -938,8 +938,8 @@ rspamd_mime_process_multipart_node(struct rspamd_task *task,
 			}
 		}
 
-		hdr = rspamd_message_get_header_from_hash(npart->raw_headers,
-												  "Content-Type", FALSE);
+		hdr = rspamd_message_get_header_by_id(npart->raw_headers,
+											  RSPAMD_HEADER_ID_CONTENT_TYPE, FALSE);
 	}
 	else {
 		npart->raw_headers_str = 0;
@@ -1492,9 +1492,9 @@ rspamd_mime_parse_message(struct rspamd_task *task,
 				}
 			}
 
-			hdr = rspamd_message_get_header_from_hash(
+			hdr = rspamd_message_get_header_by_id(
 				MESSAGE_FIELD(task, raw_headers),
-				"Content-Type", FALSE);
+				RSPAMD_HEADER_ID_CONTENT_TYPE, FALSE);
 		}
 		else {
 			/* First apply heuristic, maybe we have just headers */
@@ -1522,9 +1522,9 @@ rspamd_mime_parse_message(struct rspamd_task *task,
 					}
 				}
 
-				hdr = rspamd_message_get_header_from_hash(
+				hdr = rspamd_message_get_header_by_id(
 					MESSAGE_FIELD(task, raw_headers),
-					"Content-Type", FALSE);
+					RSPAMD_HEADER_ID_CONTENT_TYPE, FALSE);
 				task->flags |= RSPAMD_TASK_FLAG_BROKEN_HEADERS;
 			}
 			else {
@@ -1578,8 +1578,8 @@ rspamd_mime_parse_message(struct rspamd_task *task,
 				}
 			}
 
-			hdr = rspamd_message_get_header_from_hash(npart->raw_headers,
-													  "Content-Type", FALSE);
+			hdr = rspamd_message_get_header_by_id(npart->raw_headers,
+												  RSPAMD_HEADER_ID_CONTENT_TYPE, FALSE);
 		}
 		else {
 			body_pos = 0;
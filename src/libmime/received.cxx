@@ -26,6 +26,10 @@
 #include "frozen/string.h"
 #include "frozen/unordered_map.h"
 
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
 namespace rspamd::mime {
 
 enum class received_part_type {
@@ -62,6 +66,77 @@ received_part_set_or_append(const char *begin,
 	dest.trim(" \t");
 }
 
+static inline auto
+received_is_token_delim(char c) -> bool
+{
+	return g_ascii_isspace(c) || c == '(' || c == ';';
+}
+
+/*
+ * Returns pointer to the first space, `(` or `;` character in [p, end) or end.
+ * Received headers are mostly long runs of tokens, so we check 16 bytes at once.
+ */
+static inline auto
+received_skip_token(const char *p, const char *end) -> const char *
+{
+#ifdef __x86_64__
+	while (end - p >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) p);
+		/* The same as g_ascii_isspace: no \v here */
+		__m128i m = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+						 _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+			_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+						 _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+		m = _mm_or_si128(m,
+						 _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\f')),
+									  _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('(')),
+												   _mm_cmpeq_epi8(v, _mm_set1_epi8(';')))));
+		auto mask = _mm_movemask_epi8(m);
+
+		if (mask != 0) {
+			return p + __builtin_ctz(mask);
+		}
+
+		p += 16;
+	}
+#endif
+
+	while (p < end && !received_is_token_delim(*p)) {
+		p++;
+	}
+
+	return p;
+}
+
+/*
+ * Returns pointer to the first brace in [p, end) or end
+ */
+static inline auto
+received_skip_comment(const char *p, const char *end) -> const char *
+{
+#ifdef __x86_64__
+	while (end - p >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) p);
+		__m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('(')),
+								 _mm_cmpeq_epi8(v, _mm_set1_epi8(')')));
+		auto mask = _mm_movemask_epi8(m);
+
+		if (mask != 0) {
+			return p + __builtin_ctz(mask);
+		}
+
+		p += 16;
+	}
+#endif
+
+	while (p < end && *p != '(' && *p != ')') {
+		p++;
+	}
+
+	return p;
+}
+
 static auto
 received_process_part(const std::string_view &data,
 					  received_part_type type,
@@ -99,6 +174,12 @@ received_process_part(const std::string_view &data,
 			}
 			break;
 		case in_comment:
+			p = received_skip_comment(p, end);
+
+			if (p == end) {
+				continue;
+			}
+
 			if (*p == '(') {
 				obraces++;
 			}
@@ -184,7 +265,8 @@ received_process_part(const std::string_view &data,
 				}
 			}
 			else {
-				p++;
+				/* Token without data before it, skip it as a whole */
+				p = received_skip_token(p + 1, end);
 			}
 			break;
 		case read_tcpinfo:
@@ -366,14 +448,7 @@ received_spill(const std::string_view &in,
 				got_part = maybe_process_part(received_part_type::RSPAMD_RECEIVED_PART_ID);
 			}
 			else {
-				while (p < end) {
-					if (!(g_ascii_isspace(*p) || *p == '(' || *p == ';')) {
-						p++;
-					}
-					else {
-						break;
-					}
-				}
+				p = received_skip_token(p, end);
 
 				if (p == end) {
 					return {};
@@ -698,6 +773,19 @@ received_header_parse(received_header_chain &chain, rspamd_mempool_t *pool,
 	return true;
 }
 
+auto received_header_chain::parse_until(std::size_t n) -> void
+{
+	while (headers.size() < n && nparsed < unparsed.size()) {
+		auto *hdr = unparsed[nparsed++];
+
+		if (hdr->decoded &&
+			received_header_parse(*this, pool,
+								  std::string_view{hdr->decoded, strlen(hdr->decoded)}, hdr)) {
+			hdr->flags |= RSPAMD_HEADER_RECEIVED;
+		}
+	}
+}
+
 static auto
 received_maybe_fix_task(struct rspamd_task *task) -> bool
 {
@@ -786,65 +874,71 @@ received_maybe_fix_task(struct rspamd_task *task) -> bool
 }
 
 static auto
-received_export_to_lua(received_header_chain *chain, lua_State *L) -> bool
+received_push_lua(lua_State *L, const received_header &rh) -> void
 {
-	if (chain == nullptr) {
-		return false;
-	}
-
-	lua_createtable(L, chain->size(), 0);
-
 	auto push_flag = [L](const received_header &rh, received_flags fl, const char *name) {
 		lua_pushboolean(L, !!(rh.flags & fl));
 		lua_setfield(L, -2, name);
 	};
 
-	auto i = 1;
+	lua_createtable(L, 0, 10);
 
-	for (const auto &rh: chain->as_vector()) {
-		lua_createtable(L, 0, 10);
+	if (rh.hdr && rh.hdr->decoded) {
+		rspamd_lua_table_set(L, "raw", rh.hdr->decoded);
+	}
+
+	lua_createtable(L, 0, 3);
+	push_flag(rh, received_flags::ARTIFICIAL, "artificial");
+	push_flag(rh, received_flags::AUTHENTICATED, "authenticated");
+	push_flag(rh, received_flags::SSL, "ssl");
+	push_flag(rh, received_flags::UTF8, "utf8");
+	lua_setfield(L, -2, "flags");
 
-		if (rh.hdr && rh.hdr->decoded) {
-			rspamd_lua_table_set(L, "raw", rh.hdr->decoded);
+	auto push_nullable_string = [L](const mime_string &st, const char *field) {
+		if (st.empty()) {
+			lua_pushnil(L);
 		}
+		else {
+			lua_pushlstring(L, st.data(), st.size());
+		}
+		lua_setfield(L, -2, field);
+	};
 
-		lua_createtable(L, 0, 3);
-		push_flag(rh, received_flags::ARTIFICIAL, "artificial");
-		push_flag(rh, received_flags::AUTHENTICATED, "authenticated");
-		push_flag(rh, received_flags::SSL, "ssl");
-		push_flag(rh, received_flags::UTF8, "utf8");
-		lua_setfield(L, -2, "flags");
+	push_nullable_string(rh.from_hostname, "from_hostname");
+	push_nullable_string(rh.real_hostname, "real_hostname");
+	push_nullable_string(rh.real_ip, "from_ip");
+	push_nullable_string(rh.by_hostname, "by_hostname");
+	push_nullable_string(rh.for_mbox, "for");
 
-		auto push_nullable_string = [L](const mime_string &st, const char *field) {
-			if (st.empty()) {
-				lua_pushnil(L);
-			}
-			else {
-				lua_pushlstring(L, st.data(), st.size());
-			}
-			lua_setfield(L, -2, field);
-		};
+	if (rh.addr) {
+		rspamd_lua_ip_push(L, rh.addr);
+	}
+	else {
+		lua_pushnil(L);
+	}
+	lua_setfield(L, -2, "real_ip");
 
-		push_nullable_string(rh.from_hostname, "from_hostname");
-		push_nullable_string(rh.real_hostname, "real_hostname");
-		push_nullable_string(rh.real_ip, "from_ip");
-		push_nullable_string(rh.by_hostname, "by_hostname");
-		push_nullable_string(rh.for_mbox, "for");
+	lua_pushstring(L, received_protocol_to_string(rh.flags));
+	lua_setfield(L, -2, "proto");
 
-		if (rh.addr) {
-			rspamd_lua_ip_push(L, rh.addr);
-		}
-		else {
-			lua_pushnil(L);
-		}
-		lua_setfield(L, -2, "real_ip");
+	lua_pushinteger(L, rh.timestamp);
+	lua_setfield(L, -2, "timestamp");
+}
+
+static auto
+received_export_to_lua(received_header_chain *chain, lua_State *L) -> bool
+{
+	if (chain == nullptr) {
+		return false;
+	}
 
-		lua_pushstring(L, received_protocol_to_string(rh.flags));
-		lua_setfield(L, -2, "proto");
+	const auto &headers = chain->as_vector();
+	lua_createtable(L, headers.size(), 0);
 
-		lua_pushinteger(L, rh.timestamp);
-		lua_setfield(L, -2, "timestamp");
+	auto i = 1;
 
+	for (const auto &rh: headers) {
+		received_push_lua(L, rh);
 		lua_rawseti(L, -2, i++);
 	}
 
@@ -853,9 +947,8 @@ received_export_to_lua(received_header_chain *chain, lua_State *L) -> bool
 
 }// namespace rspamd::mime
 
-bool rspamd_received_header_parse(struct rspamd_task *task,
-								  const char *data, size_t sz,
-								  struct rspamd_mime_header *hdr)
+void rspamd_received_header_add(struct rspamd_task *task,
+								struct rspamd_mime_header *hdr)
 {
 	auto *recv_chain_ptr = static_cast<rspamd::mime::received_header_chain *>(MESSAGE_FIELD(task, received_headers));
 
@@ -864,8 +957,8 @@ bool rspamd_received_header_parse(struct rspamd_task *task,
 		recv_chain_ptr = new rspamd::mime::received_header_chain(task);
 		MESSAGE_FIELD(task, received_headers) = (void *) recv_chain_ptr;
 	}
-	return rspamd::mime::received_header_parse(*recv_chain_ptr, task->task_pool,
-											   std::string_view{data, sz}, hdr);
+
+	recv_chain_ptr->add_unparsed(hdr);
 }
 
 bool rspamd_received_maybe_fix_task(struct rspamd_task *task)
@@ -880,6 +973,44 @@ bool rspamd_received_export_to_lua(struct rspamd_task *task, lua_State *L)
 		L);
 }
 
+bool rspamd_received_export_nth_to_lua(struct rspamd_task *task, unsigned int nth,
+									   lua_State *L)
+{
+	auto *recv_chain_ptr = static_cast<rspamd::mime::received_header_chain *>(MESSAGE_FIELD(task, received_headers));
+
+	if (recv_chain_ptr == nullptr) {
+		return false;
+	}
+
+	auto rh = recv_chain_ptr->get_received(nth);
+
+	if (!rh.has_value()) {
+		return false;
+	}
+
+	rspamd::mime::received_push_lua(L, rh.value().get());
+
+	return true;
+}
+
+unsigned int rspamd_received_count(struct rspamd_task *task, bool skip_artificial)
+{
+	auto *recv_chain_ptr = static_cast<rspamd::mime::received_header_chain *>(MESSAGE_FIELD(task, received_headers));
+
+	if (recv_chain_ptr == nullptr) {
+		return 0;
+	}
+
+	/* Malformed headers are not counted, so the whole chain is parsed */
+	auto cnt = recv_chain_ptr->size();
+
+	if (skip_artificial && recv_chain_ptr->has_artificial()) {
+		cnt--;
+	}
+
+	return cnt;
+}
+
 /* Tests part */
 #define DOCTEST_CONFIG_IMPLEMENTATION_IN_DLL
 #include "doctest/doctest.h"
@@ -1027,4 +1158,41 @@ TEST_SUITE("received")
 
 		rspamd_mempool_delete(pool);
 	}
+
+	TEST_CASE("received tokens")
+	{
+		using namespace std::string_view_literals;
+		std::vector<std::string_view> cases{
+			""sv,
+			"a"sv,
+			"mx1.freebsd.org"sv,
+			"very-long-hostname.subdomain.example.com (Postfix)"sv,
+			"abcdefghijklmnopqrstuvwxyz0123456789;date"sv,
+			"abcdefghijklmnop\tqrstuvwxyz"sv,
+			"abcdefghijklmnopq\vrstuvwxyz\r\n"sv,
+			"[IPv6:2a01:7c8:aab6:26d:5054:ff:fed1:1da2](comment)"sv,
+			"0123456789abcdef0123456789abcdef\f"sv,
+		};
+
+		for (const auto &c: cases) {
+			const auto *end = c.data() + c.size();
+			const auto *expected = c.data();
+
+			while (expected < end && !rspamd::mime::received_is_token_delim(*expected)) {
+				expected++;
+			}
+
+			CHECK_MESSAGE(rspamd::mime::received_skip_token(c.data(), end) == expected,
+						  std::string{c});
+
+			expected = c.data();
+
+			while (expected < end && *expected != '(' && *expected != ')') {
+				expected++;
+			}
+
+			CHECK_MESSAGE(rspamd::mime::received_skip_comment(c.data(), end) == expected,
+						  std::string{c});
+		}
+	}
 }
\ No newline at end of file
@@ -33,15 +33,13 @@ struct rspamd_received_header_chain;
 struct rspamd_mime_header;
 
 /**
- * Parse received header from an input header data
+ * Add received header to the task's chain, headers are parsed lazily when
+ * they are requested
  * @param task
- * @param data
- * @param sz
  * @param hdr
- * @return
  */
-bool rspamd_received_header_parse(struct rspamd_task *task,
-								  const char *data, size_t sz, struct rspamd_mime_header *hdr);
+void rspamd_received_header_add(struct rspamd_task *task,
+								struct rspamd_mime_header *hdr);
 
 
 /**
@@ -60,6 +58,24 @@ struct lua_State;
  */
 bool rspamd_received_export_to_lua(struct rspamd_task *task, struct lua_State *L);
 
+/**
+ * Push nth received header (starting from 0) to lua
+ * @param task
+ * @param nth
+ * @param L
+ * @return false if there is no such header
+ */
+bool rspamd_received_export_nth_to_lua(struct rspamd_task *task, unsigned int nth,
+									   struct lua_State *L);
+
+/**
+ * Returns number of parsed received headers
+ * @param task
+ * @param skip_artificial do not count header added by rspamd
+ * @return
+ */
+unsigned int rspamd_received_count(struct rspamd_task *task, bool skip_artificial);
+
 #ifdef __cplusplus
 }
 #endif
@@ -29,6 +29,7 @@
 #include <string_view>
 #include <utility>
 #include <optional>
+#include <limits>
 
 namespace rspamd::mime {
 
@@ -241,9 +242,15 @@ struct received_header {
 	}
 };
 
+/*
+ * Chain of received headers: raw headers are added when a message is parsed,
+ * but they are parsed only when some specific header is requested, so if
+ * nobody is interested in the whole chain, only the top header is parsed.
+ */
 class received_header_chain {
 public:
 	explicit received_header_chain(struct rspamd_task *task)
+		: pool(task->task_pool)
 	{
 		headers.reserve(2);
 		rspamd_mempool_add_destructor(task->task_pool,
@@ -285,20 +292,36 @@ public:
 			return headers.front();
 		}
 	}
+	/* Adds a raw header that is parsed on the first access */
+	auto add_unparsed(struct rspamd_mime_header *hdr) -> void
+	{
+		unparsed.push_back(hdr);
+	}
 	auto get_received(std::size_t nth) -> std::optional<std::reference_wrapper<received_header>>
 	{
+		parse_until(nth + 1);
+
 		if (nth < headers.size()) {
 			return headers[nth];
 		}
 
 		return std::nullopt;
 	}
-	auto size() const -> std::size_t
+	auto size() -> std::size_t
 	{
+		parse_until(std::numeric_limits<std::size_t>::max());
+
 		return headers.size();
 	}
-	constexpr auto as_vector() const -> const std::vector<received_header> &
+	/* Artificial header can be prepended only to the parsed headers */
+	auto has_artificial() const -> bool
+	{
+		return !headers.empty() && !!(headers.front().flags & received_flags::ARTIFICIAL);
+	}
+	auto as_vector() -> const std::vector<received_header> &
 	{
+		parse_until(std::numeric_limits<std::size_t>::max());
+
 		return headers;
 	}
 
@@ -307,7 +330,13 @@ private:
 	{
 		delete static_cast<received_header_chain *>(ptr);
 	}
+	/* Parses unparsed headers until the chain has `n` elements or there are no more headers */
+	auto parse_until(std::size_t n) -> void;
+
 	std::vector<received_header> headers;
+	std::vector<struct rspamd_mime_header *> unparsed;
+	std::size_t nparsed = 0;
+	rspamd_mempool_t *pool = nullptr;
 };
 
 }// namespace rspamd::mime
@@ -35,6 +35,14 @@ INIT_LOG_MODULE(metric)
 /* Average symbols count to optimize hash allocation */
 static struct rspamd_counter_data symbols_count;
 
+/* Hashes of destroyed results are cleared and reused by the new results */
+#define RSPAMD_SCAN_RESULT_MAX_FREE_HASHES 64
+static struct {
+	khash_t(rspamd_symbols_hash) * symbols;
+	khash_t(rspamd_symbols_group_hash) * sym_groups;
+} free_hashes[RSPAMD_SCAN_RESULT_MAX_FREE_HASHES];
+static unsigned int nfree_hashes = 0;
+
 static void
 rspamd_scan_result_dtor(gpointer d)
 {
@@ -53,8 +61,17 @@ rspamd_scan_result_dtor(gpointer d)
 		}
 	});
 
-	kh_destroy(rspamd_symbols_hash, r->symbols);
-	kh_destroy(rspamd_symbols_group_hash, r->sym_groups);
+	if (nfree_hashes < G_N_ELEMENTS(free_hashes)) {
+		kh_clear(rspamd_symbols_hash, r->symbols);
+		kh_clear(rspamd_symbols_group_hash, r->sym_groups);
+		free_hashes[nfree_hashes].symbols = r->symbols;
+		free_hashes[nfree_hashes].sym_groups = r->sym_groups;
+		nfree_hashes++;
+	}
+	else {
+		kh_destroy(rspamd_symbols_hash, r->symbols);
+		kh_destroy(rspamd_symbols_group_hash, r->sym_groups);
+	}
 }
 
 static void
@@ -79,8 +96,17 @@ rspamd_create_metric_result(struct rspamd_task *task,
 
 	metric_res = rspamd_mempool_alloc0(task->task_pool,
 									   sizeof(struct rspamd_scan_result));
-	metric_res->symbols = kh_init(rspamd_symbols_hash);
-	metric_res->sym_groups = kh_init(rspamd_symbols_group_hash);
+
+	if (nfree_hashes > 0) {
+		/* Buckets are preserved, so resize below is usually a no-op */
+		nfree_hashes--;
+		metric_res->symbols = free_hashes[nfree_hashes].symbols;
+		metric_res->sym_groups = free_hashes[nfree_hashes].sym_groups;
+	}
+	else {
+		metric_res->symbols = kh_init(rspamd_symbols_hash);
+		metric_res->sym_groups = kh_init(rspamd_symbols_group_hash);
+	}
 
 	if (name) {
 		metric_res->name = rspamd_mempool_strdup(task->task_pool, name);
@@ -93,12 +119,16 @@ rspamd_create_metric_result(struct rspamd_task *task,
 	metric_res->task = task;
 
 	/* Optimize allocation */
-	kh_resize(rspamd_symbols_group_hash, metric_res->sym_groups, 4);
+	if (kh_n_buckets(metric_res->sym_groups) < 4) {
+		kh_resize(rspamd_symbols_group_hash, metric_res->sym_groups, 4);
+	}
 
 	if (symbols_count.mean > 4) {
-		kh_resize(rspamd_symbols_hash, metric_res->symbols, symbols_count.mean);
+		if (kh_n_buckets(metric_res->symbols) < symbols_count.mean) {
+			kh_resize(rspamd_symbols_hash, metric_res->symbols, symbols_count.mean);
+		}
 	}
-	else {
+	else if (kh_n_buckets(metric_res->symbols) < 4) {
 		kh_resize(rspamd_symbols_hash, metric_res->symbols, 4);
 	}
 
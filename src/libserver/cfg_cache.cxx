@@ -0,0 +1,543 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "cfg_cache.hxx"
+#include "cfg_file.h"
+#include "cryptobox.h"
+#include "unix-std.h"
+#include "utlist.h"
+#include "libutil/cxx/file_util.hxx"
+
+#include <algorithm>
+#include <cstring>
+#include <glob.h>
+
+namespace rspamd::config {
+
+/* Bump on any format change */
+static constexpr const char cfg_cache_magic[8] = {'r', 's', 'c', 'f', 'g', 'c', '0', '1'};
+static constexpr const std::uint64_t cfg_cache_seed = 0x6c8a3b9e15f2d047ULL;
+/* Flags that are meaningful for the config consumers */
+static constexpr const std::uint16_t cfg_cache_flags_mask = UCL_OBJECT_MULTILINE | UCL_OBJECT_MULTIVALUE |
+															UCL_OBJECT_INHERITED | UCL_OBJECT_BINARY |
+															UCL_OBJECT_SQUOTED;
+/* Directories overridden by the environment, see `rspamd_lua_set_env` */
+static constexpr const char *cfg_cache_env_vars[] = {
+	"SHAREDIR", "PLUGINSDIR", "RULESDIR", "DBDIR", "RUNDIR",
+	"LUALIBDIR", "LOGDIR", "WWWDIR", "CONFDIR", "LOCAL_CONFDIR"};
+
+static auto
+digest_update_str(rspamd_cryptobox_fast_hash_state_t &st, const char *str) -> void
+{
+	/* Include terminating zero to separate fields */
+	rspamd_cryptobox_fast_hash_update(&st, str, strlen(str) + 1);
+}
+
+config_cache::config_cache(struct rspamd_config *_cfg, const char *_cache_file,
+						   const char *cfg_name, GHashTable *vars,
+						   char **lua_env, bool skip_jinja)
+	: cfg(_cfg), cache_file(_cache_file)
+{
+	rspamd_cryptobox_fast_hash_state_t st;
+
+	rspamd_cryptobox_fast_hash_init_specific(&st, RSPAMD_CRYPTOBOX_XXHASH64, cfg_cache_seed);
+	digest_update_str(st, RVERSION);
+	digest_update_str(st, RID);
+	digest_update_str(st, cfg_name);
+	digest_update_str(st, skip_jinja ? "1" : "0");
+
+	if (vars) {
+		std::vector<std::pair<std::string_view, std::string_view>> sorted_vars;
+		GHashTableIter it;
+		gpointer k, v;
+
+		g_hash_table_iter_init(&it, vars);
+
+		while (g_hash_table_iter_next(&it, &k, &v)) {
+			sorted_vars.emplace_back((const char *) k, (const char *) v);
+		}
+
+		std::sort(sorted_vars.begin(), sorted_vars.end());
+
+		for (const auto &[var, value]: sorted_vars) {
+			rspamd_cryptobox_fast_hash_update(&st, var.data(), var.size() + 1);
+			rspamd_cryptobox_fast_hash_update(&st, value.data(), value.size() + 1);
+		}
+	}
+
+	/* Environment that is visible from templates */
+	auto **env = g_get_environ();
+	std::vector<std::string_view> sorted_env;
+
+	for (auto **cur = env; cur && *cur; cur++) {
+		std::string_view env_line{*cur};
+
+		if (env_line.starts_with("RSPAMD_")) {
+			sorted_env.emplace_back(env_line);
+		}
+	}
+
+	for (const auto *var: cfg_cache_env_vars) {
+		const auto *value = g_environ_getenv(env, var);
+
+		digest_update_str(st, var);
+		digest_update_str(st, value ? value : "");
+	}
+
+	std::sort(sorted_env.begin(), sorted_env.end());
+
+	for (const auto &env_line: sorted_env) {
+		rspamd_cryptobox_fast_hash_update(&st, env_line.data(), env_line.size() + 1);
+	}
+
+	g_strfreev(env);
+
+	char hostbuf[256];
+	memset(hostbuf, 0, sizeof(hostbuf));
+	gethostname(hostbuf, sizeof(hostbuf) - 1);
+	digest_update_str(st, hostbuf);
+
+	env_digest = rspamd_cryptobox_fast_hash_final(&st);
+
+	/* Main config and lua environment files are dependencies as well */
+	add_dependency(std::string{cfg_name});
+
+	if (lua_env) {
+		for (auto **cur = lua_env; *cur; cur++) {
+			add_dependency(std::string{*cur});
+		}
+	}
+}
+
+auto config_cache::dependency_digest(const std::string &path, dep_type type) -> std::uint64_t
+{
+	rspamd_cryptobox_fast_hash_state_t st;
+
+	rspamd_cryptobox_fast_hash_init_specific(&st, RSPAMD_CRYPTOBOX_XXHASH64, cfg_cache_seed);
+
+	if (type == dep_type::GLOB) {
+		glob_t globbuf;
+
+		memset(&globbuf, 0, sizeof(globbuf));
+
+		if (glob(path.c_str(), 0, nullptr, &globbuf) == 0) {
+			/* glob output is sorted, files are checked separately */
+			for (auto i = 0u; i < globbuf.gl_pathc; i++) {
+				digest_update_str(st, globbuf.gl_pathv[i]);
+			}
+		}
+
+		globfree(&globbuf);
+	}
+	else {
+		auto maybe_file = util::raii_mmaped_file::mmap_shared(path.c_str(), O_RDONLY, PROT_READ);
+
+		if (maybe_file) {
+			/* Distinguish an empty file from a missing one */
+			digest_update_str(st, "+");
+			rspamd_cryptobox_fast_hash_update(&st, maybe_file->get_map(), maybe_file->get_size());
+		}
+		else {
+			auto maybe_empty = util::raii_file::open(path.c_str(), O_RDONLY);
+
+			digest_update_str(st, maybe_empty ? "+" : "-");
+		}
+	}
+
+	return rspamd_cryptobox_fast_hash_final(&st);
+}
+
+auto config_cache::add_dependency(std::string &&path) -> void
+{
+	if (path.starts_with("http://") || path.starts_with("https://")) {
+		/* We cannot track remote includes */
+		cacheable = false;
+
+		return;
+	}
+
+	auto type = (path.find_first_of("*?") != std::string::npos) ? dep_type::GLOB : dep_type::FILE;
+
+	if (std::find_if(deps.begin(), deps.end(), [&](const auto &dep) {
+			return dep.path == path;
+		}) != deps.end()) {
+		return;
+	}
+
+	auto digest = dependency_digest(path, type);
+	deps.emplace_back(dependency{std::move(path), type, digest});
+}
+
+auto config_cache::include_tracer(struct ucl_parser *parser,
+								  const ucl_object_t *parent,
+								  const ucl_object_t *args,
+								  const char *path,
+								  size_t pathlen,
+								  void *user_data) -> void
+{
+	auto *cache = reinterpret_cast<config_cache *>(user_data);
+
+	cache->add_dependency(std::string{path, pathlen});
+}
+
+/*
+ * Serialisation: all numbers are stored in the host byte order as the cache
+ * is never shared between hosts
+ */
+class cache_writer {
+public:
+	std::string buf;
+
+	template<typename T>
+	auto write(T val) -> void
+	{
+		buf.append(reinterpret_cast<const char *>(&val), sizeof(val));
+	}
+
+	auto write_str(const char *str, std::size_t len) -> void
+	{
+		write<std::uint32_t>(len);
+		buf.append(str, len);
+	}
+
+	auto write_obj(const ucl_object_t *obj, bool with_key) -> void
+	{
+		auto type = obj->type;
+
+		if (type == UCL_USERDATA) {
+			/* Cannot be produced by the parser */
+			type = UCL_NULL;
+		}
+
+		write<std::uint8_t>(type);
+		write<std::uint16_t>(obj->flags & cfg_cache_flags_mask);
+		write<std::uint8_t>(ucl_object_get_priority(obj));
+
+		if (with_key) {
+			write_str(obj->key, obj->keylen);
+		}
+
+		switch (type) {
+		case UCL_INT:
+			write<std::int64_t>(obj->value.iv);
+			break;
+		case UCL_FLOAT:
+		case UCL_TIME:
+			write<double>(obj->value.dv);
+			break;
+		case UCL_BOOLEAN:
+			write<std::uint8_t>(obj->value.iv ? 1 : 0);
+			break;
+		case UCL_STRING:
+			write_str(obj->value.sv, obj->len);
+			break;
+		case UCL_OBJECT: {
+			ucl_object_iter_t it = nullptr;
+			const ucl_object_t *cur, *elt;
+
+			write<std::uint32_t>(obj->len);
+
+			while ((cur = ucl_object_iterate(obj, &it, true)) != nullptr) {
+				std::uint32_t nvalues = 0;
+
+				LL_FOREACH(cur, elt)
+				{
+					nvalues++;
+				}
+
+				/* Implicit array of values with the same key */
+				write<std::uint32_t>(nvalues);
+
+				LL_FOREACH(cur, elt)
+				{
+					write_obj(elt, true);
+				}
+			}
+			break;
+		}
+		case UCL_ARRAY: {
+			ucl_object_iter_t it = nullptr;
+			const ucl_object_t *cur;
+
+			write<std::uint32_t>(obj->len);
+
+			while ((cur = ucl_object_iterate(obj, &it, true)) != nullptr) {
+				write_obj(cur, false);
+			}
+			break;
+		}
+		default:
+			break;
+		}
+	}
+};
+
+class cache_reader {
+public:
+	const unsigned char *p;
+	const unsigned char *end;
+
+	template<typename T>
+	auto read(T &val) -> bool
+	{
+		if (end - p < (std::ptrdiff_t) sizeof(T)) {
+			return false;
+		}
+
+		memcpy(&val, p, sizeof(T));
+		p += sizeof(T);
+
+		return true;
+	}
+
+	auto read_str(std::string_view &out) -> bool
+	{
+		std::uint32_t len;
+
+		if (!read(len) || end - p < (std::ptrdiff_t) len) {
+			return false;
+		}
+
+		out = std::string_view{(const char *) p, len};
+		p += len;
+
+		return true;
+	}
+
+	auto read_obj(std::string_view *key) -> ucl_object_t *
+	{
+		std::uint8_t type, prio;
+		std::uint16_t flags;
+		ucl_object_t *obj = nullptr;
+
+		if (!read(type) || !read(flags) || !read(prio)) {
+			return nullptr;
+		}
+
+		if (key && !read_str(*key)) {
+			return nullptr;
+		}
+
+		switch (type) {
+		case UCL_INT: {
+			std::int64_t iv;
+			if (read(iv)) {
+				obj = ucl_object_fromint(iv);
+			}
+			break;
+		}
+		case UCL_FLOAT:
+		case UCL_TIME: {
+			double dv;
+			if (read(dv)) {
+				obj = ucl_object_typed_new((ucl_type_t) type);
+				obj->value.dv = dv;
+			}
+			break;
+		}
+		case UCL_BOOLEAN: {
+			std::uint8_t bv;
+			if (read(bv)) {
+				obj = ucl_object_frombool(bv != 0);
+			}
+			break;
+		}
+		case UCL_STRING: {
+			std::string_view sv;
+			if (read_str(sv)) {
+				obj = ucl_object_fromlstring(sv.data(), sv.size());
+			}
+			break;
+		}
+		case UCL_NULL:
+			obj = ucl_object_typed_new(UCL_NULL);
+			break;
+		case UCL_OBJECT: {
+			std::uint32_t nkeys;
+
+			if (!read(nkeys)) {
+				return nullptr;
+			}
+
+			obj = ucl_object_typed_new(UCL_OBJECT);
+
+			for (auto i = 0u; i < nkeys; i++) {
+				std::uint32_t nvalues;
+
+				if (!read(nvalues)) {
+					ucl_object_unref(obj);
+					return nullptr;
+				}
+
+				for (auto j = 0u; j < nvalues; j++) {
+					std::string_view child_key;
+					auto *child = read_obj(&child_key);
+
+					if (child == nullptr) {
+						ucl_object_unref(obj);
+						return nullptr;
+					}
+
+					/* Duplicate keys are appended to the implicit array */
+					ucl_object_insert_key(obj, child, child_key.data(), child_key.size(), true);
+				}
+			}
+			break;
+		}
+		case UCL_ARRAY: {
+			std::uint32_t nelts;
+
+			if (!read(nelts)) {
+				return nullptr;
+			}
+
+			obj = ucl_object_typed_new(UCL_ARRAY);
+			ucl_object_reserve(obj, nelts);
+
+			for (auto i = 0u; i < nelts; i++) {
+				auto *child = read_obj(nullptr);
+
+				if (child == nullptr) {
+					ucl_object_unref(obj);
+					return nullptr;
+				}
+
+				ucl_array_append(obj, child);
+			}
+			break;
+		}
+		default:
+			break;
+		}
+
+		if (obj) {
+			obj->flags |= flags & cfg_cache_flags_mask;
+			ucl_object_set_priority(obj, prio);
+		}
+
+		return obj;
+	}
+};
+
+auto config_cache::load() const -> ucl_object_t *
+{
+	auto maybe_file = util::raii_mmaped_file::mmap_shared(cache_file.c_str(), O_RDONLY, PROT_READ);
+
+	if (!maybe_file) {
+		msg_debug_config("cannot open config cache %s: %s", cache_file.c_str(),
+						 maybe_file.error().error_message.data());
+		return nullptr;
+	}
+
+	cache_reader reader{(const unsigned char *) maybe_file->get_map(),
+						(const unsigned char *) maybe_file->get_map() + maybe_file->get_size()};
+	char magic[sizeof(cfg_cache_magic)];
+	std::uint64_t digest;
+	std::uint32_t ndeps;
+
+	if (!reader.read(magic) || memcmp(magic, cfg_cache_magic, sizeof(magic)) != 0) {
+		msg_info_config("invalid config cache %s: bad magic", cache_file.c_str());
+		return nullptr;
+	}
+
+	if (!reader.read(digest) || digest != env_digest) {
+		msg_info_config("config cache %s is stale: environment has been changed", cache_file.c_str());
+		return nullptr;
+	}
+
+	if (!reader.read(ndeps)) {
+		return nullptr;
+	}
+
+	for (auto i = 0u; i < ndeps; i++) {
+		std::uint8_t type;
+		std::string_view path;
+
+		if (!reader.read(type) || !reader.read_str(path) || !reader.read(digest)) {
+			msg_info_config("invalid config cache %s: truncated", cache_file.c_str());
+			return nullptr;
+		}
+
+		if (dependency_digest(std::string{path}, (dep_type) type) != digest) {
+			msg_info_config("config cache %s is stale: %*s has been changed", cache_file.c_str(),
+							(int) path.size(), path.data());
+			return nullptr;
+		}
+	}
+
+	auto *top = reader.read_obj(nullptr);
+
+	if (top == nullptr || reader.p != reader.end) {
+		msg_info_config("invalid config cache %s: cannot load config tree", cache_file.c_str());
+
+		if (top) {
+			ucl_object_unref(top);
+		}
+
+		return nullptr;
+	}
+
+	msg_info_config("loaded config from cache %s, %d dependencies checked", cache_file.c_str(),
+					(int) ndeps);
+
+	return top;
+}
+
+auto config_cache::save(const ucl_object_t *top) const -> bool
+{
+	if (!cacheable) {
+		msg_info_config("config cannot be cached as it uses remote resources or maps");
+		unlink(cache_file.c_str());
+
+		return false;
+	}
+
+	cache_writer writer;
+
+	writer.buf.append(cfg_cache_magic, sizeof(cfg_cache_magic));
+	writer.write<std::uint64_t>(env_digest);
+	writer.write<std::uint32_t>(deps.size());
+
+	for (const auto &dep: deps) {
+		writer.write<std::uint8_t>(static_cast<std::uint8_t>(dep.type));
+		writer.write_str(dep.path.data(), dep.path.size());
+		writer.write<std::uint64_t>(dep.digest);
+	}
+
+	writer.write_obj(top, false);
+
+	auto file_sink = util::raii_file_sink::create(cache_file.c_str(),
+												  O_WRONLY | O_TRUNC, 00600);
+
+	if (!file_sink.has_value()) {
+		if (errno != EEXIST) {
+			msg_err_config("cannot save config cache: %s", file_sink.error().error_message.data());
+		}
+
+		return false;
+	}
+
+	if (write(file_sink->get_fd(), writer.buf.data(), writer.buf.size()) != (ssize_t) writer.buf.size()) {
+		msg_err_config("cannot write config cache %s: %s", cache_file.c_str(), strerror(errno));
+
+		return false;
+	}
+
+	return file_sink->write_output();
+}
+
+}// namespace rspamd::config
@@ -0,0 +1,94 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Binary cache of the merged UCL configuration tree
+ */
+
+#ifndef RSPAMD_CFG_CACHE_HXX
+#define RSPAMD_CFG_CACHE_HXX
+#pragma once
+
+#include "config.h"
+#include "ucl.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct rspamd_config;
+
+namespace rspamd::config {
+
+/*
+ * The cache stores the fully merged UCL tree of the config together with
+ * the digests of everything that was used to produce it: all included files
+ * (including the missing ones and the results of glob patterns), variables and
+ * environment visible to the Jinja templates. If any of these has changed, the
+ * cache is ignored and rewritten after the normal parsing.
+ *
+ * Unlike msgpack, the format preserves implicit arrays (multiple values for
+ * the same key), priorities and UCL_TIME values, so the loaded tree is
+ * identical to the parsed one.
+ */
+class config_cache {
+public:
+	explicit config_cache(struct rspamd_config *_cfg, const char *_cache_file,
+						  const char *cfg_name, GHashTable *vars,
+						  char **lua_env, bool skip_jinja);
+
+	/* Returns a new object or nullptr if cache is missing or stale */
+	auto load() const -> ucl_object_t *;
+	/* Saves the parsed tree; invalidated caches are not saved */
+	auto save(const ucl_object_t *top) const -> bool;
+	auto invalidate() -> void
+	{
+		cacheable = false;
+	}
+
+	/* Compatible with ucl_include_trace_func_t */
+	static auto include_tracer(struct ucl_parser *parser,
+							   const ucl_object_t *parent,
+							   const ucl_object_t *args,
+							   const char *path,
+							   size_t pathlen,
+							   void *user_data) -> void;
+
+private:
+	enum class dep_type : std::uint8_t {
+		FILE = 0,
+		GLOB = 1,
+	};
+
+	struct dependency {
+		std::string path;
+		dep_type type;
+		std::uint64_t digest;
+	};
+
+	struct rspamd_config *cfg;
+	std::string cache_file;
+	std::uint64_t env_digest;
+	std::vector<dependency> deps;
+	bool cacheable = true;
+
+	static auto dependency_digest(const std::string &path, dep_type type) -> std::uint64_t;
+	auto add_dependency(std::string &&path) -> void;
+};
+
+}// namespace rspamd::config
+
+#endif//RSPAMD_CFG_CACHE_HXX
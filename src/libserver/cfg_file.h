@@ -207,6 +207,7 @@ struct rspamd_worker_conf {
 	GList *listen_socks;                       /**< listening sockets descriptors						*/
 	uint64_t rlimit_nofile;                    /**< max files limit									*/
 	uint64_t rlimit_maxcore;                   /**< maximum core file size								*/
+	char *cpu_affinity;                        /**< CPU affinity: auto, numa or list of CPUs			*/
 	GHashTable *params;                        /**< params for worker									*/
 	GQueue *active_workers;                    /**< linked list of spawned workers						*/
 	gpointer ctx;                              /**< worker's context									*/
@@ -336,6 +337,7 @@ struct rspamd_config {
 	char *rspamd_group;              /**< group to run as									*/
 	rspamd_mempool_t *cfg_pool;      /**< memory pool for config								*/
 	char *cfg_name;                  /**< name of config file								*/
+	char *cfg_cache_file;            /**< binary cache of the parsed config					*/
 	char *pid_file;                  /**< name of pid file									*/
 	char *temp_dir;                  /**< dir for temp files									*/
 	char *control_socket_path;       /**< path to the control socket							*/
@@ -377,6 +379,7 @@ struct rspamd_config {
 	int default_max_shots;       /**< default maximum count of symbols hits permitted (-1 for unlimited) */
 	int32_t heartbeats_loss_max; /**< number of heartbeats lost to consider worker's termination */
 	double heartbeat_interval;   /**< interval for heartbeats for workers				*/
+	double warmup_timeout;       /**< maximum time to wait for new workers on reload		*/
 
 	enum rspamd_log_type log_type;                      /**< log type											*/
 	int log_facility;                                   /**< log facility in case of syslog						*/
@@ -439,6 +442,8 @@ struct rspamd_config {
 	char *hs_cache_dir;   /**< directory to save hyperscan databases				*/
 	char *events_backend; /**< string representation of the events backend used	*/
 
+	gboolean enable_io_uring; /**< use io_uring for network IO if available		*/
+
 	double dns_timeout;              /**< timeout in milliseconds for waiting for dns reply	*/
 	uint32_t dns_retransmits;        /**< maximum retransmits count							*/
 	uint32_t dns_io_per_server;      /**< number of sockets per DNS server					*/
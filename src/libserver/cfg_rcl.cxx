@@ -16,6 +16,7 @@
 
 #include "lua/lua_common.h"
 #include "cfg_rcl.h"
+#include "cfg_cache.hxx"
 #include "rspamd.h"
 #include "cfg_file_private.h"
 #include "utlist.h"
@@ -755,6 +756,7 @@ constexpr const auto known_worker_attributes = frozen::make_unordered_set<frozen
 	"count",
 	"max_files",
 	"max_core",
+	"cpu_affinity",
 	"enabled",
 });
 static gboolean
@@ -2153,6 +2155,13 @@ rspamd_rcl_config_init(struct rspamd_config *cfg, GHashTable *skip_sections)
 									   RSPAMD_CL_FLAG_INT_32,
 									   "Maximum count of heartbeats to be lost before trying to "
 									   "terminate a worker (default: 0 - disabled)");
+		rspamd_rcl_add_default_handler(sub,
+									   "warmup_timeout",
+									   rspamd_rcl_parse_struct_time,
+									   G_STRUCT_OFFSET(struct rspamd_config, warmup_timeout),
+									   RSPAMD_CL_FLAG_TIME_FLOAT,
+									   "Maximum time to wait for new workers to load maps and hyperscan "
+									   "before stopping the old ones on reload (default: 60s, 0 - do not wait)");
 		rspamd_rcl_add_default_handler(sub,
 									   "max_lua_urls",
 									   rspamd_rcl_parse_struct_integer,
@@ -2189,6 +2198,13 @@ rspamd_rcl_config_init(struct rspamd_config *cfg, GHashTable *skip_sections)
 									   G_STRUCT_OFFSET(struct rspamd_config, events_backend),
 									   0,
 									   "Events backend to use: kqueue, epoll, select, poll or auto (default: auto)");
+		rspamd_rcl_add_default_handler(sub,
+									   "io_uring",
+									   rspamd_rcl_parse_struct_boolean,
+									   G_STRUCT_OFFSET(struct rspamd_config, enable_io_uring),
+									   0,
+									   "Use io_uring completion based IO for HTTP, TCP and UDP clients "
+									   "if rspamd is built with io_uring support (default: false)");
 
 		rspamd_rcl_add_doc_by_path(cfg,
 								   "options",
@@ -2374,6 +2390,12 @@ rspamd_rcl_config_init(struct rspamd_config *cfg, GHashTable *skip_sections)
 									   G_STRUCT_OFFSET(struct rspamd_worker_conf, rlimit_maxcore),
 									   RSPAMD_CL_FLAG_INT_64,
 									   "Max size of core file in bytes");
+		rspamd_rcl_add_default_handler(sub,
+									   "cpu_affinity",
+									   rspamd_rcl_parse_struct_string,
+									   G_STRUCT_OFFSET(struct rspamd_worker_conf, cpu_affinity),
+									   0,
+									   "CPU affinity of workers: `auto` (a CPU per worker), `numa` (a NUMA node per worker) or list of CPUs");
 		rspamd_rcl_add_default_handler(sub,
 									   "enabled",
 									   rspamd_rcl_parse_struct_boolean,
@@ -3709,7 +3731,33 @@ rspamd_config_read(struct rspamd_config *cfg,
 		return FALSE;
 	}
 
-	if (!rspamd_config_parse_ucl(cfg, filename, vars, nullptr, nullptr, skip_jinja, &err)) {
+	if (cfg->cfg_cache_file && access(fmt::format("{}.key", filename).c_str(), R_OK) == -1) {
+		/* Encrypted configs are never cached */
+		rspamd::config::config_cache cache{cfg, cfg->cfg_cache_file, filename, vars,
+										   lua_env, static_cast<bool>(skip_jinja)};
+
+		cfg->cfg_ucl_obj = cache.load();
+
+		if (cfg->cfg_ucl_obj == nullptr) {
+			auto nmaps = g_list_length(cfg->maps);
+
+			if (!rspamd_config_parse_ucl(cfg, filename, vars, rspamd::config::config_cache::include_tracer,
+										 &cache, skip_jinja, &err)) {
+				msg_err_config_forced("failed to load config: %e", err);
+				g_error_free(err);
+
+				return FALSE;
+			}
+
+			if (g_list_length(cfg->maps) != nmaps) {
+				/* Maps included via `.include_map` are not a part of the tree */
+				cache.invalidate();
+			}
+
+			cache.save(cfg->cfg_ucl_obj);
+		}
+	}
+	else if (!rspamd_config_parse_ucl(cfg, filename, vars, nullptr, nullptr, skip_jinja, &err)) {
 		msg_err_config_forced("failed to load config: %e", err);
 		g_error_free(err);
 
@@ -338,6 +338,7 @@ rspamd_config_new(enum rspamd_config_init_flags flags)
 	cfg->maps_cache_dir = rspamd_mempool_strdup(cfg->cfg_pool, RSPAMD_DBDIR);
 	cfg->c_modules = g_ptr_array_new();
 	cfg->heartbeat_interval = 10.0;
+	cfg->warmup_timeout = 60.0;
 
 	cfg->enable_css_parser = true;
 	cfg->script_modules = g_ptr_array_new();
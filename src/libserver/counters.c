@@ -0,0 +1,394 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "counters.h"
+#include "logger.h"
+#include "printf.h"
+#include "unix-std.h"
+
+#ifdef HAVE_SCHED_GETCPU
+#include <sched.h>
+#endif
+
+/* Must be a power of two */
+#define RSPAMD_COUNTERS_SHARDS 32
+
+struct rspamd_counter_def {
+	char name[RSPAMD_COUNTER_NAME_MAX];
+	char help[RSPAMD_COUNTER_HELP_MAX];
+	enum rspamd_counter_type type;
+};
+
+struct rspamd_counters_shard {
+	int64_t values[RSPAMD_COUNTERS_MAX];
+} __attribute__((aligned(64)));
+
+struct rspamd_counters_registry {
+	struct rspamd_counters_shard shards[RSPAMD_COUNTERS_SHARDS];
+	/* Values set explicitly for gauges */
+	int64_t base[RSPAMD_COUNTERS_MAX];
+	struct rspamd_counter_def defs[RSPAMD_COUNTERS_MAX];
+	/* Published after a definition is written */
+	unsigned int ndefs;
+	/* Spinlock for registration, it is rare and short */
+	int lock;
+};
+
+static struct rspamd_counters_registry *registry = NULL;
+
+static inline void
+rspamd_counters_atomic_add(int64_t *ptr, int64_t value)
+{
+#ifndef HAVE_ATOMIC_BUILTINS
+	*ptr += value;
+#else
+	__atomic_add_fetch(ptr, value, __ATOMIC_RELAXED);
+#endif
+}
+
+static inline int64_t
+rspamd_counters_atomic_load(const int64_t *ptr)
+{
+#ifndef HAVE_ATOMIC_BUILTINS
+	return *ptr;
+#else
+	return __atomic_load_n(ptr, __ATOMIC_RELAXED);
+#endif
+}
+
+static inline void
+rspamd_counters_lock(struct rspamd_counters_registry *reg)
+{
+#ifdef HAVE_ATOMIC_BUILTINS
+	while (__atomic_exchange_n(&reg->lock, 1, __ATOMIC_ACQUIRE) != 0) {
+#ifdef HAVE_SCHED_YIELD
+		(void) sched_yield();
+#endif
+	}
+#endif
+}
+
+static inline void
+rspamd_counters_unlock(struct rspamd_counters_registry *reg)
+{
+#ifdef HAVE_ATOMIC_BUILTINS
+	__atomic_store_n(&reg->lock, 0, __ATOMIC_RELEASE);
+#endif
+}
+
+static inline unsigned int
+rspamd_counters_ndefs(struct rspamd_counters_registry *reg)
+{
+#ifndef HAVE_ATOMIC_BUILTINS
+	return reg->ndefs;
+#else
+	return __atomic_load_n(&reg->ndefs, __ATOMIC_ACQUIRE);
+#endif
+}
+
+static inline unsigned int
+rspamd_counters_shard_idx(void)
+{
+#ifdef HAVE_SCHED_GETCPU
+	int cpu = sched_getcpu();
+
+	if (cpu >= 0) {
+		return cpu & (RSPAMD_COUNTERS_SHARDS - 1);
+	}
+#endif
+
+	return getpid() & (RSPAMD_COUNTERS_SHARDS - 1);
+}
+
+static struct rspamd_counters_registry *
+rspamd_counters_get_registry(void)
+{
+	if (registry == NULL) {
+		/* Registry is not shared, e.g. in rspamadm or tests */
+		registry = g_malloc0(sizeof(*registry));
+	}
+
+	return registry;
+}
+
+void rspamd_counters_init(rspamd_mempool_t *pool)
+{
+	if (registry == NULL) {
+		registry = rspamd_mempool_alloc0_shared_(pool, sizeof(*registry),
+												 RSPAMD_ALIGNOF(struct rspamd_counters_registry),
+												 G_STRLOC);
+	}
+}
+
+static gboolean
+rspamd_counter_name_valid(const char *name)
+{
+	const char *p = name;
+
+	if (!(g_ascii_isalpha(*p) || *p == '_' || *p == ':')) {
+		return FALSE;
+	}
+
+	while (*p && *p != '{') {
+		if (!(g_ascii_isalnum(*p) || *p == '_' || *p == ':')) {
+			return FALSE;
+		}
+		p++;
+	}
+
+	if (*p == '{') {
+		/* Labels must be closed */
+		gsize len = strlen(p);
+
+		if (len < 2 || p[len - 1] != '}') {
+			return FALSE;
+		}
+	}
+
+	return p - name < RSPAMD_COUNTER_NAME_MAX;
+}
+
+int rspamd_counter_register(const char *name, const char *help,
+							enum rspamd_counter_type type)
+{
+	struct rspamd_counters_registry *reg = rspamd_counters_get_registry();
+	unsigned int i, ndefs;
+	int ret = -1;
+
+	if (name == NULL || !rspamd_counter_name_valid(name) ||
+		strlen(name) >= RSPAMD_COUNTER_NAME_MAX) {
+		msg_err("invalid counter name: %s", name ? name : "(null)");
+
+		return -1;
+	}
+
+	rspamd_counters_lock(reg);
+	ndefs = reg->ndefs;
+
+	for (i = 0; i < ndefs; i++) {
+		if (strcmp(reg->defs[i].name, name) == 0) {
+			if (reg->defs[i].type != type) {
+				msg_err("counter %s is already registered with a different type",
+						name);
+			}
+			else {
+				ret = i;
+			}
+
+			rspamd_counters_unlock(reg);
+
+			return ret;
+		}
+	}
+
+	if (ndefs < RSPAMD_COUNTERS_MAX) {
+		rspamd_strlcpy(reg->defs[ndefs].name, name, sizeof(reg->defs[ndefs].name));
+		rspamd_strlcpy(reg->defs[ndefs].help, help ? help : "",
+					   sizeof(reg->defs[ndefs].help));
+		reg->defs[ndefs].type = type;
+		ret = ndefs;
+#ifndef HAVE_ATOMIC_BUILTINS
+		reg->ndefs = ndefs + 1;
+#else
+		__atomic_store_n(&reg->ndefs, ndefs + 1, __ATOMIC_RELEASE);
+#endif
+	}
+	else {
+		msg_err("cannot register counter %s: too many counters", name);
+	}
+
+	rspamd_counters_unlock(reg);
+
+	return ret;
+}
+
+void rspamd_counter_add(int id, int64_t value)
+{
+	if (id < 0 || id >= RSPAMD_COUNTERS_MAX || registry == NULL) {
+		return;
+	}
+
+	rspamd_counters_atomic_add(&registry->shards[rspamd_counters_shard_idx()].values[id],
+							   value);
+}
+
+void rspamd_counter_set(int id, int64_t value)
+{
+	unsigned int i;
+
+	if (id < 0 || id >= RSPAMD_COUNTERS_MAX || registry == NULL) {
+		return;
+	}
+
+	/* Concurrent increments can be lost, gauges are expected to be set by one process */
+	for (i = 0; i < RSPAMD_COUNTERS_SHARDS; i++) {
+#ifndef HAVE_ATOMIC_BUILTINS
+		registry->shards[i].values[id] = 0;
+#else
+		__atomic_store_n(&registry->shards[i].values[id], 0, __ATOMIC_RELAXED);
+#endif
+	}
+
+#ifndef HAVE_ATOMIC_BUILTINS
+	registry->base[id] = value;
+#else
+	__atomic_store_n(&registry->base[id], value, __ATOMIC_RELAXED);
+#endif
+}
+
+int64_t
+rspamd_counter_get(int id)
+{
+	unsigned int i;
+	int64_t res;
+
+	if (id < 0 || id >= RSPAMD_COUNTERS_MAX || registry == NULL) {
+		return 0;
+	}
+
+	res = rspamd_counters_atomic_load(&registry->base[id]);
+
+	for (i = 0; i < RSPAMD_COUNTERS_SHARDS; i++) {
+		res += rspamd_counters_atomic_load(&registry->shards[i].values[id]);
+	}
+
+	return res;
+}
+
+const char *
+rspamd_counter_escape_label(const char *value, char *buf, gsize buflen)
+{
+	const char *p;
+	char *d = buf, *end = buf + buflen - 1;
+
+	if (buflen == 0) {
+		return buf;
+	}
+
+	for (p = value; *p && d < end; p++) {
+		char esc = 0;
+
+		switch (*p) {
+		case '\\':
+			esc = '\\';
+			break;
+		case '"':
+			esc = '"';
+			break;
+		case '\n':
+			esc = 'n';
+			break;
+		default:
+			break;
+		}
+
+		if (esc) {
+			/* Do not split escape sequences */
+			if (end - d < 2) {
+				break;
+			}
+
+			*d++ = '\\';
+			*d++ = esc;
+		}
+		else {
+			*d++ = *p;
+		}
+	}
+
+	*d = '\0';
+
+	return buf;
+}
+
+static int
+rspamd_counters_cmp(const void *a, const void *b)
+{
+	unsigned int i1 = *(const unsigned int *) a, i2 = *(const unsigned int *) b;
+
+	return strcmp(registry->defs[i1].name, registry->defs[i2].name);
+}
+
+void rspamd_counters_write_openmetrics(rspamd_fstring_t **out)
+{
+	unsigned int i, ndefs, *order;
+	const char *prev_family = NULL;
+	gsize prev_len = 0;
+
+	if (registry == NULL) {
+		return;
+	}
+
+	ndefs = rspamd_counters_ndefs(registry);
+
+	if (ndefs == 0) {
+		return;
+	}
+
+	/* Group metrics with different labels into families */
+	order = g_new(unsigned int, ndefs);
+
+	for (i = 0; i < ndefs; i++) {
+		order[i] = i;
+	}
+
+	qsort(order, ndefs, sizeof(*order), rspamd_counters_cmp);
+
+	for (i = 0; i < ndefs; i++) {
+		const struct rspamd_counter_def *def = &registry->defs[order[i]];
+		gsize family_len = strcspn(def->name, "{");
+
+		if (prev_family == NULL || family_len != prev_len ||
+			memcmp(prev_family, def->name, family_len) != 0) {
+			char help[RSPAMD_COUNTER_HELP_MAX * 2];
+
+			rspamd_printf_fstring(out, "# HELP %*s %s\n",
+								  (int) family_len, def->name,
+								  rspamd_counter_escape_label(def->help, help, sizeof(help)));
+			rspamd_printf_fstring(out, "# TYPE %*s %s\n",
+								  (int) family_len, def->name,
+								  def->type == RSPAMD_COUNTER_COUNTER ? "counter" : "gauge");
+			prev_family = def->name;
+			prev_len = family_len;
+		}
+
+		rspamd_printf_fstring(out, "%s %L\n", def->name,
+							  rspamd_counter_get(order[i]));
+	}
+
+	g_free(order);
+}
+
+ucl_object_t *
+rspamd_counters_to_ucl(void)
+{
+	ucl_object_t *top = ucl_object_typed_new(UCL_OBJECT);
+	unsigned int i, ndefs;
+
+	if (registry == NULL) {
+		return top;
+	}
+
+	ndefs = rspamd_counters_ndefs(registry);
+
+	for (i = 0; i < ndefs; i++) {
+		ucl_object_insert_key(top, ucl_object_fromint(rspamd_counter_get(i)),
+							  registry->defs[i].name, 0, true);
+	}
+
+	return top;
+}
@@ -0,0 +1,114 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RSPAMD_COUNTERS_H
+#define RSPAMD_COUNTERS_H
+
+#include "config.h"
+#include "mem_pool.h"
+#include "fstring.h"
+#include "ucl.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Registry of counters and gauges in shared memory. Values are sharded by
+ * CPU, so updates from different workers do not contend on the same cache
+ * lines, and readers (e.g. controller) sum shards directly without asking
+ * other processes.
+ *
+ * Names follow the openmetrics conventions and can include labels, e.g.
+ * `rspamd_fuzzy_hits_total{rule="local"}`; HELP and TYPE are emitted once per
+ * metrics family.
+ */
+
+#define RSPAMD_COUNTERS_MAX 1024
+#define RSPAMD_COUNTER_NAME_MAX 128
+#define RSPAMD_COUNTER_HELP_MAX 128
+
+enum rspamd_counter_type {
+	RSPAMD_COUNTER_COUNTER = 0,
+	RSPAMD_COUNTER_GAUGE,
+};
+
+/**
+ * Allocates registry in shared memory, must be called in the main process
+ * before any workers are spawned. If this function has not been called, the
+ * registry is allocated in the process local memory on the first use.
+ * @param pool shared memory pool
+ */
+void rspamd_counters_init(rspamd_mempool_t *pool);
+
+/**
+ * Registers a new counter or returns id of the existing one with the same name
+ * @param name metric name with optional labels
+ * @param help description
+ * @param type
+ * @return counter id or -1 on error
+ */
+int rspamd_counter_register(const char *name, const char *help,
+							enum rspamd_counter_type type);
+
+/**
+ * Adds value to the counter (or gauge, negative values are allowed for gauges)
+ * @param id
+ * @param value
+ */
+void rspamd_counter_add(int id, int64_t value);
+
+/**
+ * Sets value of a gauge
+ * @param id
+ * @param value
+ */
+void rspamd_counter_set(int id, int64_t value);
+
+/**
+ * Returns the current value of counter
+ * @param id
+ * @return
+ */
+int64_t rspamd_counter_get(int id);
+
+/**
+ * Escapes label value as required by openmetrics: backslash, double quote and
+ * newline are escaped; the result is truncated to fit the buffer
+ * @param value label value
+ * @param buf output buffer
+ * @param buflen size of the output buffer
+ * @return `buf`
+ */
+const char *rspamd_counter_escape_label(const char *value, char *buf, gsize buflen);
+
+/**
+ * Appends all counters in openmetrics text format
+ * @param out
+ */
+void rspamd_counters_write_openmetrics(rspamd_fstring_t **out);
+
+/**
+ * Returns object with all counters, indexed by names
+ * @return
+ */
+ucl_object_t *rspamd_counters_to_ucl(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -24,6 +24,7 @@
 #include "contrib/librdns/rdns.h"
 #include "contrib/librdns/dns_private.h"
 #include "contrib/librdns/rdns_ev.h"
+#include "libutil/libev_helper.h"
 #include "unix-std.h"
 
 #include <unicode/uidna.h>
@@ -871,6 +872,62 @@ rspamd_dns_resolver_config_ucl(struct rspamd_config *cfg,
 	}
 }
 
+/*
+ * Resolver timers are retransmit timeouts that are almost never fired, so we
+ * keep them in the timer wheel instead of libev timers heap
+ */
+struct rspamd_dns_timer {
+	struct rspamd_ev_wheel_timer tm;
+	struct ev_loop *event_loop;
+	double after;
+};
+
+static void
+rspamd_dns_timer_cb(struct ev_loop *loop, struct rspamd_ev_wheel_timer *w)
+{
+	struct rspamd_dns_timer *timer = (struct rspamd_dns_timer *) w;
+
+	/* Timers are periodic, resolver can delete timer from its callback */
+	rspamd_ev_wheel_timer_start(loop, &timer->tm, timer->after);
+	rdns_process_timer(w->data);
+}
+
+static void *
+rspamd_dns_add_timer(void *priv_data, double after, void *user_data)
+{
+	struct rspamd_dns_timer *timer = g_malloc0(sizeof(*timer));
+
+	timer->event_loop = (struct ev_loop *) priv_data;
+	timer->after = after;
+	rspamd_ev_wheel_timer_init(&timer->tm, rspamd_dns_timer_cb, user_data);
+	ev_now_update_if_cheap(timer->event_loop);
+	rspamd_ev_wheel_timer_start(timer->event_loop, &timer->tm, after);
+
+	return timer;
+}
+
+static void
+rspamd_dns_repeat_timer(void *priv_data, void *ev_data)
+{
+	struct rspamd_dns_timer *timer = (struct rspamd_dns_timer *) ev_data;
+
+	if (timer != NULL) {
+		ev_now_update_if_cheap(timer->event_loop);
+		rspamd_ev_wheel_timer_start(timer->event_loop, &timer->tm, timer->after);
+	}
+}
+
+static void
+rspamd_dns_del_timer(void *priv_data, void *ev_data)
+{
+	struct rspamd_dns_timer *timer = (struct rspamd_dns_timer *) ev_data;
+
+	if (timer != NULL) {
+		rspamd_ev_wheel_timer_stop(timer->event_loop, &timer->tm);
+		g_free(timer);
+	}
+}
+
 struct rspamd_dns_resolver *
 rspamd_dns_resolver_init(rspamd_logger_t *logger,
 						 struct ev_loop *ev_base,
@@ -898,6 +955,9 @@ rspamd_dns_resolver_init(rspamd_logger_t *logger,
 	dns_resolver->uidna = uidna_openUTS46(UIDNA_DEFAULT, &uc_err);
 	g_assert(!U_FAILURE(uc_err));
 	rdns_bind_libev(dns_resolver->r, dns_resolver->event_loop);
+	dns_resolver->r->async->add_timer = rspamd_dns_add_timer;
+	dns_resolver->r->async->repeat_timer = rspamd_dns_repeat_timer;
+	dns_resolver->r->async->del_timer = rspamd_dns_del_timer;
 
 	if (cfg != NULL) {
 		rdns_resolver_set_log_level(dns_resolver->r, cfg->log_level);
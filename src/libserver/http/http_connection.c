@@ -26,6 +26,7 @@
 #include "keypair_private.h"
 #include "cryptobox.h"
 #include "libutil/libev_helper.h"
+#include "libutil/uring.h"
 #include "libserver/ssl_util.h"
 #include "libserver/url.h"
 
@@ -53,6 +54,8 @@ enum rspamd_http_priv_flags {
 	RSPAMD_HTTP_CONN_FLAG_PROXY = 1u << 5u,
 	RSPAMD_HTTP_CONN_FLAG_PROXY_REQUEST = 1u << 6u,
 	RSPAMD_HTTP_CONN_OWN_SOCKET = 1u << 7u,
+	RSPAMD_HTTP_CONN_FLAG_URING_READ = 1u << 8u,
+	RSPAMD_HTTP_CONN_FLAG_NO_URING = 1u << 9u,
 };
 
 #define IS_CONN_ENCRYPTED(c) ((c)->flags & RSPAMD_HTTP_CONN_FLAG_ENCRYPTED)
@@ -76,6 +79,11 @@ struct rspamd_http_connection_private {
 	enum rspamd_http_priv_flags flags;
 	gsize wr_pos;
 	gsize wr_total;
+	/* Completion based IO */
+	struct rspamd_uring_req *uring_req;
+	const unsigned char *uring_data; /* received data that is not consumed yet */
+	gssize uring_len;                /* length of data or read result if <= 0 */
+	gboolean uring_has_result;
 };
 
 static const rspamd_ftok_t key_header = {
@@ -90,6 +98,7 @@ static const rspamd_ftok_t last_modified_header = {
 
 static void rspamd_http_event_handler(int fd, short what, gpointer ud);
 static void rspamd_http_ssl_err_handler(gpointer ud, GError *err);
+static void rspamd_http_connection_stop_io(struct rspamd_http_connection *conn);
 
 
 #define HTTP_ERROR http_error_quark()
@@ -352,7 +361,7 @@ rspamd_http_on_headers_complete(http_parser *parser)
 
 	if (msg->method == HTTP_HEAD) {
 		/* We don't care about the rest */
-		rspamd_ev_watcher_stop(priv->ctx->event_loop, &priv->ev);
+		rspamd_http_connection_stop_io(conn);
 
 		msg->code = parser->status_code;
 		rspamd_http_connection_ref(conn);
@@ -535,7 +544,7 @@ rspamd_http_on_headers_complete_decrypted(http_parser *parser)
 
 	if (msg->method == HTTP_HEAD) {
 		/* We don't care about the rest */
-		rspamd_ev_watcher_stop(priv->ctx->event_loop, &priv->ev);
+		rspamd_http_connection_stop_io(conn);
 		msg->code = parser->status_code;
 		rspamd_http_connection_ref(conn);
 		ret = conn->finish_handler(conn, msg);
@@ -691,7 +700,7 @@ rspamd_http_on_message_complete(http_parser *parser)
 	}
 
 	if (ret == 0) {
-		rspamd_ev_watcher_stop(priv->ctx->event_loop, &priv->ev);
+		rspamd_http_connection_stop_io(conn);
 		rspamd_http_connection_ref(conn);
 		ret = conn->finish_handler(conn, priv->msg);
 
@@ -755,6 +764,122 @@ rspamd_http_simple_client_helper(struct rspamd_http_connection *conn)
 	}
 }
 
+static void rspamd_http_write_helper(struct rspamd_http_connection *conn);
+
+/* Completion based IO is used for plain connections only */
+static inline struct rspamd_uring *
+rspamd_http_connection_uring(struct rspamd_http_connection *conn)
+{
+	struct rspamd_http_connection_private *priv = conn->priv;
+
+	if (priv->ssl || conn->fd == -1 || (priv->flags & RSPAMD_HTTP_CONN_FLAG_NO_URING)) {
+		return NULL;
+	}
+
+	return rspamd_uring_get(priv->ctx->event_loop);
+}
+
+static void
+rspamd_http_connection_stop_io(struct rspamd_http_connection *conn)
+{
+	struct rspamd_http_connection_private *priv = conn->priv;
+
+	rspamd_ev_watcher_stop(priv->ctx->event_loop, &priv->ev);
+
+	if (priv->uring_req) {
+		rspamd_uring_cancel(rspamd_uring_get(priv->ctx->event_loop),
+							priv->uring_req);
+		priv->uring_req = NULL;
+	}
+
+	/* Unprocessed data is dropped just like data after the end of a message */
+	priv->flags &= ~RSPAMD_HTTP_CONN_FLAG_URING_READ;
+	priv->uring_has_result = FALSE;
+}
+
+static gboolean rspamd_http_uring_plan_read(struct rspamd_http_connection *conn);
+
+static void
+rspamd_http_uring_read_cb(gssize res, const unsigned char *buf, gpointer ud)
+{
+	struct rspamd_http_connection *conn = (struct rspamd_http_connection *) ud;
+	struct rspamd_http_connection_private *priv = conn->priv;
+
+	priv->uring_req = NULL;
+	priv->uring_data = buf;
+	priv->uring_len = res;
+	priv->uring_has_result = TRUE;
+	rspamd_http_connection_ref(conn);
+	/* Stop timeout */
+	rspamd_ev_watcher_stop(priv->ctx->event_loop, &priv->ev);
+
+	/* The buffer can contain more data than a single read can consume */
+	while ((priv->flags & RSPAMD_HTTP_CONN_FLAG_URING_READ) && priv->uring_has_result) {
+		rspamd_http_event_handler(conn->fd, EV_READ, conn);
+	}
+
+	priv->uring_has_result = FALSE;
+
+	if ((priv->flags & RSPAMD_HTTP_CONN_FLAG_URING_READ) && priv->uring_req == NULL) {
+		/* Want more data */
+		if (!rspamd_http_uring_plan_read(conn)) {
+			rspamd_ev_watcher_start(priv->ctx->event_loop, &priv->ev, priv->timeout);
+		}
+	}
+
+	rspamd_http_connection_unref(conn);
+}
+
+static gboolean
+rspamd_http_uring_plan_read(struct rspamd_http_connection *conn)
+{
+	struct rspamd_http_connection_private *priv = conn->priv;
+	struct rspamd_uring *ring = rspamd_http_connection_uring(conn);
+
+	if (ring == NULL) {
+		return FALSE;
+	}
+
+	if (priv->uring_req == NULL) {
+		priv->uring_req = rspamd_uring_recv(ring, conn->fd,
+											rspamd_http_uring_read_cb, conn);
+
+		if (priv->uring_req == NULL) {
+			return FALSE;
+		}
+	}
+
+	priv->flags |= RSPAMD_HTTP_CONN_FLAG_URING_READ;
+	rspamd_ev_watcher_start_timer(priv->ctx->event_loop, &priv->ev, priv->timeout);
+
+	return TRUE;
+}
+
+static void
+rspamd_http_uring_write_cb(gssize res, const unsigned char *buf, gpointer ud)
+{
+	struct rspamd_http_connection *conn = (struct rspamd_http_connection *) ud;
+	struct rspamd_http_connection_private *priv = conn->priv;
+	GError *err;
+
+	priv->uring_req = NULL;
+	rspamd_http_connection_ref(conn);
+
+	if (res < 0) {
+		rspamd_ev_watcher_stop(priv->ctx->event_loop, &priv->ev);
+		err = g_error_new(HTTP_ERROR, 500, "IO write error: %s", strerror(-res));
+		conn->error_handler(conn, err);
+		g_error_free(err);
+	}
+	else {
+		priv->wr_pos += res;
+		/* Either finishes writing or plans the next part */
+		rspamd_http_write_helper(conn);
+	}
+
+	rspamd_http_connection_unref(conn);
+}
+
 static void
 rspamd_http_write_helper(struct rspamd_http_connection *conn)
 {
@@ -814,6 +939,26 @@ rspamd_http_write_helper(struct rspamd_http_connection *conn)
 		g_free(cur_iov);
 	}
 	else {
+		struct rspamd_uring *ring = rspamd_http_connection_uring(conn);
+
+		if (ring) {
+			/* Data is owned by the message, iovec is copied */
+			priv->uring_req = rspamd_uring_sendmsg(ring, conn->fd,
+												   msg.msg_iov, msg.msg_iovlen,
+												   NULL, 0, RSPAMD_URING_DEFAULT,
+												   rspamd_http_uring_write_cb, conn);
+
+			if (priv->uring_req) {
+				priv->flags &= ~RSPAMD_HTTP_CONN_FLAG_RESETED;
+
+				return;
+			}
+
+			/* Cannot queue a request, switch to readiness based IO */
+			priv->flags |= RSPAMD_HTTP_CONN_FLAG_NO_URING;
+			rspamd_ev_watcher_reschedule(priv->ctx->event_loop, &priv->ev, EV_WRITE);
+		}
+
 		r = sendmsg(conn->fd, &msg, flags);
 	}
 
@@ -849,7 +994,7 @@ rspamd_http_write_helper(struct rspamd_http_connection *conn)
 	return;
 
 call_finish_handler:
-	rspamd_ev_watcher_stop(priv->ctx->event_loop, &priv->ev);
+	rspamd_http_connection_stop_io(conn);
 
 	if ((conn->opts & RSPAMD_HTTP_CLIENT_SIMPLE) == 0) {
 		rspamd_http_connection_ref(conn);
@@ -896,6 +1041,25 @@ rspamd_http_try_read(int fd,
 	if (priv->ssl) {
 		r = rspamd_ssl_read(priv->ssl, data, len);
 	}
+	else if (priv->uring_has_result) {
+		/* Data has been already received by io_uring */
+		r = priv->uring_len;
+
+		if (r > 0) {
+			r = MIN(r, len);
+			memcpy(data, priv->uring_data, r);
+			priv->uring_data += r;
+			priv->uring_len -= r;
+		}
+		else if (r < 0) {
+			errno = -r;
+			r = -1;
+		}
+
+		if (priv->uring_len <= 0) {
+			priv->uring_has_result = FALSE;
+		}
+	}
 	else {
 		r = read(fd, data, len);
 	}
@@ -1031,6 +1195,13 @@ rspamd_http_event_handler(int fd, short what, gpointer ud)
 	}
 	else if (what == EV_TIMEOUT) {
 		if (!priv->ssl) {
+			if (priv->uring_req) {
+				/* Pending recv must not race with the synchronous read below */
+				rspamd_uring_cancel(rspamd_uring_get(priv->ctx->event_loop),
+									priv->uring_req);
+				priv->uring_req = NULL;
+			}
+
 			/* Let's try to read from the socket first */
 			r = rspamd_http_try_read(fd, conn, priv, pbuf, &d);
 
@@ -1056,6 +1227,20 @@ rspamd_http_event_handler(int fd, short what, gpointer ud)
 
 					return;
 				}
+
+				/* Timer is one shot, so restart it if we still wait for data */
+				if (!conn->finished && !rspamd_ev_wheel_timer_is_active(&priv->ev.tm)) {
+					if (priv->flags & RSPAMD_HTTP_CONN_FLAG_URING_READ) {
+						if (!rspamd_http_uring_plan_read(conn)) {
+							rspamd_ev_watcher_start(priv->ctx->event_loop, &priv->ev,
+													priv->timeout);
+						}
+					}
+					else if (ev_is_active(&priv->ev.io)) {
+						rspamd_ev_watcher_start_timer(priv->ctx->event_loop, &priv->ev,
+													  priv->timeout);
+					}
+				}
 			}
 			else {
 				err = g_error_new(HTTP_ERROR, 408,
@@ -1291,7 +1476,7 @@ void rspamd_http_connection_reset(struct rspamd_http_connection *conn)
 
 	conn->finished = FALSE;
 	/* Clear priv */
-	rspamd_ev_watcher_stop(priv->ctx->event_loop, &priv->ev);
+	rspamd_http_connection_stop_io(conn);
 
 	if (!(priv->flags & RSPAMD_HTTP_CONN_FLAG_RESETED)) {
 		rspamd_http_parser_reset(conn);
@@ -1529,7 +1714,10 @@ rspamd_http_connection_read_message_common(struct rspamd_http_connection *conn,
 	if (!priv->ssl) {
 		rspamd_ev_watcher_init(&priv->ev, conn->fd, EV_READ,
 							   rspamd_http_event_handler, conn);
-		rspamd_ev_watcher_start(priv->ctx->event_loop, &priv->ev, priv->timeout);
+
+		if (!rspamd_http_uring_plan_read(conn)) {
+			rspamd_ev_watcher_start(priv->ctx->event_loop, &priv->ev, priv->timeout);
+		}
 	}
 	else {
 		rspamd_ssl_connection_restore_handlers(priv->ssl,
@@ -2359,7 +2547,7 @@ if ((priv->flags & RSPAMD_HTTP_CONN_FLAG_PROXY) && (conn->opts & RSPAMD_HTTP_CLI
 	return FALSE;
 }
 
-rspamd_ev_watcher_stop(priv->ctx->event_loop, &priv->ev);
+rspamd_http_connection_stop_io(conn);
 
 if (conn->opts & RSPAMD_HTTP_CLIENT_SSL) {
 	gpointer ssl_ctx = (msg->flags & RSPAMD_HTTP_FLAG_SSL_NOVERIFY) ? priv->ctx->ssl_ctx_noverify : priv->ctx->ssl_ctx;
@@ -2408,7 +2596,15 @@ if (conn->opts & RSPAMD_HTTP_CLIENT_SSL) {
 else {
 	rspamd_ev_watcher_init(&priv->ev, conn->fd, EV_WRITE,
 						   rspamd_http_event_handler, conn);
-	rspamd_ev_watcher_start(priv->ctx->event_loop, &priv->ev, priv->timeout);
+
+	if (rspamd_http_connection_uring(conn)) {
+		/* Write is planned immediately, the kernel waits for the socket to be writable */
+		rspamd_ev_watcher_start_timer(priv->ctx->event_loop, &priv->ev, priv->timeout);
+		rspamd_http_write_helper(conn);
+	}
+	else {
+		rspamd_ev_watcher_start(priv->ctx->event_loop, &priv->ev, priv->timeout);
+	}
 }
 
 return TRUE;
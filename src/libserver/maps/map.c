@@ -20,6 +20,7 @@
 #include "config.h"
 #include "map.h"
 #include "map_private.h"
+#include "map_helpers.h"
 #include "libserver/http/http_connection.h"
 #include "libserver/http/http_private.h"
 #include "rspamd.h"
@@ -112,6 +113,12 @@ write_http_request(struct http_callback_data *cbd)
 											   cbd->data->etag->str, cbd->data->etag->len);
 		}
 	}
+	else if (cbd->delta) {
+		/* RFC 3229: ask for the changes since the version we have */
+		rspamd_http_message_add_header(msg, "A-IM", RSPAMD_MAP_DELTA_IM);
+		rspamd_http_message_add_header_len(msg, "If-None-Match",
+										   cbd->data->etag->str, cbd->data->etag->len);
+	}
 
 	msg->url = rspamd_fstring_append(msg->url, cbd->data->rest,
 									 strlen(cbd->data->rest));
@@ -229,6 +236,25 @@ http_map_error(struct rspamd_http_connection *conn,
 	MAP_RELEASE(cbd, "http_callback_data");
 }
 
+static void
+rspamd_map_cached_cbdata_free(struct ev_loop *loop,
+							  struct rspamd_http_map_cached_cbdata *cache_cbd)
+{
+	struct rspamd_storage_shmem *delta_shm;
+	unsigned int i;
+
+	MAP_RELEASE(cache_cbd->shm, "rspamd_http_map_cached_cbdata");
+
+	PTR_ARRAY_FOREACH(cache_cbd->deltas, i, delta_shm)
+	{
+		rspamd_http_message_shmem_unref(delta_shm);
+	}
+
+	g_ptr_array_free(cache_cbd->deltas, TRUE);
+	ev_timer_stop(loop, &cache_cbd->timeout);
+	g_free(cache_cbd);
+}
+
 static void
 rspamd_map_cache_cb(struct ev_loop *loop, ev_timer *w, int revents)
 {
@@ -249,9 +275,7 @@ rspamd_map_cache_cb(struct ev_loop *loop, ev_timer *w, int revents)
 		msg_info_map("cached data is now expired (gen mismatch %L != %L) for %s; shm name=%s; refcount=%d",
 					 cache_cbd->gen, cache_cbd->data->gen, map->name, cache_cbd->shm->shm_name,
 					 cache_cbd->shm->ref.refcount);
-		MAP_RELEASE(cache_cbd->shm, "rspamd_http_map_cached_cbdata");
-		ev_timer_stop(loop, &cache_cbd->timeout);
-		g_free(cache_cbd);
+		rspamd_map_cached_cbdata_free(loop, cache_cbd);
 	}
 	else if (cache_cbd->data->last_checked >= cache_cbd->last_checked) {
 		/*
@@ -289,10 +313,151 @@ rspamd_map_cache_cb(struct ev_loop *loop, ev_timer *w, int revents)
 					 map->name,
 					 cache_cbd->shm->shm_name,
 					 cache_cbd->shm->ref.refcount);
-		MAP_RELEASE(cache_cbd->shm, "rspamd_http_map_cached_cbdata");
-		ev_timer_stop(loop, &cache_cbd->timeout);
-		g_free(cache_cbd);
+		rspamd_map_cached_cbdata_free(loop, cache_cbd);
+	}
+}
+
+/*
+ * Applies delta received in `226 IM Used` reply (RFC 3229) to the current map
+ * data and publishes it in the shared cache for other processes. If it returns
+ * FALSE, the map data has not been modified and the whole map should be loaded.
+ */
+static gboolean
+http_map_process_delta(struct http_callback_data *cbd,
+					   struct rspamd_http_message *msg)
+{
+	struct rspamd_map *map = cbd->map;
+	struct http_map_data *data = cbd->data;
+	struct map_periodic_cbdata *periodic = cbd->periodic;
+	struct rspamd_map_cachepoint *cache = data->cache;
+	struct rspamd_map_cachepoint_delta *cached_delta;
+	struct rspamd_storage_shmem *delta_shm = NULL;
+	const rspamd_ftok_t *im_hdr, *base_hdr, *expires_hdr, *etag_hdr;
+	unsigned char *in;
+	gsize dlen = 0, mmap_len = 0;
+
+	im_hdr = rspamd_http_message_find_header(msg, "IM");
+	base_hdr = rspamd_http_message_find_header(msg, "Delta-Base");
+
+	if (im_hdr == NULL ||
+		rspamd_substring_search(im_hdr->begin, im_hdr->len,
+								RSPAMD_MAP_DELTA_IM,
+								sizeof(RSPAMD_MAP_DELTA_IM) - 1) == -1) {
+		msg_info_map("%s: unknown instance manipulation in delta reply, "
+					 "reload the whole map",
+					 cbd->bk->uri);
+
+		return FALSE;
+	}
+
+	if (data->cur_cache_cbd == NULL || cache->ndeltas >= RSPAMD_MAP_MAX_DELTAS) {
+		/* Cached data has expired meanwhile, so deltas cannot be shared */
+		return FALSE;
+	}
+
+	if (base_hdr && (data->etag == NULL || base_hdr->len != data->etag->len ||
+					 memcmp(base_hdr->begin, data->etag->str, base_hdr->len) != 0)) {
+		msg_info_map("%s: delta is based on %T which we do not have, "
+					 "reload the whole map",
+					 cbd->bk->uri, base_hdr);
+
+		return FALSE;
+	}
+
+	periodic->cbdata.cur_data = periodic->cbdata.prev_data;
+
+	if (msg->body_buf.len > 0) {
+		delta_shm = rspamd_http_message_shmem_ref(msg);
+
+		if (delta_shm == NULL) {
+			periodic->cbdata.cur_data = NULL;
+
+			return FALSE;
+		}
+
+		in = rspamd_shmem_xmap(delta_shm->shm_name, PROT_READ, &mmap_len);
+
+		if (in == NULL) {
+			msg_err_map("cannot read tempfile %s: %s",
+						delta_shm->shm_name,
+						strerror(errno));
+			rspamd_http_message_shmem_unref(delta_shm);
+			periodic->cbdata.cur_data = NULL;
+
+			return FALSE;
+		}
+
+		/* Shared memory is used as a growing buffer, so it can be larger */
+		dlen = MIN(msg->body_buf.len, mmap_len);
+
+		if (!map->delta_callback((char *) in, dlen, &periodic->cbdata)) {
+			munmap(in, mmap_len);
+			rspamd_http_message_shmem_unref(delta_shm);
+			periodic->cbdata.cur_data = NULL;
+
+			return FALSE;
+		}
+
+		munmap(in, mmap_len);
+	}
+
+	data->last_checked = msg->date;
+
+	if (msg->last_modified) {
+		data->last_modified = msg->last_modified;
+	}
+	else {
+		data->last_modified = msg->date;
+	}
+
+	expires_hdr = rspamd_http_message_find_header(msg, "Expires");
+
+	if (expires_hdr) {
+		time_t hdate;
+
+		hdate = rspamd_http_parse_date(expires_hdr->begin, expires_hdr->len);
+		if (hdate != (time_t) -1 && hdate > msg->date) {
+			map->next_check = hdate;
+		}
+		else {
+			msg_info_map("invalid expires header: %T, ignore it", expires_hdr);
+			map->next_check = 0;
+		}
+	}
+
+	etag_hdr = rspamd_http_message_find_header(msg, "ETag");
+
+	if (data->etag) {
+		rspamd_fstring_free(data->etag);
+		data->etag = NULL;
 	}
+
+	if (etag_hdr) {
+		data->etag = rspamd_fstring_new_init(etag_hdr->begin, etag_hdr->len);
+	}
+
+	if (delta_shm) {
+		/* Cache keeps the delta until the full data is replaced */
+		cached_delta = &cache->deltas[cache->ndeltas];
+		rspamd_strlcpy(cached_delta->shmem_name, delta_shm->shm_name,
+					   sizeof(cached_delta->shmem_name));
+		cached_delta->len = dlen;
+		cached_delta->version = cache->version + 1;
+		g_ptr_array_add(data->cur_cache_cbd->deltas, delta_shm);
+		cache->ndeltas++;
+		cache->last_modified = data->last_modified;
+		cache->version++;
+		data->cache_version = cache->version;
+		data->ndeltas++;
+	}
+
+	msg_info_map("%s(%s): applied map delta of %z bytes (%ud deltas since "
+				 "the last full load)",
+				 cbd->bk->uri,
+				 rspamd_inet_address_to_string_pretty(cbd->addr),
+				 dlen, data->ndeltas);
+
+	return TRUE;
 }
 
 static int
@@ -330,6 +495,11 @@ http_map_finish(struct rspamd_http_connection *conn,
 			return 0;
 		}
 
+		if (cbd->delta) {
+			/* Server does not support deltas and has sent the whole map */
+			cbd->periodic->need_modify = TRUE;
+		}
+
 		cbd->data->last_checked = msg->date;
 
 		if (msg->last_modified) {
@@ -413,8 +583,15 @@ http_map_finish(struct rspamd_http_connection *conn,
 					   sizeof(data->cache->shmem_name));
 		data->cache->len = cbd->data_len;
 		data->cache->last_modified = cbd->data->last_modified;
+		/* Full data invalidates all deltas */
+		data->cache->ndeltas = 0;
+		data->cache->version++;
+		data->cache->full_version = data->cache->version;
+		data->cache_version = data->cache->version;
+		data->ndeltas = 0;
 		cache_cbd = g_malloc0(sizeof(*cache_cbd));
 		cache_cbd->shm = cbd->shmem_data;
+		cache_cbd->deltas = g_ptr_array_new();
 		cache_cbd->event_loop = cbd->event_loop;
 		cache_cbd->map = map;
 		cache_cbd->data = cbd->data;
@@ -511,7 +688,26 @@ http_map_finish(struct rspamd_http_connection *conn,
 		munmap(in, dlen);
 		rspamd_map_process_periodic(cbd->periodic);
 	}
-	else if (msg->code == 304 && cbd->check) {
+	else if (msg->code == 226 && cbd->delta) {
+		cbd->periodic->need_modify = TRUE;
+
+		if (http_map_process_delta(cbd, msg)) {
+			cbd->periodic->cur_backend++;
+		}
+		else {
+			/* Drop etag and cache to request the whole map */
+			if (cbd->data->etag) {
+				rspamd_fstring_free(cbd->data->etag);
+				cbd->data->etag = NULL;
+			}
+
+			g_atomic_int_set(&data->cache->available, 0);
+			data->cur_cache_cbd = NULL;
+		}
+
+		rspamd_map_process_periodic(cbd->periodic);
+	}
+	else if (msg->code == 304 && (cbd->check || cbd->delta)) {
 		cbd->data->last_checked = msg->date;
 
 		if (msg->last_modified) {
@@ -1009,6 +1205,8 @@ rspamd_map_periodic_dtor(struct map_periodic_cbdata *periodic)
 		/* Not modified */
 	}
 
+	map->checked = true;
+
 	if (periodic->locked) {
 		g_atomic_int_set(periodic->map->locked, 0);
 		msg_debug_map("unlocked map %s", periodic->map->name);
@@ -1084,7 +1282,9 @@ rspamd_map_schedule_periodic(struct rspamd_map *map, int how)
 				reason = "early active non-trivial check";
 			}
 
-			jittered_sec = MIN(timeout, poll_timeout);
+			/* Spread checks of maps that expire at the same time */
+			jittered_sec = rspamd_time_jitter(MIN(timeout, poll_timeout),
+											  min_timer_interval);
 		}
 		else if (timeout <= 0) {
 			/* Data is already expired, need to check */
@@ -1094,13 +1294,13 @@ rspamd_map_schedule_periodic(struct rspamd_map *map, int how)
 				reason = "expired non-trivial data (after error)";
 			}
 			else {
-				jittered_sec = 0.0;
+				jittered_sec = rspamd_time_jitter(0.0, min_timer_interval);
 				reason = "expired non-trivial data";
 			}
 		}
 		else {
 			/* No need to check now, wait till next_check */
-			jittered_sec = timeout;
+			jittered_sec = rspamd_time_jitter(timeout, min_timer_interval);
 			reason = "valid non-trivial data";
 		}
 	}
@@ -1326,6 +1526,56 @@ rspamd_map_dns_callback(struct rdns_reply *reply, void *arg)
 	MAP_RELEASE(cbd, "http_callback_data");
 }
 
+/*
+ * Applies deltas stored in the shared cache starting from `start` up to `end`
+ */
+static gboolean
+rspamd_map_apply_cached_deltas(struct rspamd_map *map,
+							   struct rspamd_map_backend *bk,
+							   struct map_periodic_cbdata *periodic,
+							   unsigned int start, unsigned int end)
+{
+	struct rspamd_map_cachepoint_delta *delta;
+	struct http_map_data *data = bk->data.hd;
+	gsize mmap_len;
+	gpointer in;
+	unsigned int i;
+
+	for (i = start; i < end; i++) {
+		delta = &data->cache->deltas[i];
+		in = rspamd_shmem_xmap(delta->shmem_name, PROT_READ, &mmap_len);
+
+		if (in == NULL) {
+			msg_err_map("cannot map cached delta from %s: %s", delta->shmem_name,
+						strerror(errno));
+			return FALSE;
+		}
+
+		if (mmap_len < delta->len) {
+			msg_err_map("cannot map cached delta from %s: truncated length %z, %z expected",
+						delta->shmem_name,
+						mmap_len, delta->len);
+			munmap(in, mmap_len);
+
+			return FALSE;
+		}
+
+		if (!map->delta_callback(in, delta->len, &periodic->cbdata)) {
+			munmap(in, mmap_len);
+
+			return FALSE;
+		}
+
+		munmap(in, mmap_len);
+	}
+
+	if (end > start) {
+		msg_info_map("%s: applied %ud cached deltas", bk->uri, end - start);
+	}
+
+	return TRUE;
+}
+
 static gboolean
 rspamd_map_read_cached(struct rspamd_map *map, struct rspamd_map_backend *bk,
 					   struct map_periodic_cbdata *periodic, const char *host)
@@ -1333,9 +1583,45 @@ rspamd_map_read_cached(struct rspamd_map *map, struct rspamd_map_backend *bk,
 	gsize mmap_len, len;
 	gpointer in;
 	struct http_map_data *data;
+	unsigned int i, start = G_MAXUINT, ndeltas = 0;
+	uint64_t version;
 
 	data = bk->data.hd;
 
+	if (map->delta_callback) {
+		ndeltas = data->cache->ndeltas;
+	}
+
+	version = ndeltas > 0 ? data->cache->deltas[ndeltas - 1].version : data->cache->full_version;
+
+	if (ndeltas > 0 && data->cache_version != 0 && periodic->cbdata.prev_data) {
+		/* Our data might be just a few deltas behind the cache */
+		if (data->cache_version == data->cache->full_version) {
+			start = 0;
+		}
+		else {
+			for (i = 0; i < ndeltas; i++) {
+				if (data->cache->deltas[i].version == data->cache_version) {
+					start = i + 1;
+					break;
+				}
+			}
+		}
+
+		if (start != G_MAXUINT) {
+			periodic->cbdata.cur_data = periodic->cbdata.prev_data;
+
+			if (rspamd_map_apply_cached_deltas(map, bk, periodic, start, ndeltas)) {
+				data->cache_version = version;
+
+				return TRUE;
+			}
+
+			/* Load everything from scratch */
+			periodic->cbdata.cur_data = NULL;
+		}
+	}
+
 	in = rspamd_shmem_xmap(data->cache->shmem_name, PROT_READ, &mmap_len);
 
 	if (in == NULL) {
@@ -1422,6 +1708,15 @@ rspamd_map_read_cached(struct rspamd_map *map, struct rspamd_map_backend *bk,
 
 	munmap(in, mmap_len);
 
+	if (!rspamd_map_apply_cached_deltas(map, bk, periodic, 0, ndeltas)) {
+		/* New data is incomplete, so it is cleaned up by the fin callback */
+		periodic->errored = TRUE;
+
+		return TRUE;
+	}
+
+	data->cache_version = version;
+
 	return TRUE;
 }
 
@@ -1549,6 +1844,11 @@ rspamd_map_update_http_cached_file(struct rspamd_map *map,
 		return FALSE;
 	}
 
+	if (htdata->ndeltas > 0) {
+		/* Cached file has the data without deltas, so it must keep the old etag */
+		return FALSE;
+	}
+
 	rspamd_cryptobox_hash(digest, bk->uri, strlen(bk->uri), NULL, 0);
 	rspamd_snprintf(path, sizeof(path), "%s%c%*xs.map", cfg->maps_cache_dir,
 					G_DIR_SEPARATOR, 20, digest);
@@ -1726,6 +2026,29 @@ rspamd_map_read_http_cached_file(struct rspamd_map *map,
 	return TRUE;
 }
 
+/*
+ * Changes can be requested directly instead of checking if the map has a single
+ * plain backend, its data can be modified in place (e.g. it is not a compact
+ * hash) and our data is the latest one published in the shared cache
+ */
+static gboolean
+rspamd_map_http_can_request_delta(struct rspamd_map *map,
+								  struct rspamd_map_backend *bk,
+								  struct map_periodic_cbdata *periodic)
+{
+	struct http_map_data *data = bk->data.hd;
+
+	return map->delta_callback != NULL && !map->no_delta &&
+		   map->backends->len == 1 &&
+		   !bk->is_compressed && !bk->is_signed &&
+		   data->etag != NULL &&
+		   periodic->cbdata.prev_data != NULL &&
+		   data->cur_cache_cbd != NULL &&
+		   g_atomic_int_get(&data->cache->available) == 1 &&
+		   data->cache_version == data->cache->version &&
+		   data->cache->ndeltas < RSPAMD_MAP_MAX_DELTAS;
+}
+
 /**
  * Async HTTP callback
  */
@@ -1744,7 +2067,9 @@ rspamd_map_common_http_callback(struct rspamd_map *map,
 	if (g_atomic_int_get(&data->cache->available) == 1) {
 		/* Read cached data */
 		if (check) {
-			if (data->last_modified < data->cache->last_modified) {
+			if (data->last_modified < data->cache->last_modified ||
+				(data->cache_version != 0 &&
+				 data->cache_version < data->cache->version)) {
 				msg_info_map("need to reread cached map triggered by %s "
 							 "(%d our modify time, %d cached modify time)",
 							 bk->uri,
@@ -1795,6 +2120,12 @@ rspamd_map_common_http_callback(struct rspamd_map *map,
 check:
 	cbd = g_malloc0(sizeof(struct http_callback_data));
 
+	if (check && rspamd_map_http_can_request_delta(map, bk, periodic)) {
+		/* Ask for changes since our version instead of checking */
+		check = FALSE;
+		cbd->delta = TRUE;
+	}
+
 	cbd->event_loop = map->event_loop;
 	cbd->addrs = g_ptr_array_sized_new(4);
 	cbd->map = map;
@@ -1807,7 +2138,8 @@ check:
 	cbd->stage = http_map_terminated;
 	REF_INIT_RETAIN(cbd, free_http_cbdata);
 
-	msg_debug_map("%s map data from %s", check ? "checking" : "reading",
+	msg_debug_map("%s map data from %s",
+				  check ? "checking" : (cbd->delta ? "reading delta of" : "reading"),
 				  data->host);
 
 	/* Try address */
@@ -2321,6 +2653,7 @@ void rspamd_map_preload(struct rspamd_config *cfg)
 				}
 
 				map->seen = true;
+				map->checked = true;
 			}
 			else {
 				msg_info_map("preload of %s failed", map->name);
@@ -2331,6 +2664,24 @@ void rspamd_map_preload(struct rspamd_config *cfg)
 	}
 }
 
+unsigned int rspamd_map_pending_count(struct rspamd_config *cfg)
+{
+	struct rspamd_map *map;
+	GList *cur;
+	unsigned int pending = 0;
+
+	for (cur = cfg->maps; cur != NULL; cur = g_list_next(cur)) {
+		map = cur->data;
+
+		/* Maps that are not watched by this process are not counted */
+		if (map->seen && !map->checked) {
+			pending++;
+		}
+	}
+
+	return pending;
+}
+
 void rspamd_map_remove_all(struct rspamd_config *cfg)
 {
 	struct rspamd_map *map;
@@ -2839,6 +3190,20 @@ rspamd_map_add_static_string(struct rspamd_config *cfg,
 	return TRUE;
 }
 
+/* Only simple lists can be patched in place */
+static map_delta_cb_t
+rspamd_map_get_delta_callback(map_cb_t read_callback)
+{
+	if (read_callback == rspamd_kv_list_read) {
+		return rspamd_kv_list_delta;
+	}
+	else if (read_callback == rspamd_radix_read) {
+		return rspamd_radix_delta;
+	}
+
+	return NULL;
+}
+
 struct rspamd_map *
 rspamd_map_add(struct rspamd_config *cfg,
 			   const char *map_line,
@@ -2867,6 +3232,7 @@ rspamd_map_add(struct rspamd_config *cfg,
 
 	map = rspamd_mempool_alloc0(cfg->cfg_pool, sizeof(struct rspamd_map));
 	map->read_callback = read_callback;
+	map->delta_callback = rspamd_map_get_delta_callback(read_callback);
 	map->fin_callback = fin_callback;
 	map->dtor = dtor;
 	map->user_data = user_data;
@@ -2967,6 +3333,7 @@ rspamd_map_add_from_ucl(struct rspamd_config *cfg,
 
 	map = rspamd_mempool_alloc0(cfg->cfg_pool, sizeof(struct rspamd_map));
 	map->read_callback = read_callback;
+	map->delta_callback = rspamd_map_get_delta_callback(read_callback);
 	map->fin_callback = fin_callback;
 	map->dtor = dtor;
 	map->user_data = user_data;
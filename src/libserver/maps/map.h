@@ -37,6 +37,14 @@ typedef void (*map_fin_cb_t)(struct map_cb_data *data, void **target);
 
 typedef void (*map_dtor_t)(struct map_cb_data *data);
 
+/*
+ * Applies a patch to the current map data in place, used for delta updates
+ * of HTTP maps. Must return FALSE without modifying anything if the patch is
+ * malformed.
+ */
+typedef gboolean (*map_delta_cb_t)(char *chunk, int len,
+								   struct map_cb_data *data);
+
 typedef gboolean (*rspamd_map_traverse_cb)(gconstpointer key,
 										   gconstpointer value, gsize hits, gpointer ud);
 
@@ -129,6 +137,13 @@ void rspamd_map_watch(struct rspamd_config *cfg,
  */
 void rspamd_map_preload(struct rspamd_config *cfg);
 
+/**
+ * Returns number of maps watched by this process that have not finished
+ * their first check yet
+ * @param cfg
+ */
+unsigned int rspamd_map_pending_count(struct rspamd_config *cfg);
+
 /**
  * Remove all maps watched (remove events)
  */
@@ -57,11 +57,42 @@ struct rspamd_radix_map_helper {
 	radix_compressed_t *trie;
 	struct rspamd_map *map;
 	rspamd_cryptobox_fast_hash_state_t hst;
+	gboolean rebuild_trie; /* Delta cannot be applied to the trie in place */
+};
+
+/* Hash maps with more elements are converted to the compact representation */
+#define RSPAMD_MAP_COMPACT_MIN_ELTS 65536
+/* Number of keys in a front coded block */
+#define RSPAMD_MAP_COMPACT_BLOCK 16
+/* Maps with longer keys are left as is */
+#define RSPAMD_MAP_COMPACT_MAX_KEY 1024
+
+/*
+ * Immutable representation of large hash maps. Keys are sorted case
+ * insensitively, as they are matched, and front coded in blocks: each key
+ * stores only the suffix that differs from the previous key, and the first key
+ * of a block is stored in full to find the block by binary search. Keys keep
+ * their original case, so traverse returns them as they were loaded. Values
+ * are deduplicated, as most lists have the same value for all keys. Each entry
+ * is encoded as:
+ * <varint shared prefix len><varint suffix len><suffix><varint value idx>
+ */
+struct rspamd_map_compact_hash {
+	unsigned char *keys;
+	uint32_t *blocks; /* Offsets of blocks in keys */
+	uint32_t *values; /* Offsets of values in values_buf */
+	char *values_buf;
+	uint32_t *hits;
+	unsigned int nkeys;
+	unsigned int nblocks;
+	gsize keys_len;
+	gsize values_len;
 };
 
 struct rspamd_hash_map_helper {
 	rspamd_mempool_t *pool;
 	khash_t(rspamd_map_hash) * htb;
+	struct rspamd_map_compact_hash *compact; /* If not NULL, then htb is NULL */
 	struct rspamd_map *map;
 	rspamd_cryptobox_fast_hash_state_t hst;
 };
@@ -739,6 +770,322 @@ rspamd_map_helper_traverse_regexp(void *data,
 	});
 }
 
+static inline void
+rspamd_map_compact_write_varint(GByteArray *out, gsize v)
+{
+	unsigned char c;
+
+	while (v >= 0x80) {
+		c = (v & 0x7f) | 0x80;
+		g_byte_array_append(out, &c, 1);
+		v >>= 7;
+	}
+
+	c = v;
+	g_byte_array_append(out, &c, 1);
+}
+
+static inline gsize
+rspamd_map_compact_read_varint(const unsigned char **pp)
+{
+	const unsigned char *p = *pp;
+	gsize v = 0;
+	unsigned int shift = 0;
+
+	while (*p & 0x80) {
+		v |= ((gsize) (*p & 0x7f)) << shift;
+		shift += 7;
+		p++;
+	}
+
+	v |= ((gsize) *p) << shift;
+	*pp = p + 1;
+
+	return v;
+}
+
+static inline int
+rspamd_map_compact_keycmp(const char *k1, gsize l1, const char *k2, gsize l2)
+{
+	gsize i, len = MIN(l1, l2);
+
+	for (i = 0; i < len; i++) {
+		unsigned char c1 = lc_map[(unsigned char) k1[i]],
+					  c2 = lc_map[(unsigned char) k2[i]];
+
+		if (c1 != c2) {
+			return c1 < c2 ? -1 : 1;
+		}
+	}
+
+	return (l1 > l2) - (l1 < l2);
+}
+
+struct rspamd_map_compact_elt {
+	const char *key;
+	gsize len;
+	struct rspamd_map_helper_value *val;
+};
+
+static int
+rspamd_map_compact_elt_cmp(const void *a, const void *b)
+{
+	const struct rspamd_map_compact_elt *e1 = a, *e2 = b;
+
+	return rspamd_map_compact_keycmp(e1->key, e1->len, e2->key, e2->len);
+}
+
+static void
+rspamd_map_compact_destroy(struct rspamd_map_compact_hash *c)
+{
+	if (c) {
+		g_free(c->keys);
+		g_free(c->blocks);
+		g_free(c->values);
+		g_free(c->values_buf);
+		g_free(c->hits);
+		g_free(c);
+	}
+}
+
+static struct rspamd_map_compact_hash *
+rspamd_map_compact_build(khash_t(rspamd_map_hash) * htb)
+{
+	struct rspamd_map_compact_hash *c;
+	struct rspamd_map_compact_elt *elts;
+	struct rspamd_map_helper_value *val;
+	rspamd_ftok_t tok;
+	GByteArray *keys;
+	GString *values_buf;
+	GArray *values;
+	GHashTable *values_idx;
+	gsize total_len = 0, shared, vidx;
+	unsigned int i, n = kh_size(htb);
+	gboolean too_long = FALSE;
+
+	kh_foreach(htb, tok, val, {
+		if (tok.len > RSPAMD_MAP_COMPACT_MAX_KEY) {
+			too_long = TRUE;
+		}
+
+		total_len += tok.len;
+	});
+
+	if (too_long || n == 0) {
+		return NULL;
+	}
+
+	elts = g_new(struct rspamd_map_compact_elt, n);
+	i = 0;
+
+	kh_foreach(htb, tok, val, {
+		elts[i].key = tok.begin;
+		elts[i].len = tok.len;
+		elts[i].val = val;
+		i++;
+	});
+
+	qsort(elts, n, sizeof(*elts), rspamd_map_compact_elt_cmp);
+
+	c = g_malloc0(sizeof(*c));
+	c->nkeys = n;
+	c->nblocks = (n + RSPAMD_MAP_COMPACT_BLOCK - 1) / RSPAMD_MAP_COMPACT_BLOCK;
+	c->blocks = g_new(uint32_t, c->nblocks);
+	c->hits = g_new(uint32_t, n);
+	keys = g_byte_array_sized_new(total_len / 2 + n * 3);
+	values_buf = g_string_new(NULL);
+	values = g_array_new(FALSE, FALSE, sizeof(uint32_t));
+	values_idx = g_hash_table_new(g_str_hash, g_str_equal);
+
+	for (i = 0; i < n; i++) {
+		gpointer found = g_hash_table_lookup(values_idx, elts[i].val->value);
+
+		if (found == NULL) {
+			uint32_t voff = values_buf->len;
+
+			vidx = values->len;
+			g_array_append_val(values, voff);
+			g_string_append_len(values_buf, elts[i].val->value,
+								strlen(elts[i].val->value) + 1);
+			g_hash_table_insert(values_idx, (gpointer) elts[i].val->value,
+								GSIZE_TO_POINTER(vidx + 1));
+		}
+		else {
+			vidx = GPOINTER_TO_SIZE(found) - 1;
+		}
+
+		if (i % RSPAMD_MAP_COMPACT_BLOCK == 0) {
+			c->blocks[i / RSPAMD_MAP_COMPACT_BLOCK] = keys->len;
+			shared = 0;
+		}
+		else {
+			gsize maxlen = MIN(elts[i].len, elts[i - 1].len);
+
+			for (shared = 0; shared < maxlen; shared++) {
+				if (elts[i].key[shared] != elts[i - 1].key[shared]) {
+					break;
+				}
+			}
+		}
+
+		rspamd_map_compact_write_varint(keys, shared);
+		rspamd_map_compact_write_varint(keys, elts[i].len - shared);
+		g_byte_array_append(keys, (const guint8 *) elts[i].key + shared,
+							elts[i].len - shared);
+		rspamd_map_compact_write_varint(keys, vidx);
+		c->hits[i] = MIN(elts[i].val->hits, G_MAXUINT32);
+	}
+
+	g_hash_table_unref(values_idx);
+	g_free(elts);
+
+	if (keys->len > G_MAXUINT32 || values_buf->len > G_MAXUINT32) {
+		/* Offsets do not fit */
+		g_byte_array_free(keys, TRUE);
+		g_string_free(values_buf, TRUE);
+		g_array_free(values, TRUE);
+		rspamd_map_compact_destroy(c);
+
+		return NULL;
+	}
+
+	c->keys_len = keys->len;
+	c->keys = g_byte_array_free(keys, FALSE);
+	c->values_len = values_buf->len;
+	c->values_buf = g_string_free(values_buf, FALSE);
+	c->values = (uint32_t *) g_array_free(values, FALSE);
+
+	return c;
+}
+
+static const char *
+rspamd_map_compact_find(struct rspamd_map_compact_hash *c,
+						const char *in, gsize len)
+{
+	char key[RSPAMD_MAP_COMPACT_MAX_KEY];
+	const unsigned char *p, *end;
+	gsize shared, suffix, vidx, klen;
+	unsigned int lo = 0, hi = c->nblocks, mid, i;
+	int cmp;
+
+	if (len > RSPAMD_MAP_COMPACT_MAX_KEY) {
+		return NULL;
+	}
+
+	/* Find the last block with the first key not greater than query */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		p = c->keys + c->blocks[mid];
+		(void) rspamd_map_compact_read_varint(&p);
+		klen = rspamd_map_compact_read_varint(&p);
+
+		if (rspamd_map_compact_keycmp((const char *) p, klen, in, len) <= 0) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+
+	if (lo == 0) {
+		return NULL;
+	}
+
+	i = (lo - 1) * RSPAMD_MAP_COMPACT_BLOCK;
+	p = c->keys + c->blocks[lo - 1];
+	end = lo < c->nblocks ? c->keys + c->blocks[lo] : c->keys + c->keys_len;
+	klen = 0;
+
+	while (p < end) {
+		shared = rspamd_map_compact_read_varint(&p);
+		suffix = rspamd_map_compact_read_varint(&p);
+		memcpy(key + shared, p, suffix);
+		p += suffix;
+		klen = shared + suffix;
+		vidx = rspamd_map_compact_read_varint(&p);
+
+		cmp = rspamd_map_compact_keycmp(key, klen, in, len);
+
+		if (cmp == 0) {
+			c->hits[i]++;
+
+			return c->values_buf + c->values[vidx];
+		}
+		else if (cmp > 0) {
+			break;
+		}
+
+		i++;
+	}
+
+	return NULL;
+}
+
+static void
+rspamd_map_compact_traverse(struct rspamd_map_compact_hash *c,
+							rspamd_map_traverse_cb cb,
+							gpointer cbdata,
+							gboolean reset_hits)
+{
+	char key[RSPAMD_MAP_COMPACT_MAX_KEY + 1];
+	const unsigned char *p = c->keys, *end = c->keys + c->keys_len;
+	gsize shared, suffix, vidx;
+	unsigned int i = 0;
+
+	while (p < end) {
+		shared = rspamd_map_compact_read_varint(&p);
+		suffix = rspamd_map_compact_read_varint(&p);
+		memcpy(key + shared, p, suffix);
+		key[shared + suffix] = '\0';
+		p += suffix;
+		vidx = rspamd_map_compact_read_varint(&p);
+
+		if (!cb(key, c->values_buf + c->values[vidx], c->hits[i], cbdata)) {
+			break;
+		}
+
+		if (reset_hits) {
+			c->hits[i] = 0;
+		}
+
+		i++;
+	}
+}
+
+/*
+ * Replaces a large hash with the compact representation, returns a new helper
+ * as the old pool with keys and values is destroyed
+ */
+static struct rspamd_hash_map_helper *
+rspamd_map_helper_compact_hash(struct rspamd_hash_map_helper *ht)
+{
+	struct rspamd_hash_map_helper *nht;
+	struct rspamd_map_compact_hash *c;
+	struct rspamd_map *map = ht->map;
+	rspamd_mempool_t *pool;
+
+	c = rspamd_map_compact_build(ht->htb);
+
+	if (c == NULL) {
+		return ht;
+	}
+
+	msg_info_map("converted hash of %ud elements to the compact form: "
+				 "%z bytes of keys, %z bytes of values",
+				 c->nkeys, c->keys_len, c->values_len);
+
+	pool = rspamd_mempool_new(rspamd_mempool_suggest_size(),
+							  map ? map->tag : NULL, 0);
+	nht = rspamd_mempool_alloc0_type(pool, struct rspamd_hash_map_helper);
+	nht->pool = pool;
+	nht->map = map;
+	nht->compact = c;
+	memcpy(&nht->hst, &ht->hst, sizeof(nht->hst));
+	rspamd_map_helper_destroy_hash(ht);
+
+	return nht;
+}
+
 struct rspamd_hash_map_helper *
 rspamd_map_helper_new_hash(struct rspamd_map *map)
 {
@@ -771,6 +1118,7 @@ void rspamd_map_helper_destroy_hash(struct rspamd_hash_map_helper *r)
 
 	rspamd_mempool_t *pool = r->pool;
 	kh_destroy(rspamd_map_hash, r->htb);
+	rspamd_map_compact_destroy(r->compact);
 	memset(r, 0, sizeof(*r));
 	rspamd_mempool_delete(pool);
 }
@@ -785,6 +1133,12 @@ rspamd_map_helper_traverse_hash(void *data,
 	struct rspamd_map_helper_value *val;
 	struct rspamd_hash_map_helper *ht = data;
 
+	if (ht->compact) {
+		rspamd_map_compact_traverse(ht->compact, cb, cbdata, reset_hits);
+
+		return;
+	}
+
 	kh_foreach(ht->htb, tok, val, {
 		if (!cb(tok.begin, val->value, val->hits, cbdata)) {
 			break;
@@ -830,6 +1184,8 @@ void rspamd_map_helper_destroy_radix(struct rspamd_radix_map_helper *r)
 	}
 
 	kh_destroy(rspamd_map_hash, r->htb);
+	/* Trie rebuilt by delta is not allocated in the helper's pool */
+	radix_destroy_compressed(r->trie);
 	rspamd_mempool_t *pool = r->pool;
 	memset(r, 0, sizeof(*r));
 	rspamd_mempool_delete(pool);
@@ -924,6 +1280,180 @@ void rspamd_map_helper_destroy_regexp(struct rspamd_regexp_map_helper *re_map)
 	rspamd_mempool_delete(pool);
 }
 
+static void
+rspamd_map_helper_htb_remove(khash_t(rspamd_map_hash) * htb, const char *key)
+{
+	rspamd_ftok_t tok;
+	khiter_t k;
+
+	tok.begin = key;
+	tok.len = strlen(key);
+	k = kh_get(rspamd_map_hash, htb, tok);
+
+	if (k != kh_end(htb)) {
+		/* Key and value are left in the pool until the next full reload */
+		kh_del(rspamd_map_hash, htb, k);
+	}
+}
+
+static void
+rspamd_map_helper_remove_hash(gpointer st, gconstpointer key, gconstpointer value)
+{
+	struct rspamd_hash_map_helper *ht = st;
+
+	rspamd_map_helper_htb_remove(ht->htb, key);
+}
+
+static void
+rspamd_map_helper_replace_hash(gpointer st, gconstpointer key, gconstpointer value)
+{
+	struct rspamd_hash_map_helper *ht = st;
+
+	rspamd_map_helper_htb_remove(ht->htb, key);
+	rspamd_map_helper_insert_hash(st, key, value);
+}
+
+/* Radix trie does not support removal, so it is rebuilt after the delta */
+static void
+rspamd_map_helper_remove_radix(gpointer st, gconstpointer key, gconstpointer value)
+{
+	struct rspamd_radix_map_helper *r = st;
+
+	rspamd_map_helper_htb_remove(r->htb, key);
+	r->rebuild_trie = TRUE;
+}
+
+/*
+ * New keys are inserted to the trie in place, replaced keys require the trie
+ * to be rebuilt as it points to the old values
+ */
+static void
+rspamd_map_helper_replace_radix(gpointer st, gconstpointer key, gconstpointer value)
+{
+	struct rspamd_radix_map_helper *r = st;
+	struct rspamd_map_helper_value *val;
+	rspamd_ftok_t tok;
+	khiter_t k;
+	gsize vlen;
+	int res;
+
+	tok.begin = key;
+	tok.len = strlen(key);
+	k = kh_get(rspamd_map_hash, r->htb, tok);
+
+	if (k != kh_end(r->htb)) {
+		if (strcmp(kh_value(r->htb, k)->value, value) == 0) {
+			return;
+		}
+
+		kh_del(rspamd_map_hash, r->htb, k);
+		r->rebuild_trie = TRUE;
+	}
+
+	tok.begin = rspamd_mempool_strdup(r->pool, key);
+	tok.len = strlen(key);
+	vlen = strlen(value);
+	val = rspamd_mempool_alloc0(r->pool, sizeof(*val) + vlen + 1);
+	memcpy(val->value, value, vlen);
+	val->key = tok.begin;
+
+	k = kh_put(rspamd_map_hash, r->htb, tok, &res);
+	kh_value(r->htb, k) = val;
+
+	if (!r->rebuild_trie) {
+		rspamd_radix_add_iplist(val->key, ",", r->trie, val, FALSE,
+								r->map->name);
+	}
+}
+
+/*
+ * Delta consists of lines `+key [value]` to insert or replace a key and
+ * `-key` to remove it, comments and empty lines are allowed as in the
+ * normal lists
+ */
+static gboolean
+rspamd_map_helper_parse_delta(char *chunk,
+							  int len,
+							  struct map_cb_data *data,
+							  rspamd_map_insert_func insert_func,
+							  rspamd_map_insert_func remove_func,
+							  const char *default_value)
+{
+	struct rspamd_map *map = data->map;
+	char *p, *eol, *end = chunk + len;
+	unsigned int line_number = 0;
+
+	/* Check the whole delta first, so a broken one is not applied partially */
+	for (p = chunk; p < end; p = eol + 1) {
+		eol = memchr(p, '\n', end - p);
+
+		if (eol == NULL) {
+			eol = end;
+		}
+
+		line_number++;
+
+		while (p < eol && g_ascii_isspace(*p)) {
+			p++;
+		}
+
+		if (p < eol && *p != '#' && *p != '+' && *p != '-') {
+			msg_err_map("%s: invalid delta line %ud", map->name, line_number);
+
+			return FALSE;
+		}
+	}
+
+	for (p = chunk; p < end; p = eol + 1) {
+		eol = memchr(p, '\n', end - p);
+
+		if (eol == NULL) {
+			eol = end;
+		}
+
+		while (p < eol && g_ascii_isspace(*p)) {
+			p++;
+		}
+
+		if (p < eol && (*p == '+' || *p == '-')) {
+			data->state = 0;
+			rspamd_parse_kv_list(p + 1, eol - p - 1, data,
+								 *p == '+' ? insert_func : remove_func,
+								 default_value, TRUE);
+		}
+	}
+
+	return TRUE;
+}
+
+gboolean
+rspamd_kv_list_delta(char *chunk, int len, struct map_cb_data *data)
+{
+	struct rspamd_hash_map_helper *htb = data->cur_data;
+
+	if (htb == NULL) {
+		return FALSE;
+	}
+
+	if (htb->compact) {
+		msg_info_map("%s: compact hash cannot be modified, reload the whole map",
+					 data->map->name);
+
+		return FALSE;
+	}
+
+	if (!rspamd_map_helper_parse_delta(chunk, len, data,
+									   rspamd_map_helper_replace_hash,
+									   rspamd_map_helper_remove_hash,
+									   "")) {
+		return FALSE;
+	}
+
+	rspamd_cryptobox_fast_hash_update(&htb->hst, chunk, len);
+
+	return TRUE;
+}
+
 char *
 rspamd_kv_list_read(
 	char *chunk,
@@ -951,7 +1481,7 @@ void rspamd_kv_list_fin(struct map_cb_data *data, void **target)
 
 	if (data->errored) {
 		/* Clean up the current data and do not touch prev data */
-		if (data->cur_data) {
+		if (data->cur_data && data->cur_data != data->prev_data) {
 			msg_info_map("cleanup unfinished new data as error occurred for %s",
 						 map->name);
 			htb = (struct rspamd_hash_map_helper *) data->cur_data;
@@ -962,18 +1492,31 @@ void rspamd_kv_list_fin(struct map_cb_data *data, void **target)
 	else {
 		if (data->cur_data) {
 			htb = (struct rspamd_hash_map_helper *) data->cur_data;
-			msg_info_map("read hash of %d elements from %s", kh_size(htb->htb),
-						 map->name);
+
+			if (htb->compact == NULL) {
+				msg_info_map("read hash of %d elements from %s", kh_size(htb->htb),
+							 map->name);
+				data->map->nelts = kh_size(htb->htb);
+
+				if (data->map->nelts >= RSPAMD_MAP_COMPACT_MIN_ELTS &&
+					data->cur_data != data->prev_data) {
+					data->cur_data = rspamd_map_helper_compact_hash(htb);
+					htb = (struct rspamd_hash_map_helper *) data->cur_data;
+				}
+			}
+
 			data->map->traverse_function = rspamd_map_helper_traverse_hash;
-			data->map->nelts = kh_size(htb->htb);
 			data->map->digest = rspamd_cryptobox_fast_hash_final(&htb->hst);
+			/* Compact hash is immutable, so the whole map must be reloaded */
+			data->map->no_delta = htb->compact != NULL;
 		}
 
 		if (target) {
 			*target = data->cur_data;
 		}
 
-		if (data->prev_data) {
+		/* Delta updates modify the previous data in place */
+		if (data->prev_data && data->prev_data != data->cur_data) {
 			htb = (struct rspamd_hash_map_helper *) data->prev_data;
 			rspamd_map_helper_destroy_hash(htb);
 		}
@@ -1014,6 +1557,48 @@ rspamd_radix_read(
 		final);
 }
 
+gboolean
+rspamd_radix_delta(char *chunk, int len, struct map_cb_data *data)
+{
+	struct rspamd_radix_map_helper *r = data->cur_data;
+	struct rspamd_map_helper_value *val;
+	radix_compressed_t *trie;
+
+	if (r == NULL) {
+		return FALSE;
+	}
+
+	r->rebuild_trie = FALSE;
+
+	if (!rspamd_map_helper_parse_delta(chunk, len, data,
+									   rspamd_map_helper_replace_radix,
+									   rspamd_map_helper_remove_radix,
+									   hash_fill)) {
+		return FALSE;
+	}
+
+	if (r->rebuild_trie) {
+		/*
+		 * Delta has removed or replaced keys, so the trie is rebuilt from the
+		 * hash; rebuilt trie has its own pool, so the previous one can be freed
+		 */
+		trie = radix_create_compressed(data->map->name);
+
+		kh_foreach_value(r->htb, val, {
+			rspamd_radix_add_iplist(val->key, ",", trie, val, FALSE,
+									data->map->name);
+		});
+
+		radix_destroy_compressed(r->trie);
+		r->trie = trie;
+		r->rebuild_trie = FALSE;
+	}
+
+	rspamd_cryptobox_fast_hash_update(&r->hst, chunk, len);
+
+	return TRUE;
+}
+
 void rspamd_radix_fin(struct map_cb_data *data, void **target)
 {
 	struct rspamd_map *map = data->map;
@@ -1021,7 +1606,7 @@ void rspamd_radix_fin(struct map_cb_data *data, void **target)
 
 	if (data->errored) {
 		/* Clean up the current data and do not touch prev data */
-		if (data->cur_data) {
+		if (data->cur_data && data->cur_data != data->prev_data) {
 			msg_info_map("cleanup unfinished new data as error occurred for %s",
 						 map->name);
 			r = (struct rspamd_radix_map_helper *) data->cur_data;
@@ -1043,7 +1628,8 @@ void rspamd_radix_fin(struct map_cb_data *data, void **target)
 			*target = data->cur_data;
 		}
 
-		if (data->prev_data) {
+		/* Delta updates modify the previous data in place */
+		if (data->prev_data && data->prev_data != data->cur_data) {
 			r = (struct rspamd_radix_map_helper *) data->prev_data;
 			rspamd_map_helper_destroy_radix(r);
 		}
@@ -1601,7 +2187,15 @@ rspamd_match_hash_map(struct rspamd_hash_map_helper *map, const char *in,
 	struct rspamd_map_helper_value *val;
 	rspamd_ftok_t tok;
 
-	if (map == NULL || map->htb == NULL) {
+	if (map == NULL) {
+		return NULL;
+	}
+
+	if (map->compact) {
+		return rspamd_map_compact_find(map->compact, in, len);
+	}
+
+	if (map->htb == NULL) {
 		return NULL;
 	}
 
@@ -59,6 +59,11 @@ char *rspamd_radix_read(
 	struct map_cb_data *data,
 	gboolean final);
 
+/**
+ * Applies delta (`+key value` and `-key` lines) to the radix map in place
+ */
+gboolean rspamd_radix_delta(char *chunk, int len, struct map_cb_data *data);
+
 void rspamd_radix_fin(struct map_cb_data *data, void **target);
 
 void rspamd_radix_dtor(struct map_cb_data *data);
@@ -72,6 +77,11 @@ char *rspamd_kv_list_read(
 	struct map_cb_data *data,
 	gboolean final);
 
+/**
+ * Applies delta (`+key value` and `-key` lines) to the hash map in place
+ */
+gboolean rspamd_kv_list_delta(char *chunk, int len, struct map_cb_data *data);
+
 void rspamd_kv_list_fin(struct map_cb_data *data, void **target);
 
 void rspamd_kv_list_dtor(struct map_cb_data *data);
@@ -70,17 +70,36 @@ struct rspamd_http_map_cached_cbdata {
 	ev_timer timeout;
 	struct ev_loop *event_loop;
 	struct rspamd_storage_shmem *shm;
+	/* Shared memory of deltas applied on top of shm */
+	GPtrArray *deltas;
 	struct rspamd_map *map;
 	struct http_map_data *data;
 	uint64_t gen;
 	time_t last_checked;
 };
 
+/* Maximum number of deltas on top of the cached data, a full reload is requested after */
+#define RSPAMD_MAP_MAX_DELTAS 16
+/* Instance manipulation used in A-IM/IM headers for delta updates (RFC 3229) */
+#define RSPAMD_MAP_DELTA_IM "rspamd-map-delta"
+
+struct rspamd_map_cachepoint_delta {
+	gsize len;
+	uint64_t version;
+	char shmem_name[256];
+};
+
 struct rspamd_map_cachepoint {
 	int available;
 	gsize len;
 	time_t last_modified;
 	char shmem_name[256];
+	/* Incremented on each update of the cached data */
+	uint64_t version;
+	/* Version of the full data in shmem_name */
+	uint64_t full_version;
+	unsigned int ndeltas;
+	struct rspamd_map_cachepoint_delta deltas[RSPAMD_MAP_MAX_DELTAS];
 };
 
 /**
@@ -100,6 +119,10 @@ struct http_map_data {
 	time_t last_checked;
 	gboolean request_sent;
 	uint64_t gen;
+	/* Version of the cached data we have loaded */
+	uint64_t cache_version;
+	/* Deltas applied since the last full load */
+	unsigned int ndeltas;
 	uint16_t port;
 };
 
@@ -141,6 +164,7 @@ struct rspamd_map {
 	map_cb_t read_callback;
 	map_fin_cb_t fin_callback;
 	map_dtor_t dtor;
+	map_delta_cb_t delta_callback; /* NULL if delta updates are not supported */
 	void **user_data;
 	struct ev_loop *event_loop;
 	struct rspamd_worker *wrk;
@@ -167,6 +191,8 @@ struct rspamd_map {
 	bool static_only;  /* No need to check */
 	bool no_file_read; /* Do not read files */
 	bool seen;         /* This map has already been watched or pre-loaded */
+	bool checked;      /* At least one check has been finished (or map has been pre-loaded) */
+	bool no_delta;     /* Current data cannot be updated by deltas */
 	/* Shared lock for temporary disabling of map reading (e.g. when this map is written by UI) */
 	int *locked;
 	char tag[MEMPOOL_UID_LEN];
@@ -214,6 +240,7 @@ struct http_callback_data {
 	struct rspamd_storage_shmem *shmem_data;
 	gsize data_len;
 	gboolean check;
+	gboolean delta; /* Delta update has been requested */
 	enum rspamd_map_http_stage stage;
 	ev_tstamp timeout;
 
@@ -76,6 +76,9 @@
 
 INIT_LOG_MODULE(re_cache)
 
+/* Maximum number of released runtimes kept for reuse */
+#define RSPAMD_RE_CACHE_MAX_FREE_RUNTIMES 64
+
 #ifdef WITH_HYPERSCAN
 #define RSPAMD_HS_MAGIC_LEN (sizeof(rspamd_hs_magic))
 static const unsigned char rspamd_hs_magic[] = {'r', 's', 'h', 's', 'r', 'e', '1', '1'},
@@ -89,6 +92,7 @@ struct rspamd_re_class {
 	gboolean has_utf8; /* if there are any utf8 regexps */
 	gpointer type_data;
 	gsize type_len;
+	enum rspamd_mime_header_id hdr_id; /* for header classes */
 	GHashTable *re;
 	rspamd_cryptobox_hash_state_t *st;
 
@@ -120,6 +124,7 @@ struct rspamd_re_cache {
 	GHashTable *re_classes;
 
 	GPtrArray *re;
+	GPtrArray *free_runtimes; /* runtimes of finished tasks kept for reuse */
 	khash_t(lua_selectors_hash) * selectors;
 	ref_entry_t ref;
 	unsigned int nre;
@@ -228,6 +233,20 @@ rspamd_re_cache_destroy(struct rspamd_re_cache *cache)
 
 	kh_destroy(lua_selectors_hash, cache->selectors);
 
+	struct rspamd_re_runtime *rt;
+	unsigned int i;
+
+	PTR_ARRAY_FOREACH(cache->free_runtimes, i, rt)
+	{
+		if (rt->sel_cache) {
+			/* Already cleared when released */
+			kh_destroy(selectors_results_hash, rt->sel_cache);
+		}
+
+		g_free(rt);
+	}
+
+	g_ptr_array_free(cache->free_runtimes, TRUE);
 	g_hash_table_unref(cache->re_classes);
 	g_ptr_array_free(cache->re, TRUE);
 	g_free(cache);
@@ -251,6 +270,7 @@ rspamd_re_cache_new(void)
 	cache->re_classes = g_hash_table_new(g_int64_hash, g_int64_equal);
 	cache->nre = 0;
 	cache->re = g_ptr_array_new_full(256, rspamd_re_cache_elt_dtor);
+	cache->free_runtimes = g_ptr_array_new();
 	cache->selectors = kh_init(lua_selectors_hash);
 #ifdef WITH_HYPERSCAN
 	cache->hyperscan_loaded = RSPAMD_HYPERSCAN_UNKNOWN;
@@ -301,6 +321,12 @@ rspamd_re_cache_add(struct rspamd_re_cache *cache,
 		if (datalen > 0) {
 			re_class->type_data = g_malloc0(datalen);
 			memcpy(re_class->type_data, type_data, datalen);
+
+			if (type == RSPAMD_RE_HEADER || type == RSPAMD_RE_RAWHEADER) {
+				/* Type data is a zero terminated header's name */
+				re_class->hdr_id = rspamd_mime_header_id_from_name(type_data,
+																   strlen(type_data));
+			}
 		}
 
 		g_hash_table_insert(cache->re_classes, &re_class->id, re_class);
@@ -521,11 +547,21 @@ rspamd_re_cache_runtime_new(struct rspamd_re_cache *cache)
 	struct rspamd_re_runtime *rt;
 	g_assert(cache != NULL);
 
-	rt = g_malloc0(sizeof(*rt) + NBYTES(cache->nre) + cache->nre);
+	if (cache->free_runtimes->len > 0) {
+		rt = g_ptr_array_remove_index_fast(cache->free_runtimes,
+										   cache->free_runtimes->len - 1);
+		/* Checked bitmap and results are placed contiguously */
+		memset(rt->checked, 0, NBYTES(cache->nre) + cache->nre);
+		memset(&rt->stat, 0, sizeof(rt->stat));
+	}
+	else {
+		rt = g_malloc0(sizeof(*rt) + NBYTES(cache->nre) + cache->nre);
+		rt->checked = ((unsigned char *) rt) + sizeof(*rt);
+		rt->results = rt->checked + NBYTES(cache->nre);
+	}
+
 	rt->cache = cache;
 	REF_RETAIN(cache);
-	rt->checked = ((unsigned char *) rt) + sizeof(*rt);
-	rt->results = rt->checked + NBYTES(cache->nre);
 	rt->stat.regexp_total = cache->nre;
 #ifdef WITH_HYPERSCAN
 	rt->has_hs = cache->hyperscan_loaded;
@@ -1152,8 +1188,14 @@ rspamd_re_cache_exec_re(struct rspamd_task *task,
 	case RSPAMD_RE_HEADER:
 	case RSPAMD_RE_RAWHEADER:
 		/* Get list of specified headers */
-		rh = rspamd_message_get_header_array(task,
-											 re_class->type_data, FALSE);
+		if (re_class->hdr_id != RSPAMD_HEADER_ID_UNKNOWN) {
+			rh = rspamd_message_get_header_array_by_id(task,
+													   re_class->hdr_id, FALSE);
+		}
+		else {
+			rh = rspamd_message_get_header_array(task,
+												 re_class->type_data, FALSE);
+		}
 
 		if (rh) {
 			ret = rspamd_re_cache_process_headers_list(task, rt, re,
@@ -1351,7 +1393,7 @@ rspamd_re_cache_exec_re(struct rspamd_task *task,
 		 * of the body content.
 		 */
 
-		rh = rspamd_message_get_header_array(task, "Subject", FALSE);
+		rh = rspamd_message_get_header_array_by_id(task, RSPAMD_HEADER_ID_SUBJECT, FALSE);
 
 		if (rh) {
 			scvec[0] = (unsigned char *) rh->decoded;
@@ -1570,6 +1612,8 @@ int rspamd_re_cache_process_ffi(void *ptask,
 
 void rspamd_re_cache_runtime_destroy(struct rspamd_re_runtime *rt)
 {
+	struct rspamd_re_cache *cache;
+
 	g_assert(rt != NULL);
 
 	if (rt->sel_cache) {
@@ -1583,11 +1627,26 @@ void rspamd_re_cache_runtime_destroy(struct rspamd_re_runtime *rt)
 			g_free(sr.scvec);
 			g_free(sr.lenvec);
 		});
-		kh_destroy(selectors_results_hash, rt->sel_cache);
+		/* Keep buckets allocated for reuse */
+		kh_clear(selectors_results_hash, rt->sel_cache);
+	}
+
+	cache = rt->cache;
+
+	if (rt->stat.regexp_total == cache->nre &&
+		cache->free_runtimes->len < RSPAMD_RE_CACHE_MAX_FREE_RUNTIMES) {
+		/* Released runtimes do not hold a reference to the cache */
+		g_ptr_array_add(cache->free_runtimes, rt);
+	}
+	else {
+		if (rt->sel_cache) {
+			kh_destroy(selectors_results_hash, rt->sel_cache);
+		}
+
+		g_free(rt);
 	}
 
-	REF_RELEASE(rt->cache);
-	g_free(rt);
+	REF_RELEASE(cache);
 }
 
 void rspamd_re_cache_unref(struct rspamd_re_cache *cache)
@@ -55,6 +55,9 @@ struct redis_pool_connection {
 	ev_timer timeout;
 	char tag[MEMPOOL_UID_LEN];
 	rspamd_redis_pool_connection_state state;
+	/* Connection is multiplexed between several requests */
+	bool shared = false;
+	unsigned users = 0;
 
 	auto schedule_timeout() -> void;
 	~redis_pool_connection();
@@ -93,8 +96,12 @@ class redis_pool_elt {
 	int port;
 	redis_pool_key_t key;
 	bool is_unix;
+	/* Current connection for auto-pipelined requests, owned by `active` list */
+	redis_pool_connection *shared_conn = nullptr;
 
 public:
+	struct rspamd_redis_pool_stat stats = {};
+
 	/* Disable copy */
 	redis_pool_elt() = delete;
 	redis_pool_elt(const redis_pool_elt &) = delete;
@@ -122,9 +129,14 @@ public:
 	}
 
 	auto new_connection() -> redisAsyncContext *;
+	auto new_shared_connection(unsigned max_inflight) -> redisAsyncContext *;
 
 	auto release_connection(const redis_pool_connection *conn) -> void
 	{
+		if (shared_conn == conn) {
+			shared_conn = nullptr;
+		}
+
 		switch (conn->state) {
 		case rspamd_redis_pool_connection_state::RSPAMD_REDIS_POOL_CONN_ACTIVE:
 			active.erase(conn->elt_pos);
@@ -140,6 +152,12 @@ public:
 
 	auto move_to_inactive(redis_pool_connection *conn) -> void
 	{
+		if (shared_conn == conn) {
+			shared_conn = nullptr;
+		}
+
+		conn->shared = false;
+		conn->users = 0;
 		inactive.splice(std::end(inactive), active, conn->elt_pos);
 		conn->elt_pos = std::prev(std::end(inactive));
 	}
@@ -178,6 +196,34 @@ public:
 		return active.size();
 	}
 
+	auto is_current_shared(const redis_pool_connection *conn) const -> bool
+	{
+		return shared_conn == conn;
+	}
+
+	auto get_stat(struct rspamd_redis_pool_stat &st) const -> void
+	{
+		st = stats;
+		st.active = active.size();
+		st.inactive = inactive.size();
+		st.pipeline_users = shared_conn ? shared_conn->users : 0;
+	}
+
+	auto get_ip() const -> const std::string &
+	{
+		return ip;
+	}
+
+	auto get_port() const -> int
+	{
+		return port;
+	}
+
+	auto get_db() const -> const std::string &
+	{
+		return db;
+	}
+
 	~redis_pool_elt()
 	{
 		rspamd_explicit_memzero(password.data(), password.size());
@@ -210,6 +256,7 @@ private:
 class redis_pool final {
 	static constexpr const double default_timeout = 10.0;
 	static constexpr const unsigned default_max_conns = 100;
+	static constexpr const unsigned default_max_inflight = 64;
 
 	/* We want to have references integrity */
 	ankerl::unordered_dense::map<redisAsyncContext *,
@@ -244,9 +291,21 @@ public:
 	auto new_connection(const char *db, const char *username,
 						const char *password, const char *ip, int port) -> redisAsyncContext *;
 
+	auto new_shared_connection(const char *db, const char *username,
+							   const char *password, const char *ip, int port,
+							   unsigned max_inflight) -> redisAsyncContext *;
+
 	auto release_connection(redisAsyncContext *ctx,
 							enum rspamd_redis_pool_release_type how) -> void;
 
+	template<typename T>
+	auto foreach_elt(T &&func) const -> void
+	{
+		for (const auto &[key, elt]: elts_by_key) {
+			func(elt);
+		}
+	}
+
 	auto unregister_context(redisAsyncContext *ctx) -> void
 	{
 		conns_by_ctx.erase(ctx);
@@ -257,6 +316,28 @@ public:
 		conns_by_ctx.emplace(ctx, conn);
 	}
 
+private:
+	auto get_elt(const char *db, const char *username,
+				 const char *password, const char *ip, int port) -> redis_pool_elt &
+	{
+		auto key = redis_pool_elt::make_key(db, username, password, ip, port);
+		auto found_elt = elts_by_key.find(key);
+
+		if (found_elt != elts_by_key.end()) {
+			return found_elt->second;
+		}
+
+		/* Need to create a pool */
+		auto nelt = elts_by_key.try_emplace(key,
+											this, db, username, password, ip, port);
+
+		return nelt.first->second;
+	}
+
+	auto release_shared_connection(redis_pool_connection *conn,
+								   enum rspamd_redis_pool_release_type how) -> void;
+
+public:
 	/* Hack to prevent Redis callbacks to be executed */
 	auto prepare_to_die() -> void
 	{
@@ -373,6 +454,15 @@ auto redis_pool_connection::redis_on_disconnect(const struct redisAsyncContext *
 		/* Erasure of shared pointer will cause it to be removed */
 		conn->elt->release_connection(conn);
 	}
+	else if (conn->shared) {
+		/*
+		 * Shared connections are owned by the pool and not by a specific request,
+		 * all users have been already notified by the pending callbacks
+		 */
+		msg_debug_rpool("shared connection terminated: %s",
+						conn->ctx ? conn->ctx->errstr : "unknown error");
+		conn->elt->release_connection(conn);
+	}
 }
 
 auto redis_pool_connection::schedule_timeout() -> void
@@ -471,6 +561,7 @@ auto redis_pool_elt::new_connection() -> redisAsyncContext *
 				/* Reuse connection */
 				ev_timer_stop(pool->event_loop, &conn->timeout);
 				conn->state = rspamd_redis_pool_connection_state::RSPAMD_REDIS_POOL_CONN_ACTIVE;
+				stats.conns_reused++;
 				msg_debug_rpool("reused existing connection to %s:%d: %p",
 								ip.c_str(), port, conn->ctx);
 				active.emplace_front(std::move(conn));
@@ -485,6 +576,7 @@ auto redis_pool_elt::new_connection() -> redisAsyncContext *
 				active.emplace_front(std::make_unique<redis_pool_connection>(pool, this,
 																			 db.c_str(), username.c_str(), password.c_str(), nctx));
 				active.front()->elt_pos = active.begin();
+				stats.conns_created++;
 			}
 
 			return nctx;
@@ -496,6 +588,7 @@ auto redis_pool_elt::new_connection() -> redisAsyncContext *
 			active.emplace_front(std::make_unique<redis_pool_connection>(pool, this,
 																		 db.c_str(), username.c_str(), password.c_str(), nctx));
 			active.front()->elt_pos = active.begin();
+			stats.conns_created++;
 		}
 
 		return nctx;
@@ -504,31 +597,120 @@ auto redis_pool_elt::new_connection() -> redisAsyncContext *
 	RSPAMD_UNREACHABLE;
 }
 
+auto redis_pool_elt::new_shared_connection(unsigned max_inflight) -> redisAsyncContext *
+{
+	if (shared_conn != nullptr) {
+		auto *conn = shared_conn;
+
+		/* Commands are buffered by hiredis until the connection is established */
+		if (conn->ctx->err == REDIS_OK &&
+			!(conn->ctx->c.flags & (REDIS_SUBSCRIBED | REDIS_DISCONNECTING))) {
+			if (conn->users < max_inflight) {
+				/* Only requests sent while others are in flight are pipelined */
+				if (conn->users > 0) {
+					stats.pipelined_requests++;
+				}
+
+				conn->users++;
+
+				return conn->ctx;
+			}
+
+			/*
+			 * Too many requests are in flight: detach this connection, so it
+			 * is drained by its current users, and start a new shared one
+			 */
+			msg_debug_rpool("shared connection %p is full (%ud users), detach it",
+							conn->ctx, conn->users);
+			stats.pipeline_overflows++;
+		}
+
+		shared_conn = nullptr;
+	}
+
+	auto *nctx = new_connection();
+
+	if (nctx) {
+		auto *conn = active.front().get();
+
+		g_assert(conn->ctx == nctx);
+		conn->shared = true;
+		conn->users = 1;
+		shared_conn = conn;
+	}
+
+	return nctx;
+}
+
 auto redis_pool::new_connection(const char *db, const char *username,
 								const char *password, const char *ip, int port) -> redisAsyncContext *
 {
 
 	if (!wanna_die) {
-		auto key = redis_pool_elt::make_key(db, username, password, ip, port);
-		auto found_elt = elts_by_key.find(key);
+		return get_elt(db, username, password, ip, port).new_connection();
+	}
 
-		if (found_elt != elts_by_key.end()) {
-			auto &elt = found_elt->second;
+	return nullptr;
+}
 
-			return elt.new_connection();
+auto redis_pool::new_shared_connection(const char *db, const char *username,
+									   const char *password, const char *ip, int port,
+									   unsigned max_inflight) -> redisAsyncContext *
+{
+	if (!wanna_die) {
+		if (max_inflight == 0) {
+			max_inflight = default_max_inflight;
 		}
-		else {
-			/* Need to create a pool */
-			auto nelt = elts_by_key.try_emplace(key,
-												this, db, username, password, ip, port);
 
-			return nelt.first->second.new_connection();
-		}
+		return get_elt(db, username, password, ip, port).new_shared_connection(max_inflight);
 	}
 
 	return nullptr;
 }
 
+auto redis_pool::release_shared_connection(redis_pool_connection *conn,
+										   enum rspamd_redis_pool_release_type how) -> void
+{
+	auto *ctx = conn->ctx;
+
+	if (conn->users > 0) {
+		conn->users--;
+	}
+
+	if (ctx->err != REDIS_OK || how != RSPAMD_REDIS_RELEASE_DEFAULT) {
+		/*
+		 * We cannot reuse this connection anymore; requests of other users
+		 * (if any) will be terminated with an error by hiredis
+		 */
+		msg_debug_rpool("closed shared connection %p, %ud users left",
+						conn->ctx, conn->users);
+		conn->elt->release_connection(conn);
+
+		return;
+	}
+
+	if (conn->users > 0) {
+		msg_debug_rpool("release shared connection %p, %ud users left",
+						conn->ctx, conn->users);
+
+		return;
+	}
+
+	if (ctx->replies.head == nullptr && (ctx->c.flags & REDIS_CONNECTED)) {
+		/* Nobody uses this connection, so it can be reused as usual */
+		conn->state = rspamd_redis_pool_connection_state::RSPAMD_REDIS_POOL_CONN_INACTIVE;
+		conn->elt->move_to_inactive(conn);
+		conn->schedule_timeout();
+		msg_debug_rpool("mark shared connection %p inactive", conn->ctx);
+	}
+	else if (!conn->elt->is_current_shared(conn)) {
+		/* Detached connection with abandoned replies, nobody would release it */
+		msg_debug_rpool("closed detached shared connection %p due to callbacks left",
+						conn->ctx);
+		conn->elt->release_connection(conn);
+	}
+}
+
 auto redis_pool::release_connection(redisAsyncContext *ctx,
 									enum rspamd_redis_pool_release_type how) -> void
 {
@@ -538,6 +720,12 @@ auto redis_pool::release_connection(redisAsyncContext *ctx,
 			auto *conn = conn_it->second;
 			g_assert(conn->state == rspamd_redis_pool_connection_state::RSPAMD_REDIS_POOL_CONN_ACTIVE);
 
+			if (conn->shared) {
+				release_shared_connection(conn, how);
+
+				return;
+			}
+
 			if (ctx->err != REDIS_OK) {
 				/* We need to terminate connection forcefully */
 				msg_debug_rpool("closed connection %p due to an error", conn->ctx);
@@ -573,6 +761,13 @@ auto redis_pool::release_connection(redisAsyncContext *ctx,
 
 			conn->elt->release_connection(conn);
 		}
+		else if (ctx->c.flags & REDIS_FREEING) {
+			/*
+			 * Shared connection has been already destroyed by one of its users,
+			 * hiredis calls pending callbacks of other users that release it again
+			 */
+			return;
+		}
 		else {
 			msg_err("fatal internal error, connection with ctx %p is not found in the Redis pool",
 					ctx);
@@ -611,6 +806,18 @@ rspamd_redis_pool_connect(void *p,
 	return pool->new_connection(db, username, password, ip, port);
 }
 
+struct redisAsyncContext *
+rspamd_redis_pool_connect_shared(void *p,
+								 const char *db, const char *username,
+								 const char *password, const char *ip, int port,
+								 unsigned int max_inflight)
+{
+	g_assert(p != NULL);
+	auto *pool = reinterpret_cast<class rspamd::redis_pool *>(p);
+
+	return pool->new_shared_connection(db, username, password, ip, port, max_inflight);
+}
+
 
 void rspamd_redis_pool_release_connection(void *p,
 										  struct redisAsyncContext *ctx, enum rspamd_redis_pool_release_type how)
@@ -622,6 +829,19 @@ void rspamd_redis_pool_release_connection(void *p,
 	pool->release_connection(ctx, how);
 }
 
+void rspamd_redis_pool_foreach_stat(void *p, rspamd_redis_pool_stat_cb cb,
+									void *ud)
+{
+	g_assert(p != NULL);
+	auto *pool = reinterpret_cast<class rspamd::redis_pool *>(p);
+
+	pool->foreach_elt([&](const rspamd::redis_pool_elt &elt) {
+		struct rspamd_redis_pool_stat st;
+
+		elt.get_stat(st);
+		cb(elt.get_ip().c_str(), elt.get_port(), elt.get_db().c_str(), &st, ud);
+	});
+}
 
 void rspamd_redis_pool_destroy(void *p)
 {
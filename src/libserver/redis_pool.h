@@ -56,6 +56,26 @@ struct redisAsyncContext *rspamd_redis_pool_connect(
 	const char *db, const char *username, const char *password,
 	const char *ip, int port);
 
+/**
+ * Create or reuse a connection that is shared between several requests
+ * (auto-pipelining). Commands issued on the returned context are written in
+ * the same batch as the commands of other users of this connection, replies
+ * are dispatched in order. The context must be released with
+ * `rspamd_redis_pool_release_connection` just like an exclusive one.
+ * @param pool
+ * @param db
+ * @param username
+ * @param password
+ * @param ip
+ * @param port
+ * @param max_inflight maximum number of users of a shared connection (0 for default)
+ * @return
+ */
+struct redisAsyncContext *rspamd_redis_pool_connect_shared(
+	void *pool,
+	const char *db, const char *username, const char *password,
+	const char *ip, int port, unsigned int max_inflight);
+
 enum rspamd_redis_pool_release_type {
 	RSPAMD_REDIS_RELEASE_DEFAULT = 0,
 	RSPAMD_REDIS_RELEASE_FATAL = 1,
@@ -71,6 +91,30 @@ void rspamd_redis_pool_release_connection(void *pool,
 										  struct redisAsyncContext *ctx,
 										  enum rspamd_redis_pool_release_type how);
 
+struct rspamd_redis_pool_stat {
+	uint64_t conns_created;
+	uint64_t conns_reused;
+	uint64_t pipelined_requests; /* joined a shared connection with requests in flight */
+	uint64_t pipeline_overflows;
+	unsigned int active;
+	unsigned int inactive;
+	unsigned int pipeline_users;
+};
+
+typedef void (*rspamd_redis_pool_stat_cb)(const char *ip, int port,
+										  const char *db,
+										  const struct rspamd_redis_pool_stat *st,
+										  void *ud);
+
+/**
+ * Calls `cb` for each server (ip, port, db) known by the pool
+ * @param pool
+ * @param cb
+ * @param ud
+ */
+void rspamd_redis_pool_foreach_stat(void *pool, rspamd_redis_pool_stat_cb cb,
+									void *ud);
+
 /**
  * Stops redis pool and destroys it
  * @param pool
@@ -1137,6 +1137,22 @@ rspamd_srv_handler(EV_P_ ev_io *w, int revents)
 				rspamd_control_broadcast_cmd(rspamd_main, &wcmd, rfd,
 											 rspamd_control_ignore_io_handler, NULL, worker->pid);
 				break;
+			case RSPAMD_SRV_READY:
+				/* Main process checks this flag to retire the previous generation */
+				worker->flags &= ~RSPAMD_WORKER_WARMUP;
+				rdata->rep.reply.ready.status = 0;
+
+				if (cmd.cmd.ready.timed_out) {
+					msg_warn_main("%s process %P (generation %ud) is ready after warmup timeout",
+								  g_quark_to_string(worker->type), worker->pid,
+								  cmd.cmd.ready.generation);
+				}
+				else {
+					msg_info_main("%s process %P (generation %ud) is ready",
+								  g_quark_to_string(worker->type), worker->pid,
+								  cmd.cmd.ready.generation);
+				}
+				break;
 			default:
 				msg_err_main("unknown command type: %d", cmd.type);
 				break;
@@ -1469,6 +1485,9 @@ const char *rspamd_srv_command_to_string(enum rspamd_srv_type cmd)
 	case RSPAMD_SRV_FUZZY_BLOCKED:
 		reply = "fuzzy_blocked";
 		break;
+	case RSPAMD_SRV_READY:
+		reply = "ready";
+		break;
 	}
 
 	return reply;
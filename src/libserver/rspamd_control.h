@@ -50,6 +50,7 @@ enum rspamd_srv_type {
 	RSPAMD_SRV_HEALTH,
 	RSPAMD_SRV_NOTICE_HYPERSCAN_CACHE,
 	RSPAMD_SRV_FUZZY_BLOCKED, /* Used to notify main process about a blocked ip */
+	RSPAMD_SRV_READY,         /* Worker has finished warmup and accepts connections */
 };
 
 enum rspamd_log_pipe_type {
@@ -201,6 +202,11 @@ struct rspamd_srv_command {
 			} addr;
 			sa_family_t af;
 		} fuzzy_blocked;
+		/* Sent by workers of a new generation when they are ready to serve */
+		struct {
+			unsigned int generation;
+			gboolean timed_out;
+		} ready;
 	} cmd;
 };
 
@@ -238,6 +244,9 @@ struct rspamd_srv_reply {
 		struct {
 			int unused;
 		} fuzzy_blocked;
+		struct {
+			int status;
+		} ready;
 	} reply;
 };
 
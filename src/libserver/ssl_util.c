@@ -438,7 +438,7 @@ rspamd_ssl_connection_dtor(struct rspamd_ssl_connection *conn)
 	/*
 	 * Try to workaround for the race between timeout and ssl error
 	 */
-	if (conn->shut_ev != conn->ev && ev_can_stop(&conn->ev->tm)) {
+	if (conn->shut_ev != conn->ev && rspamd_ev_wheel_timer_is_active(&conn->ev->tm)) {
 		rspamd_ev_watcher_stop(conn->event_loop, conn->ev);
 	}
 
@@ -33,16 +33,45 @@ constexpr static const auto PROFILE_MAX_TIME = 60.0;
 constexpr static const auto PROFILE_MESSAGE_SIZE_THRESHOLD = 1024ul * 1024 * 2;
 /* Enable profile at least once per this amount of messages processed */
 constexpr static const auto PROFILE_PROBABILITY = 0.01;
+/* Maximum number of released runtimes kept for reuse */
+constexpr static const auto MAX_FREE_RUNTIMES = 64;
+
+/*
+ * Runtimes of finished tasks are reused by the next tasks of the same process,
+ * so we do not allocate and zero the dynamic items array in each task's pool
+ */
+static std::vector<symcache_runtime *> free_runtimes;
 
 auto symcache_runtime::create(struct rspamd_task *task, symcache &cache) -> symcache_runtime *
 {
 	cache.maybe_resort();
 
 	auto &&cur_order = cache.get_cache_order();
-	auto *checkpoint = (symcache_runtime *) rspamd_mempool_alloc0(task->task_pool,
-																  sizeof(symcache_runtime) +
-																	  sizeof(struct cache_dynamic_item) * cur_order->size());
+	auto nitems = cur_order->size();
+	auto alloc_size = sizeof(symcache_runtime) + sizeof(struct cache_dynamic_item) * nitems;
+	symcache_runtime *checkpoint = nullptr;
+	std::size_t capacity = nitems;
+
+	if (!free_runtimes.empty()) {
+		checkpoint = free_runtimes.back();
+		free_runtimes.pop_back();
+
+		if (checkpoint->capacity >= nitems) {
+			/* Order cannot shrink, but it can grow on new symbols registration */
+			capacity = checkpoint->capacity;
+			memset((void *) checkpoint, 0, alloc_size);
+		}
+		else {
+			g_free(checkpoint);
+			checkpoint = nullptr;
+		}
+	}
+
+	if (checkpoint == nullptr) {
+		checkpoint = (symcache_runtime *) g_malloc0(alloc_size);
+	}
 
+	checkpoint->capacity = capacity;
 	checkpoint->order = cache.get_cache_order();
 
 	/* Calculate profile probability */
@@ -64,6 +93,19 @@ auto symcache_runtime::create(struct rspamd_task *task, symcache &cache) -> symc
 	return checkpoint;
 }
 
+auto symcache_runtime::savepoint_dtor() -> void
+{
+	/* Drop shared ownership */
+	order.reset();
+
+	if (free_runtimes.size() < MAX_FREE_RUNTIMES) {
+		free_runtimes.push_back(this);
+	}
+	else {
+		g_free((void *) this);
+	}
+}
+
 auto symcache_runtime::process_settings(struct rspamd_task *task, const symcache &cache) -> bool
 {
 	if (!task->settings) {
@@ -56,9 +56,11 @@ class symcache_runtime {
 
 	struct cache_dynamic_item *cur_item;
 	order_generation_ptr order;
+	/* Number of dynamic items allocated, can be larger than the current order */
+	std::size_t capacity;
 	/* Dynamically expanded as needed */
 	mutable struct cache_dynamic_item dynamic_items[];
-	/* We allocate this structure merely in memory pool, so destructor is absent */
+	/* Runtimes are allocated as raw memory and recycled, so destructor is absent */
 	~symcache_runtime() = delete;
 
 	auto process_symbol(struct rspamd_task *task, symcache &cache, cache_item *item,
@@ -71,15 +73,14 @@ class symcache_runtime {
 						 cache_dynamic_item *dyn_item, bool check_only) -> bool;
 
 public:
-	/* Dropper for a shared ownership */
-	auto savepoint_dtor() -> void
-	{
-
-		/* Drop shared ownership */
-		order.reset();
-	}
 	/**
-	 * Creates a cache runtime using task mempool
+	 * Drops shared ownership of the order and returns runtime to the per-process
+	 * free list to be reused by the next task
+	 */
+	auto savepoint_dtor() -> void;
+	/**
+	 * Creates a cache runtime reusing one of the previously released runtimes
+	 * if possible
 	 * @param task
 	 * @param cache
 	 * @return
@@ -51,6 +51,14 @@ __KHASH_IMPL(rspamd_req_headers_hash, static inline,
 			 rspamd_ftok_t *, struct rspamd_request_header_chain *, 1,
 			 rspamd_ftok_icase_hash, rspamd_ftok_icase_equal)
 
+/*
+ * Request headers hashes of finished tasks are cleared and reused by new tasks
+ * of the same process (buckets are preserved)
+ */
+#define RSPAMD_TASK_MAX_FREE_HEADERS 64
+static khash_t(rspamd_req_headers_hash) * free_request_headers[RSPAMD_TASK_MAX_FREE_HEADERS];
+static unsigned int nfree_request_headers = 0;
+
 static GQuark
 rspamd_task_quark(void)
 {
@@ -109,7 +117,13 @@ rspamd_task_new(struct rspamd_worker *worker,
 	new_task->task_timestamp = ev_time();
 	new_task->time_real_finish = NAN;
 
-	new_task->request_headers = kh_init(rspamd_req_headers_hash);
+	if (nfree_request_headers > 0) {
+		new_task->request_headers = free_request_headers[--nfree_request_headers];
+	}
+	else {
+		new_task->request_headers = kh_init(rspamd_req_headers_hash);
+	}
+
 	new_task->sock = -1;
 	new_task->flags |= (RSPAMD_TASK_FLAG_MIME);
 	/* Default results chain */
@@ -286,7 +300,15 @@ void rspamd_task_free(struct rspamd_task *task)
 			REF_RELEASE(task->cfg);
 		}
 
-		kh_destroy(rspamd_req_headers_hash, task->request_headers);
+		if (nfree_request_headers < G_N_ELEMENTS(free_request_headers)) {
+			/* Keys and values are allocated in the task's pool */
+			kh_clear(rspamd_req_headers_hash, task->request_headers);
+			free_request_headers[nfree_request_headers++] = task->request_headers;
+		}
+		else {
+			kh_destroy(rspamd_req_headers_hash, task->request_headers);
+		}
+
 		rspamd_message_unref(task->message);
 
 		if (task->flags & RSPAMD_TASK_FLAG_OWN_POOL) {
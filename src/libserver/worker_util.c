@@ -26,6 +26,8 @@
 #include "libserver/http/http_private.h"
 #include "libserver/http/http_router.h"
 #include "libutil/rrd.h"
+#include "libutil/uring.h"
+#include "libutil/libev_helper.h"
 
 /* sys/resource.h */
 #ifdef HAVE_SYS_RESOURCE_H
@@ -55,11 +57,24 @@
 
 #endif
 
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif
+
+#ifdef HAVE_SYS_SET_MEMPOLICY
+#include <sys/syscall.h>
+#endif
+
 #include "contrib/libev/ev.h"
 #include "libstat/stat_api.h"
 
 struct rspamd_worker *rspamd_current_worker = NULL;
 
+/* io_uring settings, read buffers are used only while data is being processed */
+#define RSPAMD_WORKER_URING_ENTRIES 1024
+#define RSPAMD_WORKER_URING_BUFS 256
+#define RSPAMD_WORKER_URING_BUF_SIZE (16 * 1024)
+
 /* Forward declaration */
 static void rspamd_worker_heartbeat_start(struct rspamd_worker *,
 										  struct ev_loop *);
@@ -482,6 +497,12 @@ rspamd_prepare_worker(struct rspamd_worker *worker, const char *name,
 
 	worker->srv->event_loop = event_loop;
 
+	if (worker->srv->cfg->enable_io_uring) {
+		/* Falls back to the readiness based IO if io_uring is not available */
+		rspamd_uring_new(event_loop, RSPAMD_WORKER_URING_ENTRIES,
+						 RSPAMD_WORKER_URING_BUFS, RSPAMD_WORKER_URING_BUF_SIZE);
+	}
+
 	rspamd_worker_init_signals(worker, event_loop);
 	rspamd_control_worker_add_default_cmd_handlers(worker, event_loop);
 	rspamd_worker_heartbeat_start(worker, event_loop);
@@ -500,7 +521,11 @@ rspamd_prepare_worker(struct rspamd_worker *worker, const char *name,
 				accept_ev->event_loop = event_loop;
 				accept_ev->accept_ev.data = worker;
 				ev_io_init(&accept_ev->accept_ev, hdl, ls->fd, EV_READ);
-				ev_io_start(event_loop, &accept_ev->accept_ev);
+
+				if (!(worker->flags & RSPAMD_WORKER_WARMUP)) {
+					ev_io_start(event_loop, &accept_ev->accept_ev);
+				}
+				/* Otherwise accept is started by `rspamd_worker_warmup` */
 
 				DL_APPEND(worker->accept_events, accept_ev);
 			}
@@ -512,6 +537,126 @@ rspamd_prepare_worker(struct rspamd_worker *worker, const char *name,
 	return event_loop;
 }
 
+struct rspamd_worker_warmup_cbdata {
+	struct rspamd_worker *worker;
+	ev_timer check_ev;
+	ev_tstamp deadline;
+	gboolean need_hyperscan;
+};
+
+static gboolean
+rspamd_worker_warmup_finished(struct rspamd_worker_warmup_cbdata *cbd)
+{
+	struct rspamd_config *cfg = cbd->worker->srv->cfg;
+
+	if (rspamd_map_pending_count(cfg) > 0) {
+		return FALSE;
+	}
+
+#ifdef WITH_HYPERSCAN
+	if (cbd->need_hyperscan &&
+		rspamd_re_cache_is_hs_loaded(cfg->re_cache) != RSPAMD_HYPERSCAN_LOADED_FULL) {
+		return FALSE;
+	}
+#endif
+
+	return TRUE;
+}
+
+static void
+rspamd_worker_warmup_check(EV_P_ ev_timer *w, int revents)
+{
+	struct rspamd_worker_warmup_cbdata *cbd =
+		(struct rspamd_worker_warmup_cbdata *) w->data;
+	struct rspamd_worker *worker = cbd->worker;
+	struct rspamd_worker_accept_event *cur;
+	struct rspamd_srv_command srv_cmd;
+	gboolean timed_out;
+
+	if (worker->state != rspamd_worker_state_running) {
+		/* Terminated before being ready, accept events are already removed */
+		ev_timer_stop(EV_A_ w);
+		g_free(cbd);
+
+		return;
+	}
+
+	timed_out = ev_now(EV_A) >= cbd->deadline;
+
+	if (!timed_out && !rspamd_worker_warmup_finished(cbd)) {
+		return;
+	}
+
+	ev_timer_stop(EV_A_ w);
+	worker->flags &= ~RSPAMD_WORKER_WARMUP;
+
+	DL_FOREACH(worker->accept_events, cur)
+	{
+		ev_io_start(cur->event_loop, &cur->accept_ev);
+	}
+
+	if (timed_out) {
+		msg_warn("warmup has not been finished in %.1f seconds: %ud maps pending, "
+				 "start accepting connections",
+				 worker->srv->cfg->warmup_timeout,
+				 rspamd_map_pending_count(worker->srv->cfg));
+	}
+	else {
+		msg_info("warmup has been finished, start accepting connections");
+	}
+
+	/* Main process can now stop workers of the previous generation */
+	memset(&srv_cmd, 0, sizeof(srv_cmd));
+	srv_cmd.type = RSPAMD_SRV_READY;
+	srv_cmd.cmd.ready.generation = worker->generation;
+	srv_cmd.cmd.ready.timed_out = timed_out;
+	rspamd_srv_send_command(worker, EV_A, &srv_cmd, -1, NULL, NULL);
+
+	g_free(cbd);
+}
+
+void rspamd_worker_warmup(struct rspamd_worker *worker, struct ev_loop *event_loop)
+{
+	struct rspamd_worker_warmup_cbdata *cbd;
+	struct rspamd_config *cfg = worker->srv->cfg;
+	static const ev_tstamp warmup_check_interval = 0.1;
+
+	if (!(worker->flags & RSPAMD_WORKER_WARMUP)) {
+		return;
+	}
+
+	cbd = g_malloc0(sizeof(*cbd));
+	cbd->worker = worker;
+	cbd->deadline = ev_now(event_loop) + cfg->warmup_timeout;
+
+#ifdef WITH_HYPERSCAN
+	if (!cfg->disable_hyperscan && (worker->flags & RSPAMD_WORKER_SCANNER)) {
+		GList *cur;
+
+		/* Hyperscan databases are compiled and announced by hs_helper */
+		for (cur = cfg->workers; cur != NULL; cur = g_list_next(cur)) {
+			struct rspamd_worker_conf *cf = (struct rspamd_worker_conf *) cur->data;
+
+			if (cf->type == g_quark_from_static_string("hs_helper") && cf->enabled) {
+				cbd->need_hyperscan = TRUE;
+				break;
+			}
+		}
+	}
+#endif
+
+	msg_info("wait for warmup before accepting connections: %ud maps pending, "
+			 "%s hyperscan",
+			 rspamd_map_pending_count(cfg),
+			 cbd->need_hyperscan ? "wait for" : "do not wait for");
+
+	cbd->check_ev.data = cbd;
+	/* Check immediately as everything might be already loaded */
+	ev_timer_init(&cbd->check_ev, rspamd_worker_warmup_check, 0.0,
+				  warmup_check_interval);
+	ev_timer_start(event_loop, &cbd->check_ev);
+}
+
 void rspamd_worker_stop_accept(struct rspamd_worker *worker)
 {
 	struct rspamd_worker_accept_event *cur, *tmp;
@@ -987,6 +1132,25 @@ rspamd_maybe_reuseport_socket(struct rspamd_worker_listen_socket *ls)
 			}
 			ls->fd = nfd;
 			nfd = -1;
+
+#if defined(SO_INCOMING_CPU) && defined(HAVE_SCHED_SETAFFINITY)
+			/* Prefer packets processed by the same CPU for the pinned workers */
+			cpu_set_t set;
+
+			if (sched_getaffinity(0, sizeof(set), &set) != -1 && CPU_COUNT(&set) == 1) {
+				int cpu;
+
+				for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+					if (CPU_ISSET(cpu, &set)) {
+						break;
+					}
+				}
+
+				if (setsockopt(ls->fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) == -1) {
+					msg_warn("cannot set SO_INCOMING_CPU on %d: %s", ls->fd, strerror(errno));
+				}
+			}
+#endif
 		}
 	}
 	else {
@@ -1013,6 +1177,253 @@ rspamd_maybe_reuseport_socket(struct rspamd_worker_listen_socket *ls)
 	return true;
 }
 
+#ifdef HAVE_SCHED_SETAFFINITY
+/* Parses cpu list in the Linux format, e.g. `0-7,16,18-19` */
+static gboolean
+rspamd_worker_parse_cpulist(const char *str, cpu_set_t *set)
+{
+	char *end;
+
+	CPU_ZERO(set);
+
+	while (*str != '\0') {
+		unsigned long first, last;
+
+		while (g_ascii_isspace(*str) || *str == ',') {
+			str++;
+		}
+
+		if (*str == '\0') {
+			break;
+		}
+
+		if (!g_ascii_isdigit(*str)) {
+			return FALSE;
+		}
+
+		first = strtoul(str, &end, 10);
+		last = first;
+		str = end;
+
+		if (*str == '-') {
+			str++;
+
+			if (!g_ascii_isdigit(*str)) {
+				return FALSE;
+			}
+
+			last = strtoul(str, &end, 10);
+			str = end;
+		}
+
+		if (last < first || last >= CPU_SETSIZE) {
+			return FALSE;
+		}
+
+		for (; first <= last; first++) {
+			CPU_SET(first, set);
+		}
+	}
+
+	return CPU_COUNT(set) > 0;
+}
+
+static int
+rspamd_worker_int_cmp(gconstpointer a, gconstpointer b)
+{
+	return *(const int *) a - *(const int *) b;
+}
+
+/*
+ * Returns CPUs of the NUMA node with the specified index (nodes are counted
+ * in the order of their ids as node ids can be sparse)
+ */
+static int
+rspamd_worker_numa_node_cpus(unsigned int idx, cpu_set_t *set)
+{
+	static const char *nodes_dir = "/sys/devices/system/node";
+	GArray *nodes;
+	GDir *dir;
+	const char *name;
+	int node = -1;
+
+	dir = g_dir_open(nodes_dir, 0, NULL);
+
+	if (dir == NULL) {
+		return -1;
+	}
+
+	nodes = g_array_new(FALSE, FALSE, sizeof(int));
+
+	while ((name = g_dir_read_name(dir)) != NULL) {
+		if (g_str_has_prefix(name, "node") && g_ascii_isdigit(name[4])) {
+			int id = atoi(name + 4);
+			g_array_append_val(nodes, id);
+		}
+	}
+
+	g_dir_close(dir);
+
+	if (nodes->len > 0) {
+		char path[PATH_MAX], *cpulist = NULL;
+
+		g_array_sort(nodes, rspamd_worker_int_cmp);
+		node = g_array_index(nodes, int, idx % nodes->len);
+		rspamd_snprintf(path, sizeof(path), "%s/node%d/cpulist", nodes_dir, node);
+
+		if (!g_file_get_contents(path, &cpulist, NULL, NULL) ||
+			!rspamd_worker_parse_cpulist(g_strstrip(cpulist), set)) {
+			node = -1;
+		}
+
+		g_free(cpulist);
+	}
+
+	g_array_free(nodes, TRUE);
+
+	return node;
+}
+
+static void
+rspamd_worker_set_mempolicy(struct rspamd_main *rspamd_main, int node)
+{
+#if defined(HAVE_SYS_SET_MEMPOLICY)
+	/* MPOL_PREFERRED from linux/mempolicy.h */
+	static const int mpol_preferred = 1;
+	static const unsigned int word_bits = sizeof(unsigned long) * 8;
+	unsigned long nodemask[16];
+
+	if ((unsigned int) node >= G_N_ELEMENTS(nodemask) * word_bits) {
+		return;
+	}
+
+	memset(nodemask, 0, sizeof(nodemask));
+	nodemask[node / word_bits] |= 1UL << (node % word_bits);
+
+	/* Kernel expects number of bits plus one */
+	if (syscall(SYS_set_mempolicy, mpol_preferred, nodemask,
+				G_N_ELEMENTS(nodemask) * word_bits + 1) == -1) {
+		msg_warn_main("cannot set preferred memory node %d: %s",
+					  node, strerror(errno));
+	}
+#endif
+}
+
+/*
+ * Returns index of a worker among workers of all types with the same
+ * affinity mode, so workers of different types are not placed on the same
+ * CPUs; indexes are stable when a worker is respawned
+ */
+static unsigned int
+rspamd_worker_affinity_index(struct rspamd_main *rspamd_main,
+							 struct rspamd_worker_conf *cf,
+							 struct rspamd_worker *wrk)
+{
+	struct rspamd_worker_conf *ocf;
+	GList *cur;
+	unsigned int index = 0;
+
+	for (cur = rspamd_main->cfg->workers; cur != NULL; cur = g_list_next(cur)) {
+		ocf = (struct rspamd_worker_conf *) cur->data;
+
+		if (ocf == cf) {
+			break;
+		}
+
+		if (ocf->worker == NULL || !ocf->enabled || ocf->count <= 0 ||
+			ocf->cpu_affinity == NULL ||
+			g_ascii_strcasecmp(ocf->cpu_affinity, cf->cpu_affinity) != 0) {
+			continue;
+		}
+
+		if (ocf->worker->flags & (RSPAMD_WORKER_UNIQUE | RSPAMD_WORKER_THREADED)) {
+			index++;
+		}
+		else {
+			index += ocf->count;
+		}
+	}
+
+	return index + wrk->index;
+}
+
+/*
+ * Sets CPU affinity of a worker:
+ * - `auto`: each worker is pinned to a single CPU in the round robin order;
+ * - `numa`: workers are bound to NUMA nodes in the round robin order and
+ * prefer memory of their node, so the data loaded by a worker after fork
+ * (hyperscan databases, maps, statistics) is node local;
+ * - list of CPUs, e.g. `0-7,16`: all workers of this type use these CPUs.
+ * The round robin order is shared by all worker types using the same mode.
+ */
+static void
+rspamd_worker_set_affinity(struct rspamd_main *rspamd_main,
+						   struct rspamd_worker_conf *cf,
+						   struct rspamd_worker *wrk)
+{
+	cpu_set_t set;
+	int node = -1;
+	unsigned int index;
+
+	if (cf->cpu_affinity == NULL) {
+		return;
+	}
+
+	index = rspamd_worker_affinity_index(rspamd_main, cf, wrk);
+
+	if (g_ascii_strcasecmp(cf->cpu_affinity, "auto") == 0) {
+		cpu_set_t allowed;
+		unsigned int i, n = 0, ncpus;
+
+		if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+			msg_warn_main("cannot get CPU affinity: %s", strerror(errno));
+			return;
+		}
+
+		ncpus = CPU_COUNT(&allowed);
+		CPU_ZERO(&set);
+
+		for (i = 0; i < CPU_SETSIZE; i++) {
+			if (CPU_ISSET(i, &allowed)) {
+				if (n++ == index % ncpus) {
+					CPU_SET(i, &set);
+					break;
+				}
+			}
+		}
+	}
+	else if (g_ascii_strcasecmp(cf->cpu_affinity, "numa") == 0) {
+		node = rspamd_worker_numa_node_cpus(index, &set);
+
+		if (node == -1) {
+			msg_warn_main("cannot get NUMA topology, CPU affinity is not set");
+			return;
+		}
+	}
+	else if (!rspamd_worker_parse_cpulist(cf->cpu_affinity, &set)) {
+		msg_err_main("invalid CPU affinity for %s worker: %s",
+					 cf->worker->name, cf->cpu_affinity);
+		return;
+	}
+
+	if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+		msg_warn_main("cannot set CPU affinity to %s for %s worker: %s",
+					  cf->cpu_affinity, cf->worker->name, strerror(errno));
+		return;
+	}
+
+	if (node != -1) {
+		rspamd_worker_set_mempolicy(rspamd_main, node);
+		msg_info_main("bound %s worker %d to NUMA node %d (%d CPUs)",
+					  cf->worker->name, wrk->index, node, CPU_COUNT(&set));
+	}
+	else {
+		msg_info_main("set CPU affinity of %s worker %d to %d CPUs",
+					  cf->worker->name, wrk->index, CPU_COUNT(&set));
+	}
+}
+#endif
+
 /**
  * Handles worker after fork returned zero
  * @param wrk
@@ -1055,6 +1466,7 @@ rspamd_handle_child_fork(struct rspamd_worker *wrk,
 	ev_signal_stop(rspamd_main->event_loop, &rspamd_main->hup_ev);
 	ev_signal_stop(rspamd_main->event_loop, &rspamd_main->usr1_ev);
 	/* Remove the inherited event base */
+	rspamd_ev_wheel_destroy(rspamd_main->event_loop);
 	ev_loop_destroy(rspamd_main->event_loop);
 	rspamd_main->event_loop = NULL;
 
@@ -1093,6 +1505,11 @@ rspamd_handle_child_fork(struct rspamd_worker *wrk,
 		}
 	}
 
+#ifdef HAVE_SCHED_SETAFFINITY
+	/* Before any worker data is allocated */
+	rspamd_worker_set_affinity(rspamd_main, cf, wrk);
+#endif
+
 	/* Reuseport before dropping privs */
 	GList *cur = cf->listen_socks;
 
@@ -1280,6 +1697,15 @@ rspamd_fork_worker(struct rspamd_main *rspamd_main,
 	wrk->type = cf->type;
 	wrk->cf = cf;
 	wrk->flags = cf->worker->flags;
+	wrk->generation = rspamd_main->generation;
+
+	if (rspamd_main->generation > 0 && rspamd_main->cfg->warmup_timeout > 0 &&
+		(wrk->flags & RSPAMD_WORKER_SCANNER) && !(wrk->flags & RSPAMD_WORKER_CONTROLLER) &&
+		cf->bind_conf) {
+		/* Previous generation serves connections until this worker is ready */
+		wrk->flags |= RSPAMD_WORKER_WARMUP;
+	}
+
 	REF_RETAIN(cf);
 	wrk->index = index;
 	wrk->ctx = cf->ctx;
@@ -76,6 +76,15 @@ void rspamd_worker_set_signal_handler(int signo,
 									  rspamd_worker_signal_cb_t handler,
 									  void *handler_data);
 
+/**
+ * Starts accepting connections for a worker spawned on reload once its maps
+ * and hyperscan databases are loaded (or `warmup_timeout` is reached) and
+ * notifies the main process; does nothing for other workers
+ * @param worker
+ * @param event_loop
+ */
+void rspamd_worker_warmup(struct rspamd_worker *worker, struct ev_loop *event_loop);
+
 /**
  * Stop accepting new connections for a worker
  * @param worker
@@ -15,6 +15,283 @@
  */
 
 #include "libev_helper.h"
+#include <math.h>
+
+/*
+ * Hierarchical timer wheel: the first level has a slot per tick, each slot of
+ * the upper levels covers the whole range of the previous level. Timers are
+ * moved (cascaded) to the lower levels when the lower level wraps, so most of
+ * timers are stopped long before they are touched by a cascade.
+ */
+#define WHEEL_ROOT_BITS 8
+#define WHEEL_LEVEL_BITS 6
+#define WHEEL_ROOT_SIZE (1u << WHEEL_ROOT_BITS)
+#define WHEEL_LEVEL_SIZE (1u << WHEEL_LEVEL_BITS)
+#define WHEEL_ROOT_MASK (WHEEL_ROOT_SIZE - 1)
+#define WHEEL_LEVEL_MASK (WHEEL_LEVEL_SIZE - 1)
+#define WHEEL_UPPER_LEVELS 3
+#define WHEEL_LEVEL_SHIFT(n) (WHEEL_ROOT_BITS + (n) * WHEEL_LEVEL_BITS)
+#define WHEEL_MAX_DELTA ((UINT64_C(1) << WHEEL_LEVEL_SHIFT(WHEEL_UPPER_LEVELS)) - 1)
+
+struct rspamd_ev_wheel {
+	struct rspamd_ev_wheel_link root[WHEEL_ROOT_SIZE];
+	struct rspamd_ev_wheel_link levels[WHEEL_UPPER_LEVELS][WHEEL_LEVEL_SIZE];
+	ev_timer tick_ev;
+	uint64_t next_tick; /* The next tick to be processed */
+	gsize count;
+};
+
+static inline void
+rspamd_ev_wheel_list_init(struct rspamd_ev_wheel_link *head)
+{
+	head->next = head;
+	head->prev = head;
+}
+
+static inline void
+rspamd_ev_wheel_list_append(struct rspamd_ev_wheel_link *head,
+							struct rspamd_ev_wheel_link *elt)
+{
+	elt->next = head;
+	elt->prev = head->prev;
+	head->prev->next = elt;
+	head->prev = elt;
+}
+
+static inline void
+rspamd_ev_wheel_list_unlink(struct rspamd_ev_wheel_link *elt)
+{
+	elt->prev->next = elt->next;
+	elt->next->prev = elt->prev;
+	elt->next = NULL;
+	elt->prev = NULL;
+}
+
+/* Moves all elements from `src` to an empty list `dst` */
+static inline void
+rspamd_ev_wheel_list_move(struct rspamd_ev_wheel_link *src,
+						  struct rspamd_ev_wheel_link *dst)
+{
+	if (src->next == src) {
+		rspamd_ev_wheel_list_init(dst);
+	}
+	else {
+		dst->next = src->next;
+		dst->prev = src->prev;
+		dst->next->prev = dst;
+		dst->prev->next = dst;
+		rspamd_ev_wheel_list_init(src);
+	}
+}
+
+static inline uint64_t
+rspamd_ev_wheel_now_tick(struct ev_loop *loop)
+{
+	return (uint64_t) (ev_now(loop) / RSPAMD_EV_WHEEL_RESOLUTION);
+}
+
+static void
+rspamd_ev_wheel_insert(struct rspamd_ev_wheel *wheel,
+					   struct rspamd_ev_wheel_timer *t)
+{
+	struct rspamd_ev_wheel_link *slot;
+	uint64_t delta, pos;
+
+	if (t->expire < wheel->next_tick) {
+		t->expire = wheel->next_tick;
+	}
+
+	delta = t->expire - wheel->next_tick;
+
+	if (delta < WHEEL_ROOT_SIZE) {
+		slot = &wheel->root[t->expire & WHEEL_ROOT_MASK];
+	}
+	else {
+		unsigned int level;
+
+		pos = t->expire;
+
+		if (delta > WHEEL_MAX_DELTA) {
+			/*
+			 * Far too long timeout: it is placed to the farthest slot and
+			 * inserted again with the real expire when that slot is cascaded
+			 */
+			delta = WHEEL_MAX_DELTA;
+			pos = wheel->next_tick + WHEEL_MAX_DELTA;
+		}
+
+		for (level = 0; level < WHEEL_UPPER_LEVELS - 1; level++) {
+			if (delta < (UINT64_C(1) << WHEEL_LEVEL_SHIFT(level + 1))) {
+				break;
+			}
+		}
+
+		slot = &wheel->levels[level][(pos >> WHEEL_LEVEL_SHIFT(level)) & WHEEL_LEVEL_MASK];
+	}
+
+	rspamd_ev_wheel_list_append(slot, &t->link);
+}
+
+/* Reinserts timers of the upper level slot and returns its index */
+static unsigned int
+rspamd_ev_wheel_cascade(struct rspamd_ev_wheel *wheel, unsigned int level)
+{
+	unsigned int idx = (wheel->next_tick >> WHEEL_LEVEL_SHIFT(level)) & WHEEL_LEVEL_MASK;
+	struct rspamd_ev_wheel_link tmp;
+
+	rspamd_ev_wheel_list_move(&wheel->levels[level][idx], &tmp);
+
+	while (tmp.next != &tmp) {
+		struct rspamd_ev_wheel_link *cur = tmp.next;
+
+		rspamd_ev_wheel_list_unlink(cur);
+		rspamd_ev_wheel_insert(wheel, (struct rspamd_ev_wheel_timer *) cur);
+	}
+
+	return idx;
+}
+
+static void
+rspamd_ev_wheel_process(struct ev_loop *loop, struct rspamd_ev_wheel *wheel,
+						uint64_t now_tick)
+{
+	struct rspamd_ev_wheel_link expired;
+
+	while (wheel->count > 0 && wheel->next_tick <= now_tick) {
+		unsigned int idx = wheel->next_tick & WHEEL_ROOT_MASK, level;
+
+		if (idx == 0) {
+			for (level = 0; level < WHEEL_UPPER_LEVELS; level++) {
+				if (rspamd_ev_wheel_cascade(wheel, level) != 0) {
+					break;
+				}
+			}
+		}
+
+		rspamd_ev_wheel_list_move(&wheel->root[idx], &expired);
+		wheel->next_tick++;
+
+		/* Callbacks can start and stop any timers including the expired ones */
+		while (expired.next != &expired) {
+			struct rspamd_ev_wheel_timer *t = (struct rspamd_ev_wheel_timer *) expired.next;
+
+			rspamd_ev_wheel_list_unlink(&t->link);
+			wheel->count--;
+			t->cb(EV_A_ t);
+		}
+	}
+}
+
+static void
+rspamd_ev_wheel_tick_cb(EV_P_ ev_timer *w, int revents)
+{
+	struct rspamd_ev_wheel *wheel = (struct rspamd_ev_wheel *) w->data;
+
+	rspamd_ev_wheel_process(EV_A_ wheel, rspamd_ev_wheel_now_tick(EV_A));
+
+	if (wheel->count == 0) {
+		ev_timer_stop(EV_A_ w);
+	}
+}
+
+static struct rspamd_ev_wheel *
+rspamd_ev_wheel_get(struct ev_loop *loop)
+{
+	struct rspamd_ev_wheel *wheel = (struct rspamd_ev_wheel *) ev_userdata(loop);
+
+	if (wheel == NULL) {
+		unsigned int i, j;
+
+		wheel = g_malloc0(sizeof(*wheel));
+
+		for (i = 0; i < WHEEL_ROOT_SIZE; i++) {
+			rspamd_ev_wheel_list_init(&wheel->root[i]);
+		}
+
+		for (i = 0; i < WHEEL_UPPER_LEVELS; i++) {
+			for (j = 0; j < WHEEL_LEVEL_SIZE; j++) {
+				rspamd_ev_wheel_list_init(&wheel->levels[i][j]);
+			}
+		}
+
+		ev_timer_init(&wheel->tick_ev, rspamd_ev_wheel_tick_cb,
+					  RSPAMD_EV_WHEEL_RESOLUTION, RSPAMD_EV_WHEEL_RESOLUTION);
+		wheel->tick_ev.data = wheel;
+		ev_set_userdata(loop, wheel);
+	}
+
+	return wheel;
+}
+
+void rspamd_ev_wheel_timer_init(struct rspamd_ev_wheel_timer *t,
+								rspamd_ev_wheel_cb cb, void *data)
+{
+	t->link.next = NULL;
+	t->link.prev = NULL;
+	t->expire = 0;
+	t->cb = cb;
+	t->data = data;
+}
+
+void rspamd_ev_wheel_timer_start(struct ev_loop *loop,
+								 struct rspamd_ev_wheel_timer *t,
+								 ev_tstamp after)
+{
+	struct rspamd_ev_wheel *wheel = rspamd_ev_wheel_get(loop);
+
+	g_assert(t->cb != NULL);
+
+	if (rspamd_ev_wheel_timer_is_active(t)) {
+		rspamd_ev_wheel_list_unlink(&t->link);
+		wheel->count--;
+	}
+
+	if (wheel->count == 0) {
+		/* Wheel is empty, so we can start it from the current tick */
+		wheel->next_tick = rspamd_ev_wheel_now_tick(loop) + 1;
+	}
+
+	/* Round up, so timer never fires too early */
+	t->expire = (uint64_t) ceil((ev_now(loop) + after) / RSPAMD_EV_WHEEL_RESOLUTION);
+	rspamd_ev_wheel_insert(wheel, t);
+	wheel->count++;
+
+	if (!ev_is_active(&wheel->tick_ev)) {
+		ev_timer_start(loop, &wheel->tick_ev);
+	}
+}
+
+void rspamd_ev_wheel_timer_stop(struct ev_loop *loop,
+								struct rspamd_ev_wheel_timer *t)
+{
+	if (rspamd_ev_wheel_timer_is_active(t)) {
+		struct rspamd_ev_wheel *wheel = (struct rspamd_ev_wheel *) ev_userdata(loop);
+
+		rspamd_ev_wheel_list_unlink(&t->link);
+		wheel->count--;
+		/* Tick timer is stopped lazily */
+	}
+}
+
+void rspamd_ev_wheel_advance(struct ev_loop *loop, ev_tstamp now)
+{
+	struct rspamd_ev_wheel *wheel = (struct rspamd_ev_wheel *) ev_userdata(loop);
+
+	if (wheel != NULL) {
+		rspamd_ev_wheel_process(loop, wheel, (uint64_t) (now / RSPAMD_EV_WHEEL_RESOLUTION));
+	}
+}
+
+void rspamd_ev_wheel_destroy(struct ev_loop *loop)
+{
+	struct rspamd_ev_wheel *wheel = (struct rspamd_ev_wheel *) ev_userdata(loop);
+
+	if (wheel != NULL) {
+		ev_timer_stop(loop, &wheel->tick_ev);
+		ev_set_userdata(loop, NULL);
+		g_free(wheel);
+	}
+}
 
 static void
 rspamd_ev_watcher_io_cb(EV_P_ struct ev_io *w, int revents)
@@ -25,7 +302,7 @@ rspamd_ev_watcher_io_cb(EV_P_ struct ev_io *w, int revents)
 }
 
 static void
-rspamd_ev_watcher_timer_cb(EV_P_ struct ev_timer *w, int revents)
+rspamd_ev_watcher_timer_cb(EV_P_ struct rspamd_ev_wheel_timer *w)
 {
 	struct rspamd_io_ev *ev = (struct rspamd_io_ev *) w->data;
 
@@ -45,8 +322,7 @@ void rspamd_ev_watcher_init(struct rspamd_io_ev *ev,
 {
 	ev_io_init(&ev->io, rspamd_ev_watcher_io_cb, fd, what);
 	ev->io.data = ev;
-	ev_init(&ev->tm, rspamd_ev_watcher_timer_cb);
-	ev->tm.data = ev;
+	rspamd_ev_wheel_timer_init(&ev->tm, rspamd_ev_watcher_timer_cb, ev);
 	ev->ud = ud;
 	ev->cb = cb;
 }
@@ -64,8 +340,22 @@ void rspamd_ev_watcher_start(struct ev_loop *loop,
 		ev_now_update_if_cheap(loop);
 
 		ev->timeout = timeout;
-		ev_timer_set(&ev->tm, timeout, 0.0);
-		ev_timer_start(EV_A, &ev->tm);
+		rspamd_ev_wheel_timer_start(EV_A, &ev->tm, timeout);
+	}
+}
+
+void rspamd_ev_watcher_start_timer(struct ev_loop *loop,
+								   struct rspamd_io_ev *ev,
+								   ev_tstamp timeout)
+{
+	g_assert(ev->cb != NULL);
+
+	if (timeout > 0) {
+		/* Update timestamp to avoid timers running early */
+		ev_now_update_if_cheap(loop);
+
+		ev->timeout = timeout;
+		rspamd_ev_wheel_timer_start(EV_A, &ev->tm, timeout);
 	}
 }
 
@@ -76,9 +366,7 @@ void rspamd_ev_watcher_stop(struct ev_loop *loop,
 		ev_io_stop(EV_A, &ev->io);
 	}
 
-	if (ev->timeout > 0) {
-		ev_timer_stop(EV_A, &ev->tm);
-	}
+	rspamd_ev_wheel_timer_stop(EV_A, &ev->tm);
 }
 
 void rspamd_ev_watcher_reschedule(struct ev_loop *loop,
@@ -99,13 +387,11 @@ void rspamd_ev_watcher_reschedule(struct ev_loop *loop,
 	}
 
 	if (ev->timeout > 0) {
-		if (!(ev_can_stop(&ev->tm))) {
+		if (!rspamd_ev_wheel_timer_is_active(&ev->tm)) {
 			/* Update timestamp to avoid timers running early */
 			ev_now_update_if_cheap(loop);
 
-			ev->tm.data = ev;
-			ev_timer_init(&ev->tm, rspamd_ev_watcher_timer_cb, ev->timeout, 0.0);
-			ev_timer_start(EV_A, &ev->tm);
+			rspamd_ev_wheel_timer_start(EV_A, &ev->tm, ev->timeout);
 		}
 	}
 }
\ No newline at end of file
@@ -32,9 +32,77 @@ extern "C" {
 
 typedef void (*rspamd_ev_cb)(int fd, short what, void *ud);
 
+/*
+ * Coarse one shot timers for timeouts that are normally stopped before they
+ * fire. Timers are kept in a hierarchical timer wheel attached to the event
+ * loop (created on demand), so start and stop are O(1) and do not touch the
+ * libev timers heap. Timers never fire earlier than requested but can fire
+ * later by up to `RSPAMD_EV_WHEEL_RESOLUTION` seconds.
+ */
+#define RSPAMD_EV_WHEEL_RESOLUTION 0.05
+
+struct rspamd_ev_wheel_timer;
+typedef void (*rspamd_ev_wheel_cb)(struct ev_loop *loop,
+								   struct rspamd_ev_wheel_timer *t);
+
+struct rspamd_ev_wheel_link {
+	struct rspamd_ev_wheel_link *next, *prev;
+};
+
+struct rspamd_ev_wheel_timer {
+	struct rspamd_ev_wheel_link link;
+	uint64_t expire;
+	rspamd_ev_wheel_cb cb;
+	void *data;
+};
+
+#define rspamd_ev_wheel_timer_is_active(t) ((t)->link.next != NULL)
+
+/**
+ * Initialize wheel timer
+ * @param t
+ * @param cb
+ * @param data
+ */
+void rspamd_ev_wheel_timer_init(struct rspamd_ev_wheel_timer *t,
+								rspamd_ev_wheel_cb cb, void *data);
+
+/**
+ * Starts (or restarts) wheel timer
+ * @param loop
+ * @param t
+ * @param after timeout in seconds
+ */
+void rspamd_ev_wheel_timer_start(struct ev_loop *loop,
+								 struct rspamd_ev_wheel_timer *t,
+								 ev_tstamp after);
+
+/**
+ * Stops wheel timer if it is active
+ * @param loop
+ * @param t
+ */
+void rspamd_ev_wheel_timer_stop(struct ev_loop *loop,
+								struct rspamd_ev_wheel_timer *t);
+
+/**
+ * Fires wheel timers of the loop as if the current time was `now`; the wheel
+ * does it by itself on each tick, so this function is intended for tests
+ * @param loop
+ * @param now
+ */
+void rspamd_ev_wheel_advance(struct ev_loop *loop, ev_tstamp now);
+
+/**
+ * Destroys timer wheel of the loop (if any), should be called before
+ * `ev_loop_destroy`; pending timers must not be used after that
+ * @param loop
+ */
+void rspamd_ev_wheel_destroy(struct ev_loop *loop);
+
 struct rspamd_io_ev {
 	ev_io io;
-	ev_timer tm;
+	struct rspamd_ev_wheel_timer tm;
 	rspamd_ev_cb cb;
 	void *ud;
 	ev_tstamp timeout;
@@ -61,6 +129,17 @@ void rspamd_ev_watcher_start(struct ev_loop *loop,
 							 struct rspamd_io_ev *ev,
 							 ev_tstamp timeout);
 
+/**
+ * Start only timeout part of the watcher, IO is performed by other means
+ * (e.g. completion based IO), the callback is called with EV_TIMER
+ * @param loop
+ * @param ev
+ * @param timeout
+ */
+void rspamd_ev_watcher_start_timer(struct ev_loop *loop,
+								   struct rspamd_io_ev *ev,
+								   ev_tstamp timeout);
+
 /**
  * Stops watcher and clean it up
  * @param loop
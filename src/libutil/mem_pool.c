@@ -1106,7 +1106,10 @@ rspamd_mempool_get_mutex(rspamd_mempool_t *pool)
 
 void rspamd_mempool_lock_mutex(rspamd_mempool_mutex_t *mutex)
 {
-	pthread_mutex_lock(mutex);
+	if (pthread_mutex_lock(mutex) == EOWNERDEAD) {
+		/* Previous owner has died while holding this robust mutex */
+		pthread_mutex_consistent(mutex);
+	}
 }
 
 void rspamd_mempool_unlock_mutex(rspamd_mempool_mutex_t *mutex)
@@ -0,0 +1,521 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "uring.h"
+#include "logger.h"
+#include "unix-std.h"
+
+#ifdef WITH_IO_URING
+
+#include <liburing.h>
+#include <sys/eventfd.h>
+
+/* Id of the provided buffers group */
+#define RSPAMD_URING_BGID 1
+#define RSPAMD_URING_MAX_BUFS 32768
+
+enum rspamd_uring_req_type {
+	RSPAMD_URING_RECV = 0,
+	RSPAMD_URING_SENDMSG,
+};
+
+struct rspamd_uring_req {
+	rspamd_uring_cb cb;
+	gpointer ud;
+	/* Not NULL while the request is in the submission queue */
+	struct io_uring_sqe *sqe;
+	struct rspamd_uring_req *next_unsubmitted;
+	enum rspamd_uring_req_type type;
+	int fd;
+	gboolean cancelled;
+	struct msghdr msg;
+	union {
+		struct sockaddr sa;
+		struct sockaddr_storage ss;
+	} addr;
+	struct iovec iov[];
+};
+
+struct rspamd_uring {
+	struct io_uring ring;
+	struct io_uring_buf_ring *br;
+	unsigned char *bufs;
+	/* Used to read directly when all provided buffers are in use */
+	unsigned char *fallback_buf;
+	gsize buf_size;
+	unsigned int nbufs;
+	int efd;
+	gboolean sync_cancel;
+	struct ev_loop *loop;
+	ev_io efd_ev;
+	ev_prepare submit_ev;
+	struct rspamd_uring_req *unsubmitted;
+};
+
+/* We have one event loop per process */
+static struct rspamd_uring *process_ring = NULL;
+
+static void
+rspamd_uring_submit(struct rspamd_uring *ring)
+{
+	struct rspamd_uring_req *req, *next;
+	int ret;
+
+	if (io_uring_sq_ready(&ring->ring) == 0) {
+		return;
+	}
+
+	ret = io_uring_submit(&ring->ring);
+
+	if (ret < 0) {
+		/* Requests are still in the queue and will be submitted on the next iteration */
+		msg_err("cannot submit io_uring requests: %s", strerror(-ret));
+
+		return;
+	}
+
+	for (req = ring->unsubmitted; req != NULL; req = next) {
+		next = req->next_unsubmitted;
+		req->sqe = NULL;
+		req->next_unsubmitted = NULL;
+	}
+
+	ring->unsubmitted = NULL;
+}
+
+static struct io_uring_sqe *
+rspamd_uring_get_sqe(struct rspamd_uring *ring, unsigned int need)
+{
+	if (io_uring_sq_space_left(&ring->ring) < need) {
+		/* Submission queue is full, flush it */
+		rspamd_uring_submit(ring);
+	}
+
+	return io_uring_get_sqe(&ring->ring);
+}
+
+static gboolean
+rspamd_uring_prep(struct rspamd_uring *ring, struct rspamd_uring_req *req, int flags)
+{
+	struct io_uring_sqe *sqe;
+
+	/* Linked request must be in the same submission as the next one */
+	sqe = rspamd_uring_get_sqe(ring, (flags & RSPAMD_URING_LINK) ? 2 : 1);
+
+	if (sqe == NULL) {
+		return FALSE;
+	}
+
+	switch (req->type) {
+	case RSPAMD_URING_RECV:
+		io_uring_prep_recv(sqe, req->fd, NULL, ring->buf_size, 0);
+		sqe->flags |= IOSQE_BUFFER_SELECT;
+		sqe->buf_group = RSPAMD_URING_BGID;
+		break;
+	case RSPAMD_URING_SENDMSG:
+		io_uring_prep_sendmsg(sqe, req->fd, &req->msg, MSG_NOSIGNAL);
+		break;
+	}
+
+	if (flags & RSPAMD_URING_LINK) {
+		sqe->flags |= IOSQE_IO_LINK;
+	}
+
+	io_uring_sqe_set_data(sqe, req);
+	req->sqe = sqe;
+	req->next_unsubmitted = ring->unsubmitted;
+	ring->unsubmitted = req;
+
+	return TRUE;
+}
+
+static inline void
+rspamd_uring_recycle_buf(struct rspamd_uring *ring, unsigned int bid)
+{
+	io_uring_buf_ring_add(ring->br, ring->bufs + (gsize) bid * ring->buf_size,
+						  ring->buf_size, bid,
+						  io_uring_buf_ring_mask(ring->nbufs), 0);
+	io_uring_buf_ring_advance(ring->br, 1);
+}
+
+static void
+rspamd_uring_process_completions(struct rspamd_uring *ring)
+{
+	struct io_uring_cqe *cqe;
+
+	/* Callbacks can submit or cancel requests, so we process cqes one by one */
+	while (io_uring_peek_cqe(&ring->ring, &cqe) == 0) {
+		struct rspamd_uring_req *req = io_uring_cqe_get_data(cqe);
+		int res = cqe->res;
+		unsigned int cflags = cqe->flags;
+		const unsigned char *buf = NULL;
+		int bid = -1;
+
+		io_uring_cqe_seen(&ring->ring, cqe);
+
+		if (cflags & IORING_CQE_F_BUFFER) {
+			bid = cflags >> IORING_CQE_BUFFER_SHIFT;
+			buf = ring->bufs + (gsize) bid * ring->buf_size;
+		}
+
+		if (req == NULL) {
+			/* Async cancel request */
+			continue;
+		}
+
+		if (!req->cancelled) {
+			if (res == -ENOBUFS && req->type == RSPAMD_URING_RECV) {
+				/*
+				 * All buffers are in use, and resubmitting the request would
+				 * fail again straight away, so we read data without the ring
+				 */
+				res = recv(req->fd, ring->fallback_buf, ring->buf_size, MSG_DONTWAIT);
+
+				if (res == -1) {
+					if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+						rspamd_uring_prep(ring, req, 0)) {
+						/* Nothing to read, so wait for data as usual */
+						continue;
+					}
+
+					res = -errno;
+				}
+				else {
+					buf = ring->fallback_buf;
+				}
+			}
+
+			req->cb(res, buf, req->ud);
+		}
+
+		if (bid >= 0) {
+			rspamd_uring_recycle_buf(ring, bid);
+		}
+
+		g_free(req);
+	}
+}
+
+static void
+rspamd_uring_efd_cb(EV_P_ ev_io *w, int revents)
+{
+	struct rspamd_uring *ring = (struct rspamd_uring *) w->data;
+	uint64_t cnt;
+
+	if (read(ring->efd, &cnt, sizeof(cnt)) == -1 && errno != EAGAIN) {
+		msg_err("cannot read io_uring eventfd: %s", strerror(errno));
+	}
+
+	rspamd_uring_process_completions(ring);
+}
+
+static void
+rspamd_uring_prepare_cb(EV_P_ ev_prepare *w, int revents)
+{
+	struct rspamd_uring *ring = (struct rspamd_uring *) w->data;
+
+	/* Loop is going to block, so submit everything planned during this iteration */
+	rspamd_uring_submit(ring);
+}
+
+struct rspamd_uring *
+rspamd_uring_new(struct ev_loop *loop, unsigned int entries,
+				 unsigned int nbufs, gsize buf_size)
+{
+	struct rspamd_uring *ring;
+	unsigned int i;
+	int ret;
+
+	if (process_ring != NULL) {
+		msg_err("io_uring is already initialised for this process");
+
+		return NULL;
+	}
+
+	ring = g_malloc0(sizeof(*ring));
+	ring->efd = -1;
+	ret = io_uring_queue_init(entries, &ring->ring, 0);
+
+	if (ret < 0) {
+		msg_info("io_uring is not available: %s", strerror(-ret));
+		g_free(ring);
+
+		return NULL;
+	}
+
+	/* Buffer ring size must be a power of two */
+	nbufs = MIN(MAX(nbufs, 1), RSPAMD_URING_MAX_BUFS);
+	ring->nbufs = 1;
+
+	while (ring->nbufs < nbufs) {
+		ring->nbufs <<= 1;
+	}
+
+	ring->buf_size = buf_size;
+	ring->br = io_uring_setup_buf_ring(&ring->ring, ring->nbufs,
+									   RSPAMD_URING_BGID, 0, &ret);
+
+	if (ring->br == NULL) {
+		msg_info("io_uring provided buffers are not available: %s", strerror(-ret));
+		io_uring_queue_exit(&ring->ring);
+		g_free(ring);
+
+		return NULL;
+	}
+
+	ring->bufs = g_malloc(ring->nbufs * buf_size);
+	ring->fallback_buf = g_malloc(buf_size);
+
+	for (i = 0; i < ring->nbufs; i++) {
+		io_uring_buf_ring_add(ring->br, ring->bufs + (gsize) i * buf_size,
+							  buf_size, i, io_uring_buf_ring_mask(ring->nbufs), i);
+	}
+
+	io_uring_buf_ring_advance(ring->br, ring->nbufs);
+
+	ring->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if (ring->efd == -1 || (ret = io_uring_register_eventfd(&ring->ring, ring->efd)) < 0) {
+		msg_err("cannot setup eventfd for io_uring: %s",
+				ring->efd == -1 ? strerror(errno) : strerror(-ret));
+
+		if (ring->efd != -1) {
+			close(ring->efd);
+		}
+
+		io_uring_free_buf_ring(&ring->ring, ring->br, ring->nbufs, RSPAMD_URING_BGID);
+		io_uring_queue_exit(&ring->ring);
+		g_free(ring->bufs);
+		g_free(ring->fallback_buf);
+		g_free(ring);
+
+		return NULL;
+	}
+
+	ring->loop = loop;
+	ring->sync_cancel = TRUE;
+
+	ev_io_init(&ring->efd_ev, rspamd_uring_efd_cb, ring->efd, EV_READ);
+	ring->efd_ev.data = ring;
+	ev_io_start(loop, &ring->efd_ev);
+	ev_prepare_init(&ring->submit_ev, rspamd_uring_prepare_cb);
+	ring->submit_ev.data = ring;
+	ev_prepare_start(loop, &ring->submit_ev);
+	/* These watchers should not keep the loop alive */
+	ev_unref(loop);
+	ev_unref(loop);
+
+	process_ring = ring;
+	msg_info("use io_uring for network IO; %ud entries, %ud buffers of %z bytes",
+			 entries, ring->nbufs, buf_size);
+
+	return ring;
+}
+
+struct rspamd_uring *
+rspamd_uring_get(struct ev_loop *loop)
+{
+	if (process_ring && process_ring->loop == loop) {
+		return process_ring;
+	}
+
+	return NULL;
+}
+
+void rspamd_uring_destroy(struct rspamd_uring *ring)
+{
+	if (ring) {
+		ev_ref(ring->loop);
+		ev_ref(ring->loop);
+		ev_io_stop(ring->loop, &ring->efd_ev);
+		ev_prepare_stop(ring->loop, &ring->submit_ev);
+		io_uring_unregister_eventfd(&ring->ring);
+		close(ring->efd);
+		io_uring_free_buf_ring(&ring->ring, ring->br, ring->nbufs, RSPAMD_URING_BGID);
+		/* Cancels all pending requests */
+		io_uring_queue_exit(&ring->ring);
+		g_free(ring->bufs);
+		g_free(ring->fallback_buf);
+
+		if (process_ring == ring) {
+			process_ring = NULL;
+		}
+
+		g_free(ring);
+	}
+}
+
+struct rspamd_uring_req *
+rspamd_uring_recv(struct rspamd_uring *ring, int fd,
+				  rspamd_uring_cb cb, gpointer ud)
+{
+	struct rspamd_uring_req *req;
+
+	req = g_malloc0(sizeof(*req));
+	req->type = RSPAMD_URING_RECV;
+	req->fd = fd;
+	req->cb = cb;
+	req->ud = ud;
+
+	if (!rspamd_uring_prep(ring, req, 0)) {
+		g_free(req);
+
+		return NULL;
+	}
+
+	return req;
+}
+
+struct rspamd_uring_req *
+rspamd_uring_sendmsg(struct rspamd_uring *ring, int fd,
+					 const struct iovec *iov, unsigned int niov,
+					 const struct sockaddr *addr, socklen_t addrlen,
+					 int flags,
+					 rspamd_uring_cb cb, gpointer ud)
+{
+	struct rspamd_uring_req *req;
+
+	if (addrlen > sizeof(req->addr)) {
+		return NULL;
+	}
+
+	req = g_malloc0(sizeof(*req) + sizeof(struct iovec) * niov);
+	req->type = RSPAMD_URING_SENDMSG;
+	req->fd = fd;
+	req->cb = cb;
+	req->ud = ud;
+	memcpy(req->iov, iov, sizeof(struct iovec) * niov);
+	req->msg.msg_iov = req->iov;
+	req->msg.msg_iovlen = niov;
+
+	if (addr) {
+		memcpy(&req->addr, addr, addrlen);
+		req->msg.msg_name = &req->addr.sa;
+		req->msg.msg_namelen = addrlen;
+	}
+
+	if (!rspamd_uring_prep(ring, req, flags)) {
+		g_free(req);
+
+		return NULL;
+	}
+
+	return req;
+}
+
+void rspamd_uring_cancel(struct rspamd_uring *ring, struct rspamd_uring_req *req)
+{
+	struct io_uring_sqe *sqe;
+	int ret;
+
+	if (req == NULL || req->cancelled) {
+		return;
+	}
+
+	/* The request itself is freed when its completion arrives */
+	req->cancelled = TRUE;
+
+	if (req->sqe) {
+		/* Not submitted yet, so we can just replace it with a no-op */
+		uint8_t link = req->sqe->flags & IOSQE_IO_LINK;
+
+		io_uring_prep_nop(req->sqe);
+		req->sqe->flags |= link;
+		io_uring_sqe_set_data(req->sqe, req);
+
+		return;
+	}
+
+	if (ring->sync_cancel) {
+		struct io_uring_sync_cancel_reg reg;
+
+		memset(&reg, 0, sizeof(reg));
+		reg.addr = (uint64_t) (uintptr_t) req;
+		reg.timeout.tv_sec = -1;
+		reg.timeout.tv_nsec = -1;
+
+		ret = io_uring_register_sync_cancel(&ring->ring, &reg);
+
+		if (ret != -EINVAL && ret != -EOPNOTSUPP) {
+			/* Either cancelled or already completed */
+			return;
+		}
+
+		/* Old kernel */
+		ring->sync_cancel = FALSE;
+	}
+
+	sqe = rspamd_uring_get_sqe(ring, 1);
+
+	if (sqe == NULL) {
+		msg_err("cannot cancel io_uring request: submission queue is full");
+
+		return;
+	}
+
+	io_uring_prep_cancel(sqe, req, 0);
+	io_uring_sqe_set_data(sqe, NULL);
+	/*
+	 * Submit it immediately: sockets are non-blocking, so the pending request
+	 * is waiting for poll and it is cancelled within this syscall
+	 */
+	rspamd_uring_submit(ring);
+}
+
+#else
+
+struct rspamd_uring *
+rspamd_uring_new(struct ev_loop *loop, unsigned int entries,
+				 unsigned int nbufs, gsize buf_size)
+{
+	msg_info("rspamd is built without io_uring support");
+
+	return NULL;
+}
+
+struct rspamd_uring *
+rspamd_uring_get(struct ev_loop *loop)
+{
+	return NULL;
+}
+
+void rspamd_uring_destroy(struct rspamd_uring *ring)
+{
+}
+
+struct rspamd_uring_req *
+rspamd_uring_recv(struct rspamd_uring *ring, int fd,
+				  rspamd_uring_cb cb, gpointer ud)
+{
+	return NULL;
+}
+
+struct rspamd_uring_req *
+rspamd_uring_sendmsg(struct rspamd_uring *ring, int fd,
+					 const struct iovec *iov, unsigned int niov,
+					 const struct sockaddr *addr, socklen_t addrlen,
+					 int flags,
+					 rspamd_uring_cb cb, gpointer ud)
+{
+	return NULL;
+}
+
+void rspamd_uring_cancel(struct rspamd_uring *ring, struct rspamd_uring_req *req)
+{
+}
+
+#endif
@@ -0,0 +1,126 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RSPAMD_URING_H
+#define RSPAMD_URING_H
+
+#include "config.h"
+#include "contrib/libev/ev.h"
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Completion based network IO built on top of io_uring.
+ *
+ * Requests are queued to the submission ring and submitted all together right
+ * before the event loop blocks, completions are delivered to the event loop via
+ * an eventfd. Reads use buffers provided by the ring, so a connection that waits
+ * for data does not own any buffer. All requests are one shot and callbacks are
+ * called from the event loop.
+ *
+ * If rspamd is built without io_uring support, `rspamd_uring_get` always
+ * returns NULL and the callers should use readiness based IO.
+ */
+struct rspamd_uring;
+struct rspamd_uring_req;
+
+enum rspamd_uring_req_flags {
+	RSPAMD_URING_DEFAULT = 0,
+	/* The next request submitted is started only after this one has succeeded */
+	RSPAMD_URING_LINK = (1u << 0u),
+};
+
+/**
+ * Completion callback, the request is destroyed after this callback returns
+ * @param res number of bytes transferred or negative errno
+ * @param buf data received for read requests, owned by the ring and valid during the callback only
+ * @param ud user data
+ */
+typedef void (*rspamd_uring_cb)(gssize res, const unsigned char *buf, gpointer ud);
+
+/**
+ * Creates a new ring for the specified event loop (one ring per process)
+ * @param loop event loop
+ * @param entries size of the submission queue
+ * @param nbufs number of read buffers (rounded up to a power of two)
+ * @param buf_size size of each read buffer
+ * @return new ring or NULL if io_uring is not available
+ */
+struct rspamd_uring *rspamd_uring_new(struct ev_loop *loop, unsigned int entries,
+									  unsigned int nbufs, gsize buf_size);
+
+/**
+ * Returns ring attached to the specified event loop if any
+ * @param loop
+ * @return ring or NULL
+ */
+struct rspamd_uring *rspamd_uring_get(struct ev_loop *loop);
+
+/**
+ * Destroys ring, callbacks of the pending requests are not called
+ * @param ring
+ */
+void rspamd_uring_destroy(struct rspamd_uring *ring);
+
+/**
+ * Plans reading from a socket into a ring provided buffer
+ * @param ring
+ * @param fd
+ * @param cb
+ * @param ud
+ * @return request handle or NULL on error
+ */
+struct rspamd_uring_req *rspamd_uring_recv(struct rspamd_uring *ring, int fd,
+										   rspamd_uring_cb cb, gpointer ud);
+
+/**
+ * Plans writing of iovec to a socket; iovec array and address are copied but the
+ * data they point to must be kept until the request is completed or cancelled
+ * @param ring
+ * @param fd
+ * @param iov
+ * @param niov
+ * @param addr destination address (can be NULL)
+ * @param addrlen
+ * @param flags see `enum rspamd_uring_req_flags`
+ * @param cb
+ * @param ud
+ * @return request handle or NULL on error
+ */
+struct rspamd_uring_req *rspamd_uring_sendmsg(struct rspamd_uring *ring, int fd,
+											  const struct iovec *iov, unsigned int niov,
+											  const struct sockaddr *addr, socklen_t addrlen,
+											  int flags,
+											  rspamd_uring_cb cb, gpointer ud);
+
+/**
+ * Cancels a pending request; when this function returns, the kernel no longer
+ * accesses any data of the request and the callback is never called
+ * @param ring
+ * @param req
+ */
+void rspamd_uring_cancel(struct rspamd_uring *ring, struct rspamd_uring_req *req);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
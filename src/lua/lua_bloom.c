@@ -0,0 +1,365 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "lua_common.h"
+#include "cryptobox.h"
+
+/***
+ * @module rspamd_bloom
+ * Rspamd bloom module implements bloom filters that can be used to skip lookups
+ * of keys that are definitely absent. Bits layout is the same as used by Redis
+ * bitmaps, so filters can be stored in Redis using `SETBIT` or `BITFIELD` with
+ * bits offsets returned by `positions` and merged from the strings returned by `GET`.
+ *
+ * @example
+local rspamd_bloom = require "rspamd_bloom"
+local bf = rspamd_bloom.create(1024 * 1024, 4)
+bf:add('test')
+bf:check('test') -- true
+bf:check('other') -- false (most likely)
+ */
+
+/***
+ * @function rspamd_bloom.create(nbits, [nhashes])
+ * Creates a new empty bloom filter
+ * @param {number} nbits number of bits, rounded up to the power of two
+ * @param {number} nhashes number of hash functions (4 by default)
+ * @return {rspamd_bloom} bloom filter object
+ */
+LUA_FUNCTION_DEF(bloom, create);
+/***
+ * @method rspamd_bloom:add(key)
+ * Adds key to the filter
+ * @param {string|text} key key to add
+ */
+LUA_FUNCTION_DEF(bloom, add);
+/***
+ * @method rspamd_bloom:check(key)
+ * Checks if a key might be in the filter
+ * @param {string|text} key key to check
+ * @return {boolean} `false` if key is definitely absent, `true` otherwise
+ */
+LUA_FUNCTION_DEF(bloom, check);
+/***
+ * @method rspamd_bloom:positions(key)
+ * Returns bits offsets that are set for the key, e.g. to set them in Redis
+ * @param {string|text} key key
+ * @return {table|number} array of bits offsets
+ */
+LUA_FUNCTION_DEF(bloom, positions);
+/***
+ * @method rspamd_bloom:merge(other)
+ * Merges another filter with the same parameters or a bitmap string (e.g.
+ * obtained from Redis) to this filter
+ * @param {rspamd_bloom|string|text} other filter or bitmap
+ * @return {boolean} `true` if data has been merged
+ */
+LUA_FUNCTION_DEF(bloom, merge);
+/***
+ * @method rspamd_bloom:reset()
+ * Removes all keys from the filter
+ */
+LUA_FUNCTION_DEF(bloom, reset);
+/***
+ * @method rspamd_bloom:get_size()
+ * Returns number of bits in the filter
+ * @return {number} number of bits
+ */
+LUA_FUNCTION_DEF(bloom, get_size);
+LUA_FUNCTION_DEF(bloom, dtor);
+
+static const struct luaL_reg bloomlib_m[] = {
+	LUA_INTERFACE_DEF(bloom, add),
+	LUA_INTERFACE_DEF(bloom, check),
+	LUA_INTERFACE_DEF(bloom, positions),
+	LUA_INTERFACE_DEF(bloom, merge),
+	LUA_INTERFACE_DEF(bloom, reset),
+	LUA_INTERFACE_DEF(bloom, get_size),
+	{"__tostring", rspamd_lua_class_tostring},
+	{"__gc", lua_bloom_dtor},
+	{NULL, NULL}};
+
+static const struct luaL_reg bloomlib_f[] = {
+	LUA_INTERFACE_DEF(bloom, create),
+	{NULL, NULL}};
+
+/* Redis does not allow bitmaps larger than 512Mb */
+#define RSPAMD_BLOOM_MAX_BITS (G_GUINT64_CONSTANT(1) << 32u)
+#define RSPAMD_BLOOM_MIN_BITS 64
+#define RSPAMD_BLOOM_MAX_HASHES 16
+/* Seeds must never be changed as filters can be shared between hosts */
+#define RSPAMD_BLOOM_SEED1 G_GUINT64_CONSTANT(0xb5a1c9e9d8a3f2e7)
+#define RSPAMD_BLOOM_SEED2 G_GUINT64_CONSTANT(0x6c8e9cf570932bd5)
+
+struct rspamd_lua_bloom {
+	uint64_t nbits;
+	unsigned int nhashes;
+	unsigned char *bits;
+};
+
+static struct rspamd_lua_bloom *
+lua_check_bloom(lua_State *L, int pos)
+{
+	void *ud = rspamd_lua_check_udata(L, pos, rspamd_bloom_classname);
+
+	luaL_argcheck(L, ud != NULL, pos, "'bloom' expected");
+	return ud ? *((struct rspamd_lua_bloom **) ud) : NULL;
+}
+
+/*
+ * Double hashing: bit i is h1 + i * h2, the same positions are used for
+ * checks, inserts and Redis updates
+ */
+static inline void
+lua_bloom_hashes(const struct rspamd_lua_bloom *bf, const char *key, gsize keylen,
+				 uint64_t *h1, uint64_t *h2)
+{
+	*h1 = rspamd_cryptobox_fast_hash_specific(RSPAMD_CRYPTOBOX_XXHASH64,
+											  key, keylen, RSPAMD_BLOOM_SEED1);
+	/* Odd step visits all bits as the size is a power of two */
+	*h2 = rspamd_cryptobox_fast_hash_specific(RSPAMD_CRYPTOBOX_XXHASH64,
+											  key, keylen, RSPAMD_BLOOM_SEED2) |
+		  1;
+}
+
+static inline uint64_t
+lua_bloom_position(const struct rspamd_lua_bloom *bf, uint64_t h1, uint64_t h2,
+				   unsigned int i)
+{
+	return (h1 + i * h2) & (bf->nbits - 1);
+}
+
+/* Redis bitmaps order: bit 0 is the most significant bit of the first byte */
+#define BLOOM_BYTE(pos) ((pos) >> 3u)
+#define BLOOM_MASK(pos) (0x80u >> ((pos) & 7u))
+
+static int
+lua_bloom_create(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_bloom *bf, **pbf;
+	uint64_t nbits = luaL_checknumber(L, 1), real_bits = RSPAMD_BLOOM_MIN_BITS;
+	unsigned int nhashes = 4;
+
+	if (lua_isnumber(L, 2)) {
+		nhashes = lua_tointeger(L, 2);
+	}
+
+	if (nbits == 0 || nbits > RSPAMD_BLOOM_MAX_BITS ||
+		nhashes == 0 || nhashes > RSPAMD_BLOOM_MAX_HASHES) {
+		return luaL_error(L, "invalid arguments: bits = %d, hashes = %d",
+						  (int) nbits, (int) nhashes);
+	}
+
+	while (real_bits < nbits) {
+		real_bits <<= 1u;
+	}
+
+	bf = g_malloc(sizeof(*bf));
+	bf->nbits = real_bits;
+	bf->nhashes = nhashes;
+	bf->bits = g_malloc0(real_bits / 8u);
+
+	pbf = lua_newuserdata(L, sizeof(*pbf));
+	rspamd_lua_setclass(L, rspamd_bloom_classname, -1);
+	*pbf = bf;
+
+	return 1;
+}
+
+static int
+lua_bloom_add(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_bloom *bf = lua_check_bloom(L, 1);
+	struct rspamd_lua_text *t = lua_check_text_or_string(L, 2);
+	uint64_t h1, h2, pos;
+
+	if (bf == NULL || t == NULL) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	lua_bloom_hashes(bf, t->start, t->len, &h1, &h2);
+
+	for (unsigned int i = 0; i < bf->nhashes; i++) {
+		pos = lua_bloom_position(bf, h1, h2, i);
+		bf->bits[BLOOM_BYTE(pos)] |= BLOOM_MASK(pos);
+	}
+
+	return 0;
+}
+
+static int
+lua_bloom_check(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_bloom *bf = lua_check_bloom(L, 1);
+	struct rspamd_lua_text *t = lua_check_text_or_string(L, 2);
+	uint64_t h1, h2, pos;
+
+	if (bf == NULL || t == NULL) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	lua_bloom_hashes(bf, t->start, t->len, &h1, &h2);
+
+	for (unsigned int i = 0; i < bf->nhashes; i++) {
+		pos = lua_bloom_position(bf, h1, h2, i);
+
+		if (!(bf->bits[BLOOM_BYTE(pos)] & BLOOM_MASK(pos))) {
+			lua_pushboolean(L, false);
+
+			return 1;
+		}
+	}
+
+	lua_pushboolean(L, true);
+
+	return 1;
+}
+
+static int
+lua_bloom_positions(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_bloom *bf = lua_check_bloom(L, 1);
+	struct rspamd_lua_text *t = lua_check_text_or_string(L, 2);
+	uint64_t h1, h2;
+
+	if (bf == NULL || t == NULL) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	lua_bloom_hashes(bf, t->start, t->len, &h1, &h2);
+	lua_createtable(L, bf->nhashes, 0);
+
+	for (unsigned int i = 0; i < bf->nhashes; i++) {
+		lua_pushinteger(L, lua_bloom_position(bf, h1, h2, i));
+		lua_rawseti(L, -2, i + 1);
+	}
+
+	return 1;
+}
+
+static int
+lua_bloom_merge(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_bloom *bf = lua_check_bloom(L, 1);
+	const unsigned char *src;
+	gsize len;
+
+	if (bf == NULL) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	if (lua_type(L, 2) == LUA_TUSERDATA &&
+		rspamd_lua_check_udata_maybe(L, 2, rspamd_bloom_classname)) {
+		struct rspamd_lua_bloom *other = lua_check_bloom(L, 2);
+
+		if (other->nbits != bf->nbits || other->nhashes != bf->nhashes) {
+			lua_pushboolean(L, false);
+
+			return 1;
+		}
+
+		src = other->bits;
+		len = other->nbits / 8u;
+	}
+	else {
+		struct rspamd_lua_text *t = lua_check_text_or_string(L, 2);
+
+		if (t == NULL) {
+			return luaL_error(L, "invalid arguments");
+		}
+
+		/* Redis strips trailing zero bytes, so a bitmap can be shorter */
+		if (t->len > bf->nbits / 8u) {
+			lua_pushboolean(L, false);
+
+			return 1;
+		}
+
+		src = (const unsigned char *) t->start;
+		len = t->len;
+	}
+
+	for (gsize i = 0; i < len; i++) {
+		bf->bits[i] |= src[i];
+	}
+
+	lua_pushboolean(L, true);
+
+	return 1;
+}
+
+static int
+lua_bloom_reset(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_bloom *bf = lua_check_bloom(L, 1);
+
+	if (bf == NULL) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	memset(bf->bits, 0, bf->nbits / 8u);
+
+	return 0;
+}
+
+static int
+lua_bloom_get_size(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_bloom *bf = lua_check_bloom(L, 1);
+
+	if (bf == NULL) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	lua_pushinteger(L, bf->nbits);
+
+	return 1;
+}
+
+static int
+lua_bloom_dtor(lua_State *L)
+{
+	struct rspamd_lua_bloom *bf = lua_check_bloom(L, 1);
+
+	if (bf) {
+		g_free(bf->bits);
+		g_free(bf);
+	}
+
+	return 0;
+}
+
+static int
+lua_load_bloom(lua_State *L)
+{
+	lua_newtable(L);
+	luaL_register(L, NULL, bloomlib_f);
+
+	return 1;
+}
+
+void luaopen_bloom(lua_State *L)
+{
+	rspamd_lua_new_class(L, rspamd_bloom_classname, bloomlib_m);
+	lua_pop(L, 1);
+	rspamd_lua_add_preload(L, "rspamd_bloom", lua_load_bloom);
+}
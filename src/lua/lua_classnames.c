@@ -20,6 +20,7 @@
 #include "lua_classnames.h"
 
 const char *rspamd_archive_classname = "rspamd{archive}";
+const char *rspamd_bloom_classname = "rspamd{bloom}";
 const char *rspamd_cdb_builder_classname = "rspamd{cdb_builder}";
 const char *rspamd_cdb_classname = "rspamd{cdb}";
 const char *rspamd_classifier_classname = "rspamd{classifier}";
@@ -50,11 +51,13 @@ const char *rspamd_rsa_privkey_classname = "rspamd{rsa_privkey}";
 const char *rspamd_rsa_pubkey_classname = "rspamd{rsa_pubkey}";
 const char *rspamd_rsa_signature_classname = "rspamd{rsa_signature}";
 const char *rspamd_session_classname = "rspamd{session}";
+const char *rspamd_shared_cache_classname = "rspamd{shared_cache}";
 const char *rspamd_spf_record_classname = "rspamd{spf_record}";
 const char *rspamd_sqlite3_stmt_classname = "rspamd{sqlite3_stmt}";
 const char *rspamd_sqlite3_classname = "rspamd{sqlite3}";
 const char *rspamd_statfile_classname = "rspamd{statfile}";
 const char *rspamd_task_classname = "rspamd{task}";
+const char *rspamd_task_timer_classname = "rspamd{task_timer}";
 const char *rspamd_tcp_sync_classname = "rspamd{tcp_sync}";
 const char *rspamd_tcp_classname = "rspamd{tcp}";
 const char *rspamd_tensor_classname = "rspamd{tensor}";
@@ -63,6 +66,7 @@ const char *rspamd_text_classname = "rspamd{text}";
 const char *rspamd_trie_classname = "rspamd{trie}";
 const char *rspamd_upstream_list_classname = "rspamd{upstream_list}";
 const char *rspamd_upstream_classname = "rspamd{upstream}";
+const char *rspamd_url_feed_classname = "rspamd{url_feed}";
 const char *rspamd_url_classname = "rspamd{url}";
 const char *rspamd_worker_classname = "rspamd{worker}";
 const char *rspamd_zstd_compress_classname = "rspamd{zstd_compress}";
@@ -86,6 +90,7 @@ RSPAMD_CONSTRUCTOR(rspamd_lua_init_classnames)
 	kh_resize(rspamd_lua_static_classes, lua_static_classes, RSPAMD_MAX_LUA_CLASSES);
 
 	CLASS_PUT_STR(archive);
+	CLASS_PUT_STR(bloom);
 	CLASS_PUT_STR(cdb_builder);
 	CLASS_PUT_STR(cdb);
 	CLASS_PUT_STR(classifier);
@@ -116,11 +121,13 @@ RSPAMD_CONSTRUCTOR(rspamd_lua_init_classnames)
 	CLASS_PUT_STR(rsa_pubkey);
 	CLASS_PUT_STR(rsa_signature);
 	CLASS_PUT_STR(session);
+	CLASS_PUT_STR(shared_cache);
 	CLASS_PUT_STR(spf_record);
 	CLASS_PUT_STR(sqlite3_stmt);
 	CLASS_PUT_STR(sqlite3);
 	CLASS_PUT_STR(statfile);
 	CLASS_PUT_STR(task);
+	CLASS_PUT_STR(task_timer);
 	CLASS_PUT_STR(tcp_sync);
 	CLASS_PUT_STR(tcp);
 	CLASS_PUT_STR(tensor);
@@ -129,6 +136,7 @@ RSPAMD_CONSTRUCTOR(rspamd_lua_init_classnames)
 	CLASS_PUT_STR(trie);
 	CLASS_PUT_STR(upstream_list);
 	CLASS_PUT_STR(upstream);
+	CLASS_PUT_STR(url_feed);
 	CLASS_PUT_STR(url);
 	CLASS_PUT_STR(worker);
 	CLASS_PUT_STR(zstd_compress);
@@ -23,6 +23,7 @@
  */
 
 extern const char *rspamd_archive_classname;
+extern const char *rspamd_bloom_classname;
 extern const char *rspamd_cdb_builder_classname;
 extern const char *rspamd_cdb_classname;
 extern const char *rspamd_classifier_classname;
@@ -53,11 +54,13 @@ extern const char *rspamd_rsa_privkey_classname;
 extern const char *rspamd_rsa_pubkey_classname;
 extern const char *rspamd_rsa_signature_classname;
 extern const char *rspamd_session_classname;
+extern const char *rspamd_shared_cache_classname;
 extern const char *rspamd_spf_record_classname;
 extern const char *rspamd_sqlite3_stmt_classname;
 extern const char *rspamd_sqlite3_classname;
 extern const char *rspamd_statfile_classname;
 extern const char *rspamd_task_classname;
+extern const char *rspamd_task_timer_classname;
 extern const char *rspamd_tcp_sync_classname;
 extern const char *rspamd_tcp_classname;
 extern const char *rspamd_tensor_classname;
@@ -66,13 +69,14 @@ extern const char *rspamd_text_classname;
 extern const char *rspamd_trie_classname;
 extern const char *rspamd_upstream_list_classname;
 extern const char *rspamd_upstream_classname;
+extern const char *rspamd_url_feed_classname;
 extern const char *rspamd_url_classname;
 extern const char *rspamd_worker_classname;
 extern const char *rspamd_zstd_compress_classname;
 extern const char *rspamd_zstd_decompress_classname;
 
 /* Keep it consistent when adding new classes */
-#define RSPAMD_MAX_LUA_CLASSES 48
+#define RSPAMD_MAX_LUA_CLASSES 52
 
 /*
  * Return a static class name for a given name (only for known classes) or NULL
@@ -376,6 +376,12 @@ void luaopen_regexp(lua_State *L);
 
 void luaopen_cdb(lua_State *L);
 
+void luaopen_bloom(lua_State *L);
+
+void luaopen_shared_cache(lua_State *L);
+
+void luaopen_url_feed(lua_State *L);
+
 void luaopen_xmlrpc(lua_State *L);
 
 void luaopen_http(lua_State *L);
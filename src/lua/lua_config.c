@@ -21,6 +21,7 @@
 #include "libmime/lang_detection.h"
 #include "lua/lua_map.h"
 #include "lua/lua_thread_pool.h"
+#include "libserver/counters.h"
 #include "utlist.h"
 #include <math.h>
 
@@ -563,6 +564,14 @@ LUA_FUNCTION_DEF(config, replace_regexp);
  */
 LUA_FUNCTION_DEF(config, register_worker_script);
 
+/***
+ * @method rspamd_config:has_worker(worker_type)
+ * Checks if a worker of the specified type is defined in the configuration
+ * @param {string} worker_type worker type (e.g. "neural_trainer")
+ * @return {boolean} `true` if such a worker is configured
+ */
+LUA_FUNCTION_DEF(config, has_worker);
+
 /***
  * @method rspamd_config:add_on_load(function(cfg, ev_base, worker) ... end)
  * Registers the following script to be executed when configuration is completely loaded
@@ -851,6 +860,44 @@ LUA_FUNCTION_DEF(config, get_dns_max_requests);
  */
 LUA_FUNCTION_DEF(config, get_dns_timeout);
 
+/***
+ * @method rspamd_config:register_counter(name[, help[, type]])
+ * Registers a counter shared between all workers and exported by the controller
+ * in `/metrics` and `/stat`. Name can include openmetrics labels, e.g.
+ * `my_hits_total{rule="foo"}`; backslashes, double quotes and newlines in label
+ * values must be escaped as `\\`, `\"` and `\n`. If a counter with the same
+ * name already exists, then its id is returned.
+ * @param {string} name name of the counter
+ * @param {string} help description of the counter
+ * @param {string} type `counter` (default) or `gauge`
+ * @return {number} counter id or nil on error
+ */
+LUA_FUNCTION_DEF(config, register_counter);
+
+/***
+ * @method rspamd_config:counter_add(id[, value])
+ * Adds value (1 by default) to the counter registered by `register_counter`
+ * @param {number} id counter id
+ * @param {number} value value to add
+ */
+LUA_FUNCTION_DEF(config, counter_add);
+
+/***
+ * @method rspamd_config:counter_set(id, value)
+ * Sets value of the gauge registered by `register_counter`
+ * @param {number} id counter id
+ * @param {number} value new value
+ */
+LUA_FUNCTION_DEF(config, counter_set);
+
+/***
+ * @method rspamd_config:counter_get(id)
+ * Returns the current value of the counter summed over all workers
+ * @param {number} id counter id
+ * @return {number} counter value
+ */
+LUA_FUNCTION_DEF(config, counter_get);
+
 static const struct luaL_reg configlib_m[] = {
 	LUA_INTERFACE_DEF(config, get_module_opt),
 	LUA_INTERFACE_DEF(config, get_mempool),
@@ -893,6 +940,7 @@ static const struct luaL_reg configlib_m[] = {
 	LUA_INTERFACE_DEF(config, register_regexp),
 	LUA_INTERFACE_DEF(config, replace_regexp),
 	LUA_INTERFACE_DEF(config, register_worker_script),
+	LUA_INTERFACE_DEF(config, has_worker),
 	LUA_INTERFACE_DEF(config, register_re_selector),
 	LUA_INTERFACE_DEF(config, add_on_load),
 	LUA_INTERFACE_DEF(config, add_periodic),
@@ -925,6 +973,10 @@ static const struct luaL_reg configlib_m[] = {
 	LUA_INTERFACE_DEF(config, get_tld_path),
 	LUA_INTERFACE_DEF(config, get_dns_max_requests),
 	LUA_INTERFACE_DEF(config, get_dns_timeout),
+	LUA_INTERFACE_DEF(config, register_counter),
+	LUA_INTERFACE_DEF(config, counter_add),
+	LUA_INTERFACE_DEF(config, counter_set),
+	LUA_INTERFACE_DEF(config, counter_get),
 	{"__tostring", rspamd_lua_class_tostring},
 	{"__newindex", lua_config_newindex},
 	{NULL, NULL}};
@@ -3195,6 +3247,35 @@ lua_config_register_worker_script(lua_State *L)
 	return 1;
 }
 
+static int
+lua_config_has_worker(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_config *cfg = lua_check_config(L, 1);
+	const char *worker_type = luaL_checkstring(L, 2);
+	struct rspamd_worker_conf *cf;
+	GList *cur;
+	gboolean found = FALSE;
+
+	if (cfg == NULL || worker_type == NULL) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	for (cur = g_list_first(cfg->workers); cur != NULL; cur = g_list_next(cur)) {
+		cf = cur->data;
+
+		if (cf->enabled && cf->count > 0 &&
+			g_ascii_strcasecmp(g_quark_to_string(cf->type), worker_type) == 0) {
+			found = TRUE;
+			break;
+		}
+	}
+
+	lua_pushboolean(L, found);
+
+	return 1;
+}
+
 static int
 lua_config_add_on_load(lua_State *L)
 {
@@ -4683,6 +4764,88 @@ lua_config_get_dns_timeout(lua_State *L)
 	return 1;
 }
 
+static int
+lua_config_register_counter(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_config *cfg = lua_check_config(L, 1);
+	const char *name = luaL_checkstring(L, 2),
+			   *help = luaL_optstring(L, 3, NULL),
+			   *type_str = luaL_optstring(L, 4, "counter");
+	enum rspamd_counter_type type;
+	int id;
+
+	if (cfg == NULL || name == NULL) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	if (strcmp(type_str, "counter") == 0) {
+		type = RSPAMD_COUNTER_COUNTER;
+	}
+	else if (strcmp(type_str, "gauge") == 0) {
+		type = RSPAMD_COUNTER_GAUGE;
+	}
+	else {
+		return luaL_error(L, "invalid counter type: %s", type_str);
+	}
+
+	id = rspamd_counter_register(name, help, type);
+
+	if (id >= 0) {
+		lua_pushinteger(L, id);
+	}
+	else {
+		lua_pushnil(L);
+	}
+
+	return 1;
+}
+
+static int
+lua_config_counter_add(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_config *cfg = lua_check_config(L, 1);
+
+	if (cfg == NULL || lua_type(L, 2) != LUA_TNUMBER) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	rspamd_counter_add(lua_tointeger(L, 2), luaL_optinteger(L, 3, 1));
+
+	return 0;
+}
+
+static int
+lua_config_counter_set(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_config *cfg = lua_check_config(L, 1);
+
+	if (cfg == NULL || lua_type(L, 2) != LUA_TNUMBER || lua_type(L, 3) != LUA_TNUMBER) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	rspamd_counter_set(lua_tointeger(L, 2), lua_tointeger(L, 3));
+
+	return 0;
+}
+
+static int
+lua_config_counter_get(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_config *cfg = lua_check_config(L, 1);
+
+	if (cfg == NULL || lua_type(L, 2) != LUA_TNUMBER) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	lua_pushinteger(L, rspamd_counter_get(lua_tointeger(L, 2)));
+
+	return 1;
+}
+
 static int
 lua_monitored_alive(lua_State *L)
 {
@@ -15,6 +15,7 @@
  */
 #include "lua_common.h"
 #include "expression.h"
+#include "libmime/mime_expressions.h"
 
 /***
  * @module rspamd_expression
@@ -52,6 +53,28 @@ pool:destroy()
  */
 LUA_FUNCTION_DEF(expr, create);
 
+/***
+ * @function rspamd_expression.create_mime(line, cfg, [functions])
+ * Create expression from the line using mime atoms, the same as used by the regexp
+ * module. Regular expressions atoms are registered in the regexps cache, so they
+ * are matched all together for the specific class and they are not passed to Lua
+ * on processing.
+ * @param {string} line expression line
+ * @param {rspamd_config} cfg config object
+ * @param {table} functions optional table of functions that could be referred as `lua:name` atoms
+ * @return {expr, err} expression object and error message of `expr` is nil
+ * @example
+local rspamd_expression = require "rspamd_expression"
+
+local expr,err = rspamd_expression.create_mime('Subject=/test/iH & !lua:check_from',
+  rspamd_config, {
+    check_from = function(task) return task:has_from('smtp') end
+  })
+-- Then in a symbol callback
+local res = expr:process(task)
+ */
+LUA_FUNCTION_DEF(expr, create_mime);
+
 /***
  * @method rspamd_expression:to_string()
  * Converts rspamd expression to string
@@ -61,7 +84,8 @@ LUA_FUNCTION_DEF(expr, to_string);
 
 /***
  * @method rspamd_expression:process([callback, ]input[, flags])
- * Executes the expression and pass input to process atom callbacks
+ * Executes the expression and pass input to process atom callbacks. Expressions
+ * created by `create_mime` accept task as input and have no callbacks
  * @param {function} callback if not specified on process, then callback must be here
  * @param {any} input input data for processing callbacks
  * @return {number} result of the expression evaluation
@@ -94,6 +118,7 @@ static const struct luaL_reg exprlib_m[] = {
 
 static const struct luaL_reg exprlib_f[] = {
 	LUA_INTERFACE_DEF(expr, create),
+	LUA_INTERFACE_DEF(expr, create_mime),
 	{NULL, NULL}};
 
 static rspamd_expression_atom_t *lua_atom_parse(const char *line, gsize len,
@@ -112,6 +137,8 @@ struct lua_expression {
 	int process_idx;
 	lua_State *L;
 	rspamd_mempool_t *pool;
+	/* Set for mime expressions only */
+	struct rspamd_config *cfg;
 };
 
 static GQuark
@@ -237,6 +264,23 @@ lua_expr_process(lua_State *L)
 	pd.e = e;
 	old_top = lua_gettop(L);
 
+	if (e->cfg != NULL) {
+		struct rspamd_task *task = lua_check_task(L, 2);
+
+		if (task == NULL) {
+			return luaL_error(L, "invalid arguments: task expected");
+		}
+
+		if (lua_isnumber(L, 3)) {
+			flags = lua_tointeger(L, 3);
+		}
+
+		res = rspamd_process_expression(e->expr, flags, task);
+		lua_pushnumber(L, res);
+
+		return 1;
+	}
+
 	if (e->process_idx == -1) {
 		if (!lua_isfunction(L, 2)) {
 			return luaL_error(L, "expression process is called with no callback function");
@@ -293,7 +337,20 @@ lua_expr_process_traced(lua_State *L)
 	pd.e = e;
 	old_top = lua_gettop(L);
 
-	if (e->process_idx == -1) {
+	if (e->cfg != NULL) {
+		struct rspamd_task *task = lua_check_task(L, 2);
+
+		if (task == NULL) {
+			return luaL_error(L, "invalid arguments: task expected");
+		}
+
+		if (lua_isnumber(L, 3)) {
+			flags = lua_tointeger(L, 3);
+		}
+
+		res = rspamd_process_expression_track(e->expr, flags, task, &trace);
+	}
+	else if (e->process_idx == -1) {
 		if (!lua_isfunction(L, 2)) {
 			return luaL_error(L, "expression process is called with no callback function");
 		}
@@ -315,7 +372,9 @@ lua_expr_process_traced(lua_State *L)
 		}
 	}
 
-	res = rspamd_process_expression_track(e->expr, flags, &pd, &trace);
+	if (e->cfg == NULL) {
+		res = rspamd_process_expression_track(e->expr, flags, &pd, &trace);
+	}
 
 	lua_settop(L, old_top);
 	lua_pushnumber(L, res);
@@ -359,6 +418,7 @@ lua_expr_create(lua_State *L)
 		e = rspamd_mempool_alloc(pool, sizeof(*e));
 		e->L = L;
 		e->pool = pool;
+		e->cfg = NULL;
 
 		/* Check callbacks */
 		if (lua_istable(L, 2)) {
@@ -437,6 +497,68 @@ lua_expr_create(lua_State *L)
 	return 2;
 }
 
+static int
+lua_expr_create_mime(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct lua_expression *e, **pe;
+	struct rspamd_config *cfg = lua_check_config(L, 2);
+	struct rspamd_mime_expr_ud ud;
+	ucl_object_t *conf_obj = NULL;
+	const char *line;
+	gsize len;
+	GError *err = NULL;
+
+	if (lua_type(L, 1) != LUA_TSTRING || cfg == NULL ||
+		(lua_type(L, 3) != LUA_TNONE && lua_type(L, 3) != LUA_TNIL &&
+		 lua_type(L, 3) != LUA_TTABLE)) {
+		lua_pushnil(L);
+		lua_pushstring(L, "bad arguments");
+
+		return 2;
+	}
+
+	line = lua_tolstring(L, 1, &len);
+
+	if (lua_istable(L, 3)) {
+		/* Functions are converted to userdata objects as in the configuration */
+		conf_obj = ucl_object_typed_new(UCL_OBJECT);
+		ucl_object_insert_key(conf_obj, ucl_object_lua_import(L, 3),
+							  "functions", 0, false);
+		rspamd_mempool_add_destructor(cfg->cfg_pool,
+									  (rspamd_mempool_destruct_t) ucl_object_unref,
+									  conf_obj);
+	}
+
+	e = rspamd_mempool_alloc0(cfg->cfg_pool, sizeof(*e));
+	e->L = L;
+	e->pool = cfg->cfg_pool;
+	e->cfg = cfg;
+	e->parse_idx = -1;
+	e->process_idx = -1;
+
+	ud.cfg = cfg;
+	ud.conf_obj = conf_obj;
+
+	/* Atoms refer to the expression line, so it must live in the pool */
+	if (!rspamd_parse_expression(rspamd_mempool_strdup(cfg->cfg_pool, line), len,
+								 &mime_expr_subr, &ud, cfg->cfg_pool, &err,
+								 &e->expr)) {
+		lua_pushnil(L);
+		lua_pushstring(L, err->message);
+		g_error_free(err);
+
+		return 2;
+	}
+
+	pe = lua_newuserdata(L, sizeof(struct lua_expression *));
+	rspamd_lua_setclass(L, rspamd_expr_classname, -1);
+	*pe = e;
+	lua_pushnil(L);
+
+	return 2;
+}
+
 static int
 lua_expr_to_string(lua_State *L)
 {
@@ -158,11 +158,14 @@ LUA_FUNCTION_DEF(kann, destroy);
 LUA_FUNCTION_DEF(kann, save);
 LUA_FUNCTION_DEF(kann, train1);
 LUA_FUNCTION_DEF(kann, apply1);
+LUA_FUNCTION_DEF(kann, apply_batch);
+LUA_FUNCTION_DEF(kann, apply_multi);
 
 static luaL_reg rspamd_kann_m[] = {
 	LUA_INTERFACE_DEF(kann, save),
 	LUA_INTERFACE_DEF(kann, train1),
 	LUA_INTERFACE_DEF(kann, apply1),
+	LUA_INTERFACE_DEF(kann, apply_batch),
 	{"__gc", lua_kann_destroy},
 	{NULL, NULL},
 };
@@ -259,6 +262,11 @@ lua_load_kann(lua_State *L)
 	lua_pushcfunction(L, lua_kann_load);
 	lua_settable(L, -3);
 
+	/* Apply multiple anns at once */
+	lua_pushstring(L, "apply_multi");
+	lua_pushcfunction(L, lua_kann_apply_multi);
+	lua_settable(L, -3);
+
 	return 1;
 }
 
@@ -1056,6 +1064,7 @@ lua_kann_train1(lua_State *L)
 	int64_t max_epoch = 25;
 	int64_t max_drop_streak = 10;
 	double frac_val = 0.1;
+	int64_t threads = 1;
 	int cbref = -1;
 
 	if (k && lua_istable(L, 2) && lua_istable(L, 3)) {
@@ -1081,8 +1090,8 @@ lua_kann_train1(lua_State *L)
 
 			if (!rspamd_lua_parse_table_arguments(L, 4, &err,
 												  RSPAMD_LUA_PARSE_ARGUMENTS_IGNORE_MISSING,
-												  "lr=N;mini_size=I;max_epoch=I;max_drop_streak=I;frac_val=N;cb=F;pca=u{tensor}",
-												  &lr, &mini_size, &max_epoch, &max_drop_streak, &frac_val, &cbref, &pca)) {
+												  "lr=N;mini_size=I;max_epoch=I;max_drop_streak=I;frac_val=N;cb=F;pca=u{tensor};threads=I",
+												  &lr, &mini_size, &max_epoch, &max_drop_streak, &frac_val, &cbref, &pca, &threads)) {
 				n = luaL_error(L, "invalid params: %s",
 							   err ? err->message : "unknown error");
 				g_error_free(err);
@@ -1208,10 +1217,19 @@ lua_kann_train1(lua_State *L)
 		cbd.k = k;
 		cbd.L = L;
 
+		if (threads > 1) {
+			/* Split minibatches between threads */
+			kann_mt(k, threads, mini_size);
+		}
+
 		int niters = kann_train_fnn1(k, lr,
 									 mini_size, max_epoch, max_drop_streak,
 									 frac_val, n, x, y, lua_kann_train_cb, &cbd);
 
+		if (threads > 1) {
+			kann_mt(k, 0, 0);
+		}
+
 		lua_pushinteger(L, niters);
 
 		FREE_VEC(x, n);
@@ -1226,6 +1244,137 @@ lua_kann_train1(lua_State *L)
 	return 1;
 }
 
+/* Maximum number of rows evaluated in a single forward pass */
+#define LUA_KANN_MAX_BATCH 256
+
+/*
+ * Scratch buffers used by inference functions; they are reused between calls
+ * to avoid allocations on the hot path (Lua states are single threaded)
+ */
+enum lua_kann_scratch_type {
+	LUA_KANN_SCRATCH_INPUT = 0,
+	LUA_KANN_SCRATCH_PCA,
+	LUA_KANN_SCRATCH_MAX,
+};
+
+static float *
+lua_kann_get_scratch(enum lua_kann_scratch_type type, gsize nelts)
+{
+	static float *bufs[LUA_KANN_SCRATCH_MAX];
+	static gsize lens[LUA_KANN_SCRATCH_MAX];
+
+	if (lens[type] < nelts) {
+		g_free(bufs[type]);
+		lens[type] = MAX(nelts, lens[type] * 2);
+		bufs[type] = g_malloc(lens[type] * sizeof(float));
+	}
+
+	return bufs[type];
+}
+
+static void
+lua_kann_check_pca(lua_State *L, struct rspamd_lua_tensor *pca, int n_in)
+{
+	if (pca->ndims != 2) {
+		luaL_error(L, "invalid pca tensor: matrix expected, got a row");
+	}
+
+	if (pca->dim[0] != n_in) {
+		luaL_error(L, "invalid pca tensor: "
+					  "matrix must have %d rows and it has %d rows instead",
+				   n_in, pca->dim[0]);
+	}
+}
+
+/*
+ * Reads an input vector from a Lua table at `pos` into `dst` (`n_in` elements),
+ * projecting it with `pca` if it is not NULL.
+ * Returns FALSE if the table has an unexpected length
+ */
+static gboolean
+lua_kann_read_input(lua_State *L, int pos, int n_in,
+					struct rspamd_lua_tensor *pca, float *dst)
+{
+	gsize vec_len = rspamd_lua_table_size(L, pos);
+
+	if (pos < 0) {
+		pos = lua_gettop(L) + pos + 1;
+	}
+
+	if (pca) {
+		float *row;
+
+		if (vec_len != pca->dim[1]) {
+			return FALSE;
+		}
+
+		row = lua_kann_get_scratch(LUA_KANN_SCRATCH_PCA, vec_len);
+
+		for (gsize i = 0; i < vec_len; i++) {
+			lua_rawgeti(L, pos, i + 1);
+			row[i] = lua_tonumber(L, -1);
+			lua_pop(L, 1);
+		}
+
+		/* sgemm accumulates results, so output must be zeroed */
+		memset(dst, 0, sizeof(float) * n_in);
+		kad_sgemm_simple(0, 1, 1, n_in, vec_len, row, pca->data, dst);
+	}
+	else {
+		if (vec_len != n_in) {
+			return FALSE;
+		}
+
+		for (gsize i = 0; i < vec_len; i++) {
+			lua_rawgeti(L, pos, i + 1);
+			dst[i] = lua_tonumber(L, -1);
+			lua_pop(L, 1);
+		}
+	}
+
+	return TRUE;
+}
+
+/*
+ * Evaluates ANN for `batch` input rows stored contiguously in `in`.
+ * Returns output values (`batch` rows of `*outlen` elements) or NULL if
+ * ANN has no valid output layer
+ */
+static const float *
+lua_kann_forward(kann_t *k, float *in, int batch, int *outlen)
+{
+	int i_out = kann_find(k, KANN_F_OUT, 0);
+
+	if (i_out <= 0) {
+		return NULL;
+	}
+
+	kann_set_batch_size(k, batch);
+	kann_feed_bind(k, KANN_F_IN, 0, &in);
+	kad_eval_at(k->n, k->v, i_out);
+	*outlen = kad_len(k->v[i_out]) / batch;
+
+	return k->v[i_out]->x;
+}
+
+static void
+lua_kann_push_output(lua_State *L, const float *out, int outlen)
+{
+	lua_createtable(L, outlen, 0);
+
+	for (int i = 0; i < outlen; i++) {
+		lua_pushnumber(L, out[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+}
+
+/***
+ * @method kann:apply1(input[, pca])
+ * Applies ANN to a single input vector
+ * @param {table|tensor} input input vector
+ * @param {tensor} pca optional PCA matrix (only for table inputs)
+ * @return {table|tensor} output vector
+ */
 static int
 lua_kann_apply1(lua_State *L)
 {
@@ -1233,117 +1382,63 @@ lua_kann_apply1(lua_State *L)
 	struct rspamd_lua_tensor *pca = NULL;
 
 	if (k) {
-		if (lua_istable(L, 2)) {
-			gsize vec_len = rspamd_lua_table_size(L, 2);
-			float *vec = (float *) g_malloc(sizeof(float) * vec_len),
-				  *pca_out = NULL;
-			int i_out;
-			int n_in = kann_dim_in(k);
+		int n_in = kann_dim_in(k), outlen;
+		const float *out;
 
-			if (n_in <= 0) {
-				g_free(vec);
-				return luaL_error(L, "invalid inputs count: %d", n_in);
-			}
+		if (n_in <= 0) {
+			return luaL_error(L, "invalid inputs count: %d", n_in);
+		}
+
+		if (lua_istable(L, 2)) {
+			float *vec = lua_kann_get_scratch(LUA_KANN_SCRATCH_INPUT, n_in);
 
 			if (lua_isuserdata(L, 3)) {
 				pca = lua_check_tensor(L, 3);
 
-				if (pca) {
-					if (pca->ndims != 2) {
-						g_free(vec);
-						return luaL_error(L, "invalid pca tensor: matrix expected, got a row");
-					}
-
-					if (pca->dim[0] != n_in) {
-						g_free(vec);
-						return luaL_error(L, "invalid pca tensor: "
-											 "matrix must have %d rows and it has %d rows instead",
-										  n_in, pca->dim[0]);
-					}
-				}
-				else {
-					g_free(vec);
+				if (pca == NULL) {
 					return luaL_error(L, "invalid params: pca matrix expected");
 				}
-			}
-			else {
-				if (n_in != vec_len) {
-					g_free(vec);
-					return luaL_error(L, "invalid params: bad input dimension %d; %d expected",
-									  (int) vec_len, n_in);
-				}
+
+				lua_kann_check_pca(L, pca, n_in);
 			}
 
-			for (gsize i = 0; i < vec_len; i++) {
-				lua_rawgeti(L, 2, i + 1);
-				vec[i] = lua_tonumber(L, -1);
-				lua_pop(L, 1);
+			if (!lua_kann_read_input(L, 2, n_in, pca, vec)) {
+				return luaL_error(L, "invalid params: bad input dimension %d; %d expected",
+								  (int) rspamd_lua_table_size(L, 2),
+								  pca ? pca->dim[1] : n_in);
 			}
 
-			i_out = kann_find(k, KANN_F_OUT, 0);
+			out = lua_kann_forward(k, vec, 1, &outlen);
 
-			if (i_out <= 0) {
-				g_free(vec);
+			if (out == NULL) {
 				return luaL_error(L, "invalid ANN: output layer is missing or is "
 									 "at the input pos");
 			}
 
-			kann_set_batch_size(k, 1);
-			if (pca) {
-				pca_out = g_malloc(sizeof(float) * n_in);
-
-				kad_sgemm_simple(0, 1, 1, n_in,
-								 vec_len, vec, pca->data,
-								 pca_out);
-
-				kann_feed_bind(k, KANN_F_IN, 0, &pca_out);
-			}
-			else {
-				kann_feed_bind(k, KANN_F_IN, 0, &vec);
-			}
-
-			kad_eval_at(k->n, k->v, i_out);
-
-			gsize outlen = kad_len(k->v[i_out]);
-			lua_createtable(L, outlen, 0);
-
-			for (gsize i = 0; i < outlen; i++) {
-				lua_pushnumber(L, k->v[i_out]->x[i]);
-				lua_rawseti(L, -2, i + 1);
-			}
-
-			g_free(vec);
-			g_free(pca_out);
+			lua_kann_push_output(L, out, outlen);
 		}
 		else if (lua_isuserdata(L, 2)) {
 			struct rspamd_lua_tensor *t = lua_check_tensor(L, 2);
 
 			if (t && t->ndims == 1) {
-				int i_out;
-				int n_in = kann_dim_in(k);
+				struct rspamd_lua_tensor *res;
 
 				if (n_in != t->dim[0]) {
 					return luaL_error(L, "invalid params: bad input dimension %d; %d expected",
 									  (int) t->dim[0], n_in);
 				}
 
-				i_out = kann_find(k, KANN_F_OUT, 0);
+				out = lua_kann_forward(k, t->data, 1, &outlen);
 
-				if (i_out <= 0) {
+				if (out == NULL) {
 					return luaL_error(L, "invalid ANN: output layer is missing or is "
 										 "at the input pos");
 				}
 
-				kann_set_batch_size(k, 1);
-				kann_feed_bind(k, KANN_F_IN, 0, &t->data);
-				kad_eval_at(k->n, k->v, i_out);
-
-				int outlen = kad_len(k->v[i_out]);
-				struct rspamd_lua_tensor *out;
-				out = lua_newtensor(L, 1, &outlen, false, false);
+				res = lua_newtensor(L, 1, &outlen, false, false);
 				/* Ensure that kann and tensor have the same understanding of floats */
 				G_STATIC_ASSERT(sizeof(float) == sizeof(rspamd_tensor_num_t));
-				memcpy(out->data, k->v[i_out]->x, outlen * sizeof(float));
+				memcpy(res->data, out, outlen * sizeof(float));
 			}
 			else {
 				return luaL_error(L, "invalid arguments: 1D rspamd{tensor} expected");
@@ -1358,4 +1453,169 @@ lua_kann_apply1(lua_State *L)
 	}
 
 	return 1;
-}
\ No newline at end of file
+}
+
+/***
+ * @method kann:apply_batch(inputs[, pca])
+ * Applies ANN to many input vectors at once. Rows are evaluated in batches,
+ * so dense layers are computed as matrix products rather than row by row
+ * @param {table} inputs table of input vectors (tables of numbers)
+ * @param {tensor} pca optional PCA matrix applied to each input
+ * @return {table} table of output vectors in the same order as inputs
+ */
+static int
+lua_kann_apply_batch(lua_State *L)
+{
+	kann_t *k = lua_check_kann(L, 1);
+	struct rspamd_lua_tensor *pca = NULL;
+
+	if (k && lua_istable(L, 2)) {
+		int n = rspamd_lua_table_size(L, 2);
+		int n_in = kann_dim_in(k), outlen;
+		const float *out;
+		float *buf;
+
+		if (n_in <= 0) {
+			return luaL_error(L, "invalid inputs count: %d", n_in);
+		}
+
+		if (lua_isuserdata(L, 3)) {
+			pca = lua_check_tensor(L, 3);
+
+			if (pca == NULL) {
+				return luaL_error(L, "invalid params: pca matrix expected");
+			}
+
+			lua_kann_check_pca(L, pca, n_in);
+		}
+
+		buf = lua_kann_get_scratch(LUA_KANN_SCRATCH_INPUT,
+								   (gsize) MIN(n, LUA_KANN_MAX_BATCH) * n_in);
+		lua_createtable(L, n, 0);
+
+		for (int start = 0; start < n; start += LUA_KANN_MAX_BATCH) {
+			int batch = MIN(n - start, LUA_KANN_MAX_BATCH);
+
+			for (int s = 0; s < batch; s++) {
+				lua_rawgeti(L, 2, start + s + 1);
+
+				if (!lua_istable(L, -1) ||
+					!lua_kann_read_input(L, -1, n_in, pca, buf + (gsize) s * n_in)) {
+					return luaL_error(L, "invalid params at pos %d: "
+										 "bad input dimension %d; %d expected",
+									  start + s + 1,
+									  (int) rspamd_lua_table_size(L, -1),
+									  pca ? pca->dim[1] : n_in);
+				}
+
+				lua_pop(L, 1);
+			}
+
+			out = lua_kann_forward(k, buf, batch, &outlen);
+
+			if (out == NULL) {
+				return luaL_error(L, "invalid ANN: output layer is missing or is "
+									 "at the input pos");
+			}
+
+			for (int s = 0; s < batch; s++) {
+				lua_kann_push_output(L, out + (gsize) s * outlen, outlen);
+				lua_rawseti(L, -2, start + s + 1);
+			}
+		}
+	}
+	else {
+		return luaL_error(L, "invalid arguments: rspamd{kann} and table of inputs expected");
+	}
+
+	return 1;
+}
+
+/***
+ * @function rspamd_kann.apply_multi(anns, inputs[, pcas])
+ * Applies several ANNs to their input vectors in one call, e.g. to evaluate
+ * all neural rules for a task at once
+ * @param {table} anns array of kann objects
+ * @param {table} inputs array of input vectors, one per ann
+ * @param {table} pcas optional table of PCA matrices with the same indexes as anns
+ * @return {table} array of output vectors
+ */
+static int
+lua_kann_apply_multi(lua_State *L)
+{
+	if (lua_istable(L, 1) && lua_istable(L, 2)) {
+		int n = rspamd_lua_table_size(L, 1);
+		gboolean has_pca = lua_istable(L, 3);
+
+		if (rspamd_lua_table_size(L, 2) != n) {
+			return luaL_error(L, "invalid arguments: number of inputs must be "
+								 "equal to number of anns");
+		}
+
+		lua_createtable(L, n, 0);
+
+		for (int i = 0; i < n; i++) {
+			struct rspamd_lua_tensor *pca = NULL;
+			kann_t *k;
+			int n_in, outlen, top;
+			const float *out;
+			float *vec;
+
+			lua_rawgeti(L, 1, i + 1);
+			k = lua_check_kann(L, lua_gettop(L));
+			lua_rawgeti(L, 2, i + 1);
+			top = lua_gettop(L);
+
+			if (!lua_istable(L, top)) {
+				return luaL_error(L, "invalid arguments: table input expected at pos %d",
+								  i + 1);
+			}
+
+			if (has_pca) {
+				lua_rawgeti(L, 3, i + 1);
+
+				if (lua_isuserdata(L, -1)) {
+					pca = lua_check_tensor(L, lua_gettop(L));
+				}
+
+				lua_pop(L, 1);
+			}
+
+			n_in = kann_dim_in(k);
+
+			if (n_in <= 0) {
+				return luaL_error(L, "invalid inputs count for ann %d: %d", i + 1, n_in);
+			}
+
+			if (pca) {
+				lua_kann_check_pca(L, pca, n_in);
+			}
+
+			vec = lua_kann_get_scratch(LUA_KANN_SCRATCH_INPUT, n_in);
+
+			if (!lua_kann_read_input(L, top, n_in, pca, vec)) {
+				return luaL_error(L, "invalid params for ann %d: bad input dimension %d; %d expected",
+								  i + 1,
+								  (int) rspamd_lua_table_size(L, top),
+								  pca ? pca->dim[1] : n_in);
+			}
+
+			out = lua_kann_forward(k, vec, 1, &outlen);
+
+			if (out == NULL) {
+				return luaL_error(L, "invalid ANN %d: output layer is missing or is "
+									 "at the input pos",
+								  i + 1);
+			}
+
+			lua_pop(L, 2); /* ann and input */
+			lua_kann_push_output(L, out, outlen);
+			lua_rawseti(L, -2, i + 1);
+		}
+	}
+	else {
+		return luaL_error(L, "invalid arguments: table of anns and table of inputs expected");
+	}
+
+	return 1;
+}
@@ -16,6 +16,7 @@
 #include "lua_common.h"
 #include "lua_thread_pool.h"
 #include "utlist.h"
+#include "libutil/libev_helper.h"
 
 #include "contrib/hiredis/hiredis.h"
 #include "contrib/hiredis/async.h"
@@ -53,6 +54,8 @@ LUA_FUNCTION_DEF(redis, make_request);
 LUA_FUNCTION_DEF(redis, make_request_sync);
 LUA_FUNCTION_DEF(redis, connect);
 LUA_FUNCTION_DEF(redis, connect_sync);
+LUA_FUNCTION_DEF(redis, get_pool_stats);
+LUA_FUNCTION_DEF(redis, key_slot);
 LUA_FUNCTION_DEF(redis, add_cmd);
 LUA_FUNCTION_DEF(redis, exec);
 LUA_FUNCTION_DEF(redis, gc);
@@ -62,6 +65,8 @@ static const struct luaL_reg redislib_f[] = {
 	LUA_INTERFACE_DEF(redis, make_request_sync),
 	LUA_INTERFACE_DEF(redis, connect),
 	LUA_INTERFACE_DEF(redis, connect_sync),
+	LUA_INTERFACE_DEF(redis, get_pool_stats),
+	LUA_INTERFACE_DEF(redis, key_slot),
 	{NULL, NULL}};
 
 static const struct luaL_reg redislib_m[] = {
@@ -123,6 +128,8 @@ INIT_LOG_MODULE(lua_redis)
 #define LUA_REDIS_TERMINATED (1 << 2)
 #define LUA_REDIS_NO_POOL (1 << 3)
 #define LUA_REDIS_SUBSCRIBED (1 << 4)
+/* connection is shared with other requests (auto-pipelining) */
+#define LUA_REDIS_SHARED (1 << 5)
 #define IS_ASYNC(ctx) ((ctx)->flags & LUA_REDIS_ASYNC)
 
 struct lua_redis_request_specific_userdata {
@@ -133,7 +140,7 @@ struct lua_redis_request_specific_userdata {
 	struct lua_redis_userdata *c;
 	struct lua_redis_ctx *ctx;
 	struct lua_redis_request_specific_userdata *next;
-	ev_timer timeout_ev;
+	struct rspamd_ev_wheel_timer timeout_ev;
 	unsigned int flags;
 };
 
@@ -179,6 +186,85 @@ lua_redis_free_args(char **args, gsize *arglens, unsigned int nargs)
 	}
 }
 
+/*
+ * Removes callbacks that belong to the specific userdata from the shared
+ * connection, so the replies are silently discarded by hiredis. If `fail_cb`
+ * is not NULL, it is called with no reply for each detached callback, as
+ * hiredis does when a connection is closed
+ */
+static void
+lua_redis_detach_callbacks(redisAsyncContext *ac, struct lua_redis_userdata *ud,
+						   redisCallbackFn *fail_cb)
+{
+	redisCallback *cb;
+	struct lua_redis_request_specific_userdata *cur;
+	GPtrArray *detached = NULL;
+
+	for (cb = ac->replies.head; cb != NULL; cb = cb->next) {
+		LL_FOREACH(ud->specific, cur)
+		{
+			if (cb->privdata == cur) {
+				cb->fn = NULL;
+				cb->privdata = NULL;
+
+				if (fail_cb) {
+					if (detached == NULL) {
+						detached = g_ptr_array_new();
+					}
+
+					g_ptr_array_add(detached, cur);
+				}
+				break;
+			}
+		}
+	}
+
+	if (detached) {
+		/* Callbacks can send new commands, so they are called after the loop */
+		for (unsigned int i = 0; i < detached->len; i++) {
+			fail_cb(ac, NULL, g_ptr_array_index(detached, i));
+		}
+
+		g_ptr_array_free(detached, TRUE);
+	}
+}
+
+/*
+ * Releases connection of the context after an error or a timeout.
+ * Shared connections are used by requests of other tasks, so only pending
+ * callbacks of this context are failed and the connection is left to the pool.
+ * Otherwise, the connection is closed and hiredis calls all pending callbacks
+ * with an error.
+ */
+static void
+lua_redis_release_on_error(struct lua_redis_ctx *ctx, struct lua_redis_userdata *ud,
+						   int err, redisCallbackFn *fail_cb)
+{
+	redisAsyncContext *ac = ud->ctx;
+
+	/* Set to NULL to avoid double free in dtor */
+	ud->ctx = NULL;
+
+	if (ctx->flags & LUA_REDIS_SHARED) {
+		lua_redis_detach_callbacks(ac, ud, fail_cb);
+		rspamd_redis_pool_release_connection(ud->pool, ac,
+											 RSPAMD_REDIS_RELEASE_DEFAULT);
+	}
+	else {
+		if (err != 0) {
+			ac->err = REDIS_ERR_IO;
+			errno = err;
+		}
+
+		/*
+		 * This will call all callbacks pending so the entire context
+		 * will be destructed
+		 */
+		rspamd_redis_pool_release_connection(ud->pool, ac,
+											 RSPAMD_REDIS_RELEASE_FATAL);
+	}
+}
+
 static void
 lua_redis_dtor(struct lua_redis_ctx *ctx)
 {
@@ -194,7 +280,7 @@ lua_redis_dtor(struct lua_redis_ctx *ctx)
 
 		LL_FOREACH_SAFE(ud->specific, cur, tmp)
 		{
-			ev_timer_stop(ud->event_loop, &cur->timeout_ev);
+			rspamd_ev_wheel_timer_stop(ud->event_loop, &cur->timeout_ev);
 
 			if (!(cur->flags & LUA_REDIS_SPECIFIC_REPLIED)) {
 				is_successful = FALSE;
@@ -209,7 +295,19 @@ lua_redis_dtor(struct lua_redis_ctx *ctx)
 		ac = ud->ctx;
 		ud->ctx = NULL;
 
-		if (!is_successful) {
+		if (ctx->flags & LUA_REDIS_SHARED) {
+			/*
+			 * Other requests are still using this connection, so we just
+			 * forget about our own replies instead of closing it
+			 */
+			if (!is_successful) {
+				lua_redis_detach_callbacks(ac, ud, NULL);
+			}
+
+			rspamd_redis_pool_release_connection(ud->pool, ac,
+												 RSPAMD_REDIS_RELEASE_DEFAULT);
+		}
+		else if (!is_successful) {
 			rspamd_redis_pool_release_connection(ud->pool, ac,
 												 RSPAMD_REDIS_RELEASE_FATAL);
 		}
@@ -264,9 +362,7 @@ lua_redis_fin(void *arg)
 	ctx = sp_ud->ctx;
 	ud = sp_ud->c;
 
-	if (ev_can_stop(&sp_ud->timeout_ev)) {
-		ev_timer_stop(sp_ud->ctx->async.event_loop, &sp_ud->timeout_ev);
-	}
+	rspamd_ev_wheel_timer_stop(sp_ud->ctx->async.event_loop, &sp_ud->timeout_ev);
 
 	msg_debug_lua_redis("finished redis query %p from session %p; refcount=%d",
 						sp_ud, ctx, ctx->ref.refcount);
@@ -417,10 +513,8 @@ lua_redis_push_data(const redisReply *r, struct lua_redis_ctx *ctx,
 
 		if (sp_ud->flags & LUA_REDIS_SUBSCRIBED) {
 			if (!(sp_ud->flags & LUA_REDIS_SPECIFIC_REPLIED)) {
-				if (ev_can_stop(&sp_ud->timeout_ev)) {
-					ev_timer_stop(sp_ud->ctx->async.event_loop,
-								  &sp_ud->timeout_ev);
-				}
+				rspamd_ev_wheel_timer_stop(sp_ud->ctx->async.event_loop,
+										   &sp_ud->timeout_ev);
 			}
 		}
 
@@ -606,9 +700,7 @@ lua_redis_callback_sync(redisAsyncContext *ac, gpointer r, gpointer priv)
 		return;
 	}
 
-	if (ev_can_stop(&sp_ud->timeout_ev)) {
-		ev_timer_stop(ud->event_loop, &sp_ud->timeout_ev);
-	}
+	rspamd_ev_wheel_timer_stop(ud->event_loop, &sp_ud->timeout_ev);
 
 	if (!(sp_ud->flags & LUA_REDIS_SPECIFIC_FINISHED)) {
 		msg_debug_lua_redis("got reply from redis: %p for query %p", ac, sp_ud);
@@ -645,17 +737,8 @@ lua_redis_callback_sync(redisAsyncContext *ac, gpointer r, gpointer priv)
 		   and release it */
 
 		if (result->is_error && sp_ud->c->ctx) {
-			ac = sp_ud->c->ctx;
-			/* Set to NULL to avoid double free in dtor */
-			sp_ud->c->ctx = NULL;
 			ctx->flags |= LUA_REDIS_TERMINATED;
-
-			/*
-			 * This will call all callbacks pending so the entire context
-			 * will be destructed
-			 */
-			rspamd_redis_pool_release_connection(sp_ud->c->pool, ac,
-												 RSPAMD_REDIS_RELEASE_FATAL);
+			lua_redis_release_on_error(ctx, sp_ud->c, 0, lua_redis_callback_sync);
 		}
 
 		result->result_ref = luaL_ref(L, LUA_REGISTRYINDEX);
@@ -696,13 +779,12 @@ lua_redis_callback_sync(redisAsyncContext *ac, gpointer r, gpointer priv)
 }
 
 static void
-lua_redis_timeout_sync(EV_P_ ev_timer *w, int revents)
+lua_redis_timeout_sync(EV_P_ struct rspamd_ev_wheel_timer *w)
 {
 	struct lua_redis_request_specific_userdata *sp_ud =
 		(struct lua_redis_request_specific_userdata *) w->data;
 	struct lua_redis_ctx *ctx;
 	struct lua_redis_userdata *ud;
-	redisAsyncContext *ac;
 
 	if (sp_ud->flags & LUA_REDIS_SPECIFIC_FINISHED) {
 		return;
@@ -713,32 +795,19 @@ lua_redis_timeout_sync(EV_P_ ev_timer *w, int revents)
 	msg_debug_lua_redis("timeout while querying redis server: %p, redis: %p", sp_ud,
 						sp_ud->c->ctx);
 
-	if (sp_ud->c->ctx) {
-		ac = sp_ud->c->ctx;
-
-		/* Set to NULL to avoid double free in dtor */
-		sp_ud->c->ctx = NULL;
-		ac->err = REDIS_ERR_IO;
-		errno = ETIMEDOUT;
+	if (ud->ctx) {
 		ctx->flags |= LUA_REDIS_TERMINATED;
-
-		/*
-		 * This will call all callbacks pending so the entire context
-		 * will be destructed
-		 */
-		rspamd_redis_pool_release_connection(sp_ud->c->pool, ac,
-											 RSPAMD_REDIS_RELEASE_FATAL);
+		lua_redis_release_on_error(ctx, ud, ETIMEDOUT, lua_redis_callback_sync);
 	}
 }
 
 static void
-lua_redis_timeout(EV_P_ ev_timer *w, int revents)
+lua_redis_timeout(EV_P_ struct rspamd_ev_wheel_timer *w)
 {
 	struct lua_redis_request_specific_userdata *sp_ud =
 		(struct lua_redis_request_specific_userdata *) w->data;
 	struct lua_redis_userdata *ud;
 	struct lua_redis_ctx *ctx;
-	redisAsyncContext *ac;
 
 	if (sp_ud->flags & LUA_REDIS_SPECIFIC_FINISHED) {
 		return;
@@ -752,18 +821,8 @@ lua_redis_timeout(EV_P_ ev_timer *w, int revents)
 						sp_ud->c->ctx);
 	lua_redis_push_error("timeout while connecting the server", ctx, sp_ud, TRUE);
 
-	if (sp_ud->c->ctx) {
-		ac = sp_ud->c->ctx;
-		/* Set to NULL to avoid double free in dtor */
-		sp_ud->c->ctx = NULL;
-		ac->err = REDIS_ERR_IO;
-		errno = ETIMEDOUT;
-		/*
-		 * This will call all callbacks pending so the entire context
-		 * will be destructed
-		 */
-		rspamd_redis_pool_release_connection(sp_ud->c->pool, ac,
-											 RSPAMD_REDIS_RELEASE_FATAL);
+	if (ud->ctx) {
+		lua_redis_release_on_error(ctx, ud, ETIMEDOUT, lua_redis_callback);
 	}
 
 	REDIS_RELEASE(ctx);
@@ -866,8 +925,35 @@ lua_redis_parse_args(lua_State *L, int idx, const char *cmd,
 	*nargs = top;
 }
 
+/*
+ * Commands that change the connection state or block it cannot be multiplexed
+ */
+static gboolean
+lua_redis_cmd_is_pipelinable(const char *cmd)
+{
+	static const char *unsafe_cmds[] = {
+		"SUBSCRIBE", "PSUBSCRIBE", "SSUBSCRIBE", "MONITOR",
+		"MULTI", "EXEC", "DISCARD", "WATCH", "UNWATCH",
+		"SELECT", "AUTH", "HELLO", "QUIT", "RESET", "CLIENT",
+		"BLPOP", "BRPOP", "BRPOPLPUSH", "BLMOVE", "BLMPOP",
+		"BZPOPMIN", "BZPOPMAX", "BZMPOP", "WAIT", "XREAD", "XREADGROUP"};
+
+	if (cmd == NULL) {
+		return FALSE;
+	}
+
+	for (unsigned int i = 0; i < G_N_ELEMENTS(unsafe_cmds); i++) {
+		if (g_ascii_strcasecmp(cmd, unsafe_cmds[i]) == 0) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
 static struct lua_redis_ctx *
-rspamd_lua_redis_prepare_connection(lua_State *L, int *pcbref, gboolean is_async)
+rspamd_lua_redis_prepare_connection(lua_State *L, int *pcbref, gboolean is_async,
+									gboolean allow_shared)
 {
 	struct lua_redis_ctx *ctx = NULL;
 	rspamd_inet_addr_t *ip = NULL;
@@ -1005,6 +1091,22 @@ rspamd_lua_redis_prepare_connection(lua_State *L, int *pcbref, gboolean is_async
 		}
 		lua_pop(L, 1);
 
+		if (allow_shared && !(flags & LUA_REDIS_NO_POOL)) {
+			lua_pushstring(L, "auto_pipeline");
+			lua_gettable(L, -2);
+			if (!!lua_toboolean(L, -1)) {
+				lua_pushstring(L, "cmd");
+				lua_gettable(L, -3);
+
+				if (lua_redis_cmd_is_pipelinable(lua_tostring(L, -1))) {
+					flags |= LUA_REDIS_SHARED;
+				}
+
+				lua_pop(L, 1);
+			}
+			lua_pop(L, 1);
+		}
+
 		lua_pop(L, 1); /* table */
 
 		if (session && rspamd_session_blocked(session)) {
@@ -1059,10 +1161,20 @@ rspamd_lua_redis_prepare_connection(lua_State *L, int *pcbref, gboolean is_async
 
 	if (ret) {
 		ud->terminated = 0;
-		ud->ctx = rspamd_redis_pool_connect(ud->pool,
-											dbname, username, password,
-											rspamd_inet_address_to_string(addr->addr),
-											rspamd_inet_address_get_port(addr->addr));
+
+		if (ctx->flags & LUA_REDIS_SHARED) {
+			ud->ctx = rspamd_redis_pool_connect_shared(ud->pool,
+													   dbname, username, password,
+													   rspamd_inet_address_to_string(addr->addr),
+													   rspamd_inet_address_get_port(addr->addr),
+													   0);
+		}
+		else {
+			ud->ctx = rspamd_redis_pool_connect(ud->pool,
+												dbname, username, password,
+												rspamd_inet_address_to_string(addr->addr),
+												rspamd_inet_address_get_port(addr->addr));
+		}
 
 		if (ip) {
 			rspamd_inet_address_free(ip);
@@ -1072,8 +1184,9 @@ rspamd_lua_redis_prepare_connection(lua_State *L, int *pcbref, gboolean is_async
 			if (ud->ctx) {
 				msg_err_task_check("cannot connect to redis: %s",
 								   ud->ctx->errstr);
+				/* Shared connection is closed by the pool when nobody else uses it */
 				rspamd_redis_pool_release_connection(ud->pool, ud->ctx,
-													 RSPAMD_REDIS_RELEASE_FATAL);
+													 (ctx->flags & LUA_REDIS_SHARED) ? RSPAMD_REDIS_RELEASE_DEFAULT : RSPAMD_REDIS_RELEASE_FATAL);
 				ud->ctx = NULL;
 			}
 			else {
@@ -1108,6 +1221,7 @@ rspamd_lua_redis_prepare_connection(lua_State *L, int *pcbref, gboolean is_async
  * @param {string} cmd command to be sent to redis
  * @param {table} args numeric array of strings used as redis arguments
  * @param {number} timeout timeout in seconds for request (1.0 by default)
+ * @param {boolean} auto_pipeline share connection with other requests to the same server, so commands are pipelined
  * @return {boolean} `true` if a request has been scheduled
  */
 static int
@@ -1122,7 +1236,7 @@ lua_redis_make_request(lua_State *L)
 	int cbref = -1;
 	gboolean ret = FALSE;
 
-	ctx = rspamd_lua_redis_prepare_connection(L, &cbref, TRUE);
+	ctx = rspamd_lua_redis_prepare_connection(L, &cbref, TRUE, TRUE);
 
 	if (ctx) {
 		ud = &ctx->async;
@@ -1178,18 +1292,15 @@ lua_redis_make_request(lua_State *L)
 				sp_ud->flags |= LUA_REDIS_SUBSCRIBED;
 			}
 
-			sp_ud->timeout_ev.data = sp_ud;
 			ev_now_update_if_cheap((struct ev_loop *) ud->event_loop);
-			ev_timer_init(&sp_ud->timeout_ev, lua_redis_timeout, timeout, 0.0);
-			ev_timer_start(ud->event_loop, &sp_ud->timeout_ev);
+			rspamd_ev_wheel_timer_init(&sp_ud->timeout_ev, lua_redis_timeout, sp_ud);
+			rspamd_ev_wheel_timer_start(ud->event_loop, &sp_ud->timeout_ev, timeout);
 
 			ret = TRUE;
 		}
 		else {
 			msg_info("call to redis failed: %s", ud->ctx->errstr);
-			rspamd_redis_pool_release_connection(ud->pool, ud->ctx,
-												 RSPAMD_REDIS_RELEASE_FATAL);
-			ud->ctx = NULL;
+			lua_redis_release_on_error(ctx, ud, 0, lua_redis_callback);
 			REDIS_RELEASE(ctx);
 			ret = FALSE;
 		}
@@ -1378,7 +1489,7 @@ lua_redis_connect(lua_State *L)
 	struct lua_redis_ctx *ctx, **pctx;
 	double timeout = REDIS_DEFAULT_TIMEOUT;
 
-	ctx = rspamd_lua_redis_prepare_connection(L, NULL, TRUE);
+	ctx = rspamd_lua_redis_prepare_connection(L, NULL, TRUE, FALSE);
 
 	if (ctx) {
 		ud = &ctx->async;
@@ -1421,7 +1532,7 @@ lua_redis_connect_sync(lua_State *L)
 	double timeout = REDIS_DEFAULT_TIMEOUT;
 	struct lua_redis_ctx *ctx, **pctx;
 
-	ctx = rspamd_lua_redis_prepare_connection(L, NULL, FALSE);
+	ctx = rspamd_lua_redis_prepare_connection(L, NULL, FALSE, FALSE);
 
 	if (ctx) {
 		if (lua_istable(L, 1)) {
@@ -1449,6 +1560,111 @@ lua_redis_connect_sync(lua_State *L)
 	return 2;
 }
 
+static void
+lua_redis_push_pool_stat(const char *ip, int port, const char *db,
+						 const struct rspamd_redis_pool_stat *st, void *ud)
+{
+	lua_State *L = (lua_State *) ud;
+
+	lua_createtable(L, 0, 10);
+	lua_pushstring(L, ip);
+	lua_setfield(L, -2, "host");
+	lua_pushinteger(L, port);
+	lua_setfield(L, -2, "port");
+	lua_pushstring(L, db);
+	lua_setfield(L, -2, "db");
+	lua_pushinteger(L, st->conns_created);
+	lua_setfield(L, -2, "connections_created");
+	lua_pushinteger(L, st->conns_reused);
+	lua_setfield(L, -2, "connections_reused");
+	lua_pushinteger(L, st->pipelined_requests);
+	lua_setfield(L, -2, "pipelined_requests");
+	lua_pushinteger(L, st->pipeline_overflows);
+	lua_setfield(L, -2, "pipeline_overflows");
+	lua_pushinteger(L, st->active);
+	lua_setfield(L, -2, "active");
+	lua_pushinteger(L, st->inactive);
+	lua_setfield(L, -2, "inactive");
+	lua_pushinteger(L, st->pipeline_users);
+	lua_setfield(L, -2, "pipeline_users");
+
+	lua_rawseti(L, -2, rspamd_lua_table_size(L, -2) + 1);
+}
+
+/***
+ * @function rspamd_redis.get_pool_stats(cfg)
+ * Returns statistics of the redis connections pool: an array of tables with
+ * `host`, `port`, `db`, `connections_created`, `connections_reused`,
+ * `pipelined_requests`, `pipeline_overflows`, `active`, `inactive` and
+ * `pipeline_users` fields; `pipelined_requests` counts requests sent on a
+ * shared connection while other requests were in flight on it
+ * @param {rspamd_config} cfg config object
+ * @return {table} array of per server statistics
+ */
+static int
+lua_redis_get_pool_stats(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_config *cfg = lua_check_config(L, 1);
+
+	if (cfg == NULL || cfg->redis_pool == NULL) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	lua_newtable(L);
+	rspamd_redis_pool_foreach_stat(cfg->redis_pool, lua_redis_push_pool_stat, L);
+
+	return 1;
+}
+
+/* CRC16-CCITT (XMODEM) as used by Redis Cluster */
+static uint16_t
+lua_redis_crc16(const unsigned char *p, gsize len)
+{
+	uint16_t crc = 0;
+
+	while (len--) {
+		crc ^= ((uint16_t) *p++) << 8;
+
+		for (unsigned int i = 0; i < 8; i++) {
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+		}
+	}
+
+	return crc;
+}
+
+/***
+ * @function rspamd_redis.key_slot(key)
+ * Returns Redis Cluster hash slot for a key (hash tags in `{}` are respected)
+ * @param {string} key redis key
+ * @return {number} slot number (0..16383)
+ */
+static int
+lua_redis_key_slot(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	gsize len;
+	const char *key = luaL_checklstring(L, 1, &len);
+	const char *obrace, *cbrace;
+
+	/* Only the part between the first `{` and the next `}` is hashed if not empty */
+	obrace = memchr(key, '{', len);
+
+	if (obrace != NULL) {
+		cbrace = memchr(obrace + 1, '}', len - (obrace - key) - 1);
+
+		if (cbrace != NULL && cbrace != obrace + 1) {
+			key = obrace + 1;
+			len = cbrace - key;
+		}
+	}
+
+	lua_pushinteger(L, lua_redis_crc16((const unsigned char *) key, len) & 16383);
+
+	return 1;
+}
+
 /***
  * @method rspamd_redis:add_cmd(cmd, {args})
  * Append new cmd to redis pipeline
@@ -1544,18 +1760,17 @@ lua_redis_add_cmd(lua_State *L)
 				}
 			}
 
-			sp_ud->timeout_ev.data = sp_ud;
-
 			if (IS_ASYNC(ctx)) {
-				ev_timer_init(&sp_ud->timeout_ev, lua_redis_timeout,
-							  sp_ud->c->timeout, 0.0);
+				rspamd_ev_wheel_timer_init(&sp_ud->timeout_ev, lua_redis_timeout,
+										   sp_ud);
 			}
 			else {
-				ev_timer_init(&sp_ud->timeout_ev, lua_redis_timeout_sync,
-							  sp_ud->c->timeout, 0.0);
+				rspamd_ev_wheel_timer_init(&sp_ud->timeout_ev, lua_redis_timeout_sync,
+										   sp_ud);
 			}
 
-			ev_timer_start(ud->event_loop, &sp_ud->timeout_ev);
+			rspamd_ev_wheel_timer_start(ud->event_loop, &sp_ud->timeout_ev,
+										sp_ud->c->timeout);
 			REDIS_RETAIN(ctx);
 			ctx->cmds_pending++;
 		}
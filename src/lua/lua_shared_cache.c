@@ -0,0 +1,468 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "lua_common.h"
+#include "cryptobox.h"
+#include "unix-std.h"
+
+/***
+ * @module rspamd_shared_cache
+ * This module provides a fixed size key-value cache with expiration that is
+ * shared between all worker processes of a host. Cache must be created when
+ * the configuration is loaded (e.g. in a plugin's body), so the workers inherit
+ * the shared memory; caches created in a worker are local to that worker.
+ *
+ * Cache is set associative: each key can be stored only in one bucket of a few
+ * slots, and the least recently used slot of a bucket is evicted when there is
+ * no free space. Keys are stored as 64 bit hashes. Buckets are protected by a
+ * fixed number of shared mutexes, which are released if their owner dies.
+ *
+ * @example
+local rspamd_shared_cache = require "rspamd_shared_cache"
+local cache = rspamd_shared_cache.create(rspamd_config, 16 * 1024 * 1024)
+cache:set('key', 'value', 3600)
+cache:get('key') -- 'value'
+ */
+
+/***
+ * @function rspamd_shared_cache.create(cfg, size, [max_value])
+ * Creates a new cache in shared memory
+ * @param {rspamd_config} cfg configuration, the cache lives as long as it
+ * @param {number} size memory size in bytes
+ * @param {number} max_value maximum length of values (256 by default, up to 4096)
+ * @return {rspamd_shared_cache} cache object
+ */
+LUA_FUNCTION_DEF(shared_cache, create);
+/***
+ * @method rspamd_shared_cache:get(key)
+ * Returns a value that has not expired yet
+ * @param {string|text} key key
+ * @return {string|nil,number} value and the remaining lifetime in seconds
+ */
+LUA_FUNCTION_DEF(shared_cache, get);
+/***
+ * @method rspamd_shared_cache:set(key, value, ttl)
+ * Inserts or replaces a value, evicting the least recently used value if needed
+ * @param {string|text} key key
+ * @param {string|text} value value
+ * @param {number} ttl lifetime in seconds
+ * @return {boolean} `true` if value has been stored (`false` if it is too long)
+ */
+LUA_FUNCTION_DEF(shared_cache, set);
+/***
+ * @method rspamd_shared_cache:delete(key)
+ * Removes a value
+ * @param {string|text} key key
+ * @return {boolean} `true` if value has been removed
+ */
+LUA_FUNCTION_DEF(shared_cache, delete);
+/***
+ * @method rspamd_shared_cache:stat()
+ * Returns statistics of the cache: `size`, `slots`, `max_value`, `entries`,
+ * `bytes` (total length of stored values), `hits`, `misses` and `evictions`
+ * @return {table} statistics
+ */
+LUA_FUNCTION_DEF(shared_cache, stat);
+
+static const struct luaL_reg shared_cachelib_m[] = {
+	LUA_INTERFACE_DEF(shared_cache, get),
+	LUA_INTERFACE_DEF(shared_cache, set),
+	LUA_INTERFACE_DEF(shared_cache, delete),
+	LUA_INTERFACE_DEF(shared_cache, stat),
+	{"__tostring", rspamd_lua_class_tostring},
+	{NULL, NULL}};
+
+static const struct luaL_reg shared_cachelib_f[] = {
+	LUA_INTERFACE_DEF(shared_cache, create),
+	{NULL, NULL}};
+
+#define RSPAMD_SHARED_CACHE_WAYS 8
+#define RSPAMD_SHARED_CACHE_LOCKS 64
+#define RSPAMD_SHARED_CACHE_MAX_VALUE 4096
+#define RSPAMD_SHARED_CACHE_SEED G_GUINT64_CONSTANT(0x9ae16a3b2f90404f)
+
+struct rspamd_shared_cache_slot {
+	uint64_t hash; /* 0 for empty slots */
+	double expire;
+	double atime;
+	uint32_t len;
+	uint32_t unused;
+	unsigned char data[];
+};
+
+struct rspamd_shared_cache_bucket {
+	uint64_t unused;
+	/* Slots follow */
+};
+
+struct rspamd_shared_cache {
+	uint64_t nbuckets;
+	gsize bucket_size;
+	gsize slot_size;
+	gsize size;
+	unsigned int max_value;
+	int64_t entries;
+	int64_t bytes;
+	int64_t hits;
+	int64_t misses;
+	int64_t evictions;
+	unsigned char *buckets;
+	/* Bucket i is protected by lock i % RSPAMD_SHARED_CACHE_LOCKS */
+	rspamd_mempool_mutex_t *locks[RSPAMD_SHARED_CACHE_LOCKS];
+};
+
+static struct rspamd_shared_cache *
+lua_check_shared_cache(lua_State *L, int pos)
+{
+	void *ud = rspamd_lua_check_udata(L, pos, rspamd_shared_cache_classname);
+
+	luaL_argcheck(L, ud != NULL, pos, "'shared_cache' expected");
+	return ud ? *((struct rspamd_shared_cache **) ud) : NULL;
+}
+
+static inline void
+rspamd_shared_cache_stat_add(int64_t *ptr, int64_t value)
+{
+#ifndef HAVE_ATOMIC_BUILTINS
+	*ptr += value;
+#else
+	__atomic_add_fetch(ptr, value, __ATOMIC_RELAXED);
+#endif
+}
+
+static inline int64_t
+rspamd_shared_cache_stat_load(const int64_t *ptr)
+{
+#ifndef HAVE_ATOMIC_BUILTINS
+	return *ptr;
+#else
+	return __atomic_load_n(ptr, __ATOMIC_RELAXED);
+#endif
+}
+
+static inline rspamd_mempool_mutex_t *
+rspamd_shared_cache_lock(struct rspamd_shared_cache *cache, uint64_t hash)
+{
+	rspamd_mempool_mutex_t *mtx;
+
+	mtx = cache->locks[(hash & (cache->nbuckets - 1)) % RSPAMD_SHARED_CACHE_LOCKS];
+	rspamd_mempool_lock_mutex(mtx);
+
+	return mtx;
+}
+
+static inline struct rspamd_shared_cache_bucket *
+rspamd_shared_cache_bucket(struct rspamd_shared_cache *cache, uint64_t hash)
+{
+	return (struct rspamd_shared_cache_bucket *) (cache->buckets +
+												  (hash & (cache->nbuckets - 1)) * cache->bucket_size);
+}
+
+static inline struct rspamd_shared_cache_slot *
+rspamd_shared_cache_slot(struct rspamd_shared_cache *cache,
+						 struct rspamd_shared_cache_bucket *bucket, unsigned int i)
+{
+	return (struct rspamd_shared_cache_slot *) (((unsigned char *) bucket) +
+												sizeof(*bucket) + i * cache->slot_size);
+}
+
+static inline uint64_t
+rspamd_shared_cache_hash(const char *key, gsize keylen)
+{
+	uint64_t h = rspamd_cryptobox_fast_hash_specific(RSPAMD_CRYPTOBOX_XXHASH64,
+													 key, keylen, RSPAMD_SHARED_CACHE_SEED);
+
+	/* Zero hash marks empty slots */
+	return h ? h : 1;
+}
+
+/* Must be called with bucket locked */
+static void
+rspamd_shared_cache_clear_slot(struct rspamd_shared_cache *cache,
+							   struct rspamd_shared_cache_slot *slot)
+{
+	rspamd_shared_cache_stat_add(&cache->entries, -1);
+	rspamd_shared_cache_stat_add(&cache->bytes, -((int64_t) slot->len));
+	slot->hash = 0;
+	slot->len = 0;
+}
+
+static int
+lua_shared_cache_create(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_config *cfg = lua_check_config(L, 1);
+	gsize size = luaL_checknumber(L, 2);
+	unsigned int max_value = 256;
+	struct rspamd_shared_cache *cache, **pcache;
+
+	if (lua_isnumber(L, 3)) {
+		max_value = lua_tointeger(L, 3);
+	}
+
+	if (cfg == NULL || max_value == 0 || max_value > RSPAMD_SHARED_CACHE_MAX_VALUE) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	cache = rspamd_mempool_alloc0_shared_type(cfg->cfg_pool, struct rspamd_shared_cache);
+	cache->max_value = max_value;
+	cache->slot_size = sizeof(struct rspamd_shared_cache_slot) +
+					   ((max_value + 7u) & ~7u);
+	/* Do not share cache lines between buckets */
+	cache->bucket_size = sizeof(struct rspamd_shared_cache_bucket) +
+						 RSPAMD_SHARED_CACHE_WAYS * cache->slot_size;
+	cache->bucket_size = (cache->bucket_size + 63) & ~((gsize) 63);
+	cache->nbuckets = 1;
+
+	while (cache->nbuckets * 2 * cache->bucket_size <= size) {
+		cache->nbuckets *= 2;
+	}
+
+	cache->size = cache->nbuckets * cache->bucket_size;
+	cache->buckets = rspamd_mempool_alloc0_shared_(cfg->cfg_pool, cache->size, 64,
+												   G_STRLOC);
+
+	for (unsigned int i = 0; i < RSPAMD_SHARED_CACHE_LOCKS; i++) {
+		cache->locks[i] = rspamd_mempool_get_mutex(cfg->cfg_pool);
+	}
+
+	pcache = lua_newuserdata(L, sizeof(*pcache));
+	rspamd_lua_setclass(L, rspamd_shared_cache_classname, -1);
+	*pcache = cache;
+
+	return 1;
+}
+
+static int
+lua_shared_cache_get(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_shared_cache *cache = lua_check_shared_cache(L, 1);
+	struct rspamd_lua_text *t = lua_check_text_or_string(L, 2);
+	struct rspamd_shared_cache_bucket *bucket;
+	struct rspamd_shared_cache_slot *slot;
+	rspamd_mempool_mutex_t *mtx;
+	unsigned char buf[RSPAMD_SHARED_CACHE_MAX_VALUE];
+	gsize len = 0;
+	double now, ttl = 0;
+	uint64_t h;
+	gboolean found = FALSE;
+
+	if (cache == NULL || t == NULL) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	h = rspamd_shared_cache_hash(t->start, t->len);
+	bucket = rspamd_shared_cache_bucket(cache, h);
+	now = rspamd_get_calendar_ticks();
+
+	mtx = rspamd_shared_cache_lock(cache, h);
+
+	for (unsigned int i = 0; i < RSPAMD_SHARED_CACHE_WAYS; i++) {
+		slot = rspamd_shared_cache_slot(cache, bucket, i);
+
+		if (slot->hash == h) {
+			/* Slot could be left half written by a process that has died */
+			if (slot->expire > now && slot->len <= cache->max_value) {
+				/* Copy value, as we cannot call Lua with the bucket locked */
+				len = slot->len;
+				memcpy(buf, slot->data, len);
+				ttl = slot->expire - now;
+				slot->atime = now;
+				found = TRUE;
+			}
+			else {
+				rspamd_shared_cache_clear_slot(cache, slot);
+			}
+
+			break;
+		}
+	}
+
+	rspamd_mempool_unlock_mutex(mtx);
+
+	if (found) {
+		rspamd_shared_cache_stat_add(&cache->hits, 1);
+		lua_pushlstring(L, (const char *) buf, len);
+		lua_pushnumber(L, ttl);
+
+		return 2;
+	}
+
+	rspamd_shared_cache_stat_add(&cache->misses, 1);
+	lua_pushnil(L);
+
+	return 1;
+}
+
+static int
+lua_shared_cache_set(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_shared_cache *cache = lua_check_shared_cache(L, 1);
+	struct rspamd_lua_text *t = lua_check_text_or_string(L, 2),
+						   *value = lua_check_text_or_string(L, 3);
+	double ttl = luaL_checknumber(L, 4), now;
+	struct rspamd_shared_cache_bucket *bucket;
+	struct rspamd_shared_cache_slot *slot, *selected = NULL, *lru = NULL;
+	rspamd_mempool_mutex_t *mtx;
+	uint64_t h;
+
+	if (cache == NULL || t == NULL || value == NULL || ttl <= 0) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	if (value->len > cache->max_value) {
+		lua_pushboolean(L, false);
+
+		return 1;
+	}
+
+	h = rspamd_shared_cache_hash(t->start, t->len);
+	bucket = rspamd_shared_cache_bucket(cache, h);
+	now = rspamd_get_calendar_ticks();
+
+	mtx = rspamd_shared_cache_lock(cache, h);
+
+	for (unsigned int i = 0; i < RSPAMD_SHARED_CACHE_WAYS; i++) {
+		slot = rspamd_shared_cache_slot(cache, bucket, i);
+
+		if (slot->hash == h) {
+			selected = slot;
+			break;
+		}
+
+		if (slot->hash != 0 && slot->expire <= now) {
+			rspamd_shared_cache_clear_slot(cache, slot);
+		}
+
+		if (slot->hash == 0) {
+			if (selected == NULL) {
+				selected = slot;
+			}
+		}
+		else if (lru == NULL || slot->atime < lru->atime) {
+			lru = slot;
+		}
+	}
+
+	if (selected == NULL) {
+		selected = lru;
+		rspamd_shared_cache_stat_add(&cache->evictions, 1);
+	}
+
+	if (selected->hash != 0) {
+		rspamd_shared_cache_clear_slot(cache, selected);
+	}
+
+	selected->hash = h;
+	selected->expire = now + ttl;
+	selected->atime = now;
+	selected->len = value->len;
+	memcpy(selected->data, value->start, value->len);
+	rspamd_shared_cache_stat_add(&cache->entries, 1);
+	rspamd_shared_cache_stat_add(&cache->bytes, value->len);
+
+	rspamd_mempool_unlock_mutex(mtx);
+
+	lua_pushboolean(L, true);
+
+	return 1;
+}
+
+static int
+lua_shared_cache_delete(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_shared_cache *cache = lua_check_shared_cache(L, 1);
+	struct rspamd_lua_text *t = lua_check_text_or_string(L, 2);
+	struct rspamd_shared_cache_bucket *bucket;
+	struct rspamd_shared_cache_slot *slot;
+	rspamd_mempool_mutex_t *mtx;
+	gboolean found = FALSE;
+	uint64_t h;
+
+	if (cache == NULL || t == NULL) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	h = rspamd_shared_cache_hash(t->start, t->len);
+	bucket = rspamd_shared_cache_bucket(cache, h);
+
+	mtx = rspamd_shared_cache_lock(cache, h);
+
+	for (unsigned int i = 0; i < RSPAMD_SHARED_CACHE_WAYS; i++) {
+		slot = rspamd_shared_cache_slot(cache, bucket, i);
+
+		if (slot->hash == h) {
+			rspamd_shared_cache_clear_slot(cache, slot);
+			found = TRUE;
+			break;
+		}
+	}
+
+	rspamd_mempool_unlock_mutex(mtx);
+
+	lua_pushboolean(L, found);
+
+	return 1;
+}
+
+static int
+lua_shared_cache_stat(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_shared_cache *cache = lua_check_shared_cache(L, 1);
+
+	if (cache == NULL) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	lua_createtable(L, 0, 8);
+	lua_pushinteger(L, cache->size);
+	lua_setfield(L, -2, "size");
+	lua_pushinteger(L, cache->nbuckets * RSPAMD_SHARED_CACHE_WAYS);
+	lua_setfield(L, -2, "slots");
+	lua_pushinteger(L, cache->max_value);
+	lua_setfield(L, -2, "max_value");
+	lua_pushinteger(L, rspamd_shared_cache_stat_load(&cache->entries));
+	lua_setfield(L, -2, "entries");
+	lua_pushinteger(L, rspamd_shared_cache_stat_load(&cache->bytes));
+	lua_setfield(L, -2, "bytes");
+	lua_pushinteger(L, rspamd_shared_cache_stat_load(&cache->hits));
+	lua_setfield(L, -2, "hits");
+	lua_pushinteger(L, rspamd_shared_cache_stat_load(&cache->misses));
+	lua_setfield(L, -2, "misses");
+	lua_pushinteger(L, rspamd_shared_cache_stat_load(&cache->evictions));
+	lua_setfield(L, -2, "evictions");
+
+	return 1;
+}
+
+static int
+lua_load_shared_cache(lua_State *L)
+{
+	lua_newtable(L);
+	luaL_register(L, NULL, shared_cachelib_f);
+
+	return 1;
+}
+
+void luaopen_shared_cache(lua_State *L)
+{
+	rspamd_lua_new_class(L, rspamd_shared_cache_classname, shared_cachelib_m);
+	lua_pop(L, 1);
+	rspamd_lua_add_preload(L, "rspamd_shared_cache", lua_load_shared_cache);
+}
@@ -126,6 +126,17 @@ LUA_FUNCTION_DEF(task, set_session);
  * @return {rspamd_ev_base} event base
  */
 LUA_FUNCTION_DEF(task, get_ev_base);
+/***
+ * @method task:add_timer(timeout, callback)
+ * Calls `callback(task)` after `timeout` seconds. Task is not finished while a
+ * timer is pending, so it can be used to wait for some shared event, e.g. a result
+ * of request performed by another task. Timer can be stopped before it fires by
+ * `timer:cancel()`, callback is not called in this case.
+ * @param {number} timeout timeout in seconds
+ * @param {function} callback function to call
+ * @return {rspamd_task_timer} timer object
+ */
+LUA_FUNCTION_DEF(task, add_timer);
 /***
  * @method task:get_worker()
  * Returns a worker object associated with the task
@@ -360,6 +371,9 @@ LUA_FUNCTION_DEF(task, get_subject);
  * @method task:get_header(name[, case_sensitive])
  * Get decoded value of a header specified with optional case_sensitive flag.
  * By default headers are searched in caseless matter.
+ * All `get_header*` methods also accept a numeric id of a well-known header
+ * returned by `rspamd_util.get_header_id` instead of a name, such lookups
+ * do not hash the name of the header.
  * @param {string} name name of header to get
  * @param {boolean} case_sensitive case sensitiveness flag to search for a header
  * @return {string} decoded value of a header
@@ -467,6 +481,29 @@ LUA_FUNCTION_DEF(task, modify_header);
  * @return {table of tables} list of received headers described above
  */
 LUA_FUNCTION_DEF(task, get_received_headers);
+/***
+ * @method task:get_received_header(n)
+ * Returns a single parsed received header (starting from 1) in the same format as
+ * `task:get_received_headers()`. Received headers are parsed on demand, so this
+ * method is cheaper when only the top headers are needed.
+ * @param {number} n number of header
+ * @return {table} received header or nil if there is no such header
+ */
+LUA_FUNCTION_DEF(task, get_received_header);
+/***
+ * @method task:get_received_count([skip_artificial])
+ * Returns number of parsed received headers
+ * @param {boolean} skip_artificial do not count received header added by rspamd
+ * @return {number} number of received headers
+ */
+LUA_FUNCTION_DEF(task, get_received_count);
+/***
+ * @method task:get_headers_hash()
+ * Returns hash of the message header names excluding valid Received headers,
+ * it is also stored in the `headers_hash` mempool variable
+ * @return {string} hex encoded hash or nil if the message has no headers
+ */
+LUA_FUNCTION_DEF(task, get_headers_hash);
 /***
  * @method task:get_queue_id()
  * Returns queue ID of the message being processed.
@@ -1238,6 +1275,7 @@ static const struct luaL_reg tasklib_m[] = {
 	LUA_INTERFACE_DEF(task, get_session),
 	LUA_INTERFACE_DEF(task, set_session),
 	LUA_INTERFACE_DEF(task, get_ev_base),
+	LUA_INTERFACE_DEF(task, add_timer),
 	LUA_INTERFACE_DEF(task, get_worker),
 	LUA_INTERFACE_DEF(task, insert_result),
 	LUA_INTERFACE_DEF(task, insert_result_named),
@@ -1267,6 +1305,9 @@ static const struct luaL_reg tasklib_m[] = {
 	LUA_INTERFACE_DEF(task, get_headers),
 	LUA_INTERFACE_DEF(task, modify_header),
 	LUA_INTERFACE_DEF(task, get_received_headers),
+	LUA_INTERFACE_DEF(task, get_received_header),
+	LUA_INTERFACE_DEF(task, get_received_count),
+	LUA_INTERFACE_DEF(task, get_headers_hash),
 	LUA_INTERFACE_DEF(task, get_queue_id),
 	LUA_INTERFACE_DEF(task, get_uid),
 	LUA_INTERFACE_DEF(task, get_resolver),
@@ -1364,6 +1405,28 @@ static const struct luaL_reg imagelib_m[] = {
 	{"__tostring", rspamd_lua_class_tostring},
 	{NULL, NULL}};
 
+/* Task timer methods */
+/***
+ * @method task_timer:cancel()
+ * Stops timer without calling its callback
+ * @return {boolean} `true` if timer has been pending
+ */
+LUA_FUNCTION_DEF(task_timer, cancel);
+/***
+ * @method task_timer:reschedule(timeout)
+ * Changes timeout of a pending timer, new timeout is counted from now, so
+ * `timer:reschedule(0)` calls callback on the next event loop iteration
+ * @param {number} timeout timeout in seconds
+ * @return {boolean} `true` if timer has been pending
+ */
+LUA_FUNCTION_DEF(task_timer, reschedule);
+
+static const struct luaL_reg task_timerlib_m[] = {
+	LUA_INTERFACE_DEF(task_timer, cancel),
+	LUA_INTERFACE_DEF(task_timer, reschedule),
+	{"__tostring", rspamd_lua_class_tostring},
+	{NULL, NULL}};
+
 /* Archive methods */
 LUA_FUNCTION_DEF(archive, get_type);
 LUA_FUNCTION_DEF(archive, get_files);
@@ -1953,6 +2016,160 @@ lua_task_get_ev_base(lua_State *L)
 	return 1;
 }
 
+struct lua_task_timer {
+	struct rspamd_task *task;
+	struct rspamd_symcache_dynamic_item *item;
+	lua_State *L;
+	ev_timer ev;
+	int cbref;
+	int selfref;
+	gboolean pending;
+};
+
+#define M "lua task timer"
+
+static void
+lua_task_timer_fin(gpointer ud)
+{
+	struct lua_task_timer *tm = (struct lua_task_timer *) ud;
+
+	if (tm->pending) {
+		tm->pending = FALSE;
+		ev_timer_stop(tm->task->event_loop, &tm->ev);
+
+		if (tm->item) {
+			rspamd_symcache_item_async_dec_check(tm->task, tm->item, M);
+			tm->item = NULL;
+		}
+
+		luaL_unref(tm->L, LUA_REGISTRYINDEX, tm->cbref);
+		/* Timer object can be collected from now */
+		luaL_unref(tm->L, LUA_REGISTRYINDEX, tm->selfref);
+	}
+}
+
+static void
+lua_task_timer_cb(struct ev_loop *loop, ev_timer *w, int revents)
+{
+	struct lua_task_timer *tm = (struct lua_task_timer *) w->data;
+	struct rspamd_task *task = tm->task, **ptask;
+	lua_State *L = tm->L;
+	int err_idx;
+
+	ev_timer_stop(loop, w);
+
+	lua_pushcfunction(L, &rspamd_lua_traceback);
+	err_idx = lua_gettop(L);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, tm->cbref);
+	ptask = lua_newuserdata(L, sizeof(*ptask));
+	rspamd_lua_setclass(L, rspamd_task_classname, -1);
+	*ptask = task;
+
+	if (tm->item) {
+		rspamd_symcache_set_cur_item(task, tm->item);
+	}
+
+	if (lua_pcall(L, 1, 0, err_idx) != 0) {
+		msg_err_task("cannot call timer callback: %s", lua_tostring(L, -1));
+	}
+
+	lua_settop(L, err_idx - 1);
+
+	/* Callback might have cancelled the timer */
+	if (tm->pending) {
+		rspamd_session_remove_event(task->s, lua_task_timer_fin, tm);
+	}
+}
+
+static int
+lua_task_add_timer(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_task *task = lua_check_task(L, 1);
+	double timeout = luaL_checknumber(L, 2);
+	struct lua_task_timer *tm;
+
+	if (task == NULL || task->s == NULL || !lua_isfunction(L, 3) || timeout < 0) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	tm = lua_newuserdata(L, sizeof(*tm));
+	memset(tm, 0, sizeof(*tm));
+	rspamd_lua_setclass(L, rspamd_task_timer_classname, -1);
+	tm->task = task;
+	tm->L = task->cfg->lua_state;
+	tm->item = rspamd_symcache_get_cur_item(task);
+
+	if (tm->item) {
+		rspamd_session_add_event_full(task->s, lua_task_timer_fin, tm, M,
+									  rspamd_symcache_dyn_item_name(task, tm->item));
+		rspamd_symcache_item_async_inc(task, tm->item, M);
+	}
+	else {
+		rspamd_session_add_event(task->s, lua_task_timer_fin, tm, M);
+	}
+
+	lua_pushvalue(L, 3);
+	tm->cbref = luaL_ref(L, LUA_REGISTRYINDEX);
+	/* Keep timer alive while it is pending */
+	lua_pushvalue(L, -1);
+	tm->selfref = luaL_ref(L, LUA_REGISTRYINDEX);
+	tm->pending = TRUE;
+
+	ev_timer_init(&tm->ev, lua_task_timer_cb, timeout, 0.0);
+	tm->ev.data = tm;
+	ev_timer_start(task->event_loop, &tm->ev);
+
+	return 1;
+}
+
+static int
+lua_task_timer_cancel(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct lua_task_timer *tm = rspamd_lua_check_udata(L, 1, rspamd_task_timer_classname);
+
+	if (tm == NULL) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	if (tm->pending) {
+		rspamd_session_remove_event(tm->task->s, lua_task_timer_fin, tm);
+		lua_pushboolean(L, true);
+	}
+	else {
+		lua_pushboolean(L, false);
+	}
+
+	return 1;
+}
+
+static int
+lua_task_timer_reschedule(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct lua_task_timer *tm = rspamd_lua_check_udata(L, 1, rspamd_task_timer_classname);
+	double timeout = luaL_checknumber(L, 2);
+
+	if (tm == NULL || timeout < 0) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	if (tm->pending) {
+		ev_timer_stop(tm->task->event_loop, &tm->ev);
+		ev_timer_set(&tm->ev, timeout, 0.0);
+		ev_timer_start(tm->task->event_loop, &tm->ev);
+		lua_pushboolean(L, true);
+	}
+	else {
+		lua_pushboolean(L, false);
+	}
+
+	return 1;
+}
+
+#undef M
+
 static int
 lua_task_get_worker(lua_State *L)
 {
@@ -3092,9 +3309,17 @@ lua_task_get_header_common(lua_State *L, enum rspamd_lua_task_header_type how)
 	gboolean strong = FALSE, need_modified = FALSE;
 	struct rspamd_task *task = lua_check_task(L, 1);
 	struct rspamd_mime_header *rh;
+	enum rspamd_mime_header_id id = RSPAMD_HEADER_ID_UNKNOWN;
 	const char *name;
 
-	name = luaL_checkstring(L, 2);
+	if (lua_type(L, 2) == LUA_TNUMBER) {
+		id = lua_tointeger(L, 2);
+		/* Canonical name is used for case sensitive comparison */
+		name = rspamd_mime_header_id_to_name(id);
+	}
+	else {
+		name = luaL_checkstring(L, 2);
+	}
 
 	if (name && task) {
 		if (lua_gettop(L) >= 3) {
@@ -3104,8 +3329,12 @@ lua_task_get_header_common(lua_State *L, enum rspamd_lua_task_header_type how)
 			}
 		}
 
-
-		rh = rspamd_message_get_header_array(task, name, need_modified);
+		if (id != RSPAMD_HEADER_ID_UNKNOWN) {
+			rh = rspamd_message_get_header_array_by_id(task, id, need_modified);
+		}
+		else {
+			rh = rspamd_message_get_header_array(task, name, need_modified);
+		}
 
 		return rspamd_lua_push_header_array(L, name, rh, how, strong);
 	}
@@ -3235,6 +3464,71 @@ lua_task_get_received_headers(lua_State *L)
 	return 1;
 }
 
+static int
+lua_task_get_received_header(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_task *task = lua_check_task(L, 1);
+	lua_Integer n = luaL_checkinteger(L, 2);
+
+	if (task) {
+		if (!task->message || n < 1 ||
+			!rspamd_received_export_nth_to_lua(task, n - 1, L)) {
+			lua_pushnil(L);
+		}
+	}
+	else {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	return 1;
+}
+
+static int
+lua_task_get_received_count(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_task *task = lua_check_task(L, 1);
+
+	if (task) {
+		if (task->message) {
+			lua_pushinteger(L, rspamd_received_count(task, lua_toboolean(L, 2)));
+		}
+		else {
+			lua_pushinteger(L, 0);
+		}
+	}
+	else {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	return 1;
+}
+
+static int
+lua_task_get_headers_hash(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_task *task = lua_check_task(L, 1);
+	const char *hash;
+
+	if (task) {
+		hash = rspamd_mime_headers_hash(task);
+
+		if (hash) {
+			lua_pushstring(L, hash);
+		}
+		else {
+			lua_pushnil(L);
+		}
+	}
+	else {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	return 1;
+}
+
 static int
 lua_task_get_queue_id(lua_State *L)
 {
@@ -4136,7 +4430,7 @@ lua_task_get_reply_sender(lua_State *L)
 
 	if (task) {
 
-		rh = rspamd_message_get_header_array(task, "Reply-To", FALSE);
+		rh = rspamd_message_get_header_array_by_id(task, RSPAMD_HEADER_ID_REPLY_TO, FALSE);
 
 		if (rh) {
 			GPtrArray *addrs;
@@ -5252,7 +5546,7 @@ lua_task_get_date(lua_State *L)
 			}
 		}
 		else {
-			h = rspamd_message_get_header_array(task, "Date", FALSE);
+			h = rspamd_message_get_header_array_by_id(task, RSPAMD_HEADER_ID_DATE, FALSE);
 
 			if (h) {
 				time_t tt;
@@ -7318,6 +7612,9 @@ void luaopen_task(lua_State *L)
 	rspamd_lua_add_preload(L, "rspamd_task", lua_load_task);
 
 	luaopen_archive(L);
+
+	rspamd_lua_new_class(L, rspamd_task_timer_classname, task_timerlib_m);
+	lua_pop(L, 1);
 }
 
 void luaopen_image(lua_State *L)
@@ -16,6 +16,7 @@
 #include "lua_common.h"
 #include "lua_thread_pool.h"
 #include "libserver/ssl_util.h"
+#include "libutil/uring.h"
 #include "utlist.h"
 #include "unix-std.h"
 #include <math.h>
@@ -344,6 +345,7 @@ struct lua_tcp_cbdata {
 	struct rspamd_ssl_connection *ssl_conn;
 	char *hostname;
 	struct upstream *up;
+	struct rspamd_uring_req *uring_req;
 	gboolean eof;
 };
 
@@ -360,6 +362,19 @@ static void lua_tcp_handler(int fd, short what, gpointer ud);
 static void lua_tcp_plan_handler_event(struct lua_tcp_cbdata *cbd,
 									   gboolean can_read, gboolean can_write);
 static void lua_tcp_unregister_event(struct lua_tcp_cbdata *cbd);
+static void lua_tcp_process_read(struct lua_tcp_cbdata *cbd,
+								 unsigned char *in, gssize r);
+
+static void
+lua_tcp_stop_io(struct lua_tcp_cbdata *cbd)
+{
+	rspamd_ev_watcher_stop(cbd->event_loop, &cbd->ev);
+
+	if (cbd->uring_req) {
+		rspamd_uring_cancel(rspamd_uring_get(cbd->event_loop), cbd->uring_req);
+		cbd->uring_req = NULL;
+	}
+}
 
 static void
 lua_tcp_void_finalyser(gpointer arg)
@@ -454,7 +469,7 @@ lua_tcp_fin(gpointer arg)
 	}
 
 	if (cbd->fd != -1) {
-		rspamd_ev_watcher_stop(cbd->event_loop, &cbd->ev);
+		lua_tcp_stop_io(cbd);
 		close(cbd->fd);
 		cbd->fd = -1;
 	}
@@ -773,9 +788,46 @@ lua_tcp_resume_thread(struct lua_tcp_cbdata *cbd, const uint8_t *str, gsize len)
 	TCP_RELEASE(cbd);
 }
 
+static void
+lua_tcp_uring_read_cb(gssize res, const unsigned char *buf, gpointer ud)
+{
+	struct lua_tcp_cbdata *cbd = ud;
+
+	cbd->uring_req = NULL;
+	TCP_RETAIN(cbd);
+	rspamd_ev_watcher_stop(cbd->event_loop, &cbd->ev);
+
+	if (res < 0) {
+		errno = -res;
+		res = -1;
+	}
+
+	lua_tcp_process_read(cbd, (unsigned char *) buf, res);
+	TCP_RELEASE(cbd);
+}
+
 static void
 lua_tcp_plan_read(struct lua_tcp_cbdata *cbd)
 {
+	struct rspamd_uring *ring = rspamd_uring_get(cbd->event_loop);
+
+	if (cbd->uring_req != NULL) {
+		/* Read is already in flight */
+		return;
+	}
+
+	if (ring != NULL && cbd->ssl_conn == NULL) {
+		cbd->uring_req = rspamd_uring_recv(ring, cbd->fd, lua_tcp_uring_read_cb, cbd);
+
+		if (cbd->uring_req != NULL) {
+			/* Data is read by the ring, so we need merely a timeout */
+			rspamd_ev_watcher_stop(cbd->event_loop, &cbd->ev);
+			rspamd_ev_watcher_start_timer(cbd->event_loop, &cbd->ev, cbd->ev.timeout);
+
+			return;
+		}
+	}
+
 	rspamd_ev_watcher_reschedule(cbd->event_loop, &cbd->ev, EV_READ);
 }
 
@@ -1103,7 +1155,7 @@ lua_tcp_handler(int fd, short what, gpointer ud)
 	struct lua_tcp_handler *rh = g_queue_peek_head(cbd->handlers);
 	event_type = rh->type;
 
-	rspamd_ev_watcher_stop(cbd->event_loop, &cbd->ev);
+	lua_tcp_stop_io(cbd);
 
 	if (what == EV_READ) {
 		if (cbd->ssl_conn) {
@@ -1226,8 +1278,7 @@ lua_tcp_plan_handler_event(struct lua_tcp_cbdata *cbd, gboolean can_read,
 				if (can_read) {
 					/* We need to plan a new event */
 					msg_debug_tcp("plan new read");
-					rspamd_ev_watcher_reschedule(cbd->event_loop, &cbd->ev,
-												 EV_READ);
+					lua_tcp_plan_read(cbd);
 				}
 				else {
 					/* Cannot read more */
@@ -2154,7 +2205,7 @@ lua_tcp_close(lua_State *L)
 	}
 
 	if (cbd->fd != -1) {
-		rspamd_ev_watcher_stop(cbd->event_loop, &cbd->ev);
+		lua_tcp_stop_io(cbd);
 		close(cbd->fd);
 		cbd->fd = -1;
 	}
@@ -2335,7 +2386,7 @@ lua_tcp_sync_close(lua_State *L)
 	cbd->flags |= LUA_TCP_FLAG_FINISHED;
 
 	if (cbd->fd != -1) {
-		rspamd_ev_watcher_stop(cbd->event_loop, &cbd->ev);
+		lua_tcp_stop_io(cbd);
 		close(cbd->fd);
 		cbd->fd = -1;
 	}
@@ -2351,7 +2402,7 @@ lua_tcp_sync_session_dtor(gpointer ud)
 
 	if (cbd->fd != -1) {
 		msg_debug("closing sync TCP connection");
-		rspamd_ev_watcher_stop(cbd->event_loop, &cbd->ev);
+		lua_tcp_stop_io(cbd);
 		close(cbd->fd);
 		cbd->fd = -1;
 	}
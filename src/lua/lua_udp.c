@@ -19,6 +19,7 @@
 #include "unix-std.h"
 #include <math.h>
 #include <src/libutil/libev_helper.h>
+#include "libutil/uring.h"
 
 static const char *M = "rspamd lua udp";
 
@@ -68,6 +69,7 @@ struct lua_udp_cbdata {
 	struct rspamd_symcache_dynamic_item *item;
 	struct rspamd_async_session *s;
 	struct iovec *iov;
+	struct rspamd_uring_req *uring_req;
 	lua_State *L;
 	unsigned int retransmits;
 	unsigned int iovlen;
@@ -115,6 +117,12 @@ lua_udp_cbd_fin(gpointer p)
 
 	if (cbd->sock != -1) {
 		rspamd_ev_watcher_stop(cbd->event_loop, &cbd->ev);
+
+		if (cbd->uring_req) {
+			rspamd_uring_cancel(rspamd_uring_get(cbd->event_loop), cbd->uring_req);
+			cbd->uring_req = NULL;
+		}
+
 		close(cbd->sock);
 	}
 
@@ -258,6 +266,45 @@ lua_udp_maybe_register_event(struct lua_udp_cbdata *cbd)
 	return TRUE;
 }
 
+static void
+lua_udp_uring_read_cb(gssize res, const unsigned char *buf, gpointer ud)
+{
+	struct lua_udp_cbdata *cbd = (struct lua_udp_cbdata *) ud;
+
+	cbd->uring_req = NULL;
+	rspamd_ev_watcher_stop(cbd->event_loop, &cbd->ev);
+
+	if (res < 0) {
+		lua_udp_maybe_push_error(cbd, strerror(-res));
+	}
+	else {
+		lua_udp_push_data(cbd, (const char *) buf, res);
+	}
+}
+
+static void
+lua_udp_plan_read(struct lua_udp_cbdata *cbd, ev_tstamp timeout)
+{
+	struct rspamd_uring *ring = rspamd_uring_get(cbd->event_loop);
+
+	if (ring != NULL && cbd->uring_req == NULL) {
+		cbd->uring_req = rspamd_uring_recv(ring, cbd->sock,
+										   lua_udp_uring_read_cb, cbd);
+	}
+
+	if (cbd->uring_req != NULL) {
+		/* Reply is received by the ring (including retransmits), we need just a timer */
+		rspamd_ev_watcher_stop(cbd->event_loop, &cbd->ev);
+		rspamd_ev_watcher_start_timer(cbd->event_loop, &cbd->ev, timeout);
+	}
+	else if (ev_can_stop(&cbd->ev.io)) {
+		rspamd_ev_watcher_reschedule(cbd->event_loop, &cbd->ev, EV_READ);
+	}
+	else {
+		rspamd_ev_watcher_start(cbd->event_loop, &cbd->ev, timeout);
+	}
+}
+
 static void
 lua_udp_io_handler(int fd, short what, gpointer p)
 {
@@ -269,7 +316,7 @@ lua_udp_io_handler(int fd, short what, gpointer p)
 			r = lua_try_send_request(cbd);
 
 			if (r == RSPAMD_SENT_OK) {
-				rspamd_ev_watcher_reschedule(cbd->event_loop, &cbd->ev, EV_READ);
+				lua_udp_plan_read(cbd, cbd->ev.timeout);
 				lua_udp_maybe_register_event(cbd);
 				cbd->retransmits--;
 			}
@@ -295,7 +342,7 @@ lua_udp_io_handler(int fd, short what, gpointer p)
 
 		if (r == RSPAMD_SENT_OK) {
 			if (cbd->cbref != -1) {
-				rspamd_ev_watcher_reschedule(cbd->event_loop, &cbd->ev, EV_READ);
+				lua_udp_plan_read(cbd, cbd->ev.timeout);
 				cbd->sent = TRUE;
 			}
 			else {
@@ -545,7 +592,7 @@ lua_udp_sendto(lua_State *L)
 
 				rspamd_ev_watcher_init(&cbd->ev, cbd->sock, EV_READ,
 									   lua_udp_io_handler, cbd);
-				rspamd_ev_watcher_start(cbd->event_loop, &cbd->ev, timeout);
+				lua_udp_plan_read(cbd, timeout);
 				cbd->sent = TRUE;
 			}
 
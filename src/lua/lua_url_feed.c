@@ -0,0 +1,652 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "lua_common.h"
+#include "lua_url.h"
+#include "message.h"
+#include "khash.h"
+
+/***
+ * @module rspamd_url_feed
+ * This module implements a compact index of URLs feeds (e.g. phishing feeds).
+ * URLs are parsed and stored in a single buffer grouped by host and sorted by
+ * path, so large feeds do not need Lua tables per entry. All URLs of a task are
+ * matched by a single call.
+ *
+ * @example
+local rspamd_url_feed = require "rspamd_url_feed"
+local feed = rspamd_url_feed.create()
+feed:add_list("http://example.com/phish\nhttp://example.net/\n")
+feed:add('http://example.org/login?id=1', 'some data')
+feed:finalize()
+for _, res in ipairs(feed:match_urls(task)) do
+  -- res.url, res.host, res.path, res.found_path, res.found_query, res.data
+end
+ */
+
+/***
+ * @function rspamd_url_feed.create()
+ * Creates a new empty feed index
+ * @return {rspamd_url_feed} feed index
+ */
+LUA_FUNCTION_DEF(url_feed, create);
+/***
+ * @method rspamd_url_feed:add(url, [data])
+ * Adds url with optional data to the index, must be called before `finalize`.
+ * Urls with host, path or query longer than 65535 bytes are not added.
+ * @param {string|text} url url
+ * @param {string|text} data data returned when url matches
+ * @return {boolean} `true` if url has been parsed and added
+ */
+LUA_FUNCTION_DEF(url_feed, add);
+/***
+ * @method rspamd_url_feed:add_list(text)
+ * Adds urls from a list with one url per line, must be called before `finalize`
+ * @param {string|text} text list of urls
+ * @return {number} number of urls added
+ */
+LUA_FUNCTION_DEF(url_feed, add_list);
+/***
+ * @method rspamd_url_feed:finalize()
+ * Builds hosts index, no urls can be added after this call
+ */
+LUA_FUNCTION_DEF(url_feed, finalize);
+/***
+ * @method rspamd_url_feed:has_host(host)
+ * Checks if there are urls with the specified host in the index
+ * @param {string|text} host host
+ * @return {boolean} `true` if host is in the index
+ */
+LUA_FUNCTION_DEF(url_feed, has_host);
+/***
+ * @method rspamd_url_feed:match_urls(task)
+ * Matches all http, https, ftp and file urls of a task (as returned by
+ * `task:get_urls()`) and returns an array of matches for urls whose host is in
+ * the index. Each match is a table with the following fields:
+ *
+ * - `url`: url object
+ * - `host`: host of url
+ * - `path`: `true` if url has path
+ * - `found_path`: `true` if url path is in the index (or both have no path)
+ * - `found_query`: `true` if url query matches or the index entry has no query
+ * - `data`: data of the matched entry if any
+ * @param {rspamd_task} task task
+ * @return {table} array of matches
+ */
+LUA_FUNCTION_DEF(url_feed, match_urls);
+/***
+ * @method rspamd_url_feed:size()
+ * Returns number of urls in the index
+ * @return {number} number of urls
+ */
+LUA_FUNCTION_DEF(url_feed, size);
+LUA_FUNCTION_DEF(url_feed, dtor);
+
+static const struct luaL_reg url_feedlib_m[] = {
+	LUA_INTERFACE_DEF(url_feed, add),
+	LUA_INTERFACE_DEF(url_feed, add_list),
+	LUA_INTERFACE_DEF(url_feed, finalize),
+	LUA_INTERFACE_DEF(url_feed, has_host),
+	LUA_INTERFACE_DEF(url_feed, match_urls),
+	LUA_INTERFACE_DEF(url_feed, size),
+	{"__tostring", rspamd_lua_class_tostring},
+	{"__gc", lua_url_feed_dtor},
+	{NULL, NULL}};
+
+static const struct luaL_reg url_feedlib_f[] = {
+	LUA_INTERFACE_DEF(url_feed, create),
+	{NULL, NULL}};
+
+enum rspamd_url_feed_entry_flags {
+	RSPAMD_URL_FEED_PATH = 1u << 0u,
+	RSPAMD_URL_FEED_QUERY = 1u << 1u,
+	RSPAMD_URL_FEED_DATA = 1u << 2u,
+};
+
+/* Strings are stored as offsets in the feed buffer */
+struct rspamd_url_feed_entry {
+	uint32_t host_off;
+	uint32_t path_off;
+	uint32_t query_off;
+	uint32_t data_off;
+	uint32_t data_len;
+	uint16_t host_len;
+	uint16_t path_len;
+	uint16_t query_len;
+	uint16_t flags;
+};
+
+struct rspamd_url_feed_range {
+	uint32_t start;
+	uint32_t count;
+};
+
+#define rspamd_url_feed_host_hash(t) (rspamd_icase_hash((t).begin, (t).len, rspamd_hash_seed()))
+#define rspamd_url_feed_host_equal(a, b) ((a).len == (b).len && rspamd_lc_cmp((a).begin, (b).begin, (a).len) == 0)
+
+KHASH_INIT(rspamd_url_feed_hosts, rspamd_ftok_t, struct rspamd_url_feed_range, true,
+		   rspamd_url_feed_host_hash, rspamd_url_feed_host_equal);
+
+struct rspamd_url_feed {
+	GByteArray *buf;
+	GArray *entries;
+	khash_t(rspamd_url_feed_hosts) * hosts;
+	/* Used for urls parsing only */
+	rspamd_mempool_t *pool;
+};
+
+struct rspamd_url_feed_add_cbdata {
+	struct rspamd_url_feed *feed;
+	const char *data;
+	gsize datalen;
+	gboolean added;
+};
+
+static struct rspamd_url_feed *
+lua_check_url_feed(lua_State *L, int pos)
+{
+	void *ud = rspamd_lua_check_udata(L, pos, rspamd_url_feed_classname);
+
+	luaL_argcheck(L, ud != NULL, pos, "'url_feed' expected");
+	return ud ? *((struct rspamd_url_feed **) ud) : NULL;
+}
+
+static inline uint32_t
+rspamd_url_feed_append(struct rspamd_url_feed *feed, const char *s, gsize len)
+{
+	uint32_t off = feed->buf->len;
+
+	g_byte_array_append(feed->buf, (const guint8 *) s, len);
+
+	return off;
+}
+
+#define FEED_STR(feed, off) ((const char *) (feed)->buf->data + (off))
+
+/* Lengths of url components are stored in 16 bits and offsets in 32 bits */
+static inline gboolean
+rspamd_url_feed_can_store(struct rspamd_url_feed *feed, struct rspamd_url *url,
+						  gsize datalen)
+{
+	gsize hostlen = url->hostlen, pathlen = url->datalen, querylen = url->querylen;
+
+	if (hostlen > G_MAXUINT16 || pathlen > G_MAXUINT16 || querylen > G_MAXUINT16) {
+		return FALSE;
+	}
+
+	return (gsize) feed->buf->len + hostlen + pathlen + querylen + datalen <= G_MAXUINT32;
+}
+
+static gboolean
+rspamd_url_feed_inserter(struct rspamd_url *url, gsize start_offset,
+						 gsize end_offset, gpointer ud)
+{
+	struct rspamd_url_feed_add_cbdata *cbd = ud;
+	struct rspamd_url_feed *feed = cbd->feed;
+	struct rspamd_url_feed_entry e;
+
+	if (url->hostlen == 0 || cbd->added) {
+		return FALSE;
+	}
+
+	if (!rspamd_url_feed_can_store(feed, url, cbd->datalen)) {
+		return FALSE;
+	}
+
+	memset(&e, 0, sizeof(e));
+	e.host_off = rspamd_url_feed_append(feed, rspamd_url_host_unsafe(url), url->hostlen);
+	e.host_len = url->hostlen;
+
+	if (url->datalen > 0) {
+		e.path_off = rspamd_url_feed_append(feed, rspamd_url_data_unsafe(url), url->datalen);
+		e.path_len = url->datalen;
+		e.flags |= RSPAMD_URL_FEED_PATH;
+	}
+
+	if (url->querylen > 0) {
+		e.query_off = rspamd_url_feed_append(feed, rspamd_url_query_unsafe(url), url->querylen);
+		e.query_len = url->querylen;
+		e.flags |= RSPAMD_URL_FEED_QUERY;
+	}
+
+	if (cbd->data) {
+		e.data_off = rspamd_url_feed_append(feed, cbd->data, cbd->datalen);
+		e.data_len = cbd->datalen;
+		e.flags |= RSPAMD_URL_FEED_DATA;
+	}
+
+	g_array_append_val(feed->entries, e);
+	cbd->added = TRUE;
+
+	/* Only the first url is used */
+	return FALSE;
+}
+
+static gboolean
+rspamd_url_feed_add(struct rspamd_url_feed *feed, const char *str, gsize len,
+					const char *data, gsize datalen)
+{
+	struct rspamd_url_feed_add_cbdata cbd;
+
+	cbd.feed = feed;
+	cbd.data = data;
+	cbd.datalen = datalen;
+	cbd.added = FALSE;
+
+	rspamd_url_find_single(feed->pool, str, len, RSPAMD_URL_FIND_ALL,
+						   rspamd_url_feed_inserter, &cbd);
+
+	return cbd.added;
+}
+
+static int
+rspamd_url_feed_cmp(const void *a, const void *b, gpointer ud)
+{
+	const struct rspamd_url_feed_entry *e1 = a, *e2 = b;
+	struct rspamd_url_feed *feed = ud;
+	int ret;
+
+	if (e1->host_len != e2->host_len) {
+		return (int) e1->host_len - (int) e2->host_len;
+	}
+
+	ret = rspamd_lc_cmp(FEED_STR(feed, e1->host_off), FEED_STR(feed, e2->host_off),
+						e1->host_len);
+
+	if (ret != 0) {
+		return ret;
+	}
+
+	/* Entries without path go first */
+	if ((e1->flags & RSPAMD_URL_FEED_PATH) != (e2->flags & RSPAMD_URL_FEED_PATH)) {
+		return (e1->flags & RSPAMD_URL_FEED_PATH) ? 1 : -1;
+	}
+
+	if (e1->path_len != e2->path_len) {
+		return (int) e1->path_len - (int) e2->path_len;
+	}
+
+	return memcmp(FEED_STR(feed, e1->path_off), FEED_STR(feed, e2->path_off),
+				  e1->path_len);
+}
+
+/* Returns the first entry with the specified path in a host range */
+static unsigned int
+rspamd_url_feed_path_lower_bound(struct rspamd_url_feed *feed,
+								 const struct rspamd_url_feed_range *range,
+								 const char *path, uint16_t pathlen)
+{
+	unsigned int lo = range->start, hi = range->start + range->count;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		const struct rspamd_url_feed_entry *e = &g_array_index(feed->entries,
+															   struct rspamd_url_feed_entry, mid);
+		int cmp;
+
+		if (!(e->flags & RSPAMD_URL_FEED_PATH)) {
+			cmp = -1;
+		}
+		else if (e->path_len != pathlen) {
+			cmp = (int) e->path_len - (int) pathlen;
+		}
+		else {
+			cmp = memcmp(FEED_STR(feed, e->path_off), path, pathlen);
+		}
+
+		if (cmp < 0) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+static inline gboolean
+rspamd_url_feed_query_matches(struct rspamd_url_feed *feed,
+							  const struct rspamd_url_feed_entry *e,
+							  struct rspamd_url *url)
+{
+	if (!(e->flags & RSPAMD_URL_FEED_QUERY)) {
+		return TRUE;
+	}
+
+	return url->querylen > 0 && url->querylen == e->query_len &&
+		   memcmp(FEED_STR(feed, e->query_off), rspamd_url_query_unsafe(url),
+				  e->query_len) == 0;
+}
+
+static void
+rspamd_url_feed_match_url(lua_State *L, struct rspamd_url_feed *feed,
+						  struct rspamd_url *url, int *nres)
+{
+	const struct rspamd_url_feed_entry *e, *found = NULL;
+	struct rspamd_url_feed_range *range;
+	struct rspamd_lua_url *lua_url;
+	gboolean found_path = FALSE, found_query = FALSE;
+	rspamd_ftok_t host;
+	khiter_t k;
+
+	host.begin = rspamd_url_host_unsafe(url);
+	host.len = url->hostlen;
+	k = kh_get(rspamd_url_feed_hosts, feed->hosts, host);
+
+	if (k == kh_end(feed->hosts)) {
+		return;
+	}
+
+	range = &kh_value(feed->hosts, k);
+
+	if (url->datalen > 0) {
+		for (unsigned int i = rspamd_url_feed_path_lower_bound(feed, range,
+															   rspamd_url_data_unsafe(url), url->datalen);
+			 i < range->start + range->count; i++) {
+			e = &g_array_index(feed->entries, struct rspamd_url_feed_entry, i);
+
+			if (e->path_len != url->datalen ||
+				memcmp(FEED_STR(feed, e->path_off), rspamd_url_data_unsafe(url),
+					   url->datalen) != 0) {
+				break;
+			}
+
+			found_path = TRUE;
+			/* The last matching entry provides data */
+			found = e;
+
+			if (rspamd_url_feed_query_matches(feed, e, url)) {
+				found_query = TRUE;
+			}
+		}
+	}
+	else {
+		for (unsigned int i = range->start; i < range->start + range->count; i++) {
+			e = &g_array_index(feed->entries, struct rspamd_url_feed_entry, i);
+
+			if (!(e->flags & RSPAMD_URL_FEED_PATH)) {
+				found_path = TRUE;
+			}
+
+			if (rspamd_url_feed_query_matches(feed, e, url)) {
+				found_query = TRUE;
+			}
+		}
+	}
+
+	lua_createtable(L, 0, 6);
+	lua_url = lua_newuserdata(L, sizeof(*lua_url));
+	rspamd_lua_setclass(L, rspamd_url_classname, -1);
+	lua_url->url = url;
+	lua_setfield(L, -2, "url");
+	lua_pushlstring(L, host.begin, host.len);
+	lua_setfield(L, -2, "host");
+	lua_pushboolean(L, url->datalen > 0);
+	lua_setfield(L, -2, "path");
+	lua_pushboolean(L, found_path);
+	lua_setfield(L, -2, "found_path");
+	lua_pushboolean(L, found_query);
+	lua_setfield(L, -2, "found_query");
+
+	if (found && (found->flags & RSPAMD_URL_FEED_DATA)) {
+		lua_pushlstring(L, FEED_STR(feed, found->data_off), found->data_len);
+		lua_setfield(L, -2, "data");
+	}
+
+	lua_rawseti(L, -2, ++(*nres));
+}
+
+static int
+lua_url_feed_create(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_url_feed *feed, **pfeed;
+
+	feed = g_malloc0(sizeof(*feed));
+	feed->buf = g_byte_array_new();
+	feed->entries = g_array_new(FALSE, FALSE, sizeof(struct rspamd_url_feed_entry));
+	feed->pool = rspamd_mempool_new(rspamd_mempool_suggest_size(), "url_feed", 0);
+
+	pfeed = lua_newuserdata(L, sizeof(*pfeed));
+	rspamd_lua_setclass(L, rspamd_url_feed_classname, -1);
+	*pfeed = feed;
+
+	return 1;
+}
+
+static int
+lua_url_feed_add(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_url_feed *feed = lua_check_url_feed(L, 1);
+	struct rspamd_lua_text *t = lua_check_text_or_string(L, 2), *data = NULL;
+
+	if (feed == NULL || t == NULL) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	if (feed->pool == NULL) {
+		return luaL_error(L, "feed is already finalized");
+	}
+
+	if (lua_gettop(L) >= 3 && !lua_isnil(L, 3)) {
+		data = lua_check_text_or_string(L, 3);
+	}
+
+	lua_pushboolean(L, rspamd_url_feed_add(feed, t->start, t->len,
+										   data ? data->start : NULL, data ? data->len : 0));
+
+	return 1;
+}
+
+static int
+lua_url_feed_add_list(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_url_feed *feed = lua_check_url_feed(L, 1);
+	struct rspamd_lua_text *t = lua_check_text_or_string(L, 2);
+	const char *p, *end, *eol;
+	unsigned int nadded = 0;
+
+	if (feed == NULL || t == NULL) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	if (feed->pool == NULL) {
+		return luaL_error(L, "feed is already finalized");
+	}
+
+	p = t->start;
+	end = t->start + t->len;
+
+	while (p < end) {
+		eol = memchr(p, '\n', end - p);
+
+		if (eol == NULL) {
+			eol = end;
+		}
+
+		if (eol > p && rspamd_url_feed_add(feed, p, eol - p, NULL, 0)) {
+			nadded++;
+		}
+
+		p = eol + 1;
+	}
+
+	lua_pushinteger(L, nadded);
+
+	return 1;
+}
+
+static int
+lua_url_feed_finalize(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_url_feed *feed = lua_check_url_feed(L, 1);
+	struct rspamd_url_feed_entry *e;
+	struct rspamd_url_feed_range *range;
+	rspamd_ftok_t host;
+	khiter_t k;
+	int r;
+
+	if (feed == NULL) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	if (feed->pool == NULL) {
+		return 0;
+	}
+
+	/* Parsed urls are no longer needed */
+	rspamd_mempool_delete(feed->pool);
+	feed->pool = NULL;
+
+	g_array_sort_with_data(feed->entries, rspamd_url_feed_cmp, feed);
+	feed->hosts = kh_init(rspamd_url_feed_hosts);
+	kh_resize(rspamd_url_feed_hosts, feed->hosts, feed->entries->len / 2 + 1);
+
+	/* Buffer is not modified any longer, so keys can point to it */
+	for (unsigned int i = 0; i < feed->entries->len; i++) {
+		e = &g_array_index(feed->entries, struct rspamd_url_feed_entry, i);
+		host.begin = FEED_STR(feed, e->host_off);
+		host.len = e->host_len;
+		k = kh_put(rspamd_url_feed_hosts, feed->hosts, host, &r);
+		range = &kh_value(feed->hosts, k);
+
+		if (r != 0) {
+			range->start = i;
+			range->count = 1;
+		}
+		else {
+			range->count++;
+		}
+	}
+
+	return 0;
+}
+
+static int
+lua_url_feed_has_host(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_url_feed *feed = lua_check_url_feed(L, 1);
+	struct rspamd_lua_text *t = lua_check_text_or_string(L, 2);
+	rspamd_ftok_t host;
+
+	if (feed == NULL || t == NULL) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	if (feed->hosts == NULL) {
+		return luaL_error(L, "feed is not finalized");
+	}
+
+	host.begin = t->start;
+	host.len = t->len;
+	lua_pushboolean(L, kh_get(rspamd_url_feed_hosts, feed->hosts, host) !=
+						   kh_end(feed->hosts));
+
+	return 1;
+}
+
+static int
+lua_url_feed_match_urls(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_url_feed *feed = lua_check_url_feed(L, 1);
+	struct rspamd_task *task = lua_check_task(L, 2);
+	static const int protocols_mask = PROTOCOL_HTTP | PROTOCOL_HTTPS |
+									  PROTOCOL_FILE | PROTOCOL_FTP;
+	struct rspamd_url *u;
+	int nres = 0;
+
+	if (feed == NULL || task == NULL) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	if (feed->hosts == NULL) {
+		return luaL_error(L, "feed is not finalized");
+	}
+
+	lua_newtable(L);
+
+	if (task->message == NULL || kh_size(feed->hosts) == 0) {
+		return 1;
+	}
+
+	kh_foreach_key(MESSAGE_FIELD(task, urls), u, {
+		/* The same urls as `task:get_urls()` returns */
+		if ((u->protocol & protocols_mask) && u->hostlen > 0 &&
+			!(u->flags & (RSPAMD_URL_FLAG_CONTENT | RSPAMD_URL_FLAG_IMAGE))) {
+			rspamd_url_feed_match_url(L, feed, u, &nres);
+		}
+	});
+
+	return 1;
+}
+
+static int
+lua_url_feed_size(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_url_feed *feed = lua_check_url_feed(L, 1);
+
+	if (feed == NULL) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	lua_pushinteger(L, feed->entries->len);
+
+	return 1;
+}
+
+static int
+lua_url_feed_dtor(lua_State *L)
+{
+	struct rspamd_url_feed *feed = lua_check_url_feed(L, 1);
+
+	if (feed) {
+		if (feed->pool) {
+			rspamd_mempool_delete(feed->pool);
+		}
+
+		if (feed->hosts) {
+			kh_destroy(rspamd_url_feed_hosts, feed->hosts);
+		}
+
+		g_array_free(feed->entries, TRUE);
+		g_byte_array_free(feed->buf, TRUE);
+		g_free(feed);
+	}
+
+	return 0;
+}
+
+static int
+lua_load_url_feed(lua_State *L)
+{
+	lua_newtable(L);
+	luaL_register(L, NULL, url_feedlib_f);
+
+	return 1;
+}
+
+void luaopen_url_feed(lua_State *L)
+{
+	rspamd_lua_new_class(L, rspamd_url_feed_classname, url_feedlib_m);
+	lua_pop(L, 1);
+	rspamd_lua_add_preload(L, "rspamd_url_feed", lua_load_url_feed);
+}
@@ -20,6 +20,7 @@
 #include "libmime/content_type.h"
 #include "libmime/mime_headers.h"
 #include "libutil/hash.h"
+#include "libutil/libev_helper.h"
 
 #include "lua_parsers.h"
 
@@ -651,6 +652,15 @@ LUA_FUNCTION_DEF(util, parse_content_type);
  */
 LUA_FUNCTION_DEF(util, mime_header_encode);
 
+/***
+ *  @function util.get_header_id(name)
+ * Returns numeric id of a well-known header (caseless), that can be used
+ * in `task:get_header*` methods instead of a name to avoid hashing
+ * @param {string} name header name
+ * @return {number} header id or nil if a header is not well-known
+ */
+LUA_FUNCTION_DEF(util, get_header_id);
+
 /***
  *  @function util.btc_polymod(input_values)
  * Performs bitcoin polymod function
@@ -668,6 +678,37 @@ LUA_FUNCTION_DEF(util, btc_polymod);
  */
 LUA_FUNCTION_DEF(util, parse_smtp_date);
 
+/***
+ * @function util.clickhouse_row_to_tsv(row)
+ * Converts a row to the ClickHouse TabSeparated format. Strings and text are
+ * escaped, tables are converted to arrays with quoted strings
+ * @param {table} row array of strings, numbers, rspamd_text or tables of them
+ * @return {rspamd_text} row in TSV format
+ */
+LUA_FUNCTION_DEF(util, clickhouse_row_to_tsv);
+
+/***
+ * @function util.clickhouse_compile_types(types)
+ * Compiles a list of ClickHouse column types to an opaque value used by
+ * `util.clickhouse_row_to_binary`. Supported types are integers, floats,
+ * `String`, `FixedString`, `Date`, `DateTime`, `Enum8`, `Enum16` and
+ * `Array`, `Nullable` or `LowCardinality` of them
+ * @param {table} types array of type names, e.g. `{'UInt32', 'Array(String)'}`
+ * @return {string} compiled types or nil and error message
+ */
+LUA_FUNCTION_DEF(util, clickhouse_compile_types);
+
+/***
+ * @function util.clickhouse_row_to_binary(row, types)
+ * Converts a row to the ClickHouse RowBinary format. `Date` accepts
+ * `YYYY-MM-DD` strings or unix timestamps, enums accept names or values and
+ * `nil` is allowed for `Nullable` columns only
+ * @param {table} row array of values, one per column
+ * @param {string} types types compiled by `util.clickhouse_compile_types`
+ * @return {rspamd_text} row in RowBinary format
+ */
+LUA_FUNCTION_DEF(util, clickhouse_row_to_binary);
+
 
 static const struct luaL_reg utillib_f[] = {
 	LUA_INTERFACE_DEF(util, create_event_base),
@@ -731,11 +772,15 @@ static const struct luaL_reg utillib_f[] = {
 	LUA_INTERFACE_DEF(util, get_hostname),
 	LUA_INTERFACE_DEF(util, parse_content_type),
 	LUA_INTERFACE_DEF(util, mime_header_encode),
+	LUA_INTERFACE_DEF(util, get_header_id),
 	LUA_INTERFACE_DEF(util, pack),
 	LUA_INTERFACE_DEF(util, unpack),
 	LUA_INTERFACE_DEF(util, packsize),
 	LUA_INTERFACE_DEF(util, btc_polymod),
 	LUA_INTERFACE_DEF(util, parse_smtp_date),
+	LUA_INTERFACE_DEF(util, clickhouse_row_to_tsv),
+	LUA_INTERFACE_DEF(util, clickhouse_compile_types),
+	LUA_INTERFACE_DEF(util, clickhouse_row_to_binary),
 	{NULL, NULL}};
 
 LUA_FUNCTION_DEF(int64, tostring);
@@ -970,6 +1015,7 @@ lua_util_process_message(lua_State *L)
 			}
 		}
 
+		rspamd_ev_wheel_destroy(base);
 		ev_loop_destroy(base);
 	}
 	else {
@@ -2409,6 +2455,30 @@ lua_util_mime_header_encode(lua_State *L)
 	return 1;
 }
 
+static int
+lua_util_get_header_id(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	gsize len;
+	const char *name = luaL_checklstring(L, 1, &len);
+	enum rspamd_mime_header_id id;
+
+	if (!name) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	id = rspamd_mime_header_id_from_name(name, len);
+
+	if (id != RSPAMD_HEADER_ID_UNKNOWN) {
+		lua_pushinteger(L, id);
+	}
+	else {
+		lua_pushnil(L);
+	}
+
+	return 1;
+}
+
 static int
 lua_util_is_valid_utf8(lua_State *L)
 {
@@ -3446,6 +3516,873 @@ lua_util_parse_smtp_date(lua_State *L)
 	return lua_parsers_parse_smtp_date(L);
 }
 
+static void
+lua_util_clickhouse_escape(GString *out, const char *s, gsize len)
+{
+	const char *p = s, *c = s, *end = s + len;
+	char esc;
+
+	while (p < end) {
+		switch (*p) {
+		case '\'':
+		case '\\':
+			esc = *p;
+			break;
+		case '\n':
+			esc = 'n';
+			break;
+		case '\t':
+			esc = 't';
+			break;
+		case '\r':
+			esc = 'r';
+			break;
+		default:
+			p++;
+			continue;
+		}
+
+		g_string_append_len(out, c, p - c);
+		g_string_append_c(out, '\\');
+		g_string_append_c(out, esc);
+		p++;
+		c = p;
+	}
+
+	g_string_append_len(out, c, p - c);
+}
+
+/* Appends value on the top of the stack, strings are quoted inside arrays */
+static gboolean
+lua_util_clickhouse_append_value(lua_State *L, GString *out, gboolean quote)
+{
+	struct rspamd_lua_text *t;
+	const char *str;
+	gsize len;
+	double num;
+
+	switch (lua_type(L, -1)) {
+	case LUA_TNUMBER:
+		num = lua_tonumber(L, -1);
+
+		if (num == floor(num) && fabs(num) < 9007199254740992.0) {
+			rspamd_printf_gstring(out, "%L", (int64_t) num);
+		}
+		else {
+			rspamd_printf_gstring(out, "%g", num);
+		}
+
+		return TRUE;
+	case LUA_TSTRING:
+		str = lua_tolstring(L, -1, &len);
+		break;
+	case LUA_TUSERDATA:
+		t = rspamd_lua_check_udata_maybe(L, -1, rspamd_text_classname);
+
+		if (t) {
+			str = t->start;
+			len = t->len;
+		}
+		else if (luaL_callmeta(L, -1, "__tostring")) {
+			if (quote) {
+				g_string_append_c(out, '\'');
+			}
+
+			str = lua_tolstring(L, -1, &len);
+			lua_util_clickhouse_escape(out, str, len);
+			lua_pop(L, 1);
+
+			if (quote) {
+				g_string_append_c(out, '\'');
+			}
+
+			return TRUE;
+		}
+		else {
+			return FALSE;
+		}
+		break;
+	default:
+		return FALSE;
+	}
+
+	if (quote) {
+		g_string_append_c(out, '\'');
+	}
+
+	lua_util_clickhouse_escape(out, str, len);
+
+	if (quote) {
+		g_string_append_c(out, '\'');
+	}
+
+	return TRUE;
+}
+
+static int
+lua_util_clickhouse_row_to_tsv(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_text *t;
+	GString *out;
+	int i, j;
+	gboolean ret = TRUE;
+
+	if (!lua_istable(L, 1)) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	out = g_string_sized_new(256);
+
+	for (i = 1;; i++) {
+		lua_rawgeti(L, 1, i);
+
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			break;
+		}
+
+		if (i > 1) {
+			g_string_append_c(out, '\t');
+		}
+
+		if (lua_type(L, -1) == LUA_TTABLE) {
+			g_string_append_c(out, '[');
+
+			for (j = 1;; j++) {
+				lua_rawgeti(L, -1, j);
+
+				if (lua_isnil(L, -1)) {
+					lua_pop(L, 1);
+					break;
+				}
+
+				if (j > 1) {
+					g_string_append_c(out, ',');
+				}
+
+				ret = lua_util_clickhouse_append_value(L, out, TRUE);
+				lua_pop(L, 1);
+
+				if (!ret) {
+					break;
+				}
+			}
+
+			g_string_append_c(out, ']');
+		}
+		else {
+			ret = lua_util_clickhouse_append_value(L, out, FALSE);
+		}
+
+		lua_pop(L, 1);
+
+		if (!ret) {
+			g_string_free(out, TRUE);
+
+			return luaL_error(L, "invalid value in row at position %d", i);
+		}
+	}
+
+	t = lua_newuserdata(L, sizeof(*t));
+	rspamd_lua_setclass(L, rspamd_text_classname, -1);
+	t->len = out->len;
+	t->start = g_string_free(out, FALSE);
+	t->flags = RSPAMD_TEXT_FLAG_OWN;
+
+	return 1;
+}
+
+/*
+ * Compiled types start with the magic and the number of columns followed by
+ * a type node per column, all numbers in host byte order
+ */
+#define LUA_CH_TYPES_MAGIC "CT"
+
+enum lua_clickhouse_type {
+	LUA_CH_TYPE_UINT8 = 1,
+	LUA_CH_TYPE_UINT16,
+	LUA_CH_TYPE_UINT32,
+	LUA_CH_TYPE_UINT64,
+	LUA_CH_TYPE_INT8,
+	LUA_CH_TYPE_INT16,
+	LUA_CH_TYPE_INT32,
+	LUA_CH_TYPE_INT64,
+	LUA_CH_TYPE_FLOAT32,
+	LUA_CH_TYPE_FLOAT64,
+	LUA_CH_TYPE_STRING,
+	LUA_CH_TYPE_FIXED_STRING, /* guint32 length */
+	LUA_CH_TYPE_DATE,
+	LUA_CH_TYPE_DATETIME,
+	LUA_CH_TYPE_ENUM8, /* guint16 count, then guint16 length, name, gint16 value */
+	LUA_CH_TYPE_ENUM16,
+	LUA_CH_TYPE_ARRAY,    /* element type node */
+	LUA_CH_TYPE_NULLABLE, /* nested type node */
+};
+
+static const struct {
+	const char *name;
+	enum lua_clickhouse_type type;
+} lua_ch_simple_types[] = {
+	{"UInt8", LUA_CH_TYPE_UINT8},
+	{"Bool", LUA_CH_TYPE_UINT8},
+	{"UInt16", LUA_CH_TYPE_UINT16},
+	{"UInt32", LUA_CH_TYPE_UINT32},
+	{"UInt64", LUA_CH_TYPE_UINT64},
+	{"Int8", LUA_CH_TYPE_INT8},
+	{"Int16", LUA_CH_TYPE_INT16},
+	{"Int32", LUA_CH_TYPE_INT32},
+	{"Int64", LUA_CH_TYPE_INT64},
+	{"Float32", LUA_CH_TYPE_FLOAT32},
+	{"Float64", LUA_CH_TYPE_FLOAT64},
+	{"String", LUA_CH_TYPE_STRING},
+	{"Date", LUA_CH_TYPE_DATE},
+	{"DateTime", LUA_CH_TYPE_DATETIME},
+};
+
+static const char *
+lua_util_ch_skip_spaces(const char *p, const char *end)
+{
+	while (p < end && g_ascii_isspace(*p)) {
+		p++;
+	}
+
+	return p;
+}
+
+static const char *
+lua_util_ch_parse_int(const char *p, const char *end, int64_t *res)
+{
+	gboolean neg = FALSE;
+	const char *start;
+	int64_t v = 0;
+
+	if (p < end && *p == '-') {
+		neg = TRUE;
+		p++;
+	}
+
+	start = p;
+
+	while (p < end && g_ascii_isdigit(*p) && v < G_MAXINT32) {
+		v = v * 10 + (*p - '0');
+		p++;
+	}
+
+	if (p == start) {
+		return NULL;
+	}
+
+	*res = neg ? -v : v;
+
+	return p;
+}
+
+/* Parses enum items starting after the opening bracket */
+static const char *
+lua_util_ch_compile_enum(const char *p, const char *end, GByteArray *prog)
+{
+	guint16 nitems = 0, len;
+	gint16 value;
+	int64_t v;
+	guint count_pos = prog->len, len_pos;
+
+	g_byte_array_append(prog, (const guint8 *) &nitems, sizeof(nitems));
+
+	for (;;) {
+		p = lua_util_ch_skip_spaces(p, end);
+
+		if (p >= end || *p != '\'') {
+			return NULL;
+		}
+
+		p++;
+		len_pos = prog->len;
+		len = 0;
+		g_byte_array_append(prog, (const guint8 *) &len, sizeof(len));
+
+		while (p < end && *p != '\'') {
+			if (*p == '\\' && p + 1 < end) {
+				p++;
+			}
+
+			g_byte_array_append(prog, (const guint8 *) p, 1);
+			p++;
+		}
+
+		if (p >= end) {
+			return NULL;
+		}
+
+		len = prog->len - len_pos - sizeof(len);
+		memcpy(prog->data + len_pos, &len, sizeof(len));
+		p = lua_util_ch_skip_spaces(p + 1, end);
+
+		if (p >= end || *p != '=') {
+			return NULL;
+		}
+
+		p = lua_util_ch_parse_int(lua_util_ch_skip_spaces(p + 1, end), end, &v);
+
+		if (p == NULL || v < G_MININT16 || v > G_MAXINT16) {
+			return NULL;
+		}
+
+		value = v;
+		g_byte_array_append(prog, (const guint8 *) &value, sizeof(value));
+		nitems++;
+		p = lua_util_ch_skip_spaces(p, end);
+
+		if (p < end && *p == ',') {
+			p++;
+		}
+		else if (p < end && *p == ')') {
+			break;
+		}
+		else {
+			return NULL;
+		}
+	}
+
+	memcpy(prog->data + count_pos, &nitems, sizeof(nitems));
+
+	return p + 1;
+}
+
+/* Compiles a type starting at p, returns pointer after it or NULL */
+static const char *
+lua_util_ch_compile_type(const char *p, const char *end, GByteArray *prog)
+{
+	const char *id;
+	gsize idlen;
+	guint8 code;
+	guint32 fixed_len;
+	int64_t v;
+	unsigned int i;
+
+	p = lua_util_ch_skip_spaces(p, end);
+	id = p;
+
+	while (p < end && (g_ascii_isalnum(*p) || *p == '_')) {
+		p++;
+	}
+
+	idlen = p - id;
+	p = lua_util_ch_skip_spaces(p, end);
+
+#define CH_TYPE_IS(s) (idlen == sizeof(s) - 1 && memcmp(id, (s), idlen) == 0)
+
+	if (CH_TYPE_IS("Array") || CH_TYPE_IS("Nullable") ||
+		CH_TYPE_IS("LowCardinality")) {
+		if (p >= end || *p != '(') {
+			return NULL;
+		}
+
+		/* LowCardinality has the same binary representation as its type */
+		if (!CH_TYPE_IS("LowCardinality")) {
+			code = CH_TYPE_IS("Array") ? LUA_CH_TYPE_ARRAY : LUA_CH_TYPE_NULLABLE;
+			g_byte_array_append(prog, &code, sizeof(code));
+		}
+
+		p = lua_util_ch_compile_type(p + 1, end, prog);
+
+		if (p == NULL) {
+			return NULL;
+		}
+
+		p = lua_util_ch_skip_spaces(p, end);
+
+		if (p >= end || *p != ')') {
+			return NULL;
+		}
+
+		return p + 1;
+	}
+	else if (CH_TYPE_IS("FixedString")) {
+		if (p >= end || *p != '(') {
+			return NULL;
+		}
+
+		p = lua_util_ch_parse_int(lua_util_ch_skip_spaces(p + 1, end), end, &v);
+
+		if (p == NULL || v <= 0) {
+			return NULL;
+		}
+
+		p = lua_util_ch_skip_spaces(p, end);
+
+		if (p >= end || *p != ')') {
+			return NULL;
+		}
+
+		code = LUA_CH_TYPE_FIXED_STRING;
+		fixed_len = v;
+		g_byte_array_append(prog, &code, sizeof(code));
+		g_byte_array_append(prog, (const guint8 *) &fixed_len, sizeof(fixed_len));
+
+		return p + 1;
+	}
+	else if (CH_TYPE_IS("Enum8") || CH_TYPE_IS("Enum16")) {
+		if (p >= end || *p != '(') {
+			return NULL;
+		}
+
+		code = CH_TYPE_IS("Enum8") ? LUA_CH_TYPE_ENUM8 : LUA_CH_TYPE_ENUM16;
+		g_byte_array_append(prog, &code, sizeof(code));
+
+		return lua_util_ch_compile_enum(p + 1, end, prog);
+	}
+
+	for (i = 0; i < G_N_ELEMENTS(lua_ch_simple_types); i++) {
+		if (idlen == strlen(lua_ch_simple_types[i].name) &&
+			memcmp(id, lua_ch_simple_types[i].name, idlen) == 0) {
+			code = lua_ch_simple_types[i].type;
+			g_byte_array_append(prog, &code, sizeof(code));
+
+			if (code == LUA_CH_TYPE_DATETIME && p < end && *p == '(') {
+				/* Skip timezone, it does not change the representation */
+				while (p < end && *p != ')') {
+					p++;
+				}
+
+				if (p >= end) {
+					return NULL;
+				}
+
+				p++;
+			}
+
+			return p;
+		}
+	}
+
+#undef CH_TYPE_IS
+
+	return NULL;
+}
+
+static int
+lua_util_clickhouse_compile_types(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	GByteArray *prog;
+	const char *type, *p, *end;
+	gsize len;
+	guint32 ncols, i;
+
+	if (!lua_istable(L, 1)) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	ncols = rspamd_lua_table_size(L, 1);
+	prog = g_byte_array_sized_new(64);
+	g_byte_array_append(prog, (const guint8 *) LUA_CH_TYPES_MAGIC,
+						sizeof(LUA_CH_TYPES_MAGIC) - 1);
+	g_byte_array_append(prog, (const guint8 *) &ncols, sizeof(ncols));
+
+	for (i = 1; i <= ncols; i++) {
+		lua_rawgeti(L, 1, i);
+		type = lua_tolstring(L, -1, &len);
+		p = NULL;
+
+		if (type != NULL) {
+			end = type + len;
+			p = lua_util_ch_compile_type(type, end, prog);
+
+			if (p != NULL && lua_util_ch_skip_spaces(p, end) != end) {
+				p = NULL;
+			}
+		}
+
+		if (p == NULL) {
+			g_byte_array_free(prog, TRUE);
+			lua_pushnil(L);
+			lua_pushfstring(L, "unsupported type at position %d: %s", (int) i,
+							type ? type : "(not a string)");
+
+			return 2;
+		}
+
+		lua_pop(L, 1);
+	}
+
+	lua_pushlstring(L, (const char *) prog->data, prog->len);
+	g_byte_array_free(prog, TRUE);
+
+	return 1;
+}
+
+static const unsigned char *
+lua_util_ch_skip_type(const unsigned char *pc)
+{
+	guint16 nitems, len, i;
+
+	switch (*pc++) {
+	case LUA_CH_TYPE_FIXED_STRING:
+		return pc + sizeof(guint32);
+	case LUA_CH_TYPE_ENUM8:
+	case LUA_CH_TYPE_ENUM16:
+		memcpy(&nitems, pc, sizeof(nitems));
+		pc += sizeof(nitems);
+
+		for (i = 0; i < nitems; i++) {
+			memcpy(&len, pc, sizeof(len));
+			pc += sizeof(len) + len + sizeof(gint16);
+		}
+
+		return pc;
+	case LUA_CH_TYPE_ARRAY:
+	case LUA_CH_TYPE_NULLABLE:
+		return lua_util_ch_skip_type(pc);
+	default:
+		return pc;
+	}
+}
+
+static void
+lua_util_ch_append_le(GString *out, uint64_t v, unsigned int width)
+{
+	unsigned int i;
+
+	for (i = 0; i < width; i++) {
+		g_string_append_c(out, (char) (v & 0xff));
+		v >>= 8;
+	}
+}
+
+static void
+lua_util_ch_append_varint(GString *out, uint64_t v)
+{
+	while (v >= 0x80) {
+		g_string_append_c(out, (char) ((v & 0x7f) | 0x80));
+		v >>= 7;
+	}
+
+	g_string_append_c(out, (char) v);
+}
+
+/* Gets a number or a numeric string on the top of the stack */
+static gboolean
+lua_util_ch_get_number(lua_State *L, double *num)
+{
+	if (lua_type(L, -1) == LUA_TBOOLEAN) {
+		*num = lua_toboolean(L, -1) ? 1 : 0;
+
+		return TRUE;
+	}
+	else if (lua_isnumber(L, -1)) {
+		*num = lua_tonumber(L, -1);
+
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/*
+ * Gets string data of the value on the top of the stack, pushes the result of
+ * __tostring if it is used, so the caller must pop `*pushed` values
+ */
+static const char *
+lua_util_ch_get_string(lua_State *L, gsize *len, int *pushed)
+{
+	struct rspamd_lua_text *t;
+
+	*pushed = 0;
+
+	switch (lua_type(L, -1)) {
+	case LUA_TSTRING:
+	case LUA_TNUMBER:
+		return lua_tolstring(L, -1, len);
+	case LUA_TUSERDATA:
+		t = rspamd_lua_check_udata_maybe(L, -1, rspamd_text_classname);
+
+		if (t) {
+			*len = t->len;
+
+			return t->start;
+		}
+		else if (luaL_callmeta(L, -1, "__tostring")) {
+			*pushed = 1;
+
+			return lua_tolstring(L, -1, len);
+		}
+		break;
+	default:
+		break;
+	}
+
+	return NULL;
+}
+
+static gboolean
+lua_util_ch_parse_date(const char *str, gsize len, int64_t *days)
+{
+	int y, m, d, era, yoe, doy, doe;
+
+	if (len != sizeof("YYYY-MM-DD") - 1 ||
+		sscanf(str, "%4d-%2d-%2d", &y, &m, &d) != 3 ||
+		m < 1 || m > 12 || d < 1 || d > 31) {
+		return FALSE;
+	}
+
+	/* Days since the epoch for the proleptic Gregorian calendar */
+	y -= m <= 2;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = y - era * 400;
+	doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	*days = (int64_t) era * 146097 + doe - 719468;
+
+	return TRUE;
+}
+
+/* Encodes value on the top of the stack, returns pointer after its type or NULL */
+static const unsigned char *
+lua_util_ch_encode_value(lua_State *L, const unsigned char *pc, GString *out)
+{
+	const unsigned char *elt;
+	const char *str;
+	gsize len;
+	double num;
+	int64_t days;
+	uint64_t bits;
+	float fnum;
+	guint32 u32, n, i;
+	guint16 nitems, nlen, j;
+	gint16 value;
+	int pushed;
+	unsigned int width = 0;
+	unsigned char type = *pc++;
+
+	switch (type) {
+	case LUA_CH_TYPE_UINT8:
+	case LUA_CH_TYPE_INT8:
+		width = 1;
+		break;
+	case LUA_CH_TYPE_UINT16:
+	case LUA_CH_TYPE_INT16:
+	case LUA_CH_TYPE_DATE:
+		width = 2;
+		break;
+	case LUA_CH_TYPE_UINT32:
+	case LUA_CH_TYPE_INT32:
+	case LUA_CH_TYPE_DATETIME:
+		width = 4;
+		break;
+	case LUA_CH_TYPE_UINT64:
+	case LUA_CH_TYPE_INT64:
+		width = 8;
+		break;
+	default:
+		break;
+	}
+
+	switch (type) {
+	case LUA_CH_TYPE_UINT8:
+	case LUA_CH_TYPE_UINT16:
+	case LUA_CH_TYPE_UINT32:
+	case LUA_CH_TYPE_UINT64:
+	case LUA_CH_TYPE_INT8:
+	case LUA_CH_TYPE_INT16:
+	case LUA_CH_TYPE_INT32:
+	case LUA_CH_TYPE_INT64:
+	case LUA_CH_TYPE_DATETIME:
+		if (!lua_util_ch_get_number(L, &num)) {
+			return NULL;
+		}
+
+		if (num >= 9223372036854775808.0) {
+			bits = (uint64_t) num;
+		}
+		else {
+			bits = (uint64_t) (int64_t) num;
+		}
+
+		lua_util_ch_append_le(out, bits, width);
+		break;
+	case LUA_CH_TYPE_FLOAT32:
+		if (!lua_util_ch_get_number(L, &num)) {
+			return NULL;
+		}
+
+		fnum = num;
+		memcpy(&u32, &fnum, sizeof(u32));
+		lua_util_ch_append_le(out, u32, sizeof(u32));
+		break;
+	case LUA_CH_TYPE_FLOAT64:
+		if (!lua_util_ch_get_number(L, &num)) {
+			return NULL;
+		}
+
+		memcpy(&bits, &num, sizeof(bits));
+		lua_util_ch_append_le(out, bits, sizeof(bits));
+		break;
+	case LUA_CH_TYPE_DATE:
+		if (lua_type(L, -1) == LUA_TSTRING) {
+			str = lua_tolstring(L, -1, &len);
+
+			if (!lua_util_ch_parse_date(str, len, &days)) {
+				return NULL;
+			}
+		}
+		else if (lua_type(L, -1) == LUA_TNUMBER) {
+			days = floor(lua_tonumber(L, -1) / 86400.0);
+		}
+		else {
+			return NULL;
+		}
+
+		lua_util_ch_append_le(out, days, width);
+		break;
+	case LUA_CH_TYPE_STRING:
+	case LUA_CH_TYPE_FIXED_STRING:
+		str = lua_util_ch_get_string(L, &len, &pushed);
+
+		if (str == NULL) {
+			return NULL;
+		}
+
+		if (type == LUA_CH_TYPE_STRING) {
+			lua_util_ch_append_varint(out, len);
+			g_string_append_len(out, str, len);
+		}
+		else {
+			memcpy(&n, pc, sizeof(n));
+			pc += sizeof(n);
+
+			if (len >= n) {
+				g_string_append_len(out, str, n);
+			}
+			else {
+				g_string_append_len(out, str, len);
+
+				for (i = len; i < n; i++) {
+					g_string_append_c(out, '\0');
+				}
+			}
+		}
+
+		lua_pop(L, pushed);
+		break;
+	case LUA_CH_TYPE_ENUM8:
+	case LUA_CH_TYPE_ENUM16:
+		memcpy(&nitems, pc, sizeof(nitems));
+		pc += sizeof(nitems);
+
+		if (lua_type(L, -1) == LUA_TNUMBER) {
+			value = lua_tointeger(L, -1);
+			pc = lua_util_ch_skip_type(pc - sizeof(nitems) - 1);
+		}
+		else if (lua_type(L, -1) == LUA_TSTRING) {
+			str = lua_tolstring(L, -1, &len);
+			elt = NULL;
+
+			for (j = 0; j < nitems; j++) {
+				memcpy(&nlen, pc, sizeof(nlen));
+				pc += sizeof(nlen);
+
+				if (elt == NULL && nlen == len && memcmp(pc, str, len) == 0) {
+					elt = pc + nlen;
+					memcpy(&value, elt, sizeof(value));
+				}
+
+				pc += nlen + sizeof(value);
+			}
+
+			if (elt == NULL) {
+				return NULL;
+			}
+		}
+		else {
+			return NULL;
+		}
+
+		lua_util_ch_append_le(out, (uint64_t) (int64_t) value,
+							  type == LUA_CH_TYPE_ENUM8 ? 1 : 2);
+		break;
+	case LUA_CH_TYPE_ARRAY:
+		if (lua_type(L, -1) != LUA_TTABLE) {
+			return NULL;
+		}
+
+		n = rspamd_lua_table_size(L, -1);
+		lua_util_ch_append_varint(out, n);
+		elt = pc;
+
+		for (i = 1; i <= n; i++) {
+			lua_rawgeti(L, -1, i);
+			pc = lua_util_ch_encode_value(L, elt, out);
+			lua_pop(L, 1);
+
+			if (pc == NULL) {
+				return NULL;
+			}
+		}
+
+		pc = lua_util_ch_skip_type(elt);
+		break;
+	case LUA_CH_TYPE_NULLABLE:
+		if (lua_isnil(L, -1)) {
+			g_string_append_c(out, 1);
+			pc = lua_util_ch_skip_type(pc);
+		}
+		else {
+			g_string_append_c(out, 0);
+			pc = lua_util_ch_encode_value(L, pc, out);
+		}
+		break;
+	default:
+		return NULL;
+	}
+
+	return pc;
+}
+
+static int
+lua_util_clickhouse_row_to_binary(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_text *t;
+	const unsigned char *pc;
+	const char *prog;
+	gsize plen;
+	guint32 ncols, i;
+	GString *out;
+
+	prog = lua_tolstring(L, 2, &plen);
+
+	if (!lua_istable(L, 1) || prog == NULL ||
+		plen < sizeof(LUA_CH_TYPES_MAGIC) - 1 + sizeof(ncols) ||
+		memcmp(prog, LUA_CH_TYPES_MAGIC, sizeof(LUA_CH_TYPES_MAGIC) - 1) != 0) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	pc = (const unsigned char *) prog + sizeof(LUA_CH_TYPES_MAGIC) - 1;
+	memcpy(&ncols, pc, sizeof(ncols));
+	pc += sizeof(ncols);
+	out = g_string_sized_new(256);
+
+	for (i = 1; i <= ncols; i++) {
+		lua_rawgeti(L, 1, i);
+		pc = lua_util_ch_encode_value(L, pc, out);
+		lua_pop(L, 1);
+
+		if (pc == NULL) {
+			g_string_free(out, TRUE);
+
+			return luaL_error(L, "invalid value in row at position %d", (int) i);
+		}
+	}
+
+	t = lua_newuserdata(L, sizeof(*t));
+	rspamd_lua_setclass(L, rspamd_text_classname, -1);
+	t->len = out->len;
+	t->start = g_string_free(out, FALSE);
+	t->flags = RSPAMD_TEXT_FLAG_OWN;
+
+	return 1;
+}
 
 static int
 lua_load_util(lua_State *L)
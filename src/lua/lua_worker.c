@@ -18,6 +18,7 @@
 #include "unix-std.h"
 #include "worker_util.h"
 #include "rspamd_control.h"
+#include "libutil/libev_helper.h"
 #include "ottery.h"
 
 #ifdef WITH_JEMALLOC
@@ -825,6 +826,7 @@ lua_worker_spawn_process(lua_State *L)
 		/* Here we assume that we can block on writing results */
 		rspamd_socket_blocking(cbdata->sp[1]);
 		g_hash_table_remove_all(w->signal_events);
+		rspamd_ev_wheel_destroy(cbdata->event_loop);
 		ev_loop_destroy(cbdata->event_loop);
 
 		if (proctitle) {
@@ -0,0 +1,105 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Neural trainer is a helper worker that takes ANN training jobs out of
+ * scanners and controllers: it runs Lua post-load scripts (e.g. the neural
+ * plugin periodics) that pull training vectors from Redis, train networks and
+ * publish the resulting models back to Redis, where scanners pick them up
+ */
+#include "config.h"
+#include "libutil/util.h"
+#include "libutil/upstream.h"
+#include "libserver/cfg_file.h"
+#include "libserver/dns.h"
+#include "libserver/worker_util.h"
+#include "libserver/maps/map.h"
+#include "rspamd.h"
+#include "lua/lua_common.h"
+#include "unix-std.h"
+
+static gpointer init_neural_trainer(struct rspamd_config *cfg);
+__attribute__((noreturn)) static void start_neural_trainer(struct rspamd_worker *worker);
+
+worker_t neural_trainer_worker = {
+	"neural_trainer",     /* Name */
+	init_neural_trainer,  /* Init function */
+	start_neural_trainer, /* Start function */
+	RSPAMD_WORKER_UNIQUE | RSPAMD_WORKER_KILLABLE | RSPAMD_WORKER_NO_TERMINATE_DELAY,
+	RSPAMD_WORKER_SOCKET_NONE,
+	RSPAMD_WORKER_VER /* Version info */
+};
+
+static const uint64_t rspamd_neural_trainer_magic = 0x3e5f1a9c2b7d4086ULL;
+
+/*
+ * Worker's context
+ */
+struct neural_trainer_ctx {
+	uint64_t magic;
+	/* Events base */
+	struct ev_loop *event_loop;
+	/* DNS resolver */
+	struct rspamd_dns_resolver *resolver;
+	/* Config */
+	struct rspamd_config *cfg;
+	/* END OF COMMON PART */
+};
+
+static gpointer
+init_neural_trainer(struct rspamd_config *cfg)
+{
+	struct neural_trainer_ctx *ctx;
+
+	ctx = rspamd_mempool_alloc0(cfg->cfg_pool, sizeof(*ctx));
+	ctx->magic = rspamd_neural_trainer_magic;
+	ctx->cfg = cfg;
+
+	return ctx;
+}
+
+__attribute__((noreturn)) static void
+start_neural_trainer(struct rspamd_worker *worker)
+{
+	struct neural_trainer_ctx *ctx = worker->ctx;
+
+	g_assert(rspamd_worker_check_context(worker->ctx, rspamd_neural_trainer_magic));
+	ctx->cfg = worker->srv->cfg;
+	ctx->event_loop = rspamd_prepare_worker(worker,
+											"neural_trainer",
+											NULL);
+
+	ctx->resolver = rspamd_dns_resolver_init(worker->srv->logger,
+											 ctx->event_loop,
+											 worker->srv->cfg);
+	rspamd_upstreams_library_config(worker->srv->cfg, ctx->cfg->ups_ctx,
+									ctx->event_loop, ctx->resolver->r);
+	rspamd_map_watch(worker->srv->cfg, ctx->event_loop, ctx->resolver,
+					 worker, RSPAMD_MAP_WATCH_WORKER);
+
+	/* Plugins register their training periodics from on_load scripts */
+	rspamd_lua_run_postloads(ctx->cfg->lua_state, ctx->cfg, ctx->event_loop,
+							 worker);
+
+	ev_loop(ctx->event_loop, 0);
+	rspamd_worker_block_signals();
+
+	REF_RELEASE(ctx->cfg);
+	rspamd_log_close(worker->srv->logger);
+	rspamd_unset_crash_handler(worker->srv);
+
+	exit(EXIT_SUCCESS);
+}
@@ -36,6 +36,7 @@
 #include "libserver/maps/map_helpers.h"
 #include "libmime/images.h"
 #include "libserver/worker_util.h"
+#include "libserver/counters.h"
 #include "libserver/mempool_vars_internal.h"
 #include "fuzzy_wire.h"
 #include "utlist.h"
@@ -93,6 +94,7 @@ struct fuzzy_rule {
 	struct rspamd_hash_map_helper *skip_map;
 	struct fuzzy_ctx *ctx;
 	int lua_id;
+	int hits_counter;
 };
 
 struct fuzzy_ctx {
@@ -323,6 +325,7 @@ fuzzy_rule_new(const char *default_symbol, rspamd_mempool_t *pool)
 								  rule->mappings);
 	rule->read_only = FALSE;
 	rule->weight_threshold = NAN;
+	rule->hits_counter = -1;
 
 	return rule;
 }
@@ -449,6 +452,17 @@ fuzzy_parse_rule(struct rspamd_config *cfg, const ucl_object_t *obj,
 		rule->name = rule->symbol;
 	}
 
+	if (rule->name) {
+		char counter_name[RSPAMD_COUNTER_NAME_MAX], label[RSPAMD_COUNTER_NAME_MAX];
+
+		rspamd_snprintf(counter_name, sizeof(counter_name),
+						"rspamd_fuzzy_hits_total{rule=\"%s\"}",
+						rspamd_counter_escape_label(rule->name, label, sizeof(label)));
+		rule->hits_counter = rspamd_counter_register(counter_name,
+													 "Fuzzy hashes matched",
+													 RSPAMD_COUNTER_COUNTER);
+	}
+
 
 	if ((value = ucl_object_lookup(obj, "read_only")) != NULL) {
 		rule->read_only = ucl_obj_toboolean(value);
@@ -2589,6 +2603,8 @@ fuzzy_insert_metric_results(struct rspamd_task *task, struct fuzzy_rule *rule,
 
 		double weight = res->score * mult;
 
+		rspamd_counter_add(rule->hits_counter, 1);
+
 		if (!isnan(rule->weight_threshold)) {
 			if (weight >= rule->weight_threshold) {
 				rspamd_task_insert_result_single(task, res->symbol,
@@ -122,6 +122,7 @@ local function add_antivirus_rule(sym, opts)
   rule.symbol_fail = opts.symbol_fail
   rule.symbol_encrypted = opts.symbol_encrypted
   rule.redis_params = redis_params
+  common.init_local_cache(rule)
 
   if not rule then
     rspamd_logger.errx(rspamd_config, 'cannot configure %s for %s',
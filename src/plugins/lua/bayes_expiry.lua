@@ -28,7 +28,10 @@ local lredis = require "lua_redis"
 
 local settings = {
   interval = 60, -- one iteration step per minute
-  count = 1000, -- check up to 1000 keys on each iteration
+  count = 1000, -- check up to 1000 keys on each iteration initially
+  min_count = 100, -- lower bound for adaptive count
+  max_count = 10000, -- upper bound for adaptive count
+  max_step_latency = 0.1, -- shrink steps if Redis answers slower than this (seconds)
   epsilon_common = 0.01, -- eliminate common if spam to ham rate is equal to this epsilon
   common_ttl = 10 * 86400, -- TTL of discriminated common elements
   significant_factor = 3.0 / 4.0, -- which tokens should we update
@@ -120,7 +123,10 @@ local function check_redis_classifier(cls, cfg)
       symbol_spam = symbol_spam,
       symbol_ham = symbol_ham,
       redis_params = redis_params,
-      expiry = expiry
+      expiry = expiry,
+      -- Adaptive pacing state
+      count = settings.count,
+      in_flight = false,
     })
   end
 end
@@ -165,6 +171,10 @@ if opts then
   for k, v in pairs(opts) do
     settings[k] = v
   end
+
+  for _, cls in ipairs(settings.classifiers) do
+    cls.count = settings.count
+  end
 end
 
 -- In clustered setup, we need to increase interval of expiration
@@ -179,7 +189,6 @@ if settings.cluster_nodes == 0 then
 end
 
 -- Fill template
-template.count = settings.count
 template.threshold = settings.threshold
 template.common_ttl = settings.common_ttl
 template.epsilon_common = settings.epsilon_common
@@ -194,8 +203,9 @@ end
 -- Arguments:
 -- [1] = symbol pattern
 -- [2] = expire value
--- [3] = cursor
--- returns {cursor for the next step, step number, step statistic counters, cycle statistic counters, tokens occurrences distribution}
+-- [3] = number of keys to check on this step
+-- returns {cursor for the next step, step number, step statistic counters, cycle statistic counters,
+-- tokens occurrences distribution, step time in milliseconds}
 local expiry_script = [[
   local unpack_function = table.unpack or unpack
 
@@ -234,6 +244,12 @@ local expiry_script = [[
   redis.replicate_commands()
   redis.call('SETEX', lock_key, ${expire_step}, '${hostname}')
 
+  local function now_ms()
+    local t = redis.call('TIME')
+    return tonumber(t[1]) * 1000 + math.floor(tonumber(t[2]) / 1000)
+  end
+  local step_start = now_ms()
+
   local cursor_key = pattern_sha1 .. '_cursor'
   local cursor = tonumber(redis.call('GET', cursor_key) or 0)
 
@@ -244,7 +260,7 @@ local expiry_script = [[
     step = step and (tonumber(step) + 1) or 1
   end
 
-  local ret = redis.call('SCAN', cursor, 'MATCH', KEYS[1], 'COUNT', '${count}')
+  local ret = redis.call('SCAN', cursor, 'MATCH', KEYS[1], 'COUNT', KEYS[3])
   local next_cursor = ret[1]
   local keys = ret[2]
   local tokens = {}
@@ -262,9 +278,9 @@ local expiry_script = [[
     0,0,0,0,0,0,0,0,0,0,0
 
   for _,key in ipairs(keys) do
-    local t = redis.call('TYPE', key)["ok"]
-    if t == 'hash' then
-      local values = redis.call('HMGET', key, 'H', 'S')
+    -- Keys of other types fail with WRONGTYPE, that is cheaper than checking TYPE of each key
+    local values = redis.pcall('HMGET', key, 'H', 'S')
+    if not values.err then
       local ham = tonumber(values[1]) or 0
       local spam = tonumber(values[2]) or 0
       local ttl = redis.call('TTL', key)
@@ -358,6 +374,21 @@ local expiry_script = [[
   redis.call('HMSET', counters_key, unpack_function(hash2list(c)))
   redis.call('SET', cursor_key, tostring(next_cursor))
   redis.call('SET', step_key, tostring(step))
+
+  -- Progress of the current cycle, used to export statistics
+  local progress_key = pattern_sha1 .. '_progress'
+  local step_end = now_ms()
+  if cursor == 0 then
+    redis.call('HSET', progress_key, 'cycle_start', tostring(step_start))
+  end
+  redis.call('HMSET', progress_key, 'last_step', tostring(step_end),
+    'last_step_ms', tostring(step_end - step_start), 'last_step_count', KEYS[3])
+  if tostring(next_cursor) == '0' then
+    local cycle_start = tonumber(redis.call('HGET', progress_key, 'cycle_start')) or step_start
+    redis.call('HINCRBY', progress_key, 'cycles', 1)
+    redis.call('HMSET', progress_key, 'last_cycle_ms', tostring(step_end - cycle_start),
+      'last_cycle_steps', tostring(step), 'last_cycle_nelts', tostring(c.nelts))
+  end
   redis.call('DEL', lock_key)
 
   local occ_distr = {}
@@ -398,12 +429,50 @@ local expiry_script = [[
      infrequent_ttls_set, insignificant, insignificant_ttls_set},
     {c.nelts, c.extended, c.discriminated, c.sum, c.sum_squares, c.common,
      c.significant, c.infrequent, c.infrequent_ttls_set, c.insignificant, c.insignificant_ttls_set},
-    occ_distr
+    occ_distr,
+    step_end - step_start
+  }
+]]
+
+-- Arguments:
+-- [1] = symbol pattern
+-- returns {cursor, step, cycle statistic counters, cycle progress}
+local stat_script = [[
+  local pattern_sha1 = redis.sha1hex(KEYS[1])
+
+  return {
+    redis.call('GET', pattern_sha1 .. '_cursor') or '0',
+    redis.call('GET', pattern_sha1 .. '_step') or '0',
+    redis.call('HGETALL', pattern_sha1 .. '_counters'),
+    redis.call('HGETALL', pattern_sha1 .. '_progress'),
   }
 ]]
 
+-- Adjusts number of keys checked on each step according to Redis latency:
+-- halve it if Redis is slow and increase it gradually otherwise
+local function adjust_pacing(cls, latency)
+  cls.last_latency = latency
+
+  if latency > settings.max_step_latency then
+    cls.count = math.max(settings.min_count, math.floor(cls.count / 2))
+  elseif latency < settings.max_step_latency / 4 then
+    cls.count = math.min(settings.max_count, math.floor(cls.count * 1.25) + 1)
+  end
+end
+
 local function expire_step(cls, ev_base, worker)
+  if cls.in_flight then
+    -- Previous step has not been finished yet, Redis is likely overloaded
+    logger.infox(rspamd_config, 'skip expiry step: previous step is still in progress')
+    return
+  end
+
+  local start_time = rspamd_util.get_time()
+
   local function redis_step_cb(err, args)
+    cls.in_flight = false
+    adjust_pacing(cls, rspamd_util.get_time() - start_time)
+
     if err then
       logger.errx(rspamd_config, 'cannot perform expiry step: %s', err)
     elseif type(args) == 'table' then
@@ -459,13 +528,96 @@ local function expire_step(cls, ev_base, worker)
       logger.infox(rspamd_config, 'skip expiry step: %s', args)
     end
   end
+  cls.in_flight = true
   lredis.exec_redis_script(cls.script,
       { ev_base = ev_base, is_write = true },
       redis_step_cb,
-      { 'RS*_*', cls.expiry }
+      { 'RS*_*', cls.expiry, cls.count }
   )
 end
 
+local function kv_list_to_table(list)
+  local res = {}
+
+  for i = 1, #list, 2 do
+    res[list[i]] = tonumber(list[i + 1]) or list[i + 1]
+  end
+
+  return res
+end
+
+-- Controller endpoint: /plugins/bayes_expiry/stat
+local function handle_expiry_stat(task, conn)
+  local res = {}
+  local pending = #settings.classifiers
+
+  if pending == 0 then
+    conn:send_ucl({ classifiers = res })
+    return
+  end
+
+  for _, cls in ipairs(settings.classifiers) do
+    local elt = {
+      symbol_spam = cls.symbol_spam,
+      symbol_ham = cls.symbol_ham,
+      expiry = cls.expiry,
+    }
+    -- Pacing is known merely by the controller that performs expiry
+    if cls.last_latency then
+      elt.count = cls.count
+      elt.last_latency = cls.last_latency
+    end
+    table.insert(res, elt)
+
+    local function redis_stat_cb(err, data)
+      if err then
+        elt.error = tostring(err)
+      elseif type(data) == 'table' then
+        elt.cursor = tonumber(data[1]) or 0
+        elt.step = tonumber(data[2]) or 0
+        elt.counters = kv_list_to_table(data[3])
+        elt.progress = kv_list_to_table(data[4])
+      end
+
+      pending = pending - 1
+
+      if pending == 0 then
+        conn:send_ucl({ classifiers = res })
+      end
+    end
+
+    lredis.exec_redis_script(cls.stat_script,
+        { task = task, is_write = false },
+        redis_stat_cb,
+        { 'RS*_*' })
+  end
+end
+
+do
+  local stat_scripts = {}
+
+  for _, cls in ipairs(settings.classifiers) do
+    local h = cls.redis_params.hash
+
+    if not stat_scripts[h] then
+      stat_scripts[h] = lredis.add_redis_script(stat_script, cls.redis_params)
+    end
+
+    cls.stat_script = stat_scripts[h]
+  end
+
+  if #settings.classifiers > 0 then
+    rspamd_plugins[N] = {
+      webui = {
+        stat = {
+          handler = handle_expiry_stat,
+          enable = false,
+        },
+      },
+    }
+  end
+end
+
 rspamd_config:add_on_load(function(_, ev_base, worker)
   -- Exit unless we're the first 'controller' worker
   if not worker:is_primary_controller() then
@@ -491,7 +643,7 @@ rspamd_config:add_on_load(function(_, ev_base, worker)
     end
   end
 
-  -- Expire tokens at regular intervals
+  -- Expire tokens at regular intervals, number of keys per step is adjusted by latency
   for _, cls in ipairs(settings.classifiers) do
     rspamd_config:add_periodic(ev_base,
         settings['interval'],
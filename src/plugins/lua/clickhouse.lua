@@ -19,6 +19,8 @@ local upstream_list = require "rspamd_upstream_list"
 local lua_util = require "lua_util"
 local lua_clickhouse = require "lua_clickhouse"
 local lua_settings = require "lua_settings"
+local rspamd_util = require "rspamd_util"
+local rspamd_text = require "rspamd_text"
 local fun = require "fun"
 
 local N = "clickhouse"
@@ -73,6 +75,13 @@ local settings = {
   database = 'default',
   use_https = false,
   use_gzip = true,
+  use_zstd = false, -- zstd compression of inserted data, takes precedence over gzip
+  insert_format = 'tsv', -- 'binary' to send RowBinary encoded using column types of the schema
+  shared_queue = { -- Queue rows of all scanners and send them from the primary controller
+    enable = false,
+    path = nil, -- Queue directory, `${RUNDIR}/clickhouse` by default, should be on tmpfs
+    interval = 1.0, -- How often scanners move collected rows to the queue
+  },
   allow_local = false,
   insert_subject = false,
   subject_privacy = false, -- subject privacy is off
@@ -381,6 +390,26 @@ local function clickhouse_extra_columns(res)
   end
 end
 
+local function clickhouse_fields()
+  local fields = {}
+  clickhouse_main_row(fields)
+  clickhouse_attachments_row(fields)
+  clickhouse_urls_row(fields)
+  clickhouse_emails_row(fields)
+  clickhouse_asn_row(fields)
+
+  if settings.enable_symbols then
+    clickhouse_symbols_row(fields)
+    clickhouse_groups_row(fields)
+  end
+
+  if #settings.extra_columns > 0 then
+    clickhouse_extra_columns(fields)
+  end
+
+  return fields
+end
+
 local function today(ts)
   return os.date('!%Y-%m-%d', ts)
 end
@@ -430,8 +459,10 @@ local function clickhouse_send_data(task, ev_base, why, gen_rows, cust_rows)
     end
   end
 
-  local function send_data(what, tbl, query)
+  -- Rows from the shared queue are segments with `nrows` rows each
+  local function send_data(what, tbl, query, binary_header)
     local ch_params = {}
+    local how_many = tbl.nrows or #tbl
     if task then
       ch_params.task = task
     else
@@ -441,38 +472,75 @@ local function clickhouse_send_data(task, ev_base, why, gen_rows, cust_rows)
 
     local ret = lua_clickhouse.insert(upstream, settings, ch_params,
         query, tbl,
-        gen_success_cb(what, #tbl),
-        gen_fail_cb(what, #tbl))
+        gen_success_cb(what, how_many),
+        gen_fail_cb(what, how_many),
+        binary_header)
     if not ret then
       rspamd_logger.errx(log_object, "cannot send %s rows of %s data to clickhouse server %s: %s",
-          #tbl, what, ip_addr, 'cannot make HTTP request')
+          how_many, what, ip_addr, 'cannot make HTTP request')
     end
   end
 
-  local fields = {}
-  clickhouse_main_row(fields)
-  clickhouse_attachments_row(fields)
-  clickhouse_urls_row(fields)
-  clickhouse_emails_row(fields)
-  clickhouse_asn_row(fields)
+  if #gen_rows > 0 then
+    send_data('generic data', gen_rows,
+        string.format('INSERT INTO rspamd (%s)',
+            table.concat(clickhouse_fields(), ',')),
+        settings.binary_header)
+  end
 
-  if settings.enable_symbols then
-    clickhouse_symbols_row(fields)
-    clickhouse_groups_row(fields)
+  for k, crows in pairs(cust_rows) do
+    if #crows > 0 then
+      send_data('custom data (' .. k .. ')', crows,
+          settings.custom_rules[k].first_row())
+    end
   end
+end
 
-  if #settings.extra_columns > 0 then
-    clickhouse_extra_columns(fields)
+local function queue_key(custom_name)
+  if custom_name then
+    return string.format('custom_%s.tsv',
+        tostring(rspamd_util.encode_base32(custom_name)))
   end
 
-  send_data('generic data', gen_rows,
-      string.format('INSERT INTO rspamd (%s)',
-          table.concat(fields, ',')))
+  return settings.binary_header and 'rspamd.bin' or 'rspamd.tsv'
+end
 
-  for k, crows in pairs(cust_rows) do
-    if #crows > 1 then
-      send_data('custom data (' .. k .. ')', crows,
-          settings.custom_rules[k].first_row())
+-- Moves collected rows to the shared queue as a segment per table, segments
+-- are written to hidden files and renamed, so the flusher never reads them partially
+local function clickhouse_queue_rows(log_obj)
+  local function write_segment(key, rows, delim)
+    local fname = string.format('%s-%d-%s-%d.rows', key, os.time(),
+        rspamd_util.random_hex(8), #rows)
+    local tmp_path = string.format('%s/.%s.tmp', settings.shared_queue.path, fname)
+    local path = string.format('%s/%s', settings.shared_queue.path, fname)
+    local ret, err = rspamd_text.fromtable(rows, delim):save_in_file(tmp_path)
+
+    if ret then
+      ret, err = os.rename(tmp_path, path)
+    end
+
+    if not ret then
+      rspamd_util.unlink(tmp_path)
+      rspamd_logger.errx(log_obj, 'cannot queue %s clickhouse rows to %s: %s',
+          #rows, path, err)
+    end
+  end
+
+  local saved_rows = data_rows
+  local saved_custom = custom_rows
+
+  nrows = 0
+  used_memory = 0
+  data_rows = {}
+  custom_rows = {}
+
+  if #saved_rows > 0 then
+    write_segment(queue_key(), saved_rows, settings.binary_header and '' or '\n')
+  end
+
+  for k, crows in pairs(saved_custom) do
+    if #crows > 0 then
+      write_segment(queue_key(k), crows, '\n')
     end
   end
 end
@@ -914,6 +982,21 @@ local function clickhouse_collect(task)
     end
   end
 
+  local encoded_row
+
+  if settings.binary_types then
+    local ret_enc, res = pcall(lua_clickhouse.row_to_binary, row, settings.binary_types)
+
+    if not ret_enc then
+      rspamd_logger.errx(task, 'cannot encode clickhouse row: %s', res)
+      return
+    end
+
+    encoded_row = res
+  else
+    encoded_row = lua_clickhouse.row_to_tsv(row)
+  end
+
   -- Custom data
   for k, rule in pairs(settings.custom_rules) do
     if not custom_rows[k] then
@@ -922,9 +1005,8 @@ local function clickhouse_collect(task)
     table.insert(custom_rows[k], lua_clickhouse.row_to_tsv(rule.get_row(task)))
   end
 
-  local tsv_row = lua_clickhouse.row_to_tsv(row)
-  used_memory = used_memory + #tsv_row
-  data_rows[#data_rows + 1] = tsv_row
+  used_memory = used_memory + #encoded_row
+  data_rows[#data_rows + 1] = encoded_row
   nrows = nrows + 1
   lua_util.debugm(N, task,
       "add clickhouse row %s / %s; used memory: %s / %s",
@@ -1080,6 +1162,109 @@ local function clickhouse_maybe_send_data_periodic(cfg, ev_base, now)
   return settings.check_timeout
 end
 
+local function clickhouse_queue_rows_periodic(cfg, _, _)
+  if nrows > 0 and not final_call then
+    clickhouse_queue_rows(cfg)
+  end
+
+  return settings.shared_queue.interval
+end
+
+-- Sends rows queued by all scanners once any of the collection limits is
+-- reached, segments are claimed by renaming before they are read
+local function clickhouse_flush_queue(cfg, ev_base, now)
+  local segments = {}
+  local queued_rows, queued_memory, oldest = 0, 0, now
+  local files = rspamd_util.glob(string.format('%s/*.rows', settings.shared_queue.path)) or {}
+
+  for _, path in ipairs(files) do
+    local key, ts, n = path:match('([^/]+)%-(%d+)%-%x+%-(%d+)%.rows$')
+
+    if key then
+      local err, st = rspamd_util.stat(path)
+
+      if not err then
+        queued_memory = queued_memory + st.size
+      end
+
+      queued_rows = queued_rows + tonumber(n)
+      oldest = math.min(oldest, tonumber(ts))
+      table.insert(segments, { path = path, key = key, nrows = tonumber(n) })
+    end
+  end
+
+  if queued_rows == 0 then
+    return settings.shared_queue.interval
+  end
+
+  local reason
+
+  if settings.limits.max_rows > 0 and queued_rows > settings.limits.max_rows then
+    reason = string.format('limit of rows has been reached: %d', queued_rows)
+  elseif settings.limits.max_memory > 0 and queued_memory >= settings.limits.max_memory then
+    reason = string.format('limit of memory has been reached: %d bytes queued',
+        queued_memory)
+  elseif settings.limits.max_interval > 0 and now - oldest > settings.limits.max_interval then
+    reason = string.format('limit of time since the oldest queued rows has been reached: ' ..
+        '%d seconds passed (%d seconds trigger)',
+        (now - oldest), settings.limits.max_interval)
+  end
+
+  if not reason then
+    return settings.shared_queue.interval
+  end
+
+  local gen_rows = { nrows = 0 }
+  local cust_rows = {}
+  local custom_keys = {}
+
+  for k, _ in pairs(settings.custom_rules) do
+    custom_keys[queue_key(k)] = k
+  end
+
+  for _, seg in ipairs(segments) do
+    local claimed = string.format('%s/.%s.%s', settings.shared_queue.path,
+        seg.path:match('[^/]+$'), rspamd_util.random_hex(8))
+
+    if os.rename(seg.path, claimed) then
+      local f = io.open(claimed, 'rb')
+      local data = f and f:read('*a')
+
+      if f then
+        f:close()
+      end
+      rspamd_util.unlink(claimed)
+
+      local rows
+
+      if seg.key == queue_key() then
+        rows = gen_rows
+      elseif custom_keys[seg.key] then
+        local k = custom_keys[seg.key]
+        cust_rows[k] = cust_rows[k] or { nrows = 0 }
+        rows = cust_rows[k]
+      else
+        -- Format or custom rules have been changed since the rows were queued
+        rspamd_logger.errx(cfg, 'drop %s queued clickhouse rows from %s: unknown table or format',
+            seg.nrows, seg.path)
+      end
+
+      if rows and data and #data > 0 then
+        table.insert(rows, data)
+        rows.nrows = rows.nrows + seg.nrows
+      end
+    end
+  end
+
+  clickhouse_send_data(nil, ev_base, reason, gen_rows, cust_rows)
+
+  if settings.collect_garbage then
+    collectgarbage()
+  end
+
+  return settings.shared_queue.interval
+end
+
 local function clickhouse_remove_old_partitions(cfg, ev_base)
   local last_time_ago = get_last_removal_ago()
   if last_time_ago == nil then
@@ -1483,6 +1668,46 @@ if opts then
       settings.extra_columns = columns_transformed
     end
 
+    if settings.insert_format == 'binary' then
+      -- Types of the extra columns override types of the schema
+      local types = lua_clickhouse.schema_types(clickhouse_schema[1])
+      local fields = clickhouse_fields()
+      local field_types = {}
+      local compiled, err
+
+      for _, col in ipairs(settings.extra_columns) do
+        types[col.name] = col.type
+      end
+
+      for i, field in ipairs(fields) do
+        if not types[field] then
+          err = string.format('no type for column %s', field)
+          break
+        end
+        field_types[i] = types[field]
+      end
+
+      if not err then
+        compiled, err = lua_clickhouse.compile_types(field_types)
+      end
+
+      if compiled then
+        settings.binary_types = compiled
+        settings.binary_header = lua_clickhouse.row_binary_header(fields, field_types)
+      else
+        rspamd_logger.errx(rspamd_config, 'cannot use binary insert format: %s; use TSV', err)
+      end
+    elseif settings.insert_format ~= 'tsv' then
+      rspamd_logger.errx(rspamd_config, 'invalid insert_format %s; use TSV',
+          settings.insert_format)
+    end
+
+    if settings.shared_queue.enable then
+      settings.shared_queue.path = settings.shared_queue.path or
+          string.format('%s/%s', rspamd_paths['RUNDIR'], 'clickhouse')
+      settings.shared_queue.interval = settings.shared_queue.interval or 1.0
+    end
+
     rspamd_config:register_symbol({
       name = 'CLICKHOUSE_COLLECT',
       type = 'idempotent',
@@ -1491,7 +1716,10 @@ if opts then
       augmentations = { string.format("timeout=%f", settings.timeout) },
     })
     rspamd_config:register_finish_script(function(task)
-      if nrows > 0 then
+      if nrows > 0 and settings.shared_queue.enable then
+        final_call = true
+        clickhouse_queue_rows(task)
+      elseif nrows > 0 then
         final_call = true
         local saved_rows = data_rows
         local saved_custom = custom_rows
@@ -1511,13 +1739,35 @@ if opts then
     end)
     -- Create tables on load
     rspamd_config:add_on_load(function(cfg, ev_base, worker)
+      if settings.shared_queue.enable and
+          (worker:is_scanner() or worker:is_primary_controller()) then
+        -- Created by workers, so the directory is owned by their user
+        local ret, err = rspamd_util.mkdir(settings.shared_queue.path, true)
+
+        if not ret then
+          rspamd_logger.errx(rspamd_config,
+              'cannot create clickhouse queue directory %s: %s; shared queue is disabled',
+              settings.shared_queue.path, err)
+          settings.shared_queue.enable = false
+        end
+      end
       if worker:is_scanner() then
-        rspamd_config:add_periodic(ev_base, 0,
-            clickhouse_maybe_send_data_periodic, true)
+        if settings.shared_queue.enable then
+          rspamd_config:add_periodic(ev_base, 0,
+              clickhouse_queue_rows_periodic, true)
+        else
+          rspamd_config:add_periodic(ev_base, 0,
+              clickhouse_maybe_send_data_periodic, true)
+        end
       end
       if worker:is_primary_controller() then
         local upstreams = settings.upstream:all_upstreams()
 
+        if settings.shared_queue.enable then
+          rspamd_config:add_periodic(ev_base, 0,
+              clickhouse_flush_queue, true)
+        end
+
         for _, up in ipairs(upstreams) do
           check_clickhouse_upstream(up, ev_base, cfg)
         end
@@ -32,6 +32,8 @@ local N = 'dmarc'
 local settings = dmarc_common.default_settings
 
 local redis_params = nil
+-- Aggregates report updates in memory when `reporting.flush_interval` is set
+local report_buffer
 
 local E = {}
 
@@ -330,7 +332,15 @@ local function dmarc_validate_policy(task, policy, hdrfromdom, dmarc_esld)
     local idx_key = table.concat({ settings.reporting.redis_keys.index_prefix, period },
         settings.reporting.redis_keys.join_char)
 
-    if report_data then
+    if report_data and report_buffer then
+      -- The same tuples from many messages are sent as a single increment
+      local keys_expire = settings.reporting.keys_expire
+      report_buffer:sadd(task, idx_key, dmarc_domain_key)
+      report_buffer:expire(task, idx_key, keys_expire)
+      report_buffer:zincrby(task, dmarc_domain_key, report_data, 1,
+          settings.reporting.max_entries)
+      report_buffer:expire(task, dmarc_domain_key, keys_expire)
+    elseif report_data then
       lua_redis.exec_redis_script(take_report_id,
           { task = task, is_write = true },
           dmarc_report_cb,
@@ -539,6 +549,17 @@ elseif settings.reporting.enabled then
   else
     rspamd_logger.infox(rspamd_config, 'dmarc reporting is enabled')
     take_report_id = lua_redis.add_redis_script(take_report_script, redis_params)
+
+    local flush_interval = settings.reporting.flush_interval
+    if flush_interval and flush_interval > 0 then
+      -- Reports are collected by rspamadm with no hash key, so the same server must be used for writes
+      report_buffer = lua_redis.write_behind(redis_params, {
+        name = N,
+        route_by_key = false,
+        interval = flush_interval,
+        max_pending = settings.reporting.max_pending,
+      })
+    end
   end
 end
 
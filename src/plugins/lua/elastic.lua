@@ -23,14 +23,13 @@ local ucl = require "ucl"
 local rspamd_redis = require "lua_redis"
 local upstream_list = require "rspamd_upstream_list"
 local lua_settings = require "lua_settings"
+local lua_export = require "lua_export"
 
 if confighelp then
   return
 end
 
-local rows = {}
-local nrows = 0
-local failed_sends = 0
+local export_pipeline
 local elastic_template
 local redis_params
 local N = "elastic"
@@ -56,6 +55,9 @@ local settings = {
   password = nil,
   no_ssl_verify = false,
   max_fail = 3,
+  batch_interval = 1.0, -- send incomplete batches after this interval
+  max_queue = 10000, -- rows waiting to be sent, the oldest are dropped
+  spool_dir = nil, -- store rows on disk when elastic is unavailable
   ingest_module = false,
   elasticsearch_version = 6,
 }
@@ -70,59 +72,33 @@ local function read_file(path)
   return content
 end
 
-local function elastic_send_data(task)
-  local es_index = os.date(settings['index_pattern'])
-  local tbl = {}
-  for _, value in pairs(rows) do
-    if settings.elasticsearch_version >= 7 then
-      table.insert(tbl, '{ "index" : { "_index" : "' .. es_index ..
-          '","pipeline": "rspamd-geoip"} }')
-    else
-      table.insert(tbl, '{ "index" : { "_index" : "' .. es_index ..
-          '", "_type" : "_doc" ,"pipeline": "rspamd-geoip"} }')
-    end
-    table.insert(tbl, ucl.to_format(value, 'json-compact'))
-  end
-
-  table.insert(tbl, '') -- For last \n
-
+local function elastic_bulk_url()
   local upstream = settings.upstream:get_upstream_round_robin()
   local ip_addr = upstream:get_addr():to_string(true)
 
-  local push_url = connect_prefix .. ip_addr .. '/' .. es_index .. '/_bulk'
-  local bulk_json = table.concat(tbl, "\n")
+  return connect_prefix .. ip_addr .. '/_bulk'
+end
 
-  local function http_callback(err, code, _, _)
-    if err then
-      rspamd_logger.infox(task, "cannot push data to elastic backend (%s): %s; failed attempts: %s/%s",
-          push_url, err, failed_sends, settings.max_fail)
-    else
-      if code ~= 200 then
-        rspamd_logger.infox(task,
-            "cannot push data to elastic backend (%s): wrong http code %s (%s); failed attempts: %s/%s",
-            push_url, err, code, failed_sends, settings.max_fail)
-      else
-        lua_util.debugm(N, task, "successfully sent %s (%s bytes) rows to ES",
-            nrows, #bulk_json)
-      end
-    end
+-- Each row is an index action followed by the document
+local function elastic_bulk_row(row)
+  local es_index = os.date(settings['index_pattern'])
+  local action
+
+  if settings.elasticsearch_version >= 7 then
+    action = '{ "index" : { "_index" : "' .. es_index ..
+        '","pipeline": "rspamd-geoip"} }'
+  else
+    action = '{ "index" : { "_index" : "' .. es_index ..
+        '", "_type" : "_doc" ,"pipeline": "rspamd-geoip"} }'
   end
 
-  return rspamd_http.request({
-    url = push_url,
-    headers = {
-      ['Content-Type'] = 'application/x-ndjson',
-    },
-    body = bulk_json,
-    callback = http_callback,
-    task = task,
-    method = 'post',
-    gzip = settings.use_gzip,
-    no_ssl_verify = settings.no_ssl_verify,
-    user = settings.user,
-    password = settings.password,
-    timeout = settings.timeout,
-  })
+  return action .. '\n' .. ucl.to_format(row, 'json-compact')
+end
+
+local function elastic_bulk_encode(rows)
+  table.insert(rows, '') -- For last \n
+
+  return table.concat(rows, '\n')
 end
 
 local function get_general_metadata(task)
@@ -258,26 +234,7 @@ local function elastic_collect(task)
 
   local row = { ['rspamd_meta'] = get_general_metadata(task),
                 ['@timestamp'] = tostring(util.get_time() * 1000) }
-  table.insert(rows, row)
-  nrows = nrows + 1
-  if nrows > settings['limit'] then
-    lua_util.debugm(N, task, 'send elastic search rows: %s', nrows)
-    if elastic_send_data(task) then
-      nrows = 0
-      rows = {}
-      failed_sends = 0;
-    else
-      failed_sends = failed_sends + 1
-
-      if failed_sends > settings.max_fail then
-        rspamd_logger.errx(task, 'cannot send %s rows to ES %s times, stop trying',
-            nrows, failed_sends)
-        nrows = 0
-        rows = {}
-        failed_sends = 0;
-      end
-    end
-  end
+  export_pipeline:push(task, elastic_bulk_row(row))
 end
 
 local opts = rspamd_config:get_all_opt('elastic')
@@ -525,12 +482,34 @@ if redis_params and opts then
       return
     end
 
+    -- Rows are sent in batches outside of the messages processing
+    export_pipeline = lua_export.create({
+      name = N,
+      send = lua_export.http_sink({
+        url = elastic_bulk_url,
+        headers = {
+          ['Content-Type'] = 'application/x-ndjson',
+        },
+        gzip = settings.use_gzip,
+        no_ssl_verify = settings.no_ssl_verify,
+        user = settings.user,
+        password = settings.password,
+        timeout = settings.timeout,
+        valid_codes = { 200 },
+      }),
+      encode = elastic_bulk_encode,
+      batch_size = settings.limit,
+      batch_interval = settings.batch_interval,
+      max_queue = settings.max_queue,
+      max_retries = settings.max_fail,
+      spool_dir = settings.spool_dir,
+    })
+
     rspamd_config:register_symbol({
       name = 'ELASTIC_COLLECT',
       type = 'idempotent',
       callback = elastic_collect,
       flags = 'empty,explicit_disable,ignore_passthrough',
-      augmentations = { string.format("timeout=%f", settings.timeout) },
     })
 
     rspamd_config:add_on_load(function(cfg, ev_base, worker)
@@ -149,6 +149,7 @@ local function add_scanner_rule(sym, opts)
   end
 
   rule.redis_params = redis_params
+  common.init_local_cache(rule)
 
   lua_redis.register_prefix(rule.prefix .. '_*', N,
       string.format('External services cache for rule "%s"',
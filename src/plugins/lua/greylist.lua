@@ -66,6 +66,13 @@ greylist {
   check_local = false;
   # Greylist messages from authenticated users
   check_authed = false;
+  # Local bloom filter to skip Redis lookups for unknown messages,
+  # it is used once it has been populated for `expire` time
+  #prefilter {
+  #  bits = 16777216; # size of each generation (2Mb in Redis)
+  #  hashes = 4;
+  #  sync_interval = 10s; # how often workers fetch filter from Redis
+  #}
 }
   ]])
   return
@@ -91,6 +98,7 @@ local settings = {
   report_time = false, -- Tell when greylisting is expired (appended to `message`)
   check_local = false,
   check_authed = false,
+  prefilter = nil, -- local bloom filter settings
 }
 
 local rspamd_logger = require "rspamd_logger"
@@ -101,8 +109,31 @@ local fun = require "fun"
 local hash = require "rspamd_cryptobox_hash"
 local rspamd_lua_utils = require "lua_util"
 local lua_map = require "lua_maps"
+local rspamd_bloom = require "rspamd_bloom"
 local N = "greylist"
 
+-- Filter of keys stored in Redis, rebuilt from Redis bitmaps on each sync
+local prefilter = {
+  bloom = nil,
+  -- Set when filter covers all live records
+  ready = false,
+}
+
+-- Time when filter has started to be populated, records created before it
+-- are not in the filter, so it is trusted only when they have expired
+local function prefilter_start_key()
+  return settings.key_prefix .. 'fstart'
+end
+
+-- Filter bitmaps are rotated each `expire` seconds, so records that are
+-- still alive are always in the current or the previous generation
+local function prefilter_keys(now)
+  local gen = math.floor(now / settings.expire)
+  local prefix = settings.key_prefix .. 'f'
+
+  return prefix .. tostring(gen), prefix .. tostring(gen - 1)
+end
+
 local function data_key(task)
   local cached = task:get_mempool():get_variable("grey_bodyhash")
   if cached then
@@ -232,6 +263,15 @@ local function greylist_check(task)
   local meta_key = envelope_key(task)
   local hash_key = body_key .. meta_key
 
+  if prefilter.ready and not prefilter.bloom:check(body_key) and
+      not prefilter.bloom:check(meta_key) then
+    -- Definitely no records, the same as an empty reply from Redis
+    lua_util.debugm(N, task, 'skip redis lookup: no record in prefilter')
+    task:get_mempool():set_variable("grey_greylisted", 'true')
+    task:get_mempool():set_variable("grey_prefilter_miss", 'true')
+    return
+  end
+
   local function redis_get_cb(err, data)
     local ret_body = false
     local greylisted_body = false
@@ -307,6 +347,45 @@ local function greylist_check(task)
   end
 end
 
+local function prefilter_add(task, keys)
+  if not prefilter.bloom then
+    return
+  end
+
+  local cur_key = prefilter_keys(rspamd_util.get_time())
+  local args = { cur_key }
+
+  for _, k in ipairs(keys) do
+    prefilter.bloom:add(k)
+    for _, pos in ipairs(prefilter.bloom:positions(k)) do
+      table.insert(args, 'SET')
+      table.insert(args, 'u1')
+      table.insert(args, tostring(pos))
+      table.insert(args, '1')
+    end
+  end
+
+  local function redis_bitfield_cb(err)
+    if err then
+      rspamd_logger.errx(task, 'got error %s when updating greylisting prefilter', err)
+    end
+  end
+
+  -- All generations are stored on the same server
+  local ret, conn = lua_redis.redis_make_request(task,
+      redis_params, -- connect params
+      settings.key_prefix .. 'f', -- hash key
+      true, -- is write
+      redis_bitfield_cb, --callback
+      'BITFIELD', -- command
+      args -- arguments
+  )
+
+  if ret then
+    conn:add_cmd('EXPIRE', { cur_key, tostring(toint(settings.expire * 2)) })
+  end
+end
+
 local function greylist_set(task)
   local action = task:get_metric_action()
   local ip = task:get_ip()
@@ -415,6 +494,7 @@ local function greylist_set(task)
       return
     end
 
+    prefilter_add(task, { body_key, meta_key })
     ret, conn, upstream = lua_redis.redis_make_request(task,
         redis_params, -- connect params
         hash_key, -- hash key
@@ -439,21 +519,44 @@ local function greylist_set(task)
     local end_time = rspamd_util.time_to_string(t + settings['timeout'])
     rspamd_logger.infox(task, 'greylisted until "%s", new record', end_time)
     greylist_message(task, end_time, 'new record')
-    -- Create new record
-    ret, conn, upstream = lua_redis.redis_make_request(task,
-        redis_params, -- connect params
-        hash_key, -- hash key
-        true, -- is write
-        redis_set_cb, --callback
-        'SETEX', -- command
-        { body_key, tostring(toint(settings['expire'])), t } -- arguments
-    )
-
-    if ret then
-      conn:add_cmd('SETEX', {
-        meta_key, tostring(toint(settings['expire'])), t
-      })
+    prefilter_add(task, { body_key, meta_key })
+
+    if task:get_mempool():get_variable("grey_prefilter_miss") then
+      -- Redis has not been checked, and the record might have been created
+      -- by another worker after the last sync, so do not reset its time
+      ret, conn, upstream = lua_redis.redis_make_request(task,
+          redis_params, -- connect params
+          hash_key, -- hash key
+          true, -- is write
+          redis_set_cb, --callback
+          'SET', -- command
+          { body_key, t, 'EX', tostring(toint(settings['expire'])), 'NX' } -- arguments
+      )
+
+      if ret then
+        conn:add_cmd('SET', {
+          meta_key, t, 'EX', tostring(toint(settings['expire'])), 'NX'
+        })
+      end
     else
+      -- Create new record
+      ret, conn, upstream = lua_redis.redis_make_request(task,
+          redis_params, -- connect params
+          hash_key, -- hash key
+          true, -- is write
+          redis_set_cb, --callback
+          'SETEX', -- command
+          { body_key, tostring(toint(settings['expire'])), t } -- arguments
+      )
+
+      if ret then
+        conn:add_cmd('SETEX', {
+          meta_key, tostring(toint(settings['expire'])), t
+        })
+      end
+    end
+
+    if not ret then
       rspamd_logger.errx(task, 'got error while connecting to redis')
     end
   else
@@ -535,5 +638,79 @@ if opts then
       parent = id,
       score = 0,
     })
+
+    if settings.prefilter then
+      local prefilter_settings = lua_util.override_defaults({
+        bits = 16777216,
+        hashes = 4,
+        sync_interval = 10,
+      }, type(settings.prefilter) == 'table' and settings.prefilter or {})
+      prefilter.bloom = rspamd_bloom.create(prefilter_settings.bits,
+          prefilter_settings.hashes)
+      lua_redis.register_prefix(settings.key_prefix .. 'f[0-9]+', N,
+          'Greylisting prefilter bitmaps', {
+            type = 'string',
+          })
+      lua_redis.register_prefix(prefilter_start_key(), N,
+          'Greylisting prefilter population start time', {
+            type = 'string',
+          })
+
+      rspamd_config:add_on_load(function(cfg, ev_base, worker)
+        if not worker:is_scanner() then
+          return
+        end
+
+        local function sync_cb(err, data)
+          if err then
+            rspamd_logger.errx(cfg, 'cannot sync greylisting prefilter: %s', err)
+            prefilter.ready = false
+            return
+          end
+
+          local bloom = rspamd_bloom.create(prefilter_settings.bits,
+              prefilter_settings.hashes)
+          local start = tonumber(data[3])
+          -- Records created before the filter had been set up can be still alive
+          local ready = start ~= nil and rspamd_util.get_time() - start >= settings.expire
+
+          for i = 1, 2 do
+            if type(data[i]) == 'string' then
+              if not bloom:merge(data[i]) then
+                rspamd_logger.errx(cfg, 'greylisting prefilter in Redis has different size, ignore it')
+                ready = false
+              end
+            end
+          end
+
+          -- Keys added locally are already written to Redis
+          prefilter.bloom = bloom
+          prefilter.ready = ready
+        end
+
+        rspamd_config:add_periodic(ev_base, 0.0, function()
+          local now = rspamd_util.get_time()
+          local cur_key, prev_key = prefilter_keys(now)
+          local start_key = prefilter_start_key()
+          -- Start time is reset if the filter has not been used for a while
+          local start_ttl = tostring(toint(settings.expire * 2))
+          local ret, conn = lua_redis.redis_make_request_taskless(ev_base, cfg,
+              redis_params, -- connect params
+              settings.key_prefix .. 'f', -- hash key
+              true, -- is write
+              sync_cb, --callback
+              'MGET', -- command
+              { cur_key, prev_key, start_key } -- arguments
+          )
+
+          if ret then
+            conn:add_cmd('SET', { start_key, tostring(toint(now)), 'EX', start_ttl, 'NX' })
+            conn:add_cmd('EXPIRE', { start_key, start_ttl })
+          end
+
+          return prefilter_settings.sync_interval
+        end, true)
+      end)
+    end
   end
 end
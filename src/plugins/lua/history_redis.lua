@@ -35,6 +35,8 @@ redis_history {
   subject_privacy_prefix = 'obf';
   # Cut the length of the hash if desired
   subject_privacy_length = 16;
+  # Buffer rows in memory and write them in batches each second
+  write_behind = false;
 }
   ]])
   return
@@ -55,6 +57,7 @@ local template_env = {
 }
 
 local redis_params
+local write_buffer
 
 local settings = {
   key_prefix = 'rs_history{{HOSTNAME}}{{COMPRESS}}', -- default key name template
@@ -65,6 +68,7 @@ local settings = {
   subject_privacy_alg = 'blake2', -- default hash-algorithm to obfuscate subject
   subject_privacy_prefix = 'obf', -- prefix to show it's obfuscated
   subject_privacy_length = 16, -- cut the length of the hash
+  write_behind = false, -- buffer rows and write them in batches
 }
 
 local settings_schema = lua_redis.enrich_schema({
@@ -76,6 +80,7 @@ local settings_schema = lua_redis.enrich_schema({
   subject_privacy_alg = ts.string:is_optional(),
   subject_privacy_prefix = ts.string:is_optional(),
   subject_privacy_length = ts.number:is_optional(),
+  write_behind = ts.boolean:is_optional(),
 })
 
 local function process_addr(addr)
@@ -164,6 +169,16 @@ local function history_save(task)
     json = rspamd_util.zstd_compress(json)
   end
 
+  if write_buffer then
+    write_buffer:lpush(task, prefix, json, settings.nrows)
+
+    if settings.expire and settings.expire > 0 then
+      write_buffer:expire(task, prefix, settings.expire)
+    end
+
+    return
+  end
+
   local ret, conn, _ = lua_redis.rspamd_redis_make_request(task,
       redis_params, -- connect params
       nil, -- hash key
@@ -312,5 +327,13 @@ if opts then
     rspamd_plugins['history'] = {
       handler = handle_history_request
     }
+
+    if settings.write_behind then
+      -- History is read with no hash key, so the same server must be used for writes
+      write_buffer = lua_redis.write_behind(redis_params, {
+        name = N,
+        route_by_key = false,
+      })
+    end
   end
 end
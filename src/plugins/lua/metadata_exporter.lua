@@ -28,6 +28,7 @@ local rspamd_util = require "rspamd_util"
 local rspamd_logger = require "rspamd_logger"
 local rspamd_tcp = require "rspamd_tcp"
 local ucl = require "ucl"
+local lua_export = require "lua_export"
 local E = {}
 local N = 'metadata_exporter'
 local HOSTNAME = rspamd_util.get_hostname()
@@ -300,6 +301,12 @@ local pushers = {
     end
   end,
   http = function(task, formatted, rule)
+    if rule.export then
+      -- Sent in background by the export pipeline
+      rule.export:push(task, tostring(formatted))
+      return
+    end
+
     local function http_callback(err, code)
       local valid_status = { 200, 201, 202, 204 }
 
@@ -530,6 +537,7 @@ if type(settings.rules) ~= 'table' then
       r.selector = settings.pusher_select.http
       r.formatter = settings.pusher_format.http
       r.timeout = settings.timeout or 0.0
+      r.pipeline = settings.pipeline
       settings.rules[r.backend:upper()] = r
     end
   end
@@ -671,6 +679,35 @@ for k, v in pairs(settings.rules) do
   end
 end
 
+-- Creates export pipeline for http rules with `pipeline` option
+local function maybe_create_pipeline(k, rule)
+  if rule.backend ~= 'http' or not rule.pipeline then
+    return
+  end
+
+  if rule.meta_headers then
+    rspamd_logger.errx(rspamd_config, 'Rule %s: meta_headers are not supported with pipeline, pipeline is disabled', k)
+    return
+  end
+
+  if rule.defer then
+    rspamd_logger.warnx(rspamd_config, 'Rule %s: defer is ignored with pipeline', k)
+  end
+
+  -- One message per request by default as receivers expect it
+  local pipeline_opts = lua_util.override_defaults({ batch_size = 1 },
+      type(rule.pipeline) == 'table' and rule.pipeline or {})
+  pipeline_opts.name = string.format('%s_%s', N, k:lower())
+  pipeline_opts.send = lua_export.http_sink({
+    url = rule.url,
+    user = rule.user,
+    password = rule.password,
+    mime_type = rule.mime_type or settings.mime_type,
+    timeout = (rule.timeout and rule.timeout > 0) and rule.timeout or nil,
+  })
+  rule.export = lua_export.create(pipeline_opts)
+end
+
 local function gen_exporter(rule)
   return function(task)
     if task:has_flag('skip') then
@@ -698,11 +735,13 @@ if not next(settings.rules) then
   lua_util.disable_module(N, "config")
 end
 for k, r in pairs(settings.rules) do
+  maybe_create_pipeline(k, r)
   rspamd_config:register_symbol({
     name = 'EXPORT_METADATA_' .. k,
     type = 'idempotent',
     callback = gen_exporter(r),
     flags = 'empty,explicit_disable,ignore_passthrough',
-    augmentations = { string.format("timeout=%f", r.timeout or 0.0) }
+    -- Pipeline requests are not bound to messages
+    augmentations = { string.format("timeout=%f", r.export and 0.0 or r.timeout or 0.0) }
   })
 end
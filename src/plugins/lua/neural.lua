@@ -86,17 +86,19 @@ end
 
 -- ANN filter function, used to insert scores based on the existing symbols
 local function ann_scores_filter(task)
+  -- Collect all anns applicable to the task, so they are evaluated in one call
+  local anns, vectors, pcas, sets = {}, {}, {}, {}
 
   for _, rule in pairs(settings.rules) do
     local sid = task:get_settings_id() or -1
-    local ann
-    local profile
-
     local set = neural_common.get_rule_settings(task, rule)
     if set then
-      if set.ann then
-        ann = set.ann.ann
-        profile = set.ann
+      if set.ann and set.ann.ann then
+        local n = #anns + 1
+        anns[n] = set.ann.ann
+        vectors[n] = neural_common.result_to_vector(task, set.ann)
+        pcas[n] = set.ann.pca
+        sets[n] = { rule = rule, set = set }
       else
         lua_util.debugm(N, task, 'no ann loaded for %s:%s',
             rule.prefix, set.name)
@@ -105,63 +107,66 @@ local function ann_scores_filter(task)
       lua_util.debugm(N, task, 'no ann defined in %s for settings id %s',
           rule.prefix, sid)
     end
+  end
 
-    if ann then
-      local vec = neural_common.result_to_vector(task, profile)
+  if #anns == 0 then
+    return
+  end
 
-      local score
-      local out = ann:apply1(vec, set.ann.pca)
-      score = out[1]
+  local outputs = rspamd_kann.apply_multi(anns, vectors, pcas)
 
-      local symscore = string.format('%.3f', score)
-      task:cache_set(rule.prefix .. '_neural_score', score)
-      lua_util.debugm(N, task, '%s:%s:%s ann score: %s',
-          rule.prefix, set.name, set.ann.version, symscore)
+  for i, out in ipairs(outputs) do
+    local rule, set = sets[i].rule, sets[i].set
+    local score = out[1]
 
-      if score > 0 then
-        local result = score
+    local symscore = string.format('%.3f', score)
+    task:cache_set(rule.prefix .. '_neural_score', score)
+    lua_util.debugm(N, task, '%s:%s:%s ann score: %s',
+        rule.prefix, set.name, set.ann.version, symscore)
 
-        -- If spam_score_threshold is defined, override all other thresholds.
-        local spam_threshold = 0
-        if rule.spam_score_threshold then
-          spam_threshold = rule.spam_score_threshold
-        elseif rule.roc_enabled and not set.ann.roc_thresholds then
-          spam_threshold = set.ann.roc_thresholds[1]
-        end
+    if score > 0 then
+      local result = score
 
-        if result >= spam_threshold then
-          if rule.flat_threshold_curve then
-            task:insert_result(rule.symbol_spam, 1.0, symscore)
-          else
-            task:insert_result(rule.symbol_spam, result, symscore)
-          end
+      -- If spam_score_threshold is defined, override all other thresholds.
+      local spam_threshold = 0
+      if rule.spam_score_threshold then
+        spam_threshold = rule.spam_score_threshold
+      elseif rule.roc_enabled and not set.ann.roc_thresholds then
+        spam_threshold = set.ann.roc_thresholds[1]
+      end
+
+      if result >= spam_threshold then
+        if rule.flat_threshold_curve then
+          task:insert_result(rule.symbol_spam, 1.0, symscore)
         else
-          lua_util.debugm(N, task, '%s:%s:%s ann score: %s < %s (spam threshold)',
-              rule.prefix, set.name, set.ann.version, symscore,
-              spam_threshold)
+          task:insert_result(rule.symbol_spam, result, symscore)
         end
       else
-        local result = -(score)
-
-        -- If ham_score_threshold is defined, override all other thresholds.
-        local ham_threshold = 0
-        if rule.ham_score_threshold then
-          ham_threshold = rule.ham_score_threshold
-        elseif rule.roc_enabled and not set.ann.roc_thresholds then
-          ham_threshold = set.ann.roc_thresholds[2]
-        end
+        lua_util.debugm(N, task, '%s:%s:%s ann score: %s < %s (spam threshold)',
+            rule.prefix, set.name, set.ann.version, symscore,
+            spam_threshold)
+      end
+    else
+      local result = -(score)
+
+      -- If ham_score_threshold is defined, override all other thresholds.
+      local ham_threshold = 0
+      if rule.ham_score_threshold then
+        ham_threshold = rule.ham_score_threshold
+      elseif rule.roc_enabled and not set.ann.roc_thresholds then
+        ham_threshold = set.ann.roc_thresholds[2]
+      end
 
-        if result >= ham_threshold then
-          if rule.flat_threshold_curve then
-            task:insert_result(rule.symbol_ham, 1.0, symscore)
-          else
-            task:insert_result(rule.symbol_ham, result, symscore)
-          end
+      if result >= ham_threshold then
+        if rule.flat_threshold_curve then
+          task:insert_result(rule.symbol_ham, 1.0, symscore)
         else
-          lua_util.debugm(N, task, '%s:%s:%s ann score: %s < %s (ham threshold)',
-              rule.prefix, set.name, set.ann.version, result,
-              ham_threshold)
+          task:insert_result(rule.symbol_ham, result, symscore)
         end
+      else
+        lua_util.debugm(N, task, '%s:%s:%s ann score: %s < %s (ham threshold)',
+            rule.prefix, set.name, set.ann.version, result,
+            ham_threshold)
       end
     end
   end
@@ -986,7 +991,16 @@ for _, rule in pairs(settings.rules) do
           end)
     end
 
-    if worker:is_primary_controller() then
+    -- Training is performed by a dedicated `neural_trainer` worker when it is
+    -- configured, so controllers do not fetch and parse training vectors
+    local is_trainer
+    if cfg:has_worker('neural_trainer') then
+      is_trainer = worker:get_type() == 'neural_trainer'
+    else
+      is_trainer = worker:is_primary_controller()
+    end
+
+    if is_trainer then
       -- We also want to train neural nets when they have enough data
       rspamd_config:add_periodic(ev_base, 0.0,
           function(_, _)
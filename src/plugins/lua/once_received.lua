@@ -32,20 +32,13 @@ local whitelist = nil
 
 local rspamd_logger = require "rspamd_logger"
 local lua_util = require "lua_util"
-local fun = require "fun"
 local N = 'once_received'
 
 local check_local = false
 local check_authed = false
 
 local function check_quantity_received (task)
-  local recvh = task:get_received_headers()
-
-  local nreceived = fun.reduce(function(acc, _)
-    return acc + 1
-  end, 0, fun.filter(function(h)
-    return not h['flags']['artificial']
-  end, recvh))
+  local nreceived = task:get_received_count(true)
 
   local function recv_dns_cb(_, to_resolve, results, err)
     if err and (err ~= 'requested record is not found' and err ~= 'no records with this name') then
@@ -121,7 +114,7 @@ local function check_quantity_received (task)
 
   if nreceived <= 1 then
     local ret = true
-    local r = recvh[1]
+    local r = task:get_received_header(1)
 
     if not r then
       return
@@ -22,6 +22,7 @@ local rspamd_logger = require "rspamd_logger"
 local util = require "rspamd_util"
 local lua_util = require "lua_util"
 local lua_maps = require "lua_maps"
+local rspamd_url_feed = require "rspamd_url_feed"
 
 -- Phishing detection interface for selecting phished urls and inserting corresponding symbol
 --
@@ -48,9 +49,10 @@ local phishtank_enabled = false
 local phishing_feed_exclusion_hash
 local generic_service_hash
 local openphish_hash
-local phishing_feed_exclusion_data = {}
-local generic_service_data = {}
-local openphish_data = {}
+-- Feeds are stored in rspamd_url_feed indexes
+local phishing_feed_exclusion_data
+local generic_service_data
+local openphish_data
 
 local opts = rspamd_config:get_all_opt(N)
 if not (opts and type(opts) == 'table') then
@@ -60,94 +62,40 @@ end
 
 local function is_host_excluded(exclusion_map, host)
   if exclusion_map and host then
-    local excluded = exclusion_map[host]
-    if excluded then
-      return true
-    end
-    return false
+    return exclusion_map:has_host(host)
   end
 end
 
 local function phishing_cb(task)
-  local function check_phishing_map(table)
-    local phishing_data = {}
-    for k,v in pairs(table) do
-      phishing_data[k] = v
-    end
-    local url = phishing_data.url
-    local host = url:get_host()
-
-    if is_host_excluded(phishing_data.exclusion_map, host) then
-      task:insert_result(phishing_data.excl_symbol, 1.0, host)
-      return
-    end
-
-    if host then
-      local elt = phishing_data.map[host]
-      local found_path = false
-      local found_query = false
-      local data = nil
-
-      if elt then
-        local path = url:get_path()
-        local query = url:get_query()
-
-        if path then
-          for _, d in ipairs(elt) do
-            if d['path'] == path then
-              found_path = true
-              data = d['data']
-
-              if query and d['query'] and query == d['query'] then
-                found_query = true
-              elseif not d['query'] then
-                found_query = true
-              end
-            end
-          end
-        else
-          for _, d in ipairs(elt) do
-            if not d['path'] then
-              found_path = true
-            end
+  local function check_phishing_feed(feed, phish_symbol)
+    for _, res in ipairs(feed:match_urls(task)) do
+      local host = res.host
 
-            if query and d['query'] and query == d['query'] then
-              found_query = true
-            elseif not d['query'] then
-              found_query = true
-            end
-          end
-        end
-
-        if found_path then
+      if not is_host_excluded(phishing_feed_exclusion_data, host) then
+        if res.found_path then
           local args
 
-          if type(data) == 'table' then
-            args = {
-              data['tld'],
-              data['sector'],
-              data['brand'],
-            }
-          elseif type(data) == 'string' then
-            args = data
+          if res.data then
+            -- Premium feed: tld, sector and brand
+            args = lua_util.str_split(res.data, '\t')
           else
             args = host
           end
 
-          if found_query then
+          if res.found_query then
             -- Query + path match
-            task:insert_result(phishing_data.phish_symbol, 1.0, args)
+            task:insert_result(phish_symbol, 1.0, args)
           else
             -- Host + path match
-            if path then
-              task:insert_result(phishing_data.phish_symbol, 0.3, args)
+            if res.path then
+              task:insert_result(phish_symbol, 0.3, args)
             end
             -- No path, no symbol
           end
         else
-          if url:is_phished() then
+          if res.url:is_phished() then
             -- Only host matches
-            task:insert_result(phishing_data.phish_symbol, 0.1, host)
+            task:insert_result(phish_symbol, 0.1, host)
           end
         end
       end
@@ -228,6 +176,22 @@ local function phishing_cb(task)
     end
   end
 
+  if generic_service_data or openphish_data then
+    if phishing_feed_exclusion_data then
+      for _, res in ipairs(phishing_feed_exclusion_data:match_urls(task)) do
+        task:insert_result(phishing_feed_exclusion_symbol, 1.0, res.host)
+      end
+    end
+
+    if generic_service_data then
+      check_phishing_feed(generic_service_data, generic_service_symbol)
+    end
+
+    if openphish_data then
+      check_phishing_feed(openphish_data, openphish_symbol)
+    end
+  end
+
   local urls = task:get_urls() or {}
   for _, url_iter in ipairs(urls) do
     local function do_loop_iter()
@@ -237,17 +201,6 @@ local function phishing_cb(task)
       phishing_data.url = url
       phishing_data.exclusion_map = phishing_feed_exclusion_data
       phishing_data.excl_symbol = phishing_feed_exclusion_symbol
-      if generic_service_hash then
-        phishing_data.map = generic_service_data
-        phishing_data.phish_symbol = generic_service_symbol
-        check_phishing_map(phishing_data)
-      end
-
-      if openphish_hash then
-        phishing_data.map = openphish_data
-        phishing_data.phish_symbol = openphish_symbol
-        check_phishing_map(phishing_data)
-      end
 
       if phishtank_enabled then
         phishing_data.dns_suffix = phishtank_suffix
@@ -410,138 +363,84 @@ local function phishing_map(mapname, phishmap, id)
   end
 end
 
-local function rspamd_str_split_fun(s, sep, func)
-  local lpeg = require "lpeg"
-  sep = lpeg.P(sep)
-  local elem = lpeg.P((1 - sep) ^ 0 / func)
-  local p = lpeg.P(elem * (sep * elem) ^ 0)
-  return p:match(s)
-end
-
-local function insert_url_from_string(pool, tbl, str, data)
-  local rspamd_url = require "rspamd_url"
-
-  local u = rspamd_url.create(pool, str)
-
-  if u then
-    local host = u:get_host()
-    if host then
-      local elt = {
-        data = data,
-        path = u:get_path(),
-        query = u:get_query()
-      }
-
-      if tbl[host] then
-        table.insert(tbl[host], elt)
-      else
-        tbl[host] = { elt }
-      end
-
-      return true
-    end
-  end
-
-  return false
-end
-
 local function phishing_feed_exclusion_plain_cb(string)
-  local nelts = 0
-  local new_data = {}
-  local rspamd_mempool = require "rspamd_mempool"
-  local pool = rspamd_mempool.create()
-
-  local function phishing_feed_exclusion_elt_parser(cap)
-    if insert_url_from_string(pool, new_data, cap, nil) then
-      nelts = nelts + 1
-    end
-  end
-
-  rspamd_str_split_fun(string, '\n', phishing_feed_exclusion_elt_parser)
+  local new_data = rspamd_url_feed.create()
+  local nelts = new_data:add_list(string)
+  new_data:finalize()
 
   phishing_feed_exclusion_data = new_data
   rspamd_logger.infox(phishing_feed_exclusion_hash, "parsed %s elements from phishing feed exclusions",
       nelts)
-  pool:destroy()
 end
 
 local function generic_service_plain_cb(string)
-  local nelts = 0
-  local new_data = {}
-  local rspamd_mempool = require "rspamd_mempool"
-  local pool = rspamd_mempool.create()
-
-  local function generic_service_elt_parser(cap)
-    if insert_url_from_string(pool, new_data, cap, nil) then
-      nelts = nelts + 1
-    end
-  end
-
-  rspamd_str_split_fun(string, '\n', generic_service_elt_parser)
+  local new_data = rspamd_url_feed.create()
+  local nelts = new_data:add_list(string)
+  new_data:finalize()
 
   generic_service_data = new_data
   rspamd_logger.infox(generic_service_hash, "parsed %s elements from %s feed",
       nelts, generic_service_name)
-  pool:destroy()
 end
 
 local function openphish_json_cb(string)
   local ucl = require "ucl"
-  local rspamd_mempool = require "rspamd_mempool"
   local nelts = 0
-  local new_json_map = {}
+  local new_json_map = rspamd_url_feed.create()
   local valid = true
 
-  local pool = rspamd_mempool.create()
+  for cap in string:gmatch('[^\n]+') do
+    local parser = ucl.parser()
+    local res, err = parser:parse_string(cap)
+    if not res then
+      valid = false
+      rspamd_logger.warnx(openphish_hash, 'cannot parse openphish map: ' .. err)
+      break
+    else
+      local obj = parser:get_object()
+
+      if obj['url'] then
+        -- Fields keep their positions, missing ones are empty
+        local data, has_data = {}, false
+        for i, field in ipairs({ 'tld', 'sector', 'brand' }) do
+          if obj[field] then
+            data[i] = tostring(obj[field])
+            has_data = true
+          else
+            data[i] = ''
+          end
+        end
+        local added
 
-  local function openphish_elt_parser(cap)
-    if valid then
-      local parser = ucl.parser()
-      local res, err = parser:parse_string(cap)
-      if not res then
-        valid = false
-        rspamd_logger.warnx(openphish_hash, 'cannot parse openphish map: ' .. err)
-      else
-        local obj = parser:get_object()
+        if has_data then
+          added = new_json_map:add(obj['url'], table.concat(data, '\t'))
+        else
+          added = new_json_map:add(obj['url'])
+        end
 
-        if obj['url'] then
-          if insert_url_from_string(pool, new_json_map, obj['url'], obj) then
-            nelts = nelts + 1
-          end
+        if added then
+          nelts = nelts + 1
         end
       end
     end
   end
 
-  rspamd_str_split_fun(string, '\n', openphish_elt_parser)
-
   if valid then
+    new_json_map:finalize()
     openphish_data = new_json_map
     rspamd_logger.infox(openphish_hash, "parsed %s elements from openphish feed",
         nelts)
   end
-
-  pool:destroy()
 end
 
 local function openphish_plain_cb(s)
-  local nelts = 0
-  local new_data = {}
-  local rspamd_mempool = require "rspamd_mempool"
-  local pool = rspamd_mempool.create()
-
-  local function openphish_elt_parser(cap)
-    if insert_url_from_string(pool, new_data, cap, nil) then
-      nelts = nelts + 1
-    end
-  end
-
-  rspamd_str_split_fun(s, '\n', openphish_elt_parser)
+  local new_data = rspamd_url_feed.create()
+  local nelts = new_data:add_list(s)
+  new_data:finalize()
 
   openphish_data = new_data
   rspamd_logger.infox(openphish_hash, "parsed %s elements from openphish feed",
       nelts)
-  pool:destroy()
 end
 
 if opts then
@@ -134,6 +134,9 @@ local match_limit = 0
 -- Historically this is set to 2 allowing SA scores to override Rspamd scores
 local scores_priority = 2
 
+-- Compile meta rules to native expressions where possible
+local compile_metas = true
+
 local function split(str, delim)
   local result = {}
 
@@ -1199,33 +1202,135 @@ local function parse_atom(str)
   return atom
 end
 
+local function process_atom(atom, result_name, task)
+  local atom_cb = atoms[atom]
+
+  if atom_cb then
+    local res = atom_cb(task, result_name)
+
+    if not res then
+      lua_util.debugm(N, task, 'metric: %s, atom: %s, NULL result', result_name, atom)
+    elseif res > 0 then
+      lua_util.debugm(N, task, 'metric: %s, atom: %s, result: %s', result_name, atom, res)
+    end
+    return res
+  else
+    -- This is likely external atom
+    local real_sym = atom
+    if symbols_replacements[atom] then
+      real_sym = symbols_replacements[atom]
+    end
+    if task:has_symbol(real_sym, result_name) then
+      lua_util.debugm(N, task, 'external atom: %s, result: 1, named_result: %s', real_sym, result_name)
+      return 1
+    end
+    lua_util.debugm(N, task, 'external atom: %s, result: 0, , named_result: %s', real_sym, result_name)
+  end
+  return 0
+end
+
 local function gen_process_atom_cb(result_name, task)
   return function(atom)
-    local atom_cb = atoms[atom]
+    return process_atom(atom, result_name, task)
+  end
+end
+
+-- Returns mime expression atom for a regexp rule, if it can be matched by re_cache directly
+local function native_regexp_atom(r)
+  if not r or not r['re'] or not r['re_expr'] or r['not'] or
+      r['multiple'] or r['maxhits'] then
+    return nil
+  end
 
-    if atom_cb then
-      local res = atom_cb(task, result_name)
+  local body, flags = string.match(r['re_expr'], '^/(.*)/([imsx]*)$')
+  -- Mime atoms cannot have unescaped slashes inside
+  if not body or string.find(string.gsub(body, '\\.', ''), '/', 1, true) then
+    return nil
+  end
 
-      if not res then
-        lua_util.debugm(N, task, 'metric: %s, atom: %s, NULL result', result_name, atom)
-      elseif res > 0 then
-        lua_util.debugm(N, task, 'metric: %s, atom: %s, result: %s', result_name, atom, res)
-      end
-      return res
+  local t = r['type']
+  if t == 'header' then
+    if not r['ordinary'] or r['mime'] or #r['header'] ~= 1 then
+      return nil
+    end
+    local h = r['header'][1]
+    if type(h) ~= 'table' or not string.match(h['header'], '^[%w_%-]+$') then
+      return nil
+    end
+    local hflags = h['raw'] and 'X' or 'H'
+    if h['strong'] then
+      hflags = hflags .. 'S'
+    end
+    return string.format('%s=%s%s', h['header'], r['re_expr'], hflags)
+  end
+
+  local types = {
+    sabody = 'C',
+    sarawbody = 'D',
+    message = 'M',
+    uri = 'U',
+  }
+  local tflag = types[t]
+
+  if t == 'part' then
+    tflag = r['raw'] and 'Q' or 'P'
+  end
+
+  if tflag then
+    return string.format('%s%s', r['re_expr'], tflag)
+  end
+
+  return nil
+end
+
+-- Converts meta expression to a mime expression: regexp atoms are matched by
+-- re_cache natively, other atoms are called as local Lua functions
+-- Returns native expression and a table mapping native atoms to rules names
+local function compile_meta(k, r)
+  local functions, names = {}, {}
+  local nregexps, failed = 0, false
+
+  local line = string.gsub(r['meta'], '[^, \t()><+!|&\n]+', function(a)
+    if tonumber(a) then
+      return a
+    end
+
+    if not string.match(a, '^[%a_][%w_]*$') then
+      failed = true
+      return a
+    end
+
+    local native = native_regexp_atom(rules[a])
+
+    if native then
+      nregexps = nregexps + 1
     else
-      -- This is likely external atom
-      local real_sym = atom
-      if symbols_replacements[atom] then
-        real_sym = symbols_replacements[atom]
+      native = 'lua:' .. a
+      functions[a] = function(task)
+        return process_atom(a, 'default', task)
       end
-      if task:has_symbol(real_sym, result_name) then
-        lua_util.debugm(N, task, 'external atom: %s, result: 1, named_result: %s', real_sym, result_name)
-        return 1
-      end
-      lua_util.debugm(N, task, 'external atom: %s, result: 0, , named_result: %s', real_sym, result_name)
     end
-    return 0
+
+    if not names[native] then
+      names[native] = a
+    end
+
+    return native
+  end)
+
+  if failed or nregexps == 0 then
+    return nil
+  end
+
+  local expr, err = rspamd_expression.create_mime(line, rspamd_config, functions)
+
+  if not expr then
+    lua_util.debugm(N, rspamd_config, 'cannot compile meta %s to native expression: %s',
+        k, err)
+    return nil
   end
+
+  return expr, names
 end
 
 local function post_process()
@@ -1507,6 +1612,7 @@ local function post_process()
   -- Meta rules
   fun.each(function(k, r)
     local expression = nil
+    local native_expression, native_names = nil, nil
     -- Meta function callback
     -- Here are dragons!
     -- This function can be called from 2 DIFFERENT type of invocations:
@@ -1533,7 +1639,15 @@ local function post_process()
       if not (already_processed and already_processed[res_name or 'default']) then
         -- Execute symbol
         local function exec_symbol(cur_res)
-          local res, trace = expression:process_traced(gen_process_atom_cb(cur_res, task))
+          local res, trace
+          if native_expression and cur_res == 'default' then
+            res, trace = native_expression:process_traced(task)
+            trace = fun.totable(fun.map(function(a)
+              return native_names[a] or a
+            end, trace))
+          else
+            res, trace = expression:process_traced(gen_process_atom_cb(cur_res, task))
+          end
           lua_util.debugm(N, task, 'meta result for %s: %s; result name: %s', k, res, cur_res)
           if res > 0 then
             -- Symbol should be one shot to make it working properly
@@ -1602,6 +1716,10 @@ local function post_process()
 
       r['expression'] = expression
 
+      if compile_metas then
+        native_expression, native_names = compile_meta(k, r)
+      end
+
       if not atoms[k] then
         atoms[k] = meta_cb
       end
@@ -1717,6 +1835,9 @@ if type(section) == "table" then
     scores_priority = { 'number', function(v)
       scores_priority = tonumber(v)
     end },
+    compile_metas = { 'boolean', function(v)
+      compile_metas = v
+    end },
   }
 
   for k, fn in pairs(section) do
@@ -22,6 +22,7 @@
 #include "lua_ucl.h"
 #include "unix-std.h"
 #include "contrib/libev/ev.h"
+#include "libutil/libev_helper.h"
 
 #ifdef HAVE_LIBUTIL_H
 #include <libutil.h>
@@ -612,6 +613,7 @@ end:
 	rspamd_log_close(rspamd_main->logger);
 	rspamd_url_deinit();
 	g_ptr_array_free(all_commands, TRUE);
+	rspamd_ev_wheel_destroy(rspamd_main->event_loop);
 	ev_loop_destroy(rspamd_main->event_loop);
 	g_hash_table_unref(ucl_vars);
 	rspamd_mempool_delete(rspamd_main->server_pool);
@@ -20,6 +20,7 @@
 #include "lua/lua_common.h"
 #include "libserver/worker_util.h"
 #include "libserver/rspamd_control.h"
+#include "libserver/counters.h"
 #include "ottery.h"
 #include "cryptobox.h"
 #include "utlist.h"
@@ -78,6 +79,8 @@ static int control_fd;
 static ev_io control_ev;
 static struct rspamd_stat old_stat;
 static ev_timer stat_ev;
+static ev_timer warmup_ev;
+static ev_tstamp warmup_start = 0.0;
 
 static gboolean valgrind_mode = FALSE;
 
@@ -93,6 +96,7 @@ static gboolean is_insecure = FALSE;
 static GHashTable *ucl_vars = NULL;
 static char **lua_env = NULL;
 static gboolean skip_template = FALSE;
+static char *config_cache = NULL;
 
 static int term_attempts = 0;
 
@@ -131,6 +135,8 @@ static GOptionEntry entries[] =
 		 "Do not apply Jinja templates", NULL},
 		{"lua-env", '\0', 0, G_OPTION_ARG_FILENAME_ARRAY, &lua_env,
 		 "Load lua environment from the specified files", NULL},
+		{"config-cache", '\0', 0, G_OPTION_ARG_FILENAME, &config_cache,
+		 "Use binary cache of the parsed config to speed up startup and reload", NULL},
 		{NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL}};
 
 static gboolean
@@ -781,6 +787,7 @@ kill_old_workers(gpointer key, gpointer value, gpointer unused)
 		w->state = rspamd_worker_state_terminating;
 		kill(w->pid, SIGUSR2);
 		ev_io_stop(rspamd_main->event_loop, &w->srv_ev);
+		ev_timer_stop(rspamd_main->event_loop, &w->hb.heartbeat_ev);
 		g_hash_table_remove_all(w->control_events_pending);
 		msg_info_main("send signal to worker %P", w->pid);
 	}
@@ -801,6 +808,52 @@ mark_old_workers(gpointer key, gpointer value, gpointer unused)
 	w->flags |= RSPAMD_WORKER_OLD_CONFIG;
 }
 
+static void
+count_warming_workers(gpointer key, gpointer value, gpointer ud)
+{
+	struct rspamd_worker *w = value;
+	unsigned int *pending = (unsigned int *) ud;
+
+	if ((w->flags & RSPAMD_WORKER_WARMUP) && w->generation == w->srv->generation &&
+		w->state == rspamd_worker_state_running) {
+		(*pending)++;
+	}
+}
+
+static void
+rspamd_warmup_timer_handler(EV_P_ ev_timer *w, int revents)
+{
+	struct rspamd_main *rspamd_main = (struct rspamd_main *) w->data;
+	unsigned int pending = 0;
+	/* Workers stop waiting by themselves, this is a guard against stuck ones */
+	ev_tstamp max_wait = rspamd_main->cfg->warmup_timeout * 2.0;
+
+	if (rspamd_main->wanna_die) {
+		ev_timer_stop(EV_A_ w);
+
+		return;
+	}
+
+	g_hash_table_foreach(rspamd_main->workers, count_warming_workers, &pending);
+
+	if (pending > 0) {
+		if (ev_now(EV_A) - warmup_start < max_wait) {
+			return;
+		}
+
+		msg_warn_main("%ud workers of generation %ud are not ready after %.1f seconds, "
+					  "kill old workers anyway",
+					  pending, rspamd_main->generation, ev_now(EV_A) - warmup_start);
+	}
+	else {
+		msg_info_main("workers of generation %ud are ready in %.2f seconds, kill old workers",
+					  rspamd_main->generation, ev_now(EV_A) - warmup_start);
+	}
+
+	ev_timer_stop(EV_A_ w);
+	g_hash_table_foreach(rspamd_main->workers, kill_old_workers, NULL);
+}
+
 static void
 rspamd_worker_wait(struct rspamd_worker *w)
 {
@@ -952,6 +1005,7 @@ load_rspamd_config(struct rspamd_main *rspamd_main,
 {
 	cfg->compiled_modules = modules;
 	cfg->compiled_workers = workers;
+	cfg->cfg_cache_file = config_cache;
 
 	if (!rspamd_config_read(cfg, cfg->cfg_name, config_logger, rspamd_main,
 							ucl_vars, skip_template, lua_env)) {
@@ -1024,6 +1078,17 @@ start_srv_ev(gpointer key, gpointer value, gpointer ud)
 	rspamd_attach_worker(rspamd_main, cur);
 }
 
+static void
+start_old_srv_ev(gpointer key, gpointer value, gpointer ud)
+{
+	struct rspamd_worker *cur = (struct rspamd_worker *) value;
+	struct rspamd_main *rspamd_main = (struct rspamd_main *) ud;
+
+	if (cur->state == rspamd_worker_state_wanna_die) {
+		rspamd_attach_worker(rspamd_main, cur);
+	}
+}
+
 static void
 rspamd_final_timer_handler(EV_P_ ev_timer *w, int revents)
 {
@@ -1146,12 +1211,30 @@ rspamd_hup_handler(struct ev_loop *loop, ev_signal *w, int revents)
 			rspamd_check_core_limits(rspamd_main);
 			/* Mark old workers */
 			g_hash_table_foreach(rspamd_main->workers, mark_old_workers, NULL);
-			msg_info_main("spawn workers with a new config");
+			rspamd_main->generation++;
+			msg_info_main("spawn workers with a new config, generation %ud",
+						  rspamd_main->generation);
 			spawn_workers(rspamd_main, rspamd_main->event_loop);
 			msg_info_main("workers spawning has been finished");
-			/* Kill marked */
-			msg_info_main("kill old workers");
-			g_hash_table_foreach(rspamd_main->workers, kill_old_workers, NULL);
+
+			if (rspamd_main->cfg->warmup_timeout > 0) {
+				/*
+				 * Listen sockets are shared, so old workers continue to accept
+				 * connections until the new generation reports readiness
+				 */
+				g_hash_table_foreach(rspamd_main->workers, start_old_srv_ev, rspamd_main);
+				msg_info_main("wait for new workers to warm up before killing old workers");
+				ev_timer_stop(rspamd_main->event_loop, &warmup_ev);
+				warmup_start = ev_now(rspamd_main->event_loop);
+				ev_timer_init(&warmup_ev, rspamd_warmup_timer_handler, 0.5, 0.5);
+				warmup_ev.data = rspamd_main;
+				ev_timer_start(rspamd_main->event_loop, &warmup_ev);
+			}
+			else {
+				/* Kill marked */
+				msg_info_main("kill old workers");
+				g_hash_table_foreach(rspamd_main->workers, kill_old_workers, NULL);
+			}
 		}
 		else {
 			/* Reattach old workers */
@@ -1430,6 +1513,8 @@ int main(int argc, char **argv, char **env)
 	for (i = 0; i < MAX_AVG_TIME_SLOTS; i++) {
 		rspamd_main->stat->avg_time.avg_time[i] = NAN;
 	}
+	/* Counters must be shared with all workers */
+	rspamd_counters_init(rspamd_main->server_pool);
 
 	rspamd_main->cfg = rspamd_config_new(RSPAMD_CONFIG_INIT_DEFAULT);
 	rspamd_main->spairs = g_hash_table_new_full(rspamd_spair_hash,
@@ -69,6 +69,7 @@ enum rspamd_worker_flags {
 	RSPAMD_WORKER_NO_TERMINATE_DELAY = (1 << 7),
 	RSPAMD_WORKER_OLD_CONFIG = (1 << 8),
 	RSPAMD_WORKER_NO_STRICT_CONFIG = (1 << 9),
+	RSPAMD_WORKER_WARMUP = (1 << 10),
 };
 
 struct rspamd_worker_accept_event {
@@ -104,6 +105,7 @@ struct rspamd_worker {
 	pid_t ppid;                                       /**< pid of parent									*/
 	unsigned int index;                               /**< index number									*/
 	unsigned int nconns;                              /**< current connections count						*/
+	unsigned int generation;                          /**< config generation the worker has been spawned with */
 	enum rspamd_worker_state state;                   /**< current worker state							*/
 	gboolean cores_throttled;                         /**< set to true if cores throttling took place		*/
 	double start_time;                                /**< start time										*/
@@ -317,6 +319,7 @@ struct rspamd_main {
 	gboolean is_privileged;       /**< true if run in privileged mode                 */
 	gboolean wanna_die;           /**< no respawn of processes						*/
 	gboolean cores_throttling;    /**< turn off cores when limits are exceeded		*/
+	unsigned int generation;      /**< incremented on each config reload				*/
 	struct roll_history *history; /**< rolling history								*/
 	struct ev_loop *event_loop;
 	ev_signal term_ev, int_ev, hup_ev, usr1_ev; /**< signals 										*/
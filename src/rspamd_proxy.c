@@ -2475,6 +2475,7 @@ start_rspamd_proxy(struct rspamd_worker *worker)
 	rspamd_lua_run_postloads(ctx->cfg->lua_state, ctx->cfg, ctx->event_loop,
 							 worker);
 	adjust_upstreams_limits(ctx);
+	rspamd_worker_warmup(worker, ctx->event_loop);
 
 	ev_loop(ctx->event_loop, 0);
 	rspamd_worker_block_signals();
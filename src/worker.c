@@ -386,7 +386,12 @@ accept_socket(EV_P_ ev_io *w, int revents)
 		rspamd_worker_finish_handler,
 		http_opts);
 
+#ifndef HAVE_ATOMIC_BUILTINS
 	worker->srv->stat->connections_count++;
+#else
+	__atomic_add_fetch(&worker->srv->stat->connections_count,
+					   1, __ATOMIC_RELEASE);
+#endif
 	rspamd_http_connection_set_max_size(session->http_conn,
 										ctx->cfg->max_message);
 
@@ -520,6 +525,7 @@ start_worker(struct rspamd_worker *worker)
 
 	rspamd_lua_run_postloads(ctx->cfg->lua_state, ctx->cfg, ctx->event_loop,
 							 worker);
+	rspamd_worker_warmup(worker, ctx->event_loop);
 
 	ev_loop(ctx->event_loop, 0);
 	rspamd_worker_block_signals();
@@ -0,0 +1,37 @@
+local maps = {
+  MAP_DELTA = rspamd_config:add_map({
+    url = 'http://127.0.0.1:18080/map-delta',
+    type = 'set',
+  }),
+  MAP_DELTA_RADIX = rspamd_config:add_map({
+    url = 'http://127.0.0.1:18080/map-delta-radix',
+    type = 'radix',
+  }),
+  MAP_DELTA_BROKEN = rspamd_config:add_map({
+    url = 'http://127.0.0.1:18080/map-delta-broken',
+    type = 'set',
+  }),
+}
+
+local keys = {
+  MAP_DELTA = { 'example.com', 'example.net', 'rspamd.com' },
+  MAP_DELTA_RADIX = { '10.0.0.1', '10.0.0.2', '10.0.1.1' },
+  MAP_DELTA_BROKEN = { 'example.com', 'example.net', 'rspamd.com' },
+}
+
+for sym, map in pairs(maps) do
+  rspamd_config:register_symbol({
+    name = sym,
+    score = 1.0,
+    callback = function()
+      local found = {}
+      for _, k in ipairs(keys[sym]) do
+        if map:get_key(k) then
+          table.insert(found, k)
+        end
+      end
+
+      return true, table.concat(found, ',')
+    end
+  })
+end
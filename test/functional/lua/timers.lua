@@ -0,0 +1,43 @@
+local function timers_symbol(task)
+  -- Fires after timeout
+  task:add_timer(0.1, function(t)
+    t:insert_result('TIMER_FIRED', 1.0)
+  end)
+
+  -- Cancelled before it fires
+  local cancelled = task:add_timer(0.1, function(t)
+    t:insert_result('TIMER_CANCELLED', 1.0)
+  end)
+  task:insert_result('TIMER_CANCEL', 1.0, 'first:' .. tostring(cancelled:cancel()),
+      'second:' .. tostring(cancelled:cancel()))
+
+  -- Task would time out if timer was not rescheduled
+  local long = task:add_timer(100.0, function(t)
+    t:insert_result('TIMER_RESCHEDULED', 1.0)
+  end)
+  long:reschedule(0.2)
+
+  -- Timer that has fired cannot be rescheduled
+  local fired
+  fired = task:add_timer(0.0, function(t)
+    t:add_timer(0.1, function(tt)
+      tt:insert_result('TIMER_FINISHED', 1.0, 'reschedule:' .. tostring(fired:reschedule(0.1)))
+    end)
+  end)
+end
+
+local id = rspamd_config:register_symbol({
+  name = 'TEST_TIMERS',
+  score = 1.0,
+  callback = timers_symbol,
+})
+
+for _, sym in ipairs({ 'TIMER_FIRED', 'TIMER_CANCELLED', 'TIMER_CANCEL',
+                       'TIMER_RESCHEDULED', 'TIMER_FINISHED' }) do
+  rspamd_config:register_symbol({
+    name = sym,
+    score = 1.0,
+    type = 'virtual',
+    parent = id,
+  })
+end
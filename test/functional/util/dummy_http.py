@@ -9,10 +9,43 @@ import ssl
 import argparse
 import os
 
+# Maps supporting delta updates: full body with its etag and delta to the next version
+DELTA_MAPS = {
+    '/map-delta': ('example.com\nexample.net\n', '"v1"',
+                   '# update\n+rspamd.com\n-example.com\n', '"v2"'),
+    '/map-delta-radix': ('10.0.0.1\n10.0.1.0/24\n', '"v1"',
+                         '+10.0.0.2\n-10.0.0.1\n', '"v2"'),
+    # Broken delta is rejected, so the map is always reloaded
+    '/map-delta-broken': ('example.com\n', '"v1"',
+                          '+rspamd.com\nexample.net\n', '"v2"'),
+}
+
 class MainHandler(tornado.web.RequestHandler):
+    def delta_map(self, path, head=False):
+        full, full_etag, delta, delta_etag = DELTA_MAPS[path]
+        etag = self.request.headers.get("If-None-Match")
+        self.set_header("Content-Type", "text/plain")
+
+        if etag == delta_etag or (head and etag == full_etag):
+            self.set_status(304)
+        elif (not head and etag == full_etag and
+              'rspamd-map-delta' in self.request.headers.get("A-IM", "")):
+            # RFC 3229 reply
+            self.set_status(226)
+            self.set_header("IM", "rspamd-map-delta")
+            self.set_header("Delta-Base", full_etag)
+            self.set_header("ETag", delta_etag)
+            self.write(delta)
+        else:
+            self.set_header("ETag", full_etag)
+            if not head:
+                self.write(full)
+
     @tornado.gen.coroutine
     def get(self, path):
-        if path == '/empty':
+        if path in DELTA_MAPS:
+            self.delta_map(path)
+        elif path == '/empty':
             # Return an empty reply
             self.set_header("Content-Type", "text/plain")
             self.write("")
@@ -88,7 +121,9 @@ class MainHandler(tornado.web.RequestHandler):
 
     def head(self, path):
         self.set_header("Content-Type", "text/plain")
-        if path == "/redirect1":
+        if path in DELTA_MAPS:
+            self.delta_map(path, head=True)
+        elif path == "/redirect1":
             # Send an HTTP redirect to the bind address of the server
             self.redirect(f"{self.request.protocol}://{self.request.host}/hello")
         elif path == "/redirect2":
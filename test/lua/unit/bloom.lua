@@ -0,0 +1,59 @@
+context("Bloom filter unit tests", function()
+  local rspamd_bloom = require "rspamd_bloom"
+
+  test("Add and check", function()
+    local bf = rspamd_bloom.create(1000, 4)
+    -- Size is rounded to the power of two
+    assert_equal(bf:get_size(), 1024)
+
+    for i = 1, 50 do
+      bf:add('key' .. tostring(i))
+    end
+    for i = 1, 50 do
+      assert_true(bf:check('key' .. tostring(i)))
+    end
+
+    bf:reset()
+    assert_false(bf:check('key1'))
+  end)
+
+  test("Positions", function()
+    local bf = rspamd_bloom.create(4096, 3)
+    local pos = bf:positions('test')
+    assert_equal(#pos, 3)
+    for _, p in ipairs(pos) do
+      assert_true(p >= 0 and p < 4096)
+    end
+  end)
+
+  test("Merge filters and bitmaps", function()
+    local bf1 = rspamd_bloom.create(4096)
+    local bf2 = rspamd_bloom.create(4096)
+    bf1:add('a')
+    bf2:add('b')
+    assert_true(bf1:merge(bf2))
+    assert_true(bf1:check('a'))
+    assert_true(bf1:check('b'))
+    assert_false(bf1:merge(rspamd_bloom.create(8192)))
+
+    -- Bitmap as returned by Redis after SETBIT of all positions
+    local bits, max_idx = {}, 0
+    for _, p in ipairs(bf2:positions('c')) do
+      bits[p] = true
+    end
+    local bytes = {}
+    for p in pairs(bits) do
+      local idx = math.floor(p / 8) + 1
+      bytes[idx] = (bytes[idx] or 0) + 2 ^ (7 - p % 8)
+      max_idx = math.max(max_idx, idx)
+    end
+    local chars = {}
+    for i = 1, max_idx do
+      chars[i] = string.char(bytes[i] or 0)
+    end
+    local bitmap = table.concat(chars)
+    assert_true(bf2:merge(bitmap))
+    assert_true(bf2:check('c'))
+    assert_false(bf2:merge(string.rep('\0', 1024)))
+  end)
+end)
@@ -0,0 +1,39 @@
+context("Shared counters unit tests", function()
+  test("Register and increment counters", function()
+    local id = rspamd_config:register_counter('rspamd_test_hits_total{rule="a"}',
+        'Test counter')
+    assert_not_nil(id)
+    local id2 = rspamd_config:register_counter('rspamd_test_hits_total{rule="b"}',
+        'Test counter')
+    assert_not_nil(id2)
+    assert_not_equal(id, id2)
+
+    -- Same name returns the same id
+    assert_equal(rspamd_config:register_counter('rspamd_test_hits_total{rule="a"}'), id)
+
+    rspamd_config:counter_add(id)
+    rspamd_config:counter_add(id, 10)
+    assert_equal(rspamd_config:counter_get(id), 11)
+    assert_equal(rspamd_config:counter_get(id2), 0)
+  end)
+
+  test("Gauges", function()
+    local id = rspamd_config:register_counter('rspamd_test_gauge', 'Test gauge', 'gauge')
+    assert_not_nil(id)
+
+    rspamd_config:counter_add(id, 5)
+    rspamd_config:counter_set(id, 42)
+    assert_equal(rspamd_config:counter_get(id), 42)
+    rspamd_config:counter_add(id, -2)
+    assert_equal(rspamd_config:counter_get(id), 40)
+
+    -- Type mismatch
+    assert_nil(rspamd_config:register_counter('rspamd_test_gauge', 'Test gauge'))
+  end)
+
+  test("Invalid names", function()
+    assert_nil(rspamd_config:register_counter('1abc'))
+    assert_nil(rspamd_config:register_counter('abc def'))
+    assert_nil(rspamd_config:register_counter('abc{rule="a"'))
+  end)
+end)
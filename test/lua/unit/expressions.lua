@@ -108,4 +108,74 @@ context("Rspamd expressions", function()
           expr:to_string(), c[1], res, c[2]))
     end)
   end
+
+  test("Mime expression creation", function()
+    local functions = {
+      check = function(_) return true end
+    }
+    local expr,err = rspamd_expression.create_mime('Subject=/test/iH & !lua:check',
+        rspamd_config, functions)
+    assert_not_nil(expr, "Cannot parse mime expression; error: " .. (err or 'wut??'))
+    assert_equal(#expr:atoms(), 2)
+
+    expr = rspamd_expression.create_mime('/test/C | lua:missing', rspamd_config, functions)
+    assert_nil(expr, "Should not be able to parse expression with unknown function")
+    expr = rspamd_expression.create_mime('lua:check', rspamd_config)
+    assert_nil(expr, "Should not be able to parse expression with no functions")
+  end)
+
+  test("Mime expression with lua atoms matches Lua expression", function()
+    local rspamd_task = require "rspamd_task"
+    local msg = [[
+From: <foo@example.com>
+To: <bar@example.com>
+Subject: test
+
+Test.
+]]
+    -- Counters are results of rules limited by maxhits, as in metas
+    local functions = {
+      MAXHITS = function(_) return 3 end,
+      ONE = function(_) return 1 end,
+      TRUE = function(_) return true end,
+      ZERO = function(_) return 0 end,
+      SUBJECT = function(task)
+        return task:get_header('Subject') == 'test'
+      end,
+    }
+    local metas = {
+      {'lua:MAXHITS > 2', 1},
+      {'lua:MAXHITS + lua:ONE >= 5', 0},
+      {'lua:MAXHITS + lua:ONE + lua:TRUE', 5},
+      {'!lua:MAXHITS', 0},
+      {'!lua:ZERO & lua:SUBJECT', 1},
+      {'lua:MAXHITS & !lua:ONE | lua:ZERO', 0},
+      {'!(lua:ZERO | !lua:TRUE) && (lua:MAXHITS + lua:ZERO) > 2', 1},
+    }
+
+    local res, task = rspamd_task.load_from_string(msg, rspamd_config)
+    assert_true(res, "failed to load message")
+    task:process_message()
+
+    local function lua_process(atom)
+      local r = functions[string.match(atom, '^lua:(.+)$')](task)
+      if type(r) == 'boolean' then
+        return r and 1 or 0
+      end
+      return r
+    end
+
+    for _, c in ipairs(metas) do
+      local lua_expr = rspamd_expression.create(c[1], {parse_func, lua_process}, pool)
+      local mime_expr, err = rspamd_expression.create_mime(c[1], rspamd_config, functions)
+      assert_not_nil(mime_expr, "Cannot parse " .. c[1] .. '; error: ' .. (err or 'wut??'))
+
+      local lua_res = lua_expr:process(task)
+      assert_equal(lua_res, c[2], c[1])
+      assert_equal(mime_expr:process(task), lua_res, c[1])
+      assert_equal(mime_expr:process_traced(task), lua_res, c[1])
+    end
+
+    task:destroy()
+  end)
 end)
@@ -42,5 +42,19 @@ context("Kann test", function()
         end)
   end
 
+  test("Check batch apply matches apply1", function()
+    local res = k:apply_batch(inputs)
+    assert_equal(#inputs, #res)
+    for i, inp in ipairs(inputs) do
+      assert_less_than(math.abs(k:apply1(inp)[1] - res[i][1]), 1e-5)
+    end
+  end)
+
+  test("Check multiple anns apply", function()
+    local res = kann.apply_multi({ k, k }, { inputs[2], inputs[4] })
+    assert_equal(2, #res)
+    assert_less_than(math.abs(k:apply1(inputs[2])[1] - res[1][1]), 1e-5)
+    assert_less_than(math.abs(k:apply1(inputs[4])[1] - res[2][1]), 1e-5)
+  end)
 
 end)
\ No newline at end of file
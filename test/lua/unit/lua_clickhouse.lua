@@ -0,0 +1,37 @@
+-- ClickHouse helpers
+
+context("Lua ClickHouse", function()
+  local lua_clickhouse = require "lua_clickhouse"
+
+  test("Extract column types from schema", function()
+    local types = lua_clickhouse.schema_types([[
+CREATE TABLE IF NOT EXISTS t
+(
+    Date Date COMMENT 'Date (used for partitioning',
+    `Attachments.FileName` Array(String) COMMENT 'it\'s, a name',
+    IsBayes Enum8('ham' = 0, 'spam' = 1) DEFAULT 'ham',
+    SMTPFrom ALIAS if(From = '', '', From),
+    Cnt UInt32 MATERIALIZED 1,
+    Digest FixedString(32),
+    INDEX idx Date TYPE minmax GRANULARITY 1
+) ENGINE = MergeTree()
+PARTITION BY toMonday(Date)
+]])
+
+    assert_rspamd_table_eq({
+      expect = {
+        Date = 'Date',
+        ['Attachments.FileName'] = 'Array(String)',
+        IsBayes = "Enum8('ham' = 0, 'spam' = 1)",
+        Digest = 'FixedString(32)',
+      },
+      actual = types,
+    })
+  end)
+
+  test("RowBinaryWithNamesAndTypes header", function()
+    local header = lua_clickhouse.row_binary_header({ 'a', 'b' },
+        { 'UInt8', 'String' })
+    assert_equal(tostring(header), '\2\1a\1b\5UInt8\6String')
+  end)
+end)
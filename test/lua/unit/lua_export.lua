@@ -0,0 +1,149 @@
+-- Export pipelines
+
+context("Export pipeline", function()
+  local lua_export = require "lua_export"
+  local rspamd_util = require "rspamd_util"
+
+  local now, calls, spool_dir
+  local orig_get_time = rspamd_util.get_time
+
+  -- Sink replies are sent explicitly by tests
+  local function sink(payload, done)
+    table.insert(calls, { payload = payload, done = done })
+  end
+
+  local function create(opts)
+    opts = opts or {}
+    opts.name = opts.name or 'test'
+    opts.send = sink
+    local p = lua_export.create(opts)
+    -- Do not start periodic timer, pipeline is ticked explicitly
+    p.ev_base = true
+
+    return p
+  end
+
+  local function push(p, ...)
+    for _, rec in ipairs({ ... }) do
+      p:push(nil, rec)
+    end
+  end
+
+  local function spooled()
+    return rspamd_util.glob(spool_dir .. '/test-*.spool*') or {}
+  end
+
+  before(function()
+    now, calls = 100, {}
+    spool_dir = os.tmpname()
+    os.remove(spool_dir)
+    assert_true(rspamd_util.mkdir(spool_dir))
+    rspamd_util.get_time = function()
+      return now
+    end
+  end)
+
+  after(function()
+    rspamd_util.get_time = orig_get_time
+    for _, f in ipairs(spooled()) do
+      rspamd_util.unlink(f)
+    end
+    os.remove(spool_dir)
+  end)
+
+  test("Records are sent in batches", function()
+    local p = create({ batch_size = 2 })
+    push(p, 'a', 'b', 'c')
+    assert_equal(#calls, 1)
+    assert_equal(calls[1].payload, 'a\nb')
+
+    -- Incomplete batch is made on tick, but only one batch is in flight
+    p:tick()
+    assert_equal(#calls, 1)
+    calls[1].done(true)
+    assert_equal(#calls, 2)
+    assert_equal(calls[2].payload, 'c')
+    calls[2].done(true)
+
+    assert_rspamd_table_eq({ actual = p:stat(), expect = {
+      queued = 0, batches = 0, sent = 3, dropped = 0, spooled = 0,
+    } })
+  end)
+
+  test("Failed batches are retried with backoff", function()
+    local p = create({ batch_size = 2, retry_interval = 1.0 })
+    push(p, 'a', 'b')
+    calls[1].done(false, 'error')
+    assert_equal(p:stat().batches, 2)
+
+    p:tick()
+    assert_equal(#calls, 1)
+    now = now + 1
+    p:tick()
+    assert_equal(#calls, 2)
+    assert_equal(calls[2].payload, 'a\nb')
+
+    -- Interval is doubled after the next failure
+    calls[2].done(false, 'error')
+    now = now + 1
+    p:tick()
+    assert_equal(#calls, 2)
+    now = now + 1
+    p:tick()
+    assert_equal(#calls, 3)
+    calls[3].done(true)
+    assert_equal(p:stat().sent, 2)
+  end)
+
+  test("Batches are spooled after retries and unspooled", function()
+    for _, compress in ipairs({ false, true }) do
+      calls = {}
+      local p = create({ batch_size = 2, max_retries = 1, spool_dir = spool_dir,
+                         compress = compress })
+      push(p, 'a', 'b')
+      calls[1].done(false, 'error')
+      assert_equal(p:stat().spooled, 2)
+      assert_equal(#spooled(), 1)
+
+      -- Spooled batches are not sent until sink works
+      now = now + 100
+      p:tick()
+      assert_equal(#calls, 1)
+      push(p, 'c', 'd')
+      assert_equal(calls[2].payload, 'c\nd')
+      calls[2].done(true)
+      p:tick()
+      assert_equal(#calls, 3)
+      assert_equal(tostring(calls[3].payload), 'a\nb')
+      assert_equal(#spooled(), 0)
+      calls[3].done(true)
+      assert_equal(p:stat().sent, 4)
+    end
+  end)
+
+  test("Pending batches are spooled on termination", function()
+    local p = create({ batch_size = 2, spool_dir = spool_dir })
+    push(p, 'a', 'b', 'c')
+    assert_equal(#calls, 1)
+    p:terminate(nil)
+    assert_equal(#spooled(), 2)
+    assert_equal(p:stat().spooled, 3)
+
+    -- Reply to the request sent before termination is ignored
+    calls[1].done(true)
+    assert_equal(p:stat().sent, 0)
+    assert_equal(#calls, 1)
+
+    -- Spooled batches are sent by other workers
+    local p2 = create({ batch_size = 2, spool_dir = spool_dir })
+    local payloads = {}
+    for i = 2, 3 do
+      p2:tick()
+      assert_equal(#calls, i)
+      table.insert(payloads, tostring(calls[i].payload))
+      calls[i].done(true)
+    end
+    assert_rspamd_table_eq_sorted({ actual = payloads, expect = { 'a\nb', 'c' } })
+    assert_equal(#spooled(), 0)
+  end)
+end)
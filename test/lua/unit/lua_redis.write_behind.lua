@@ -0,0 +1,149 @@
+-- Write-behind buffer coalescing
+
+context("Redis write-behind buffer", function()
+  local lua_redis = require "lua_redis"
+  local rspamd_task = require "rspamd_task"
+  local unpack = table.unpack or unpack
+
+  local msg = [[
+From: <foo@example.com>
+To: <bar@example.com>
+Subject: test
+
+Test.
+]]
+
+  -- Flushes buffer and returns commands sent for each key
+  local function flush(wb)
+    local requests = {}
+    local orig = lua_redis.rspamd_redis_make_request
+    local _, task = rspamd_task.load_from_string(msg, rspamd_config)
+
+    lua_redis.rspamd_redis_make_request = function(_, _, route_key, is_write, _, cmd, args)
+      assert_true(is_write)
+      local key = args[1]
+      local req = { route_key = route_key, cmds = { { cmd, { select(2, unpack(args)) } } } }
+      requests[key] = req
+
+      return true, {
+        add_cmd = function(_, c, a)
+          assert_equal(a[1], key)
+          table.insert(req.cmds, { c, { select(2, unpack(a)) } })
+        end
+      }
+    end
+
+    local ok, err = pcall(wb.flush, wb, task)
+    lua_redis.rspamd_redis_make_request = orig
+    task:destroy()
+    assert_true(ok, err)
+
+    return requests
+  end
+
+  local function create(opts)
+    local wb = lua_redis.write_behind({}, opts)
+    -- Do not start flush timer, updates are flushed explicitly
+    wb.ev_base = true
+
+    return wb
+  end
+
+  test("Counters are summed", function()
+    local wb = create()
+    wb:incrby(nil, 'cnt', 1)
+    wb:incrby(nil, 'cnt', 2)
+    wb:incrby(nil, 'big', 1e15)
+    wb:incrby(nil, 'big', 3)
+    wb:incrby(nil, 'float', 0.5)
+    wb:incrby(nil, 'float', 0.25)
+    wb:hincrby(nil, 'hash', 'a', 1)
+    wb:hincrby(nil, 'hash', 'a', 41)
+
+    local reqs = flush(wb)
+    assert_rspamd_table_eq({ actual = reqs.cnt.cmds, expect = { { 'INCRBY', { '3' } } } })
+    -- Must not be sent as 1e+15
+    assert_rspamd_table_eq({ actual = reqs.big.cmds, expect = { { 'INCRBY', { '1000000000000003' } } } })
+    assert_rspamd_table_eq({ actual = reqs.float.cmds, expect = { { 'INCRBYFLOAT', { '0.75' } } } })
+    assert_rspamd_table_eq({ actual = reqs.hash.cmds, expect = { { 'HINCRBY', { 'a', '42' } } } })
+    -- Buffer is empty after flush
+    assert_nil(next(flush(wb)))
+  end)
+
+  test("List appends keep order and are trimmed", function()
+    local wb = create()
+    for _, v in ipairs({ 'a', 'b', 'c', 'd' }) do
+      wb:lpush(nil, 'list', v, 3)
+    end
+
+    local reqs = flush(wb)
+    -- LPUSH with several values inserts them one by one, so 'd' becomes the head
+    assert_rspamd_table_eq({ actual = reqs.list.cmds, expect = {
+      { 'LPUSH', { 'b', 'c', 'd' } },
+      { 'LTRIM', { '0', '2' } },
+    } })
+  end)
+
+  test("Sorted set keeps the highest score", function()
+    local wb = create()
+    wb:zadd(nil, 'zset', 5, 'm')
+    wb:zadd(nil, 'zset', 7, 'm')
+    wb:zadd(nil, 'zset', 3, 'm', 10)
+
+    local reqs = flush(wb)
+    assert_rspamd_table_eq({ actual = reqs.zset.cmds, expect = {
+      { 'ZADD', { '7', 'm' } },
+      { 'ZREMRANGEBYRANK', { '0', '-11' } },
+    } })
+  end)
+
+  test("Set members are deduplicated", function()
+    local wb = create()
+    wb:sadd(nil, 'set', 'a')
+    wb:sadd(nil, 'set', 'b')
+    wb:sadd(nil, 'set', 'a')
+
+    local reqs = flush(wb)
+    assert_equal(#reqs.set.cmds, 1)
+    assert_equal(reqs.set.cmds[1][1], 'SADD')
+    assert_rspamd_table_eq_sorted({ actual = reqs.set.cmds[1][2], expect = { 'a', 'b' } })
+  end)
+
+  test("Sorted set increments are summed", function()
+    local wb = create()
+    wb:zincrby(nil, 'zset', 'm', 1)
+    wb:zincrby(nil, 'zset', 'm', 2)
+    wb:zincrby(nil, 'zset', 'm', 1e15, 100)
+
+    local reqs = flush(wb)
+    assert_rspamd_table_eq({ actual = reqs.zset.cmds, expect = {
+      { 'ZINCRBY', { '1000000000000003', 'm' } },
+      { 'ZREMRANGEBYRANK', { '0', '-101' } },
+    } })
+  end)
+
+  test("Expire is sent last", function()
+    local wb = create()
+    wb:expire(nil, 'key', 100)
+    wb:incrby(nil, 'key', 1)
+    wb:expire(nil, 'key', 200)
+    wb:lpush(nil, 'key', 'v')
+
+    local reqs = flush(wb)
+    assert_rspamd_table_eq({ actual = reqs.key.cmds, expect = {
+      { 'INCRBY', { '1' } },
+      { 'LPUSH', { 'v' } },
+      { 'EXPIRE', { '200' } },
+    } })
+  end)
+
+  test("Routing by key", function()
+    local wb = create()
+    wb:incrby(nil, 'key', 1)
+    assert_equal(flush(wb).key.route_key, 'key')
+
+    wb = create({ route_by_key = false })
+    wb:incrby(nil, 'key', 1)
+    assert_nil(flush(wb).key.route_key)
+  end)
+end)
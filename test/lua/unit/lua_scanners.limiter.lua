@@ -0,0 +1,246 @@
+-- Concurrency limiter of external scanners
+
+context("External scanners concurrency limiter", function()
+  local common = require "lua_scanners/common"
+  local rspamd_task = require "rspamd_task"
+  local rspamd_util = require "rspamd_util"
+
+  local timers, tasks
+  local now = 0
+
+  local function message(n)
+    return string.format([[
+From: <foo@example.com>
+To: <bar@example.com>
+Subject: test %s
+
+Test %s.
+]], n, n)
+  end
+
+  -- Timers are fired explicitly by tests
+  local function add_timer(task, timeout, cb)
+    local tm = { task = task, timeout = timeout, cb = cb, pending = true }
+
+    function tm:reschedule(t)
+      if not self.pending then
+        return false
+      end
+      self.timeout = t
+      return true
+    end
+
+    table.insert(timers, tm)
+
+    return tm
+  end
+
+  -- Fires timers that are due, or all pending timers if `all` is set
+  local function fire(all)
+    local fired = 0
+    for _, tm in ipairs(timers) do
+      if tm.pending and (all or tm.timeout == 0) then
+        tm.pending = false
+        tm.cb(tm.task)
+        fired = fired + 1
+      end
+    end
+
+    return fired
+  end
+
+  local function load(n)
+    local res, task = rspamd_task.load_from_string(message(n), rspamd_config)
+    assert_true(res, "failed to load message")
+    task:process_message()
+    table.insert(tasks, task)
+
+    return task
+  end
+
+  local function destroy(task)
+    -- Session events of a task are finished before its pool is destroyed
+    for _, tm in ipairs(timers) do
+      if tm.task == task then
+        tm.pending = false
+      end
+    end
+    for i, t in ipairs(tasks) do
+      if t == task then
+        table.remove(tasks, i)
+        break
+      end
+    end
+    task:destroy()
+  end
+
+  local function rule(concurrency)
+    return {
+      name = 'test',
+      log_prefix = 'test',
+      symbol = 'TEST_VIRUS',
+      symbol_fail = 'TEST_FAIL',
+      detection_category = 'virus',
+      timeout = 5.0,
+      no_cache = true,
+      concurrency = concurrency,
+    }
+  end
+
+  -- Requests scan of a task content, started scans are appended to `scans`
+  local function check(task, r, scans)
+    local digest = task:get_digest()
+    common.condition_check_and_continue(task, 'content', r, digest, function()
+      scans[#scans + 1] = task
+    end)
+  end
+
+  local function options(task, sym)
+    local res = task:get_symbol(sym)
+    assert_not_nil(res, sym .. ' is not inserted')
+    return res[1].options or {}
+  end
+
+  local mt, orig_add_timer, orig_get_time
+
+  before(function()
+    timers, tasks = {}, {}
+    now = 0
+    local t = select(2, rspamd_task.load_from_string(message(0), rspamd_config))
+    mt = getmetatable(t)
+    t:destroy()
+    orig_add_timer = mt.add_timer
+    orig_get_time = rspamd_util.get_time
+    mt.add_timer = add_timer
+    rspamd_util.get_time = function()
+      return now
+    end
+  end)
+
+  after(function()
+    mt.add_timer = orig_add_timer
+    rspamd_util.get_time = orig_get_time
+    for _, task in ipairs(tasks) do
+      task:destroy()
+    end
+  end)
+
+  test("Requests above limit are queued and shed", function()
+    local r = rule({ max = 1, queue = 1 })
+    local scans = {}
+    local t1, t2, t3 = load(1), load(2), load(3)
+
+    check(t1, r, scans)
+    check(t2, r, scans)
+    check(t3, r, scans)
+    assert_equal(#scans, 1)
+    assert_equal(r.limiter.in_flight, 1)
+    assert_equal(#r.limiter.queue, 1)
+    assert_equal(options(t3, 'TEST_FAIL')[1], 'overloaded: 1 requests in flight and 1 queued')
+
+    common.yield_result(t1, r, 'Eicar', 1.0)
+    -- Slot is passed to the queued scan
+    assert_equal(r.limiter.in_flight, 1)
+    assert_equal(fire(), 1)
+    assert_equal(#scans, 2)
+    assert_equal(scans[2], t2)
+
+    common.yield_result(t2, r, 'Eicar', 1.0)
+    assert_equal(r.limiter.in_flight, 0)
+    assert_equal(#r.limiter.queue, 0)
+  end)
+
+  test("Queued request is shed on timeout", function()
+    local r = rule({ max = 1, queue = 1 })
+    local scans = {}
+    local t1, t2 = load(1), load(2)
+
+    check(t1, r, scans)
+    check(t2, r, scans)
+    assert_equal(fire(true), 1)
+    assert_equal(#scans, 1)
+    assert_equal(options(t2, 'TEST_FAIL')[1], 'overloaded: queue timeout')
+    assert_equal(#r.limiter.queue, 0)
+    assert_equal(r.limiter.in_flight, 1)
+  end)
+
+  test("Slot is released when task is destroyed", function()
+    local r = rule({ max = 1, queue = 1 })
+    local scans = {}
+    local t1, t2, t3 = load(1), load(2), load(3)
+
+    -- Running scan without results
+    check(t1, r, scans)
+    check(t2, r, scans)
+    destroy(t1)
+    assert_equal(r.limiter.in_flight, 1)
+
+    -- Granted scan that has not been started yet
+    destroy(t2)
+    assert_equal(#scans, 1)
+    assert_equal(r.limiter.in_flight, 0)
+
+    check(t3, r, scans)
+    assert_equal(#scans, 2)
+  end)
+
+  test("Limit is adjusted by latency and failures", function()
+    local r = rule({ max = 4, min = 2, latency = 1.0 })
+    local scans = {}
+    local function scan(n, vname, is_fail, duration)
+      local task = load(n)
+      check(task, r, scans)
+      now = now + duration
+      common.yield_result(task, r, vname, 1.0, is_fail)
+    end
+
+    scan(1, 'Eicar', nil, 0.1)
+    assert_equal(r.limiter.limit, 4)
+    scan(2, 'Eicar', nil, 2.0)
+    assert_equal(r.limiter.limit, 3)
+    scan(3, 'timeout', 'fail', 0.1)
+    assert_equal(r.limiter.limit, 2.25)
+    scan(4, 'Eicar', nil, 0.1)
+    assert_equal(r.limiter.limit, 2.25 + 1.0 / 2.25)
+    scan(5, 'timeout', 'fail', 0.1)
+    scan(6, 'timeout', 'fail', 0.1)
+    assert_equal(r.limiter.limit, 2)
+    assert_equal(r.limiter.in_flight, 0)
+  end)
+
+  test("Scans of the same content are coalesced", function()
+    local r = rule({ max = 4 })
+    local scans = {}
+    local t1, t2, t3 = load(1), load(1), load(1)
+
+    check(t1, r, scans)
+    check(t2, r, scans)
+    check(t3, r, scans)
+    assert_equal(#scans, 1)
+    assert_equal(r.limiter.in_flight, 1)
+
+    common.yield_result(t1, r, 'Eicar', 1.0)
+    assert_equal(fire(), 2)
+    assert_equal(options(t2, 'TEST_VIRUS')[1], 'Eicar')
+    assert_equal(options(t3, 'TEST_VIRUS')[1], 'Eicar')
+    assert_equal(r.limiter.in_flight, 0)
+  end)
+
+  test("Coalesced tasks fail when scan is aborted", function()
+    local r = rule({ max = 4 })
+    local scans = {}
+    local t1, t2 = load(1), load(1)
+
+    check(t1, r, scans)
+    check(t2, r, scans)
+    destroy(t1)
+    assert_equal(fire(), 1)
+    assert_equal(options(t2, 'TEST_FAIL')[1], 'failed: concurrent scan has been aborted')
+    assert_nil(t2:get_symbol('TEST_VIRUS'))
+
+    -- The next scan of the same content is performed again
+    local t3 = load(1)
+    check(t3, r, scans)
+    assert_equal(#scans, 2)
+  end)
+end)
@@ -0,0 +1,94 @@
+context("Received headers access", function()
+  local rspamd_task = require "rspamd_task"
+
+  local msg = [[
+Received: from server2.example.net (server2.example.net [192.0.2.2])
+	by mx.example.org (Postfix) with ESMTPS id 1234
+	for <user@example.org>; Mon, 1 Jan 2024 10:00:02 +0000
+Received: garbage
+Received: from server1.example.net (server1.example.net [192.0.2.1])
+	by server2.example.net (Postfix) with ESMTP id 5678;
+	Mon, 1 Jan 2024 10:00:01 +0000
+From: <foo@example.net>
+To: <user@example.org>
+Subject: test
+
+Test.
+]]
+
+  local function load(from_ip)
+    local res, task = rspamd_task.load_from_string(msg, rspamd_config)
+    assert_true(res, "failed to load message")
+    if from_ip then
+      task:set_from_ip(from_ip)
+    end
+    task:process_message()
+
+    return task
+  end
+
+  test("Get single received header", function()
+    local task = load("192.0.2.2")
+    local rh = task:get_received_header(1)
+
+    assert_not_nil(rh)
+    assert_equal(rh.from_hostname, 'server2.example.net')
+    assert_equal(rh.from_ip, '192.0.2.2')
+    assert_equal(rh.by_hostname, 'mx.example.org')
+    assert_equal(rh.proto, 'esmtps')
+    assert_false(rh.flags.artificial)
+
+    -- The same as in the full chain
+    local all = task:get_received_headers()
+    assert_equal(task:get_received_header(#all).by_hostname, all[#all].by_hostname)
+    assert_equal(all[#all].by_hostname, 'server2.example.net')
+
+    assert_nil(task:get_received_header(0))
+    assert_nil(task:get_received_header(#all + 1))
+    task:destroy()
+  end)
+
+  test("Count received headers", function()
+    local task = load("192.0.2.2")
+
+    -- Malformed headers are not counted
+    assert_equal(task:get_received_count(), 2)
+    assert_equal(task:get_received_count(true), 2)
+    task:destroy()
+  end)
+
+  test("Artificial received header", function()
+    -- Top header does not match the sender IP, so rspamd prepends its own one
+    local task = load("198.51.100.1")
+    local rh = task:get_received_header(1)
+
+    assert_true(rh.flags.artificial)
+    assert_equal(rh.from_ip, '198.51.100.1')
+    assert_equal(task:get_received_header(2).from_ip, '192.0.2.2')
+    assert_equal(task:get_received_count(), 3)
+    assert_equal(task:get_received_count(true), 2)
+    task:destroy()
+  end)
+
+  test("Headers hash skips valid received headers", function()
+    local task = load()
+    local hash = task:get_headers_hash()
+    task:destroy()
+
+    -- Only the malformed Received header is hashed
+    local res, stripped = rspamd_task.load_from_string([[
+Received: garbage
+From: <foo@example.net>
+To: <user@example.org>
+Subject: test
+
+Test.
+]], rspamd_config)
+    assert_true(res, "failed to load message")
+    stripped:process_message()
+    assert_not_nil(hash)
+    assert_equal(stripped:get_headers_hash(), hash)
+    assert_equal(stripped:get_mempool():get_variable('headers_hash'), hash)
+    stripped:destroy()
+  end)
+end)
@@ -0,0 +1,45 @@
+-- Redis Cluster slots routing
+
+context("Redis cluster", function()
+  local rspamd_redis = require "rspamd_redis"
+  local lua_redis_cluster = require "lua_redis_cluster"
+
+  test("Key slots", function()
+    local cases = {
+      { '123456789', 12739 },
+      { 'foo', 12182 },
+      { 'bar', 5061 },
+      { '{user1000}.following', 3443 },
+      { '{user1000}.followers', 3443 },
+    }
+
+    for _, c in ipairs(cases) do
+      assert_equal(rspamd_redis.key_slot(c[1]), c[2])
+    end
+
+    -- Empty hash tag means the whole key is hashed
+    assert_not_equal(rspamd_redis.key_slot('{}foo'), rspamd_redis.key_slot('foo'))
+    assert_equal(rspamd_redis.key_slot('{bar}foo'), rspamd_redis.key_slot('bar'))
+  end)
+
+  test("Slots map lookup", function()
+    local ranges = {
+      { 0, 5460, '127.0.0.1:7000' },
+      { 5461, 10922, '127.0.0.1:7001' },
+      { 10923, 16383, '127.0.0.1:7002' },
+    }
+
+    assert_equal(lua_redis_cluster.find_slot_master(ranges, 0), '127.0.0.1:7000')
+    assert_equal(lua_redis_cluster.find_slot_master(ranges, 5461), '127.0.0.1:7001')
+    assert_equal(lua_redis_cluster.find_slot_master(ranges, 10922), '127.0.0.1:7001')
+    assert_equal(lua_redis_cluster.find_slot_master(ranges, 16383), '127.0.0.1:7002')
+    assert_nil(lua_redis_cluster.find_slot_master({ ranges[1] }, 6000))
+  end)
+
+  test("Node names", function()
+    assert_equal(lua_redis_cluster.node_name('127.0.0.1:7000'), '127.0.0.1:7000')
+    assert_equal(lua_redis_cluster.node_name('::1', 7000), '[::1]:7000')
+    assert_equal(lua_redis_cluster.node_name('::1:7000'), '[::1]:7000')
+    assert_nil(lua_redis_cluster.node_name('bad'))
+  end)
+end)
@@ -133,4 +133,49 @@ char ** rspamd_string_len_split (const char *in, size_t len,
             ffi.C.g_strfreev(ret)
         end)
     end
+
+    test("clickhouse_row_to_tsv", function()
+        local rspamd_text = require "rspamd_text"
+        local cases = {
+            {{'a', 1, 2.5}, 'a\t1\t2.5'},
+            {{'a\tb', "it's", 'c\\d\n'}, 'a\\tb\tit\\\'s\tc\\\\d\\n'},
+            {{{'x', "y'z"}, {1, 2}, {}}, "['x','y\\'z']\t[1,2]\t[]"},
+            {{rspamd_text.fromstring('t\r'), 1e15}, 't\\r\t1000000000000000'},
+        }
+
+        for _,c in ipairs(cases) do
+            local res = util.clickhouse_row_to_tsv(c[1])
+            assert_equal(tostring(res), c[2])
+        end
+
+        assert_false(pcall(util.clickhouse_row_to_tsv, {true}))
+    end)
+
+    test("clickhouse_row_to_binary", function()
+        local types = util.clickhouse_compile_types({
+            'UInt8', 'UInt32', 'String', 'FixedString(3)', 'Date', 'DateTime',
+            "Enum8('a' = 1, 'b' = -1)", 'Array(LowCardinality(String))',
+            'Nullable(Int16)', 'Float32', 'Float64',
+        })
+        assert_not_nil(types)
+
+        local res = util.clickhouse_row_to_binary({
+            5, '300', 'ab', 'x', '1970-01-03', 1, 'b', {'q', 'rr'}, nil, 1.5, -2
+        }, types)
+        local expected = table.concat({
+            '\5', '\44\1\0\0', '\2ab', 'x\0\0', '\2\0', '\1\0\0\0', '\255',
+            '\2', '\1q', '\2rr', '\1', '\0\0\192\63', '\0\0\0\0\0\0\0\192',
+        })
+        assert_equal(tostring(res), expected)
+
+        local int_type = util.clickhouse_compile_types({'UInt8'})
+        assert_false(pcall(util.clickhouse_row_to_binary, {'x'}, int_type))
+        assert_false(pcall(util.clickhouse_row_to_binary, {}, int_type))
+        assert_false(pcall(util.clickhouse_row_to_binary, {'c'},
+            util.clickhouse_compile_types({"Enum8('a' = 1)"})))
+
+        local bad, err = util.clickhouse_compile_types({'Decimal(10, 2)'})
+        assert_nil(bad)
+        assert_not_nil(err)
+    end)
 end)
\ No newline at end of file
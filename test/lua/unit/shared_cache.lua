@@ -0,0 +1,36 @@
+context("Shared cache unit tests", function()
+  local rspamd_shared_cache = require "rspamd_shared_cache"
+
+  test("Set, get and delete", function()
+    local cache = rspamd_shared_cache.create(rspamd_config, 64 * 1024, 32)
+    assert_true(cache:set('key', 'value', 3600))
+    local value, ttl = cache:get('key')
+    assert_equal(value, 'value')
+    assert_true(ttl > 3500)
+
+    assert_true(cache:set('key', 'other', 3600))
+    assert_equal(cache:get('key'), 'other')
+    assert_false(cache:set('key', string.rep('a', 33), 3600))
+
+    assert_true(cache:delete('key'))
+    assert_nil(cache:get('key'))
+    assert_false(cache:delete('key'))
+  end)
+
+  test("Eviction and stats", function()
+    local cache = rspamd_shared_cache.create(rspamd_config, 4096, 16)
+    local stat = cache:stat()
+    assert_true(stat.size <= 4096)
+
+    for i = 1, stat.slots * 2 do
+      cache:set('key' .. tostring(i), tostring(i), 3600)
+    end
+
+    stat = cache:stat()
+    assert_true(stat.entries <= stat.slots)
+    -- Each insert either takes a free slot or evicts another key
+    assert_equal(stat.entries + stat.evictions, stat.slots * 2)
+    -- The last inserted key is always available
+    assert_equal(cache:get('key' .. tostring(stat.slots * 2)), tostring(stat.slots * 2))
+  end)
+end)
@@ -157,6 +157,36 @@ Thank you,
         'evil.com', 'example.com'
       }})
 
+    task:destroy()
+  end)
+  test("Get headers by id", function()
+    local rspamd_util = require("rspamd_util")
+    local msg = [[
+From: <>
+To: <nobody@example.com>
+SUBJECT: test
+X-Custom: value
+Content-Type: text/plain
+
+Test.
+]]
+    local res,task = rspamd_task.load_from_string(msg)
+    assert_true(res, "failed to load message")
+    task:process_message()
+
+    local subject_id = rspamd_util.get_header_id('subject')
+    assert_not_nil(subject_id)
+    assert_equal(subject_id, rspamd_util.get_header_id('Subject'))
+    assert_nil(rspamd_util.get_header_id('X-Custom'))
+
+    assert_equal('test', task:get_header(subject_id))
+    assert_equal('test', task:get_header('Subject'))
+    assert_equal(1, task:get_header_count(subject_id))
+    -- Case sensitive comparison uses the canonical name
+    assert_nil(task:get_header(subject_id, true))
+    assert_equal('value', task:get_header('x-custom'))
+    assert_nil(task:get_header(rspamd_util.get_header_id('Reply-To')))
+
     task:destroy()
   end)
 end)
\ No newline at end of file
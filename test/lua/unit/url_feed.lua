@@ -0,0 +1,76 @@
+context("URL feed unit tests", function()
+  local rspamd_url_feed = require "rspamd_url_feed"
+  local rspamd_task = require "rspamd_task"
+
+  test("Add urls and lookup hosts", function()
+    local feed = rspamd_url_feed.create()
+    assert_true(feed:add('http://example.org/login?id=1', 'data'))
+    assert_true(feed:add('https://Example.COM'))
+    assert_false(feed:add('not an url'))
+    assert_equal(feed:add_list('http://a.example.net/\n\nhttp://b.example.net/x\n'), 2)
+    feed:finalize()
+
+    assert_equal(feed:size(), 4)
+    assert_true(feed:has_host('example.org'))
+    assert_true(feed:has_host('example.com'))
+    assert_true(feed:has_host('b.example.net'))
+    assert_false(feed:has_host('example.net'))
+  end)
+
+  test("Finalized feed is immutable", function()
+    local feed = rspamd_url_feed.create()
+    feed:finalize()
+    assert_false(feed:has_host('example.org'))
+    assert_false(pcall(function()
+      feed:add('http://example.org/')
+    end))
+  end)
+
+  test("Match task urls", function()
+    local feed = rspamd_url_feed.create()
+    feed:add('http://example.org/login?id=1', 'first')
+    feed:add('http://example.org/login', 'second')
+    feed:add('http://example.net/p?a=1', 'query')
+    feed:add('http://example.com', 'host')
+    feed:finalize()
+
+    local msg = [[
+From: <foo@example.com>
+To: <bar@example.com>
+Subject: test
+Content-Type: text/plain
+
+http://example.org/login?id=1
+http://example.net/p?a=2
+http://example.com/
+http://example.com/other
+http://unknown.example/login
+]]
+    local res, task = rspamd_task.load_from_string(msg, rspamd_config)
+    assert_true(res, "failed to load message")
+    task:process_message()
+
+    local matches = {}
+    for _, m in ipairs(feed:match_urls(task)) do
+      matches[m.host .. '/' .. (m.url:get_path() or '')] = m
+    end
+    task:destroy()
+
+    local function check(key, path, found_path, found_query, data)
+      local m = matches[key]
+      assert_not_nil(m, key .. ' is not matched')
+      assert_equal(m.path, path, key)
+      assert_equal(m.found_path, found_path, key)
+      assert_equal(m.found_query, found_query, key)
+      assert_equal(m.data, data, key)
+    end
+
+    -- The last entry with the same path provides data
+    check('example.org/login', true, true, true, 'second')
+    check('example.net/p', true, true, false, 'query')
+    -- Url without path matches entry without path
+    check('example.com/', false, true, true, nil)
+    check('example.com/other', true, false, false, nil)
+    assert_nil(matches['unknown.example/login'])
+  end)
+end)
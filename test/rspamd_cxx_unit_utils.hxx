@@ -26,6 +26,8 @@
 #include "contrib/libottery/ottery.h"
 #include "libcryptobox/cryptobox.h"
 #include "libserver/http/http_message.h"
+#include "libserver/counters.h"
+#include "printf.h"
 
 #include <vector>
 #include <utility>
@@ -231,6 +233,51 @@ TEST_SUITE("rspamd_utils")
 			}
 		}
 	}
+
+	TEST_CASE("rspamd_counter_escape_label")
+	{
+		std::vector<std::pair<std::string, std::string>> cases{
+			{"", ""},
+			{"rule", "rule"},
+			{"a\"b", "a\\\"b"},
+			{"a\\b", "a\\\\b"},
+			{"a\nb", "a\\nb"},
+		};
+		char buf[64];
+
+		for (const auto &c: cases) {
+			SUBCASE(("escape label: " + c.second).c_str())
+			{
+				CHECK(std::string{rspamd_counter_escape_label(c.first.c_str(), buf, sizeof(buf))} == c.second);
+			}
+		}
+
+		SUBCASE("escape sequences are not split on truncation")
+		{
+			CHECK(std::string{rspamd_counter_escape_label("ab\"", buf, 4)} == "ab");
+			CHECK(std::string{rspamd_counter_escape_label("abc\"", buf, 4)} == "abc");
+		}
+	}
+
+	TEST_CASE("rspamd_counters_write_openmetrics")
+	{
+		char label[RSPAMD_COUNTER_NAME_MAX], name[RSPAMD_COUNTER_NAME_MAX];
+
+		rspamd_snprintf(name, sizeof(name), "test_escape_total{rule=\"%s\"}",
+						rspamd_counter_escape_label("a\"b\\c\nd", label, sizeof(label)));
+		auto id = rspamd_counter_register(name, "help with \"quotes\", \\ and\nnewline",
+										  RSPAMD_COUNTER_COUNTER);
+		REQUIRE(id >= 0);
+		rspamd_counter_add(id, 2);
+
+		auto *out = rspamd_fstring_new();
+		rspamd_counters_write_openmetrics(&out);
+		std::string res{out->str, out->len};
+		rspamd_fstring_free(out);
+
+		CHECK(res.find("# HELP test_escape_total help with \\\"quotes\\\", \\\\ and\\nnewline\n") != std::string::npos);
+		CHECK(res.find("test_escape_total{rule=\"a\\\"b\\\\c\\nd\"} 2\n") != std::string::npos);
+	}
 }
 
 #endif
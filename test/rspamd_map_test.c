@@ -0,0 +1,319 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "libserver/maps/map.h"
+#include "libserver/maps/map_private.h"
+#include "libserver/maps/map_helpers.h"
+#include "tests.h"
+
+typedef char *(*map_test_read_cb)(char *chunk, int len,
+								  struct map_cb_data *data, gboolean final);
+typedef void (*map_test_fin_cb)(struct map_cb_data *data, void **target);
+
+static struct rspamd_map *
+map_test_new(const char *name)
+{
+	struct rspamd_map *map = g_malloc0(sizeof(*map));
+
+	map->name = g_strdup(name);
+	rspamd_strlcpy(map->tag, name, sizeof(map->tag));
+
+	return map;
+}
+
+static void
+map_test_free(struct rspamd_map *map)
+{
+	g_free(map->name);
+	g_free(map);
+}
+
+/* Loads the whole map as the periodic does, previous data is replaced */
+static void
+map_test_load(struct rspamd_map *map, void **target,
+			  map_test_read_cb read_cb, map_test_fin_cb fin_cb, const char *body)
+{
+	struct map_cb_data cbd;
+	char *chunk = g_strdup(body);
+
+	memset(&cbd, 0, sizeof(cbd));
+	cbd.map = map;
+	cbd.prev_data = *target;
+	read_cb(chunk, strlen(chunk), &cbd, TRUE);
+	fin_cb(&cbd, target);
+	g_free(chunk);
+}
+
+/* Applies delta in place as the periodic does on `226 IM Used` reply */
+static gboolean
+map_test_delta(struct rspamd_map *map, void **target,
+			   map_delta_cb_t delta_cb, map_test_fin_cb fin_cb, const char *body)
+{
+	struct map_cb_data cbd;
+	char *chunk = g_strdup(body);
+	gboolean ret;
+
+	memset(&cbd, 0, sizeof(cbd));
+	cbd.map = map;
+	cbd.prev_data = *target;
+	cbd.cur_data = *target;
+	ret = delta_cb(chunk, strlen(chunk), &cbd);
+
+	if (ret) {
+		fin_cb(&cbd, target);
+	}
+
+	g_free(chunk);
+
+	return ret;
+}
+
+static const char *
+map_test_hash_get(void *data, const char *key)
+{
+	return rspamd_match_hash_map(data, key, strlen(key));
+}
+
+static const char *
+map_test_radix_get(void *data, const char *ip)
+{
+	rspamd_inet_addr_t *addr = NULL;
+	gconstpointer res;
+
+	g_assert(rspamd_parse_inet_address(&addr, ip, strlen(ip),
+									   RSPAMD_INET_ADDRESS_PARSE_DEFAULT));
+	res = rspamd_match_radix_map_addr(data, addr);
+	rspamd_inet_address_free(addr);
+
+	return res;
+}
+
+static gboolean
+map_test_radix_has(void *data, const char *ip)
+{
+	return map_test_radix_get(data, ip) != NULL;
+}
+
+static void
+rspamd_map_delta_hash_test(void)
+{
+	struct rspamd_map *map = map_test_new("delta_hash");
+	void *data = NULL;
+	uint64_t digest;
+
+	map_test_load(map, &data, rspamd_kv_list_read, rspamd_kv_list_fin,
+				  "example.com one\nexample.net two\nexample.org\n");
+	g_assert_cmpuint(map->nelts, ==, 3);
+	digest = map->digest;
+
+	/* Replace, insert and remove keys */
+	g_assert(map_test_delta(map, &data, rspamd_kv_list_delta, rspamd_kv_list_fin,
+							"# comment\n"
+							"+example.com three\n"
+							"  +rspamd.com\n"
+							"\n"
+							"-example.net\n"));
+	g_assert_cmpstr(map_test_hash_get(data, "example.com"), ==, "three");
+	g_assert_cmpstr(map_test_hash_get(data, "rspamd.com"), ==, "");
+	g_assert_cmpstr(map_test_hash_get(data, "example.org"), ==, "");
+	g_assert(map_test_hash_get(data, "example.net") == NULL);
+	g_assert_cmpuint(map->nelts, ==, 3);
+	g_assert_cmpuint(map->digest, !=, digest);
+
+	/* Invalid line rejects the whole delta */
+	digest = map->digest;
+	g_assert(!map_test_delta(map, &data, rspamd_kv_list_delta, rspamd_kv_list_fin,
+							 "-example.com\n"
+							 "example.net\n"));
+	g_assert_cmpstr(map_test_hash_get(data, "example.com"), ==, "three");
+	g_assert(map_test_hash_get(data, "example.net") == NULL);
+	g_assert_cmpuint(map->digest, ==, digest);
+
+	rspamd_map_helper_destroy_hash(data);
+	map_test_free(map);
+}
+
+static void
+rspamd_map_delta_radix_test(void)
+{
+	struct rspamd_map *map = map_test_new("delta_radix");
+	void *data = NULL;
+	unsigned int i;
+
+	map_test_load(map, &data, rspamd_radix_read, rspamd_radix_fin,
+				  "10.0.0.1\n10.0.1.0/24\n");
+	g_assert(map_test_radix_has(data, "10.0.0.1"));
+	g_assert(map_test_radix_has(data, "10.0.1.1"));
+	g_assert(!map_test_radix_has(data, "10.0.0.2"));
+
+	/* Trie is rebuilt on each delta, removed networks must not match */
+	for (i = 0; i < 3; i++) {
+		g_assert(map_test_delta(map, &data, rspamd_radix_delta, rspamd_radix_fin,
+								"+10.0.0.2\n-10.0.1.0/24\n-10.0.0.1\n"));
+		g_assert(map_test_radix_has(data, "10.0.0.2"));
+		g_assert(!map_test_radix_has(data, "10.0.0.1"));
+		g_assert(!map_test_radix_has(data, "10.0.1.1"));
+
+		g_assert(map_test_delta(map, &data, rspamd_radix_delta, rspamd_radix_fin,
+								"+10.0.0.1\n+10.0.1.0/24\n"));
+		g_assert(map_test_radix_has(data, "10.0.0.1"));
+		g_assert(map_test_radix_has(data, "10.0.1.1"));
+	}
+
+	g_assert_cmpuint(map->nelts, ==, 3);
+	g_assert(!map_test_delta(map, &data, rspamd_radix_delta, rspamd_radix_fin,
+							 "+10.0.0.3\n10.0.0.4\n"));
+	g_assert(!map_test_radix_has(data, "10.0.0.3"));
+
+	/* Insertions are applied to the trie in place, replacements rebuild it */
+	g_assert(map_test_delta(map, &data, rspamd_radix_delta, rspamd_radix_fin,
+							"+10.0.2.0/24 first\n+10.0.0.2\n"));
+	g_assert_cmpstr(map_test_radix_get(data, "10.0.2.1"), ==, "first");
+	g_assert(map_test_radix_has(data, "10.0.0.1"));
+	g_assert(map_test_delta(map, &data, rspamd_radix_delta, rspamd_radix_fin,
+							"+10.0.2.0/24 second\n+10.0.3.0/24\n"));
+	g_assert_cmpstr(map_test_radix_get(data, "10.0.2.1"), ==, "second");
+	g_assert(map_test_radix_has(data, "10.0.3.1"));
+	g_assert(map_test_radix_has(data, "10.0.1.1"));
+
+	rspamd_map_helper_destroy_radix(data);
+	map_test_free(map);
+}
+
+struct map_test_traverse_cbd {
+	char *prev;
+	unsigned int nkeys;
+	gsize mixed_hits;
+	gboolean mixed_found;
+};
+
+static gboolean
+map_test_traverse_cb(gconstpointer key, gconstpointer value, gsize hits,
+					 gpointer ud)
+{
+	struct map_test_traverse_cbd *cbd = ud;
+
+	/* Keys are sorted case insensitively */
+	if (cbd->prev) {
+		g_assert_cmpint(g_ascii_strcasecmp(cbd->prev, key), <, 0);
+		g_free(cbd->prev);
+	}
+
+	cbd->prev = g_strdup(key);
+	cbd->nkeys++;
+
+	if (strcmp(key, "MixedCase.Example.COM") == 0) {
+		g_assert_cmpstr(value, ==, "mixed");
+		cbd->mixed_found = TRUE;
+		cbd->mixed_hits = hits;
+	}
+
+	return TRUE;
+}
+
+static void
+rspamd_map_compact_hash_test(void)
+{
+	struct rspamd_map *map = map_test_new("compact_hash");
+	struct map_test_traverse_cbd tcbd;
+	void *data = NULL;
+	GString *body = g_string_new(NULL);
+	char key[256], value[32], *long_key;
+	const unsigned int nkeys = 70000, nlong = 20;
+	unsigned int i;
+
+	/* Values indexes and lengths of long keys need multibyte varints */
+	for (i = 0; i < nkeys; i++) {
+		rspamd_printf_gstring(body, "key%06ud.example.com value%ud\n", i, i % 300);
+	}
+
+	memset(key, 'a', 200);
+
+	for (i = 0; i < nlong; i++) {
+		rspamd_snprintf(key + 200, sizeof(key) - 200, "%02ud", i);
+		rspamd_printf_gstring(body, "%s long%ud\n", key, i);
+	}
+
+	g_string_append(body, "MixedCase.Example.COM mixed\n");
+	map_test_load(map, &data, rspamd_kv_list_read, rspamd_kv_list_fin, body->str);
+	g_string_free(body, TRUE);
+	g_assert_cmpuint(map->nelts, ==, nkeys + nlong + 1);
+	g_assert(map->no_delta);
+
+	for (i = 0; i < nkeys; i++) {
+		rspamd_snprintf(key, sizeof(key), "key%06ud.example.com", i);
+		rspamd_snprintf(value, sizeof(value), "value%ud", i % 300);
+		g_assert_cmpstr(map_test_hash_get(data, key), ==, value);
+	}
+
+	for (i = 0; i < nlong; i++) {
+		memset(key, 'a', 200);
+		rspamd_snprintf(key + 200, sizeof(key) - 200, "%02ud", i);
+		rspamd_snprintf(value, sizeof(value), "long%ud", i);
+		g_assert_cmpstr(map_test_hash_get(data, key), ==, value);
+	}
+
+	/* Keys are matched case insensitively */
+	g_assert_cmpstr(map_test_hash_get(data, "KEY000123.Example.Com"), ==, "value123");
+	g_assert_cmpstr(map_test_hash_get(data, "mixedcase.example.com"), ==, "mixed");
+
+	g_assert(map_test_hash_get(data, "0") == NULL);
+	g_assert(map_test_hash_get(data, "zzz") == NULL);
+	g_assert(map_test_hash_get(data, "key000001.example.co") == NULL);
+	g_assert(map_test_hash_get(data, "key000001.example.comm") == NULL);
+	g_assert(map_test_hash_get(data, "key070000.example.com") == NULL);
+	key[200] = '\0';
+	g_assert(map_test_hash_get(data, key) == NULL);
+
+	long_key = g_malloc(2048);
+	memset(long_key, 'a', 2047);
+	long_key[2047] = '\0';
+	g_assert(map_test_hash_get(data, long_key) == NULL);
+	g_free(long_key);
+
+	/* Original case of keys is kept */
+	memset(&tcbd, 0, sizeof(tcbd));
+	map->traverse_function(data, map_test_traverse_cb, &tcbd, FALSE);
+	g_free(tcbd.prev);
+	g_assert_cmpuint(tcbd.nkeys, ==, nkeys + nlong + 1);
+	g_assert(tcbd.mixed_found);
+	g_assert_cmpuint(tcbd.mixed_hits, ==, 1);
+
+	/* Compact hash is immutable */
+	g_assert(!map_test_delta(map, &data, rspamd_kv_list_delta, rspamd_kv_list_fin,
+							 "+example.com\n"));
+	g_assert(map_test_hash_get(data, "example.com") == NULL);
+
+	/* Small maps can be updated by deltas again */
+	map_test_load(map, &data, rspamd_kv_list_read, rspamd_kv_list_fin,
+				  "example.com one\n");
+	g_assert(!map->no_delta);
+	g_assert(map_test_delta(map, &data, rspamd_kv_list_delta, rspamd_kv_list_fin,
+							"+example.net\n"));
+	g_assert_cmpstr(map_test_hash_get(data, "example.net"), ==, "");
+
+	rspamd_map_helper_destroy_hash(data);
+	map_test_free(map);
+}
+
+void rspamd_map_test_func(void)
+{
+	rspamd_map_delta_hash_test();
+	rspamd_map_delta_radix_test();
+	rspamd_map_compact_hash_test();
+}
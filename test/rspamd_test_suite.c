@@ -73,6 +73,7 @@ int main(int argc, char **argv)
 
 	g_test_add_func("/rspamd/mem_pool", rspamd_mem_pool_test_func);
 	g_test_add_func("/rspamd/radix", rspamd_radix_test_func);
+	g_test_add_func("/rspamd/map", rspamd_map_test_func);
 	g_test_add_func("/rspamd/dns", rspamd_dns_test_func);
 	g_test_add_func("/rspamd/dkim", rspamd_dkim_test_func);
 	g_test_add_func("/rspamd/rrd", rspamd_rrd_test_func);
@@ -81,6 +82,8 @@ int main(int argc, char **argv)
 	g_test_add_func("/rspamd/lua", rspamd_lua_test_func);
 	g_test_add_func("/rspamd/cryptobox", rspamd_cryptobox_test_func);
 	g_test_add_func("/rspamd/heap", rspamd_heap_test_func);
+	g_test_add_func("/rspamd/timer_wheel", rspamd_timer_wheel_test_func);
+	g_test_add_func("/rspamd/uring", rspamd_uring_test_func);
 	g_test_add_func("/rspamd/lua_pcall", rspamd_lua_lua_pcall_vs_resume_test_func);
 
 #if 0
@@ -0,0 +1,173 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "libutil/libev_helper.h"
+#include "tests.h"
+
+static const unsigned int ntimers = 1000;
+
+struct wheel_test_timer {
+	struct rspamd_ev_wheel_timer tm;
+	ev_tstamp started;
+	ev_tstamp after;
+	ev_tstamp fired_at;
+	unsigned int fired;
+};
+
+static unsigned int nfired = 0;
+
+static void
+wheel_test_cb(struct ev_loop *loop, struct rspamd_ev_wheel_timer *w)
+{
+	struct wheel_test_timer *t = (struct wheel_test_timer *) w->data;
+
+	/* Timers must never fire too early */
+	g_assert(ev_now(loop) - t->started >= t->after - 1e-6);
+	g_assert(!rspamd_ev_wheel_timer_is_active(w));
+	t->fired++;
+	nfired++;
+}
+
+/* Time used by `rspamd_ev_wheel_advance` */
+static ev_tstamp fake_now = 0;
+
+static void
+wheel_test_long_cb(struct ev_loop *loop, struct rspamd_ev_wheel_timer *w)
+{
+	struct wheel_test_timer *t = (struct wheel_test_timer *) w->data;
+
+	g_assert(fake_now - t->started >= t->after - 1e-6);
+	t->fired_at = fake_now;
+	t->fired++;
+}
+
+/*
+ * Timers that are cascaded from the upper levels or exceed the wheel range;
+ * time is advanced manually, as they are too long to wait for them
+ */
+static void
+rspamd_timer_wheel_long_test(void)
+{
+	struct ev_loop *loop = ev_loop_new(EVFLAG_AUTO);
+	static const struct {
+		ev_tstamp after;
+		ev_tstamp step; /* Time step used when the timer fires */
+	} cases[] = {
+		{13.0, 0.05},           /* Cascaded from the first upper level */
+		{1000.0, 10.0},         /* Second upper level */
+		{86400.0 * 3, 3600.0},  /* Third upper level */
+		{86400.0 * 40, 3600.0}, /* Longer than the whole wheel range */
+		{86400.0 * 90, 3600.0}, /* Placed to the farthest slot a few times */
+	};
+	struct wheel_test_timer timers[G_N_ELEMENTS(cases)], stopped;
+	ev_tstamp start = ev_now(loop);
+	unsigned int i;
+
+	memset(timers, 0, sizeof(timers));
+	memset(&stopped, 0, sizeof(stopped));
+
+	for (i = 0; i < G_N_ELEMENTS(cases); i++) {
+		timers[i].started = start;
+		timers[i].after = cases[i].after;
+		rspamd_ev_wheel_timer_init(&timers[i].tm, wheel_test_long_cb, &timers[i]);
+		rspamd_ev_wheel_timer_start(loop, &timers[i].tm, timers[i].after);
+	}
+
+	/* Long timer that is stopped after a few cascades */
+	stopped.started = start;
+	stopped.after = 86400.0 * 50;
+	rspamd_ev_wheel_timer_init(&stopped.tm, wheel_test_long_cb, &stopped);
+	rspamd_ev_wheel_timer_start(loop, &stopped.tm, stopped.after);
+
+	for (fake_now = start; fake_now < start + 20.0; fake_now += 0.05) {
+		rspamd_ev_wheel_advance(loop, fake_now);
+	}
+
+	for (; fake_now < start + 2000.0; fake_now += 10.0) {
+		rspamd_ev_wheel_advance(loop, fake_now);
+	}
+
+	for (; fake_now < start + 86400.0 * 91; fake_now += 3600.0) {
+		rspamd_ev_wheel_advance(loop, fake_now);
+
+		if (fake_now > start + 86400.0 * 45 && rspamd_ev_wheel_timer_is_active(&stopped.tm)) {
+			rspamd_ev_wheel_timer_stop(loop, &stopped.tm);
+		}
+	}
+
+	for (i = 0; i < G_N_ELEMENTS(cases); i++) {
+		g_assert_cmpuint(timers[i].fired, ==, 1);
+		/* Not later than the next step after expiration */
+		g_assert_cmpfloat(timers[i].fired_at - start, <=,
+						  cases[i].after + cases[i].step + RSPAMD_EV_WHEEL_RESOLUTION);
+		g_assert(!rspamd_ev_wheel_timer_is_active(&timers[i].tm));
+	}
+
+	g_assert_cmpuint(stopped.fired, ==, 0);
+
+	rspamd_ev_wheel_destroy(loop);
+	ev_loop_destroy(loop);
+}
+
+void rspamd_timer_wheel_test_func(void)
+{
+	struct ev_loop *loop = ev_loop_new(EVFLAG_AUTO);
+	struct wheel_test_timer *timers;
+	unsigned int i, nexpected = 0;
+
+	timers = g_malloc0(sizeof(*timers) * ntimers);
+
+	for (i = 0; i < ntimers; i++) {
+		timers[i].started = ev_now(loop);
+		timers[i].after = (i % 50) * 0.013;
+		rspamd_ev_wheel_timer_init(&timers[i].tm, wheel_test_cb, &timers[i]);
+		rspamd_ev_wheel_timer_start(loop, &timers[i].tm, timers[i].after);
+		g_assert(rspamd_ev_wheel_timer_is_active(&timers[i].tm));
+	}
+
+	/* Most of timeouts are cancelled or restarted */
+	for (i = 0; i < ntimers; i++) {
+		if (i % 3 == 0) {
+			rspamd_ev_wheel_timer_stop(loop, &timers[i].tm);
+			g_assert(!rspamd_ev_wheel_timer_is_active(&timers[i].tm));
+		}
+		else {
+			if (i % 3 == 1) {
+				timers[i].after = 0.3;
+				rspamd_ev_wheel_timer_start(loop, &timers[i].tm, timers[i].after);
+			}
+
+			nexpected++;
+		}
+	}
+
+	/* Loop exits when all timers are fired */
+	ev_run(loop, 0);
+
+	g_assert_cmpuint(nfired, ==, nexpected);
+
+	for (i = 0; i < ntimers; i++) {
+		g_assert_cmpuint(timers[i].fired, ==, i % 3 == 0 ? 0 : 1);
+	}
+
+	rspamd_ev_wheel_destroy(loop);
+	ev_loop_destroy(loop);
+	g_free(timers);
+
+	rspamd_timer_wheel_long_test();
+}
@@ -0,0 +1,193 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "libutil/uring.h"
+#include "unix-std.h"
+#include "tests.h"
+
+struct uring_test_read {
+	struct ev_loop *loop;
+	char data[64];
+	gssize res;
+	unsigned int called;
+};
+
+static unsigned int ncompleted = 0, nexpected = 0;
+
+static void
+uring_test_done(struct ev_loop *loop)
+{
+	ncompleted++;
+
+	if (ncompleted >= nexpected) {
+		ev_break(loop, EVBREAK_ONE);
+	}
+}
+
+static void
+uring_test_read_cb(gssize res, const unsigned char *buf, gpointer ud)
+{
+	struct uring_test_read *rd = (struct uring_test_read *) ud;
+
+	rd->res = res;
+	rd->called++;
+
+	if (res > 0) {
+		g_assert(buf != NULL);
+		g_assert_cmpint(res, <, (gssize) sizeof(rd->data));
+		memcpy(rd->data, buf, res);
+	}
+
+	uring_test_done(rd->loop);
+}
+
+static void
+uring_test_write_cb(gssize res, const unsigned char *buf, gpointer ud)
+{
+	struct uring_test_read *rd = (struct uring_test_read *) ud;
+
+	rd->res = res;
+	rd->called++;
+	uring_test_done(rd->loop);
+}
+
+static void
+uring_test_guard_cb(EV_P_ ev_timer *w, int revents)
+{
+	ev_break(EV_A_ EVBREAK_ONE);
+}
+
+/* Runs loop until the expected number of completions or the guard timeout */
+static void
+uring_test_run(struct ev_loop *loop, unsigned int expected, ev_tstamp timeout)
+{
+	ev_timer guard;
+
+	ncompleted = 0;
+	nexpected = expected;
+	ev_timer_init(&guard, uring_test_guard_cb, timeout, 0.0);
+	ev_timer_start(loop, &guard);
+	ev_run(loop, 0);
+	ev_timer_stop(loop, &guard);
+}
+
+static void
+uring_test_socketpair(int sp[2])
+{
+	g_assert(rspamd_socketpair(sp, SOCK_STREAM));
+	rspamd_socket_nonblocking(sp[0]);
+	rspamd_socket_nonblocking(sp[1]);
+}
+
+void rspamd_uring_test_func(void)
+{
+	struct ev_loop *loop = ev_loop_new(EVFLAG_AUTO);
+	struct rspamd_uring *ring;
+	struct uring_test_read rd[2];
+	struct rspamd_uring_req *req;
+	struct iovec iov[2];
+	int sp[2][2];
+	char buf[64];
+	unsigned int i;
+
+	/* Single buffer, so concurrent reads have to use the fallback path */
+	ring = rspamd_uring_new(loop, 64, 1, 16);
+
+	if (ring == NULL) {
+		/* Not built with io_uring or not allowed by the kernel */
+		ev_loop_destroy(loop);
+
+		return;
+	}
+
+	g_assert(rspamd_uring_get(loop) == ring);
+
+	for (i = 0; i < G_N_ELEMENTS(sp); i++) {
+		uring_test_socketpair(sp[i]);
+	}
+
+	/* Simple read */
+	memset(rd, 0, sizeof(rd));
+	rd[0].loop = loop;
+	g_assert(write(sp[0][1], "hello", 5) == 5);
+	g_assert(rspamd_uring_recv(ring, sp[0][0], uring_test_read_cb, &rd[0]) != NULL);
+	uring_test_run(loop, 1, 1.0);
+	g_assert_cmpuint(rd[0].called, ==, 1);
+	g_assert_cmpint(rd[0].res, ==, 5);
+	g_assert(memcmp(rd[0].data, "hello", 5) == 0);
+
+	/* Both reads complete at once but there is only one buffer in the ring */
+	memset(rd, 0, sizeof(rd));
+	rd[0].loop = rd[1].loop = loop;
+	g_assert(write(sp[0][1], "first", 5) == 5);
+	g_assert(write(sp[1][1], "second", 6) == 6);
+	g_assert(rspamd_uring_recv(ring, sp[0][0], uring_test_read_cb, &rd[0]) != NULL);
+	g_assert(rspamd_uring_recv(ring, sp[1][0], uring_test_read_cb, &rd[1]) != NULL);
+	uring_test_run(loop, 2, 1.0);
+	g_assert_cmpuint(rd[0].called, ==, 1);
+	g_assert_cmpuint(rd[1].called, ==, 1);
+	g_assert_cmpint(rd[0].res, ==, 5);
+	g_assert_cmpint(rd[1].res, ==, 6);
+	g_assert(memcmp(rd[0].data, "first", 5) == 0);
+	g_assert(memcmp(rd[1].data, "second", 6) == 0);
+
+	/* Cancelled before and after submission: callbacks are not called, data stays in socket */
+	memset(rd, 0, sizeof(rd));
+	rd[0].loop = rd[1].loop = loop;
+	req = rspamd_uring_recv(ring, sp[0][0], uring_test_read_cb, &rd[0]);
+	g_assert(req != NULL);
+	rspamd_uring_cancel(ring, req);
+	req = rspamd_uring_recv(ring, sp[1][0], uring_test_read_cb, &rd[1]);
+	g_assert(req != NULL);
+	/* Submits pending requests */
+	ev_run(loop, EVRUN_NOWAIT);
+	rspamd_uring_cancel(ring, req);
+	g_assert(write(sp[0][1], "data", 4) == 4);
+	g_assert(write(sp[1][1], "data", 4) == 4);
+	uring_test_run(loop, 1, 0.2);
+	g_assert_cmpuint(rd[0].called, ==, 0);
+	g_assert_cmpuint(rd[1].called, ==, 0);
+
+	for (i = 0; i < G_N_ELEMENTS(sp); i++) {
+		g_assert(read(sp[i][0], buf, sizeof(buf)) == 4);
+	}
+
+	/* Scattered write */
+	memset(rd, 0, sizeof(rd));
+	rd[0].loop = loop;
+	iov[0].iov_base = "abc";
+	iov[0].iov_len = 3;
+	iov[1].iov_base = "def";
+	iov[1].iov_len = 3;
+	g_assert(rspamd_uring_sendmsg(ring, sp[0][0], iov, 2, NULL, 0,
+								  RSPAMD_URING_DEFAULT, uring_test_write_cb, &rd[0]) != NULL);
+	uring_test_run(loop, 1, 1.0);
+	g_assert_cmpuint(rd[0].called, ==, 1);
+	g_assert_cmpint(rd[0].res, ==, 6);
+	g_assert(read(sp[0][1], buf, sizeof(buf)) == 6);
+	g_assert(memcmp(buf, "abcdef", 6) == 0);
+
+	for (i = 0; i < G_N_ELEMENTS(sp); i++) {
+		close(sp[i][0]);
+		close(sp[i][1]);
+	}
+
+	rspamd_uring_destroy(ring);
+	g_assert(rspamd_uring_get(loop) == NULL);
+	ev_loop_destroy(loop);
+}
@@ -21,6 +21,9 @@ void rspamd_statfile_test_func(void);
 /* Radix test */
 void rspamd_radix_test_func(void);
 
+/* Maps helpers */
+void rspamd_map_test_func(void);
+
 /* DNS resolving */
 void rspamd_dns_test_func(void);
 
@@ -42,6 +45,10 @@ void rspamd_cryptobox_test_func(void);
 
 void rspamd_heap_test_func(void);
 
+void rspamd_timer_wheel_test_func(void);
+
+void rspamd_uring_test_func(void);
+
 void rspamd_lua_lua_pcall_vs_resume_test_func(void);
 
 #ifdef __cplusplus